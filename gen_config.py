@@ -1,4 +1,4 @@
-import subprocess, os, pprint
+import subprocess, os, pprint, sys
 
 def get_subdirs(base_path: str):
     return [f.name for f in os.scandir(base_path) if f.is_dir()]
@@ -31,6 +31,9 @@ def main():
     path_table['WindowsSDKUcrtLibPath_x64'] = os.path.join(winsdk_lib_base_path, 'ucrt\\x64')
     path_table['WindowsSDKUcrtIncludePath'] = os.path.join(winsdk_include_base_path, 'ucrt')
 
+    # Deploy builds run gen_pack.py with the same interpreter.
+    path_table['PythonPath'] = sys.executable
+
     for p in path_table.values():
         if not os.path.exists(p):
             print(f'{p} doesn\'t exist')
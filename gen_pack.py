@@ -0,0 +1,95 @@
+"""Builds a resource pack out of a resource directory.
+
+    python gen_pack.py bin/Deploy/resources bin/Deploy/resources.pack
+
+The layout must match the one described in src/resource_pack.h.
+"""
+import argparse, os, struct
+
+PACK_MAGIC = 0x4B504242  # "BBPK"
+PACK_VERSION = 1
+HEADER_FORMAT = '<IIIIQQ'
+ENTRY_FORMAT = '<QQQII'
+
+
+def normalize_path(rel_path: str):
+    parts = [p for p in rel_path.replace('\\', '/').split('/') if p and p != '.']
+    return '/'.join(parts).lower()
+
+
+def hash_path(normalized_path: str):
+    # 64-bit FNV-1a
+    h = 0xcbf29ce484222325
+    for b in normalized_path.encode('utf-8'):
+        h ^= b
+        h = (h * 0x100000001b3) & 0xFFFFFFFFFFFFFFFF
+    return h
+
+
+def align_up(value: int, alignment: int):
+    return (value + alignment - 1) // alignment * alignment
+
+
+def collect_files(root: str):
+    files = []
+    for dir_path, _, file_names in os.walk(root):
+        for file_name in file_names:
+            abs_path = os.path.join(dir_path, file_name)
+            files.append((normalize_path(os.path.relpath(abs_path, root)), abs_path))
+    return files
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('root', help='Resource directory to pack')
+    parser.add_argument('output', help='Path of the pack to write')
+    parser.add_argument('--align', type=int, default=256,
+                        help='Alignment of every file inside the pack (power of two)')
+    args = parser.parse_args()
+
+    assert args.align > 0 and (args.align & (args.align - 1)) == 0
+
+    output_abs_path = os.path.abspath(args.output)
+    files = [f for f in collect_files(args.root) if os.path.abspath(f[1]) != output_abs_path]
+    entries = sorted(((hash_path(path), path, abs_path) for path, abs_path in files))
+    for a, b in zip(entries, entries[1:]):
+        if a[1] == b[1]:
+            raise RuntimeError(f'{a[2]} and {b[2]} map to the same path')
+
+    header_size = struct.calcsize(HEADER_FORMAT)
+    entry_size = struct.calcsize(ENTRY_FORMAT)
+
+    paths = bytearray()
+    path_offsets = []
+    for _, path, _ in entries:
+        path_offsets.append(len(paths))
+        paths += path.encode('utf-8')
+
+    paths_offset = header_size + entry_size * len(entries)
+    data_offset = align_up(paths_offset + len(paths), args.align)
+
+    toc = bytearray()
+    file_offsets = []
+    offset = data_offset
+    for (path_hash, path, abs_path), path_offset in zip(entries, path_offsets):
+        size = os.path.getsize(abs_path)
+        toc += struct.pack(ENTRY_FORMAT, path_hash, offset, size, path_offset, len(path.encode('utf-8')))
+        file_offsets.append(offset)
+        offset = align_up(offset + size, args.align)
+
+    with open(args.output, mode='wb') as f:
+        f.write(struct.pack(HEADER_FORMAT, PACK_MAGIC, PACK_VERSION, len(entries), args.align,
+                            paths_offset, len(paths)))
+        f.write(toc)
+        f.write(paths)
+        for (_, _, abs_path), file_offset in zip(entries, file_offsets):
+            f.write(b'\0' * (file_offset - f.tell()))
+            with open(abs_path, mode='rb') as src:
+                f.write(src.read())
+        pack_size = f.tell()
+
+    print(f'Packed {len(entries)} files into {args.output} ({pack_size} bytes)')
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,254 @@
+#include "depth_pyramid.h"
+#include <algorithm>
+
+namespace bb {
+
+DepthPyramid *createDepthPyramid(const Renderer &_renderer,
+                                 const Shader &_reduceShader) {
+  DepthPyramid *pyramid = new DepthPyramid();
+
+  // Only ever read with texelFetch().
+  VkSamplerCreateInfo samplerCreateInfo = {};
+  samplerCreateInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  samplerCreateInfo.magFilter = VK_FILTER_NEAREST;
+  samplerCreateInfo.minFilter = VK_FILTER_NEAREST;
+  samplerCreateInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  samplerCreateInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerCreateInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerCreateInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerCreateInfo.minLod = 0.f;
+  samplerCreateInfo.maxLod = VK_LOD_CLAMP_NONE;
+  BB_VK_ASSERT(vkCreateSampler(_renderer.Device, &samplerCreateInfo, nullptr,
+                               &pyramid->Sampler));
+
+  // uInput and uOutput of depth_pyramid.comp.
+  VkDescriptorSetLayoutBinding bindings[2] = {};
+  bindings[0].binding = 0;
+  bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  bindings[0].descriptorCount = 1;
+  bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[0].pImmutableSamplers = &pyramid->Sampler;
+  bindings[1].binding = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  bindings[1].descriptorCount = 1;
+  bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+  VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
+  descriptorSetLayoutCreateInfo.sType =
+      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptorSetLayoutCreateInfo.bindingCount = (uint32_t)std::size(bindings);
+  descriptorSetLayoutCreateInfo.pBindings = bindings;
+  BB_VK_ASSERT(vkCreateDescriptorSetLayout(_renderer.Device,
+                                           &descriptorSetLayoutCreateInfo,
+                                           nullptr,
+                                           &pyramid->DescriptorSetLayout));
+
+  VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {};
+  pipelineLayoutCreateInfo.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipelineLayoutCreateInfo.setLayoutCount = 1;
+  pipelineLayoutCreateInfo.pSetLayouts = &pyramid->DescriptorSetLayout;
+  BB_VK_ASSERT(vkCreatePipelineLayout(_renderer.Device,
+                                      &pipelineLayoutCreateInfo, nullptr,
+                                      &pyramid->PipelineLayout));
+
+  pyramid->Pipeline = createComputePipeline(
+      _renderer, "Depth Pyramid", _reduceShader, pyramid->PipelineLayout);
+
+  VkDescriptorPoolSize poolSizes[2] = {};
+  poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  poolSizes[0].descriptorCount = maxNumDepthPyramidLevels;
+  poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  poolSizes[1].descriptorCount = maxNumDepthPyramidLevels;
+
+  VkDescriptorPoolCreateInfo poolCreateInfo = {};
+  poolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  poolCreateInfo.maxSets = maxNumDepthPyramidLevels;
+  poolCreateInfo.poolSizeCount = (uint32_t)std::size(poolSizes);
+  poolCreateInfo.pPoolSizes = poolSizes;
+  BB_VK_ASSERT(vkCreateDescriptorPool(_renderer.Device, &poolCreateInfo,
+                                      nullptr, &pyramid->DescriptorPool));
+
+  // Written by resizeDepthPyramid().
+  VkDescriptorSetLayout setLayouts[maxNumDepthPyramidLevels];
+  std::fill(std::begin(setLayouts), std::end(setLayouts),
+            pyramid->DescriptorSetLayout);
+  VkDescriptorSetAllocateInfo descriptorSetAllocInfo = {};
+  descriptorSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  descriptorSetAllocInfo.descriptorPool = pyramid->DescriptorPool;
+  descriptorSetAllocInfo.descriptorSetCount = maxNumDepthPyramidLevels;
+  descriptorSetAllocInfo.pSetLayouts = setLayouts;
+  BB_VK_ASSERT(vkAllocateDescriptorSets(_renderer.Device,
+                                        &descriptorSetAllocInfo,
+                                        pyramid->LevelDescriptorSets));
+
+  return pyramid;
+}
+
+static void destroyDepthPyramidImage(const Renderer &_renderer,
+                                     DepthPyramid &_pyramid) {
+  if (_pyramid.Image == VK_NULL_HANDLE) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < _pyramid.NumLevels; ++i) {
+    vkDestroyImageView(_renderer.Device, _pyramid.LevelViews[i], nullptr);
+    _pyramid.LevelViews[i] = VK_NULL_HANDLE;
+  }
+  vkDestroyImageView(_renderer.Device, _pyramid.View, nullptr);
+  vkDestroyImage(_renderer.Device, _pyramid.Image, nullptr);
+  freeDeviceMemory(*_renderer.MemoryAllocator, _pyramid.Allocation);
+  _pyramid.View = VK_NULL_HANDLE;
+  _pyramid.Image = VK_NULL_HANDLE;
+  _pyramid.Allocation = {};
+  _pyramid.NumLevels = 0;
+}
+
+void destroyDepthPyramid(const Renderer &_renderer, DepthPyramid *_pyramid) {
+  destroyDepthPyramidImage(_renderer, *_pyramid);
+  vkDestroyDescriptorPool(_renderer.Device, _pyramid->DescriptorPool, nullptr);
+  vkDestroyPipeline(_renderer.Device, _pyramid->Pipeline, nullptr);
+  vkDestroyPipelineLayout(_renderer.Device, _pyramid->PipelineLayout, nullptr);
+  vkDestroyDescriptorSetLayout(_renderer.Device, _pyramid->DescriptorSetLayout,
+                               nullptr);
+  vkDestroySampler(_renderer.Device, _pyramid->Sampler, nullptr);
+  delete _pyramid;
+}
+
+void resizeDepthPyramid(const Renderer &_renderer, DepthPyramid &_pyramid,
+                        VkExtent2D _extent, VkImageView _depthView) {
+  destroyDepthPyramidImage(_renderer, _pyramid);
+
+  VkExtent2D levelExtent = _extent;
+  _pyramid.NumLevels = 0;
+  for (;;) {
+    BB_ASSERT(_pyramid.NumLevels < maxNumDepthPyramidLevels);
+    _pyramid.LevelExtents[_pyramid.NumLevels++] = levelExtent;
+    if ((levelExtent.width == 1) && (levelExtent.height == 1)) {
+      break;
+    }
+    levelExtent.width = std::max(levelExtent.width / 2, 1u);
+    levelExtent.height = std::max(levelExtent.height / 2, 1u);
+  }
+
+  VkImageCreateInfo imageCreateInfo = {};
+  imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageCreateInfo.extent.width = _extent.width;
+  imageCreateInfo.extent.height = _extent.height;
+  imageCreateInfo.extent.depth = 1;
+  imageCreateInfo.mipLevels = _pyramid.NumLevels;
+  imageCreateInfo.arrayLayers = 1;
+  imageCreateInfo.format = VK_FORMAT_R32_SFLOAT;
+  imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+  imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  imageCreateInfo.usage =
+      VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+  BB_VK_ASSERT(vkCreateImage(_renderer.Device, &imageCreateInfo, nullptr,
+                             &_pyramid.Image));
+  _pyramid.Allocation =
+      allocateImageMemory(_renderer, _pyramid.Image, imageCreateInfo.usage);
+
+  VkImageViewCreateInfo viewCreateInfo = {};
+  viewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  viewCreateInfo.image = _pyramid.Image;
+  viewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  viewCreateInfo.format = imageCreateInfo.format;
+  viewCreateInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  viewCreateInfo.subresourceRange.baseMipLevel = 0;
+  viewCreateInfo.subresourceRange.levelCount = _pyramid.NumLevels;
+  viewCreateInfo.subresourceRange.baseArrayLayer = 0;
+  viewCreateInfo.subresourceRange.layerCount = 1;
+  BB_VK_ASSERT(vkCreateImageView(_renderer.Device, &viewCreateInfo, nullptr,
+                                 &_pyramid.View));
+
+  viewCreateInfo.subresourceRange.levelCount = 1;
+  for (uint32_t i = 0; i < _pyramid.NumLevels; ++i) {
+    viewCreateInfo.subresourceRange.baseMipLevel = i;
+    BB_VK_ASSERT(vkCreateImageView(_renderer.Device, &viewCreateInfo, nullptr,
+                                   &_pyramid.LevelViews[i]));
+  }
+
+  for (uint32_t i = 0; i < _pyramid.NumLevels; ++i) {
+    VkDescriptorImageInfo imageInfos[2] = {};
+    if (i == 0) {
+      imageInfos[0].imageView = _depthView;
+      imageInfos[0].imageLayout =
+          VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    } else {
+      imageInfos[0].imageView = _pyramid.LevelViews[i - 1];
+      imageInfos[0].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    }
+    imageInfos[1].imageView = _pyramid.LevelViews[i];
+    imageInfos[1].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    VkWriteDescriptorSet writeInfos[2] = {};
+    for (uint32_t j = 0; j < std::size(writeInfos); ++j) {
+      writeInfos[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      writeInfos[j].dstSet = _pyramid.LevelDescriptorSets[i];
+      writeInfos[j].dstBinding = j;
+      writeInfos[j].descriptorCount = 1;
+      writeInfos[j].pImageInfo = &imageInfos[j];
+    }
+    writeInfos[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    writeInfos[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    vkUpdateDescriptorSets(_renderer.Device, (uint32_t)std::size(writeInfos),
+                           writeInfos, 0, nullptr);
+  }
+}
+
+void recordDepthPyramid(const DepthPyramid &_pyramid,
+                        VkCommandBuffer _cmdBuffer) {
+  BB_ASSERT(_pyramid.Image != VK_NULL_HANDLE);
+
+  // Every level is written again, so what the culling pass of the last frame
+  // read can be discarded.
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = _pyramid.Image;
+  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.baseMipLevel = 0;
+  barrier.subresourceRange.levelCount = _pyramid.NumLevels;
+  barrier.subresourceRange.baseArrayLayer = 0;
+  barrier.subresourceRange.layerCount = 1;
+  vkCmdPipelineBarrier(_cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0,
+                       nullptr, 1, &barrier);
+
+  vkCmdBindPipeline(_cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    _pyramid.Pipeline);
+
+  // Each level waits for the one it's reduced from.
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barrier.subresourceRange.levelCount = 1;
+  for (uint32_t i = 0; i < _pyramid.NumLevels; ++i) {
+    vkCmdBindDescriptorSets(_cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            _pyramid.PipelineLayout, 0, 1,
+                            &_pyramid.LevelDescriptorSets[i], 0, nullptr);
+    const VkExtent2D &extent = _pyramid.LevelExtents[i];
+    vkCmdDispatch(
+        _cmdBuffer,
+        (extent.width + depthPyramidWorkGroupSize - 1) /
+            depthPyramidWorkGroupSize,
+        (extent.height + depthPyramidWorkGroupSize - 1) /
+            depthPyramidWorkGroupSize,
+        1);
+
+    barrier.subresourceRange.baseMipLevel = i;
+    vkCmdPipelineBarrier(_cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr,
+                         0, nullptr, 1, &barrier);
+  }
+}
+
+} // namespace bb
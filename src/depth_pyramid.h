@@ -0,0 +1,50 @@
+#pragma once
+#include "render.h"
+
+namespace bb {
+
+// The farthest depth of every block of the depth buffer, for occlusion
+// culling. Level 0 is a copy of the depth buffer and every level after it
+// halves the one before, rounding down, so the last texel of a level with an
+// odd size also covers the extra row or column. Screen texel p is covered by
+// texel min(p >> level, size - 1) of any level.
+constexpr uint32_t maxNumDepthPyramidLevels = 16;
+// Matches local_size_x/y of depth_pyramid.comp.
+constexpr uint32_t depthPyramidWorkGroupSize = 8;
+
+struct DepthPyramid {
+  VkSampler Sampler;
+  VkDescriptorSetLayout DescriptorSetLayout;
+  VkDescriptorPool DescriptorPool;
+  VkPipelineLayout PipelineLayout;
+  VkPipeline Pipeline;
+
+  // Sized with the depth buffer, see resizeDepthPyramid(). Always in
+  // VK_IMAGE_LAYOUT_GENERAL once built.
+  VkImage Image;
+  DeviceAllocation Allocation;
+  // All levels, for sampling.
+  VkImageView View;
+  VkImageView LevelViews[maxNumDepthPyramidLevels];
+  VkExtent2D LevelExtents[maxNumDepthPyramidLevels];
+  // Level i is reduced from level i - 1, level 0 from the depth buffer.
+  VkDescriptorSet LevelDescriptorSets[maxNumDepthPyramidLevels];
+  uint32_t NumLevels;
+};
+
+DepthPyramid *createDepthPyramid(const Renderer &_renderer,
+                                 const Shader &_reduceShader);
+void destroyDepthPyramid(const Renderer &_renderer, DepthPyramid *_pyramid);
+
+// (Re)creates the image for a depth buffer of _extent. _depthView is sampled
+// in VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL. The GPU must not be
+// using the pyramid.
+void resizeDepthPyramid(const Renderer &_renderer, DepthPyramid &_pyramid,
+                        VkExtent2D _extent, VkImageView _depthView);
+
+// Rebuilds every level from the depth buffer. Has to be called outside of a
+// render pass, once depth is written and read only.
+void recordDepthPyramid(const DepthPyramid &_pyramid,
+                        VkCommandBuffer _cmdBuffer);
+
+} // namespace bb
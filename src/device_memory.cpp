@@ -0,0 +1,548 @@
+#include "device_memory.h"
+#include "util.h"
+#include <algorithm>
+
+namespace bb {
+
+static VkDeviceSize alignUp(VkDeviceSize _offset, VkDeviceSize _alignment) {
+  return (_offset + _alignment - 1) / _alignment * _alignment;
+}
+
+static uint32_t getBuddyOrder(VkDeviceSize _size) {
+  uint32_t order = 0;
+  while ((minDeviceAllocationSize << order) < _size) {
+    ++order;
+  }
+  return order;
+}
+
+static uint32_t getHeapIndex(const DeviceMemoryAllocator &_allocator,
+                             uint32_t _memoryTypeIndex) {
+  return _allocator.MemoryProperties.memoryTypes[_memoryTypeIndex].heapIndex;
+}
+
+// Small heaps (e.g. the 256MB device local + host visible heap on most
+// desktop GPUs) get smaller blocks, so that a single block can't take a big
+// part of them.
+static VkDeviceSize getBlockSize(const DeviceMemoryAllocator &_allocator,
+                                 uint32_t _memoryTypeIndex) {
+  VkDeviceSize heapSize =
+      _allocator.MemoryProperties
+          .memoryHeaps[getHeapIndex(_allocator, _memoryTypeIndex)]
+          .size;
+  VkDeviceSize blockSize = deviceMemoryBlockSize;
+  while ((blockSize > heapSize / 8) && (blockSize > minDeviceAllocationSize)) {
+    blockSize /= 2;
+  }
+  return blockSize;
+}
+
+const char *getDeviceMemoryCategoryName(DeviceMemoryCategory _category) {
+  static const EnumArray<DeviceMemoryCategory, const char *> names = {
+      "Other", "Textures", "Meshes", "Attachments", "Staging", "Uniforms"};
+  return names[_category];
+}
+
+// Must be called with _allocator.Mutex locked.
+static void addToCategory(DeviceMemoryAllocator &_allocator,
+                          DeviceMemoryCategory _category, VkDeviceSize _size) {
+  DeviceCategoryStats &stats = _allocator.CategoryStats[_category];
+  ++stats.NumAllocations;
+  stats.Bytes += _size;
+  stats.PeakBytes = std::max(stats.PeakBytes, stats.Bytes);
+}
+
+// Must be called with _allocator.Mutex locked.
+static void removeFromCategory(DeviceMemoryAllocator &_allocator,
+                               DeviceMemoryCategory _category,
+                               VkDeviceSize _size) {
+  DeviceCategoryStats &stats = _allocator.CategoryStats[_category];
+  --stats.NumAllocations;
+  stats.Bytes -= _size;
+}
+
+// Must be called with _allocator.Mutex locked.
+static VkDeviceMemory allocateMemoryObject(DeviceMemoryAllocator &_allocator,
+                                           uint32_t _memoryTypeIndex,
+                                           VkDeviceSize _size,
+                                           const void *_pNext,
+                                           void **_mappedData) {
+  BB_ASSERT(_allocator.NumMemoryObjects < _allocator.MaxNumMemoryObjects);
+
+  VkMemoryAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocInfo.pNext = _pNext;
+  allocInfo.allocationSize = _size;
+  allocInfo.memoryTypeIndex = _memoryTypeIndex;
+
+  VkDeviceMemory memory;
+  BB_VK_ASSERT(
+      vkAllocateMemory(_allocator.Device, &allocInfo, nullptr, &memory));
+  ++_allocator.NumMemoryObjects;
+
+  *_mappedData = nullptr;
+  if (_allocator.MemoryProperties.memoryTypes[_memoryTypeIndex].propertyFlags &
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    BB_VK_ASSERT(vkMapMemory(_allocator.Device, memory, 0, VK_WHOLE_SIZE, 0,
+                             _mappedData));
+  }
+
+  return memory;
+}
+
+// Must be called with _allocator.Mutex locked.
+static void freeMemoryObject(DeviceMemoryAllocator &_allocator,
+                             VkDeviceMemory _memory) {
+  // Freeing implicitly unmaps.
+  vkFreeMemory(_allocator.Device, _memory, nullptr);
+  --_allocator.NumMemoryObjects;
+}
+
+DeviceMemoryAllocator *createDeviceMemoryAllocator(VkPhysicalDevice _gpu,
+                                                   VkDevice _device,
+                                                   bool _hasMemoryBudget) {
+  DeviceMemoryAllocator *allocator = new DeviceMemoryAllocator();
+  allocator->PhysicalDevice = _gpu;
+  allocator->Device = _device;
+  allocator->HasMemoryBudget = _hasMemoryBudget;
+  vkGetPhysicalDeviceMemoryProperties(_gpu, &allocator->MemoryProperties);
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(_gpu, &properties);
+  allocator->BufferImageGranularity = properties.limits.bufferImageGranularity;
+  allocator->MaxNumMemoryObjects = properties.limits.maxMemoryAllocationCount;
+
+  uint32_t numHeaps = allocator->MemoryProperties.memoryHeapCount;
+  allocator->NumDedicatedAllocations.resize(numHeaps);
+  allocator->DedicatedBytes.resize(numHeaps);
+  allocator->NumLinearPoolChunks.resize(numHeaps);
+  allocator->LinearPoolBytes.resize(numHeaps);
+
+  return allocator;
+}
+
+void destroyDeviceMemoryAllocator(DeviceMemoryAllocator *_allocator) {
+  for (DeviceMemoryBlock *block : _allocator->Blocks) {
+    if (block->NumAllocations > 0) {
+      BB_LOG_WARNING("{} device memory allocations were never freed",
+                     block->NumAllocations);
+    }
+    freeMemoryObject(*_allocator, block->Memory);
+    delete block;
+  }
+  if (_allocator->NumMemoryObjects > 0) {
+    BB_LOG_WARNING("{} dedicated device memory allocations were never freed",
+                   _allocator->NumMemoryObjects);
+  }
+  delete _allocator;
+}
+
+uint32_t findDeviceMemoryType(const DeviceMemoryAllocator &_allocator,
+                              uint32_t _typeFilter,
+                              VkMemoryPropertyFlags _properties) {
+  const VkPhysicalDeviceMemoryProperties &memProperties =
+      _allocator.MemoryProperties;
+  for (uint32_t i = 0; i < memProperties.memoryTypeCount; ++i) {
+    if ((_typeFilter & (1 << i)) &&
+        ((memProperties.memoryTypes[i].propertyFlags & _properties) ==
+         _properties)) {
+      return i;
+    }
+  }
+
+  BB_ASSERT(false);
+  return 0;
+}
+
+bool hasDeviceMemoryType(const DeviceMemoryAllocator &_allocator,
+                         uint32_t _typeFilter,
+                         VkMemoryPropertyFlags _properties) {
+  const VkPhysicalDeviceMemoryProperties &memProperties =
+      _allocator.MemoryProperties;
+  for (uint32_t i = 0; i < memProperties.memoryTypeCount; ++i) {
+    if ((_typeFilter & (1 << i)) &&
+        ((memProperties.memoryTypes[i].propertyFlags & _properties) ==
+         _properties)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool allocateFromBlock(DeviceMemoryBlock &_block, uint32_t _order,
+                              VkDeviceSize &_offset) {
+  uint32_t order = _order;
+  while ((order < _block.FreeOffsets.size()) &&
+         _block.FreeOffsets[order].empty()) {
+    ++order;
+  }
+  if (order >= _block.FreeOffsets.size()) {
+    return false;
+  }
+
+  VkDeviceSize offset = *_block.FreeOffsets[order].begin();
+  _block.FreeOffsets[order].erase(_block.FreeOffsets[order].begin());
+
+  // Split until the range is as small as it can be, and give the upper halves
+  // back.
+  while (order > _order) {
+    --order;
+    _block.FreeOffsets[order].insert(offset +
+                                     (minDeviceAllocationSize << order));
+  }
+
+  _offset = offset;
+  return true;
+}
+
+static void freeToBlock(DeviceMemoryBlock &_block, VkDeviceSize _offset,
+                        uint32_t _order) {
+  VkDeviceSize offset = _offset;
+  uint32_t order = _order;
+
+  // Merge with the buddy for as long as it's free too.
+  while (order + 1 < _block.FreeOffsets.size()) {
+    VkDeviceSize buddyOffset = offset ^ (minDeviceAllocationSize << order);
+    auto buddy = _block.FreeOffsets[order].find(buddyOffset);
+    if (buddy == _block.FreeOffsets[order].end()) {
+      break;
+    }
+    _block.FreeOffsets[order].erase(buddy);
+    offset = std::min(offset, buddyOffset);
+    ++order;
+  }
+
+  _block.FreeOffsets[order].insert(offset);
+}
+
+// Must be called with _allocator.Mutex locked.
+static DeviceMemoryBlock *createMemoryBlock(DeviceMemoryAllocator &_allocator,
+                                            uint32_t _memoryTypeIndex,
+                                            DeviceResourceKind _resourceKind,
+                                            VkDeviceSize _blockSize) {
+  DeviceMemoryBlock *block = new DeviceMemoryBlock();
+  block->Memory = allocateMemoryObject(_allocator, _memoryTypeIndex, _blockSize,
+                                       nullptr, &block->MappedData);
+  block->Size = _blockSize;
+  block->MemoryTypeIndex = _memoryTypeIndex;
+  block->ResourceKind = _resourceKind;
+
+  uint32_t maxOrder = getBuddyOrder(_blockSize);
+  block->FreeOffsets.resize(maxOrder + 1);
+  block->FreeOffsets[maxOrder].insert(0);
+
+  _allocator.Blocks.push_back(block);
+  return block;
+}
+
+DeviceAllocation allocateDeviceMemory(DeviceMemoryAllocator &_allocator,
+                                      const DeviceAllocationParams &_params) {
+  const VkMemoryRequirements &requirements = _params.Requirements;
+
+  DeviceAllocation result = {};
+  result.MemoryTypeIndex = findDeviceMemoryType(
+      _allocator, requirements.memoryTypeBits, _params.Properties);
+  result.Category = _params.Category;
+  uint32_t heapIndex = getHeapIndex(_allocator, result.MemoryTypeIndex);
+
+  VkDeviceSize blockSize = getBlockSize(_allocator, result.MemoryTypeIndex);
+  // Buddy ranges are aligned to their own size, so rounding the size up to the
+  // alignment is all it takes.
+  VkDeviceSize size = std::max({requirements.size, requirements.alignment,
+                                minDeviceAllocationSize});
+
+  std::scoped_lock lock(_allocator.Mutex);
+
+  addToCategory(_allocator, _params.Category, requirements.size);
+
+  if (_params.IsDedicated || (size > blockSize / 2)) {
+    VkMemoryDedicatedAllocateInfo dedicatedInfo = {};
+    dedicatedInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+    dedicatedInfo.buffer = _params.DedicatedBuffer;
+    dedicatedInfo.image = _params.DedicatedImage;
+    bool hasDedicatedResource = (_params.DedicatedBuffer != VK_NULL_HANDLE) ||
+                                (_params.DedicatedImage != VK_NULL_HANDLE);
+
+    result.Memory = allocateMemoryObject(
+        _allocator, result.MemoryTypeIndex, requirements.size,
+        hasDedicatedResource ? &dedicatedInfo : nullptr, &result.MappedData);
+    result.Offset = 0;
+    result.Size = requirements.size;
+
+    ++_allocator.NumDedicatedAllocations[heapIndex];
+    _allocator.DedicatedBytes[heapIndex] += requirements.size;
+    return result;
+  }
+
+  uint32_t order = getBuddyOrder(size);
+  DeviceMemoryBlock *block = nullptr;
+  VkDeviceSize offset = 0;
+  for (DeviceMemoryBlock *candidate : _allocator.Blocks) {
+    if ((candidate->MemoryTypeIndex == result.MemoryTypeIndex) &&
+        (candidate->ResourceKind == _params.ResourceKind) &&
+        allocateFromBlock(*candidate, order, offset)) {
+      block = candidate;
+      break;
+    }
+  }
+  if (!block) {
+    block = createMemoryBlock(_allocator, result.MemoryTypeIndex,
+                              _params.ResourceKind, blockSize);
+    bool isAllocated = allocateFromBlock(*block, order, offset);
+    BB_ASSERT(isAllocated);
+  }
+
+  block->NumUsedBytes += minDeviceAllocationSize << order;
+  block->NumRequestedBytes += requirements.size;
+  ++block->NumAllocations;
+
+  result.Memory = block->Memory;
+  result.Offset = offset;
+  result.Size = requirements.size;
+  if (block->MappedData) {
+    result.MappedData = (uint8_t *)block->MappedData + offset;
+  }
+  result.Block = block;
+  result.Order = order;
+
+  return result;
+}
+
+void freeDeviceMemory(DeviceMemoryAllocator &_allocator,
+                      DeviceAllocation &_allocation) {
+  if (_allocation.Memory == VK_NULL_HANDLE) {
+    return;
+  }
+
+  // Pool memory is only given back on reset.
+  if (_allocation.Pool) {
+    _allocation = {};
+    return;
+  }
+
+  std::scoped_lock lock(_allocator.Mutex);
+
+  removeFromCategory(_allocator, _allocation.Category, _allocation.Size);
+
+  DeviceMemoryBlock *block = _allocation.Block;
+  if (!block) {
+    uint32_t heapIndex = getHeapIndex(_allocator, _allocation.MemoryTypeIndex);
+    --_allocator.NumDedicatedAllocations[heapIndex];
+    _allocator.DedicatedBytes[heapIndex] -= _allocation.Size;
+    freeMemoryObject(_allocator, _allocation.Memory);
+    _allocation = {};
+    return;
+  }
+
+  freeToBlock(*block, _allocation.Offset, _allocation.Order);
+  block->NumUsedBytes -= minDeviceAllocationSize << _allocation.Order;
+  block->NumRequestedBytes -= _allocation.Size;
+  --block->NumAllocations;
+
+  // Keep one empty block of each kind around, so that a resource that is
+  // freed and created again every frame doesn't hit vkAllocateMemory.
+  if (block->NumAllocations == 0) {
+    auto isSameKind = [&](const DeviceMemoryBlock *_other) {
+      return (_other != block) &&
+             (_other->MemoryTypeIndex == block->MemoryTypeIndex) &&
+             (_other->ResourceKind == block->ResourceKind);
+    };
+    if (std::any_of(_allocator.Blocks.begin(), _allocator.Blocks.end(),
+                    isSameKind)) {
+      freeMemoryObject(_allocator, block->Memory);
+      _allocator.Blocks.erase(std::find(_allocator.Blocks.begin(),
+                                        _allocator.Blocks.end(), block));
+      delete block;
+    }
+  }
+
+  _allocation = {};
+}
+
+std::vector<DeviceHeapStats>
+getDeviceHeapStats(DeviceMemoryAllocator &_allocator) {
+  const VkPhysicalDeviceMemoryProperties &memProperties =
+      _allocator.MemoryProperties;
+
+  std::vector<DeviceHeapStats> stats(memProperties.memoryHeapCount);
+  std::vector<VkDeviceSize> freeBytes(memProperties.memoryHeapCount);
+
+  VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties = {};
+  if (_allocator.HasMemoryBudget) {
+    budgetProperties.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+    VkPhysicalDeviceMemoryProperties2 memProperties2 = {};
+    memProperties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+    memProperties2.pNext = &budgetProperties;
+    vkGetPhysicalDeviceMemoryProperties2(_allocator.PhysicalDevice,
+                                         &memProperties2);
+  }
+
+  std::scoped_lock lock(_allocator.Mutex);
+
+  for (uint32_t i = 0; i < memProperties.memoryHeapCount; ++i) {
+    DeviceHeapStats &heapStats = stats[i];
+    heapStats.HeapSize = memProperties.memoryHeaps[i].size;
+    heapStats.IsDeviceLocal = memProperties.memoryHeaps[i].flags &
+                              VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+    heapStats.NumDedicatedAllocations = _allocator.NumDedicatedAllocations[i];
+    heapStats.DedicatedBytes = _allocator.DedicatedBytes[i];
+    heapStats.NumLinearPoolChunks = _allocator.NumLinearPoolChunks[i];
+    heapStats.LinearPoolBytes = _allocator.LinearPoolBytes[i];
+    if (_allocator.HasMemoryBudget) {
+      heapStats.Budget = budgetProperties.heapBudget[i];
+      heapStats.Usage = budgetProperties.heapUsage[i];
+    } else {
+      heapStats.Budget = heapStats.HeapSize;
+      heapStats.Usage = heapStats.DedicatedBytes + heapStats.LinearPoolBytes;
+    }
+  }
+
+  for (const DeviceMemoryBlock *block : _allocator.Blocks) {
+    uint32_t heapIndex = getHeapIndex(_allocator, block->MemoryTypeIndex);
+    DeviceHeapStats &heapStats = stats[heapIndex];
+    ++heapStats.NumBlocks;
+    heapStats.BlockBytes += block->Size;
+    if (!_allocator.HasMemoryBudget) {
+      heapStats.Usage += block->Size;
+    }
+    heapStats.UsedBytes += block->NumUsedBytes;
+    heapStats.RequestedBytes += block->NumRequestedBytes;
+    heapStats.NumAllocations += block->NumAllocations;
+    freeBytes[heapIndex] += block->Size - block->NumUsedBytes;
+
+    for (uint32_t order = (uint32_t)block->FreeOffsets.size(); order > 0;
+         --order) {
+      if (!block->FreeOffsets[order - 1].empty()) {
+        heapStats.LargestFreeRange =
+            std::max(heapStats.LargestFreeRange,
+                     minDeviceAllocationSize << (order - 1));
+        break;
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < memProperties.memoryHeapCount; ++i) {
+    if (freeBytes[i] > 0) {
+      stats[i].Fragmentation =
+          1.f - (float)stats[i].LargestFreeRange / (float)freeBytes[i];
+    }
+  }
+
+  return stats;
+}
+
+EnumArray<DeviceMemoryCategory, DeviceCategoryStats>
+getDeviceCategoryStats(DeviceMemoryAllocator &_allocator) {
+  std::scoped_lock lock(_allocator.Mutex);
+  return _allocator.CategoryStats;
+}
+
+LinearMemoryPool *createLinearMemoryPool(DeviceMemoryAllocator &_allocator,
+                                         VkMemoryPropertyFlags _properties,
+                                         DeviceMemoryCategory _category,
+                                         VkDeviceSize _chunkSize) {
+  LinearMemoryPool *pool = new LinearMemoryPool();
+  pool->Allocator = &_allocator;
+  pool->Properties = _properties;
+  pool->Category = _category;
+  pool->ChunkSize = _chunkSize;
+  return pool;
+}
+
+static void freeLinearMemoryPoolChunks(LinearMemoryPool &_pool) {
+  DeviceMemoryAllocator &allocator = *_pool.Allocator;
+  std::scoped_lock lock(allocator.Mutex);
+  for (LinearMemoryPool::Chunk &chunk : _pool.Chunks) {
+    uint32_t heapIndex =
+        getHeapIndex(allocator, chunk.Allocation.MemoryTypeIndex);
+    --allocator.NumLinearPoolChunks[heapIndex];
+    allocator.LinearPoolBytes[heapIndex] -= chunk.Allocation.Size;
+    removeFromCategory(allocator, _pool.Category, chunk.Allocation.Size);
+    freeMemoryObject(allocator, chunk.Allocation.Memory);
+  }
+  _pool.Chunks.clear();
+}
+
+void destroyLinearMemoryPool(LinearMemoryPool *_pool) {
+  freeLinearMemoryPoolChunks(*_pool);
+  delete _pool;
+}
+
+DeviceAllocation
+allocateFromLinearMemoryPool(LinearMemoryPool &_pool,
+                             const VkMemoryRequirements &_requirements) {
+  DeviceMemoryAllocator &allocator = *_pool.Allocator;
+  // Buffers and images can be mixed in a pool.
+  VkDeviceSize alignment =
+      std::max(_requirements.alignment, allocator.BufferImageGranularity);
+
+  LinearMemoryPool::Chunk *chunk = nullptr;
+  VkDeviceSize offset = 0;
+  if (!_pool.Chunks.empty()) {
+    LinearMemoryPool::Chunk &lastChunk = _pool.Chunks.back();
+    offset = alignUp(lastChunk.Head, alignment);
+    if ((_requirements.memoryTypeBits &
+         (1 << lastChunk.Allocation.MemoryTypeIndex)) &&
+        (offset + _requirements.size <= lastChunk.Allocation.Size)) {
+      chunk = &lastChunk;
+    }
+  }
+
+  if (!chunk) {
+    LinearMemoryPool::Chunk newChunk = {};
+    DeviceAllocation &chunkAllocation = newChunk.Allocation;
+    chunkAllocation.MemoryTypeIndex = findDeviceMemoryType(
+        allocator, _requirements.memoryTypeBits, _pool.Properties);
+    chunkAllocation.Size = std::max(_pool.ChunkSize, _requirements.size);
+
+    {
+      std::scoped_lock lock(allocator.Mutex);
+      chunkAllocation.Memory = allocateMemoryObject(
+          allocator, chunkAllocation.MemoryTypeIndex, chunkAllocation.Size,
+          nullptr, &chunkAllocation.MappedData);
+      uint32_t heapIndex =
+          getHeapIndex(allocator, chunkAllocation.MemoryTypeIndex);
+      ++allocator.NumLinearPoolChunks[heapIndex];
+      allocator.LinearPoolBytes[heapIndex] += chunkAllocation.Size;
+      addToCategory(allocator, _pool.Category, chunkAllocation.Size);
+    }
+
+    _pool.Chunks.push_back(newChunk);
+    chunk = &_pool.Chunks.back();
+    offset = 0;
+  }
+
+  chunk->Head = offset + _requirements.size;
+
+  DeviceAllocation result = {};
+  result.Memory = chunk->Allocation.Memory;
+  result.Offset = offset;
+  result.Size = _requirements.size;
+  if (chunk->Allocation.MappedData) {
+    result.MappedData = (uint8_t *)chunk->Allocation.MappedData + offset;
+  }
+  result.MemoryTypeIndex = chunk->Allocation.MemoryTypeIndex;
+  result.Category = _pool.Category;
+  result.Pool = &_pool;
+  return result;
+}
+
+void resetLinearMemoryPool(LinearMemoryPool &_pool) {
+  if (_pool.Chunks.size() > 1) {
+    VkDeviceSize totalSize = 0;
+    for (const LinearMemoryPool::Chunk &chunk : _pool.Chunks) {
+      totalSize += chunk.Allocation.Size;
+    }
+    freeLinearMemoryPoolChunks(_pool);
+    _pool.ChunkSize = std::max(_pool.ChunkSize, totalSize);
+    return;
+  }
+
+  for (LinearMemoryPool::Chunk &chunk : _pool.Chunks) {
+    chunk.Head = 0;
+  }
+}
+
+} // namespace bb
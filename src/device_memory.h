@@ -0,0 +1,187 @@
+#pragma once
+#include "enum_array.h"
+#include "external/volk.h"
+#include <mutex>
+#include <set>
+#include <vector>
+
+namespace bb {
+
+// Device memory is allocated in large blocks per memory type, and buffers and
+// images are sub-allocated out of them with a buddy allocator. Buffers and
+// images never share a block, so bufferImageGranularity can be ignored.
+// Requests that are too big for a block, or resources that want memory of
+// their own (large attachments), get a dedicated allocation instead.
+// Host visible memory is persistently mapped; never call vkMapMemory on an
+// allocation, since the same VkDeviceMemory is shared by many of them.
+constexpr VkDeviceSize deviceMemoryBlockSize = 64 * 1024 * 1024;
+constexpr VkDeviceSize minDeviceAllocationSize = 256;
+// Attachments at least this big are always allocated on their own.
+constexpr VkDeviceSize largeAttachmentSize = 4 * 1024 * 1024;
+
+enum class DeviceResourceKind { Buffer, Image, COUNT };
+
+// What the memory is used for. Only used for accounting.
+enum class DeviceMemoryCategory {
+  Other,
+  Texture,
+  Mesh,
+  Attachment,
+  Staging,
+  Uniform,
+  COUNT
+};
+
+const char *getDeviceMemoryCategoryName(DeviceMemoryCategory _category);
+
+struct DeviceCategoryStats {
+  uint32_t NumAllocations;
+  VkDeviceSize Bytes;
+  VkDeviceSize PeakBytes;
+};
+
+struct DeviceMemoryBlock {
+  VkDeviceMemory Memory;
+  VkDeviceSize Size;
+  uint32_t MemoryTypeIndex;
+  DeviceResourceKind ResourceKind;
+  void *MappedData;
+
+  // FreeOffsets[order] holds the free ranges of
+  // (minDeviceAllocationSize << order) bytes.
+  std::vector<std::set<VkDeviceSize>> FreeOffsets;
+  VkDeviceSize NumUsedBytes;
+  VkDeviceSize NumRequestedBytes;
+  uint32_t NumAllocations;
+};
+
+struct LinearMemoryPool;
+
+struct DeviceAllocation {
+  VkDeviceMemory Memory;
+  VkDeviceSize Offset;
+  VkDeviceSize Size;
+  // Points at Offset already. Null unless the memory is host visible.
+  void *MappedData;
+  uint32_t MemoryTypeIndex;
+  DeviceMemoryCategory Category;
+
+  // Both are null for dedicated allocations.
+  DeviceMemoryBlock *Block;
+  LinearMemoryPool *Pool;
+  uint32_t Order;
+};
+
+struct DeviceAllocationParams {
+  VkMemoryRequirements Requirements;
+  VkMemoryPropertyFlags Properties;
+  DeviceResourceKind ResourceKind;
+  DeviceMemoryCategory Category;
+  bool IsDedicated;
+  // Chained as VkMemoryDedicatedAllocateInfo when IsDedicated is set.
+  VkBuffer DedicatedBuffer;
+  VkImage DedicatedImage;
+};
+
+struct DeviceHeapStats {
+  VkDeviceSize HeapSize;
+  bool IsDeviceLocal;
+  // From VK_EXT_memory_budget, and both cover every process using the heap.
+  // Without the extension Budget is HeapSize and Usage is what this allocator
+  // took from the heap.
+  VkDeviceSize Budget;
+  VkDeviceSize Usage;
+
+  uint32_t NumBlocks;
+  VkDeviceSize BlockBytes;
+  // Buddy allocations are rounded up to a power of two, so UsedBytes is
+  // always >= RequestedBytes.
+  VkDeviceSize UsedBytes;
+  VkDeviceSize RequestedBytes;
+  uint32_t NumAllocations;
+  VkDeviceSize LargestFreeRange;
+  // 1 - (largest free range / total free bytes) over all blocks of the heap.
+  float Fragmentation;
+
+  uint32_t NumDedicatedAllocations;
+  VkDeviceSize DedicatedBytes;
+
+  uint32_t NumLinearPoolChunks;
+  VkDeviceSize LinearPoolBytes;
+};
+
+struct DeviceMemoryAllocator {
+  VkPhysicalDevice PhysicalDevice;
+  VkDevice Device;
+  bool HasMemoryBudget;
+  VkPhysicalDeviceMemoryProperties MemoryProperties;
+  VkDeviceSize BufferImageGranularity;
+  uint32_t MaxNumMemoryObjects;
+  uint32_t NumMemoryObjects;
+
+  std::vector<DeviceMemoryBlock *> Blocks;
+  // Indexed by heap.
+  std::vector<uint32_t> NumDedicatedAllocations;
+  std::vector<VkDeviceSize> DedicatedBytes;
+  std::vector<uint32_t> NumLinearPoolChunks;
+  std::vector<VkDeviceSize> LinearPoolBytes;
+  // Bytes requested by the resources, or the whole chunks for linear pools.
+  EnumArray<DeviceMemoryCategory, DeviceCategoryStats> CategoryStats;
+
+  std::mutex Mutex;
+};
+
+// _hasMemoryBudget tells whether VK_EXT_memory_budget is enabled on _device.
+DeviceMemoryAllocator *createDeviceMemoryAllocator(VkPhysicalDevice _gpu,
+                                                   VkDevice _device,
+                                                   bool _hasMemoryBudget);
+void destroyDeviceMemoryAllocator(DeviceMemoryAllocator *_allocator);
+
+uint32_t findDeviceMemoryType(const DeviceMemoryAllocator &_allocator,
+                              uint32_t _typeFilter,
+                              VkMemoryPropertyFlags _properties);
+bool hasDeviceMemoryType(const DeviceMemoryAllocator &_allocator,
+                         uint32_t _typeFilter,
+                         VkMemoryPropertyFlags _properties);
+
+// Thread-safe.
+DeviceAllocation allocateDeviceMemory(DeviceMemoryAllocator &_allocator,
+                                      const DeviceAllocationParams &_params);
+void freeDeviceMemory(DeviceMemoryAllocator &_allocator,
+                      DeviceAllocation &_allocation);
+
+std::vector<DeviceHeapStats>
+getDeviceHeapStats(DeviceMemoryAllocator &_allocator);
+EnumArray<DeviceMemoryCategory, DeviceCategoryStats>
+getDeviceCategoryStats(DeviceMemoryAllocator &_allocator);
+
+// For resources that are all released at once (e.g. everything that depends on
+// the window size). Allocating is a pointer bump, and nothing is freed until
+// resetLinearMemoryPool(). Chunks are dedicated allocations of at least
+// _chunkSize bytes; if a pool ever needs more than one, the next reset merges
+// them into a single bigger chunk.
+struct LinearMemoryPool {
+  DeviceMemoryAllocator *Allocator;
+  VkMemoryPropertyFlags Properties;
+  DeviceMemoryCategory Category;
+  VkDeviceSize ChunkSize;
+
+  struct Chunk {
+    DeviceAllocation Allocation;
+    VkDeviceSize Head;
+  };
+  std::vector<Chunk> Chunks;
+};
+
+LinearMemoryPool *createLinearMemoryPool(DeviceMemoryAllocator &_allocator,
+                                         VkMemoryPropertyFlags _properties,
+                                         DeviceMemoryCategory _category,
+                                         VkDeviceSize _chunkSize);
+void destroyLinearMemoryPool(LinearMemoryPool *_pool);
+// Not thread-safe with respect to the same pool.
+DeviceAllocation allocateFromLinearMemoryPool(
+    LinearMemoryPool &_pool, const VkMemoryRequirements &_requirements);
+// Every resource allocated from the pool must have been destroyed.
+void resetLinearMemoryPool(LinearMemoryPool &_pool);
+
+} // namespace bb
@@ -1,5 +1,6 @@
 #pragma once
 #include <type_traits>
+#include <stddef.h>
 #include <stdint.h>
 
 namespace bb {
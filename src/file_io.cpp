@@ -0,0 +1,277 @@
+#include "file_io.h"
+#include "util.h"
+#include <algorithm>
+#include <stdio.h>
+
+namespace bb {
+
+static struct {
+  ThreadPool *FallbackThreadPool;
+
+  std::atomic<uint64_t> NumReads;
+  std::atomic<uint64_t> NumFailedReads;
+  std::atomic<uint64_t> NumBytesRead;
+  std::atomic<uint64_t> NumBatches;
+} gFileIO;
+
+void initFileIO(ThreadPool &_fallbackThreadPool) {
+  gFileIO.FallbackThreadPool = &_fallbackThreadPool;
+}
+
+void shutdownFileIO() { gFileIO.FallbackThreadPool = nullptr; }
+
+bool getFileSize(const std::string &_filePath, uint64_t &_size) {
+#ifdef BB_WINDOWS
+  WIN32_FILE_ATTRIBUTE_DATA attributes;
+  if (!GetFileAttributesExA(_filePath.c_str(), GetFileExInfoStandard,
+                            &attributes)) {
+    return false;
+  }
+  _size = ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+  return true;
+#else
+  FILE *f = fopen(_filePath.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  _size = (uint64_t)ftell(f);
+  fclose(f);
+  return true;
+#endif
+}
+
+// Several threads may get here for the same read; only the first one records
+// the result. Once the read is marked completed its waiter may free the batch,
+// so that is the last thing done, and it's done under the lock.
+static void finishFileRead(FileReadBatch &_batch, uint32_t _index,
+                           uint64_t _numBytesRead, bool _isSucceeded) {
+  std::scoped_lock lock(_batch.Mutex);
+  if (_batch.IsCompleted[_index]) {
+    return;
+  }
+
+  FileRead &read = _batch.Reads[_index];
+  ++gFileIO.NumReads;
+  if (_isSucceeded) {
+    gFileIO.NumBytesRead += _numBytesRead;
+  } else {
+    ++gFileIO.NumFailedReads;
+    BB_LOG_WARNING("Failed to read {}", read.FilePath);
+  }
+
+  read.NumBytesRead = _numBytesRead;
+  read.IsSucceeded = _isSucceeded;
+  _batch.IsCompleted[_index] = true;
+  _batch.ReadCompleted.notify_all();
+}
+
+static bool runBlockingFileRead(const FileRead &_read,
+                                uint64_t &_numBytesRead) {
+  _numBytesRead = 0;
+
+  FILE *f = fopen(_read.FilePath.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  BB_DEFER(fclose(f));
+
+  // long is 32-bit on Windows, and packs can be bigger than that.
+#ifdef BB_WINDOWS
+  int seekResult = _fseeki64(f, (int64_t)_read.Offset, SEEK_SET);
+#else
+  int seekResult = fseeko(f, (off_t)_read.Offset, SEEK_SET);
+#endif
+  if (seekResult != 0) {
+    return false;
+  }
+  _numBytesRead = fread(_read.Dest, 1, _read.Size, f);
+  return _numBytesRead == _read.Size;
+}
+
+#ifdef BB_WINDOWS
+constexpr uint64_t maxOverlappedChunkSize = 1ull << 30;
+
+// Issues every chunk of the read without waiting for any of them. Returns false
+// if not even the first chunk could be issued.
+static bool startOverlappedFileRead(const FileRead &_read,
+                                    FileReadBatch::PendingRead &_pending) {
+  _pending.FileHandle =
+      CreateFileA(_read.FilePath.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                  nullptr, OPEN_EXISTING,
+                  FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (_pending.FileHandle == INVALID_HANDLE_VALUE) {
+    _pending.FileHandle = nullptr;
+    return false;
+  }
+
+  uint64_t numChunks = std::max(
+      (_read.Size + maxOverlappedChunkSize - 1) / maxOverlappedChunkSize,
+      (uint64_t)1);
+  _pending.Chunks.reserve(numChunks);
+  _pending.IsFullyIssued = true;
+
+  for (uint64_t i = 0; i < numChunks; ++i) {
+    uint64_t chunkOffset = i * maxOverlappedChunkSize;
+    uint64_t fileOffset = _read.Offset + chunkOffset;
+    DWORD chunkSize =
+        (DWORD)std::min(_read.Size - chunkOffset, maxOverlappedChunkSize);
+
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = (DWORD)(fileOffset & 0xFFFFFFFF);
+    overlapped.OffsetHigh = (DWORD)(fileOffset >> 32);
+    // Chunks of the same file complete independently, so each of them needs
+    // its own event to wait on.
+    overlapped.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+    if (!overlapped.hEvent) {
+      _pending.IsFullyIssued = false;
+      break;
+    }
+    _pending.Chunks.push_back(overlapped);
+
+    if (!ReadFile(_pending.FileHandle, (uint8_t *)_read.Dest + chunkOffset,
+                  chunkSize, nullptr, &_pending.Chunks.back()) &&
+        GetLastError() != ERROR_IO_PENDING) {
+      CloseHandle(_pending.Chunks.back().hEvent);
+      _pending.Chunks.pop_back();
+      _pending.IsFullyIssued = false;
+      break;
+    }
+  }
+
+  if (_pending.Chunks.empty()) {
+    CloseHandle(_pending.FileHandle);
+    _pending.FileHandle = nullptr;
+    return false;
+  }
+  return true;
+}
+#endif
+
+FileReadBatch *submitFileReads(const FileRead *_reads, uint32_t _numReads) {
+  BB_ASSERT(gFileIO.FallbackThreadPool);
+
+  FileReadBatch *batch = new FileReadBatch();
+  batch->Reads.assign(_reads, _reads + _numReads);
+  batch->IsCompleted = std::make_unique<std::atomic<bool>[]>(_numReads);
+  ++gFileIO.NumBatches;
+
+#ifdef BB_WINDOWS
+  batch->PendingReads.resize(_numReads);
+#endif
+
+  for (uint32_t i = 0; i < _numReads; ++i) {
+    FileRead &read = batch->Reads[i];
+    read.NumBytesRead = 0;
+    read.IsSucceeded = false;
+    batch->IsCompleted[i] = false;
+
+#ifdef BB_WINDOWS
+    if (startOverlappedFileRead(read, batch->PendingReads[i])) {
+      continue;
+    }
+#endif
+
+    enqueueJob(*gFileIO.FallbackThreadPool, [batch, i] {
+      uint64_t numBytesRead;
+      bool isSucceeded = runBlockingFileRead(batch->Reads[i], numBytesRead);
+      finishFileRead(*batch, i, numBytesRead, isSucceeded);
+    });
+  }
+
+  return batch;
+}
+
+void waitForFileRead(FileReadBatch &_batch, uint32_t _index) {
+  if (_batch.IsCompleted[_index]) {
+    return;
+  }
+
+#ifdef BB_WINDOWS
+  const FileReadBatch::PendingRead &pending = _batch.PendingReads[_index];
+  if (pending.FileHandle) {
+    uint64_t numBytesRead = 0;
+    bool isSucceeded = pending.IsFullyIssued;
+    for (const OVERLAPPED &overlapped : pending.Chunks) {
+      WaitForSingleObject(overlapped.hEvent, INFINITE);
+
+      DWORD numChunkBytesRead = 0;
+      if (!GetOverlappedResult(pending.FileHandle,
+                               const_cast<OVERLAPPED *>(&overlapped),
+                               &numChunkBytesRead, FALSE)) {
+        isSucceeded = false;
+      }
+      numBytesRead += numChunkBytesRead;
+    }
+    isSucceeded = isSucceeded && (numBytesRead == _batch.Reads[_index].Size);
+
+    finishFileRead(_batch, _index, numBytesRead, isSucceeded);
+    return;
+  }
+#endif
+
+  // The read is a job on the thread pool, so help run jobs rather than
+  // blocking a thread that could be running it.
+  while (!_batch.IsCompleted[_index]) {
+    if (!tryRunJob(*gFileIO.FallbackThreadPool)) {
+      std::unique_lock lock(_batch.Mutex);
+      _batch.ReadCompleted.wait(
+          lock, [&] { return (bool)_batch.IsCompleted[_index]; });
+    }
+  }
+}
+
+void waitForFileReadBatch(FileReadBatch &_batch) {
+  for (uint32_t i = 0; i < (uint32_t)_batch.Reads.size(); ++i) {
+    waitForFileRead(_batch, i);
+  }
+}
+
+void destroyFileReadBatch(FileReadBatch *_batch) {
+  waitForFileReadBatch(*_batch);
+  // Completion is seen without the lock, so the thread that finished the last
+  // read may still be notifying under it.
+  { std::scoped_lock lock(_batch->Mutex); }
+
+#ifdef BB_WINDOWS
+  for (FileReadBatch::PendingRead &pending : _batch->PendingReads) {
+    for (OVERLAPPED &overlapped : pending.Chunks) {
+      CloseHandle(overlapped.hEvent);
+    }
+    if (pending.FileHandle) {
+      CloseHandle(pending.FileHandle);
+    }
+  }
+#endif
+
+  delete _batch;
+}
+
+bool readWholeFile(const std::string &_filePath,
+                   std::vector<uint8_t> &_contents) {
+  FileRead read = {};
+  read.FilePath = _filePath;
+  if (!getFileSize(_filePath, read.Size)) {
+    return false;
+  }
+  _contents.resize(read.Size);
+  read.Dest = _contents.data();
+
+  FileReadBatch *batch = submitFileReads(&read, 1);
+  waitForFileRead(*batch, 0);
+  bool isSucceeded = batch->Reads[0].IsSucceeded;
+  destroyFileReadBatch(batch);
+
+  return isSucceeded;
+}
+
+FileIOStats getFileIOStats() {
+  FileIOStats stats = {};
+  stats.NumReads = gFileIO.NumReads;
+  stats.NumFailedReads = gFileIO.NumFailedReads;
+  stats.NumBytesRead = gFileIO.NumBytesRead;
+  stats.NumBatches = gFileIO.NumBatches;
+  return stats;
+}
+
+} // namespace bb
@@ -0,0 +1,83 @@
+#pragma once
+#include "thread_pool.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifdef BB_WINDOWS
+#include <Windows.h>
+#endif
+
+namespace bb {
+
+// Asynchronous file reads. On Windows every read is issued as overlapped I/O
+// right away, so a whole batch is in flight at once and no thread is tied up
+// while the OS serves it. Elsewhere (or for files that can't be opened for
+// overlapped I/O) the reads are run as jobs on the fallback thread pool with
+// blocking stdio.
+//
+// Destination buffers are owned by the caller and can be anything the CPU can
+// write to, including mapped staging memory.
+struct FileRead {
+  std::string FilePath;
+  void *Dest;
+  uint64_t Offset;
+  uint64_t Size;
+
+  // Valid once the read has completed.
+  uint64_t NumBytesRead;
+  bool IsSucceeded;
+};
+
+struct FileReadBatch {
+  std::vector<FileRead> Reads;
+
+#ifdef BB_WINDOWS
+  // Handles are kept open until the batch is destroyed, so that any number of
+  // threads can wait on the same read.
+  struct PendingRead {
+    HANDLE FileHandle;
+    // One OVERLAPPED per chunk, since a single ReadFile() is limited to 4GB.
+    std::vector<OVERLAPPED> Chunks;
+    bool IsFullyIssued;
+  };
+  std::vector<PendingRead> PendingReads;
+#endif
+
+  std::unique_ptr<std::atomic<bool>[]> IsCompleted;
+  std::mutex Mutex;
+  std::condition_variable ReadCompleted;
+};
+
+struct FileIOStats {
+  uint64_t NumReads;
+  uint64_t NumFailedReads;
+  uint64_t NumBytesRead;
+  uint64_t NumBatches;
+};
+
+// Every file read (shaders, textures, ...) goes through here once this is
+// called.
+void initFileIO(ThreadPool &_fallbackThreadPool);
+void shutdownFileIO();
+
+// Returns false if the file doesn't exist.
+bool getFileSize(const std::string &_filePath, uint64_t &_size);
+
+// _reads are copied into the batch; results are read back from
+// FileReadBatch::Reads.
+FileReadBatch *submitFileReads(const FileRead *_reads, uint32_t _numReads);
+void waitForFileRead(FileReadBatch &_batch, uint32_t _index);
+void waitForFileReadBatch(FileReadBatch &_batch);
+// Waits for every read that's still in flight first.
+void destroyFileReadBatch(FileReadBatch *_batch);
+
+// Blocking helper for the common case of reading a single file at once.
+bool readWholeFile(const std::string &_filePath,
+                   std::vector<uint8_t> &_contents);
+
+FileIOStats getFileIOStats();
+
+} // namespace bb
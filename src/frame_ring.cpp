@@ -0,0 +1,60 @@
+#include "frame_ring.h"
+#include "util.h"
+#include <algorithm>
+
+namespace bb {
+
+static VkDeviceSize alignUp(VkDeviceSize _offset, VkDeviceSize _alignment) {
+  return (_offset + _alignment - 1) / _alignment * _alignment;
+}
+
+FrameRing createFrameRing(const Renderer &_renderer, VkDeviceSize _segmentSize,
+                          uint32_t _numSegments) {
+  FrameRing ring = {};
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(_renderer.PhysicalDevice, &properties);
+  ring.Alignment = std::max(
+      properties.limits.minUniformBufferOffsetAlignment, (VkDeviceSize)16);
+
+  ring.SegmentSize = alignUp(_segmentSize, ring.Alignment);
+  ring.NumSegments = _numSegments;
+  ring.RingBuffer = createBuffer(
+      _renderer, ring.SegmentSize * ring.NumSegments,
+      VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  ring.MappedData = (uint8_t *)ring.RingBuffer.Allocation.MappedData;
+  BB_ASSERT(ring.MappedData);
+
+  return ring;
+}
+
+void destroyFrameRing(const Renderer &_renderer, FrameRing &_ring) {
+  destroyBuffer(_renderer, _ring.RingBuffer);
+  _ring = {};
+}
+
+void beginFrameRingSegment(FrameRing &_ring, uint32_t _frameIndex) {
+  BB_ASSERT(_frameIndex < _ring.NumSegments);
+  _ring.CurrentSegment = _frameIndex;
+  _ring.Head = 0;
+}
+
+FrameRingAllocation allocateFromFrameRing(FrameRing &_ring,
+                                          VkDeviceSize _size) {
+  VkDeviceSize offset = alignUp(_ring.Head, _ring.Alignment);
+  // The segment size is fixed, and everything that goes into the ring is
+  // bounded (MAX_NUM_LIGHTS etc.), so running out is a programming error.
+  BB_ASSERT(offset + _size <= _ring.SegmentSize);
+  _ring.Head = offset + _size;
+  _ring.PeakUsed = std::max(_ring.PeakUsed, _ring.Head);
+
+  FrameRingAllocation allocation = {};
+  allocation.Handle = _ring.RingBuffer.Handle;
+  allocation.Offset = _ring.SegmentSize * _ring.CurrentSegment + offset;
+  allocation.Data = _ring.MappedData + allocation.Offset;
+  return allocation;
+}
+
+} // namespace bb
@@ -0,0 +1,54 @@
+#pragma once
+#include "render.h"
+
+namespace bb {
+
+// Per-frame data (uniform blocks, instance data) is written straight into a
+// single persistently mapped buffer, which is split into one segment per frame
+// in flight. Allocating is a pointer bump inside the segment owned by the
+// current frame, and a segment is only rewound once the fence of the frame
+// that used it last has been waited on, so nothing is overwritten while the
+// GPU may still read it. Consumers bind the ring buffer with dynamic uniform
+// buffer offsets or vertex buffer offsets.
+constexpr VkDeviceSize defaultFrameRingSegmentSize = 256 * 1024;
+
+struct FrameRingAllocation {
+  VkBuffer Handle;
+  VkDeviceSize Offset;
+  void *Data;
+};
+
+struct FrameRing {
+  Buffer RingBuffer;
+  uint8_t *MappedData;
+  // Satisfies both minUniformBufferOffsetAlignment and the alignment of every
+  // type that is put into the ring.
+  VkDeviceSize Alignment;
+
+  VkDeviceSize SegmentSize;
+  uint32_t NumSegments;
+  uint32_t CurrentSegment;
+  VkDeviceSize Head;
+  VkDeviceSize PeakUsed;
+};
+
+FrameRing createFrameRing(const Renderer &_renderer, VkDeviceSize _segmentSize,
+                          uint32_t _numSegments);
+void destroyFrameRing(const Renderer &_renderer, FrameRing &_ring);
+
+// Call once the fence of _frameIndex has been waited on. Everything allocated
+// the last time this segment was in use becomes invalid.
+void beginFrameRingSegment(FrameRing &_ring, uint32_t _frameIndex);
+FrameRingAllocation allocateFromFrameRing(FrameRing &_ring,
+                                          VkDeviceSize _size);
+
+template <typename T>
+FrameRingAllocation pushToFrameRing(FrameRing &_ring, const T *_data,
+                                    uint32_t _count) {
+  FrameRingAllocation allocation =
+      allocateFromFrameRing(_ring, sizeof(T) * _count);
+  memcpy(allocation.Data, _data, sizeof(T) * _count);
+  return allocation;
+}
+
+} // namespace bb
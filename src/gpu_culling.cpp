@@ -0,0 +1,370 @@
+#include "gpu_culling.h"
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+
+namespace bb {
+
+// Matches the bindings of cull_instances.comp.
+enum class CullBinding {
+  Instances,
+  InstanceIds,
+  Batches,
+  DrawCommands,
+  VisibleInstances,
+  Visibility,
+  View,
+  DepthPyramid,
+  COUNT
+};
+
+static VkDescriptorType getCullBindingType(CullBinding _binding) {
+  switch (_binding) {
+  case CullBinding::View:
+    return VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  case CullBinding::DepthPyramid:
+    return VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  default:
+    return VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  }
+}
+
+GPUCulling *createGPUCulling(const Renderer &_renderer,
+                             const Shader &_cullShader) {
+  GPUCulling *culling = new GPUCulling();
+
+  VkDescriptorSetLayoutBinding bindings[(size_t)CullBinding::COUNT] = {};
+  for (uint32_t i = 0; i < std::size(bindings); ++i) {
+    bindings[i].binding = i;
+    bindings[i].descriptorType = getCullBindingType((CullBinding)i);
+    bindings[i].descriptorCount = 1;
+    bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+
+  VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
+  descriptorSetLayoutCreateInfo.sType =
+      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptorSetLayoutCreateInfo.bindingCount = (uint32_t)std::size(bindings);
+  descriptorSetLayoutCreateInfo.pBindings = bindings;
+  BB_VK_ASSERT(vkCreateDescriptorSetLayout(_renderer.Device,
+                                           &descriptorSetLayoutCreateInfo,
+                                           nullptr,
+                                           &culling->DescriptorSetLayout));
+
+  // uPhase
+  VkPushConstantRange pushConstantRange = {};
+  pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  pushConstantRange.offset = 0;
+  pushConstantRange.size = sizeof(uint32_t);
+
+  VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {};
+  pipelineLayoutCreateInfo.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipelineLayoutCreateInfo.setLayoutCount = 1;
+  pipelineLayoutCreateInfo.pSetLayouts = &culling->DescriptorSetLayout;
+  pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+  pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+  BB_VK_ASSERT(vkCreatePipelineLayout(_renderer.Device,
+                                      &pipelineLayoutCreateInfo, nullptr,
+                                      &culling->PipelineLayout));
+
+  culling->Pipeline = createComputePipeline(
+      _renderer, "Cull Instances", _cullShader, culling->PipelineLayout);
+
+  VkDescriptorPoolSize poolSizes[3] = {};
+  poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  poolSizes[0].descriptorCount = (uint32_t)CullBinding::View * numFrames;
+  poolSizes[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  poolSizes[1].descriptorCount = numFrames;
+  poolSizes[2].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  poolSizes[2].descriptorCount = numFrames;
+
+  VkDescriptorPoolCreateInfo poolCreateInfo = {};
+  poolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  poolCreateInfo.maxSets = numFrames;
+  poolCreateInfo.poolSizeCount = (uint32_t)std::size(poolSizes);
+  poolCreateInfo.pPoolSizes = poolSizes;
+  BB_VK_ASSERT(vkCreateDescriptorPool(_renderer.Device, &poolCreateInfo,
+                                      nullptr, &culling->DescriptorPool));
+
+  // Nothing is visible before the first frame, so everything goes through the
+  // late phase.
+  std::vector<uint32_t> visibility(maxNumCulledInstances, 0);
+  culling->VisibilityBuffer = createDeviceLocalBufferFromMemory(
+      _renderer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      sizeof(uint32_t) * maxNumCulledInstances, visibility.data());
+
+  VkMemoryPropertyFlags hostVisible = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  for (int i = 0; i < numFrames; ++i) {
+    culling->InstanceBuffers[i] = createBuffer(
+        _renderer, sizeof(InstanceBlock) * maxNumCulledInstances,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, hostVisible);
+    culling->InstanceIdBuffers[i] =
+        createBuffer(_renderer, sizeof(uint32_t) * maxNumCulledInstances,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, hostVisible);
+    culling->BatchBuffers[i] =
+        createBuffer(_renderer, sizeof(CullBatch) * maxNumCullBatches,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, hostVisible);
+    culling->DrawCommandBuffers[i] = createBuffer(
+        _renderer, sizeof(CullDrawCommands) * maxNumCullBatches,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+            VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+        hostVisible);
+    culling->VisibleInstanceBuffers[i] = createBuffer(
+        _renderer, sizeof(InstanceBlock) * maxNumCulledInstances,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    culling->ViewBuffers[i] =
+        createBuffer(_renderer, sizeof(CullViewBlock),
+                     VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, hostVisible);
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocInfo = {};
+    descriptorSetAllocInfo.sType =
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocInfo.descriptorPool = culling->DescriptorPool;
+    descriptorSetAllocInfo.descriptorSetCount = 1;
+    descriptorSetAllocInfo.pSetLayouts = &culling->DescriptorSetLayout;
+    BB_VK_ASSERT(vkAllocateDescriptorSets(_renderer.Device,
+                                          &descriptorSetAllocInfo,
+                                          &culling->DescriptorSets[i]));
+
+    // The depth pyramid is linked by linkDepthPyramidToGPUCulling().
+    const Buffer *buffers[] = {
+        &culling->InstanceBuffers[i],
+        &culling->InstanceIdBuffers[i],
+        &culling->BatchBuffers[i],
+        &culling->DrawCommandBuffers[i],
+        &culling->VisibleInstanceBuffers[i],
+        &culling->VisibilityBuffer,
+        &culling->ViewBuffers[i]};
+    static_assert(std::size(buffers) == (size_t)CullBinding::DepthPyramid);
+
+    VkDescriptorBufferInfo bufferInfos[std::size(buffers)] = {};
+    VkWriteDescriptorSet writeInfos[std::size(buffers)] = {};
+    for (uint32_t j = 0; j < std::size(buffers); ++j) {
+      bufferInfos[j].buffer = buffers[j]->Handle;
+      bufferInfos[j].offset = 0;
+      bufferInfos[j].range = VK_WHOLE_SIZE;
+
+      writeInfos[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      writeInfos[j].dstSet = culling->DescriptorSets[i];
+      writeInfos[j].dstBinding = j;
+      writeInfos[j].descriptorType = getCullBindingType((CullBinding)j);
+      writeInfos[j].descriptorCount = 1;
+      writeInfos[j].pBufferInfo = &bufferInfos[j];
+    }
+    vkUpdateDescriptorSets(_renderer.Device, (uint32_t)std::size(writeInfos),
+                           writeInfos, 0, nullptr);
+  }
+
+  return culling;
+}
+
+void destroyGPUCulling(const Renderer &_renderer, GPUCulling *_culling) {
+  for (int i = 0; i < numFrames; ++i) {
+    destroyBuffer(_renderer, _culling->ViewBuffers[i]);
+    destroyBuffer(_renderer, _culling->VisibleInstanceBuffers[i]);
+    destroyBuffer(_renderer, _culling->DrawCommandBuffers[i]);
+    destroyBuffer(_renderer, _culling->BatchBuffers[i]);
+    destroyBuffer(_renderer, _culling->InstanceIdBuffers[i]);
+    destroyBuffer(_renderer, _culling->InstanceBuffers[i]);
+  }
+  destroyBuffer(_renderer, _culling->VisibilityBuffer);
+  vkDestroyDescriptorPool(_renderer.Device, _culling->DescriptorPool, nullptr);
+  vkDestroyPipeline(_renderer.Device, _culling->Pipeline, nullptr);
+  vkDestroyPipelineLayout(_renderer.Device, _culling->PipelineLayout, nullptr);
+  vkDestroyDescriptorSetLayout(_renderer.Device, _culling->DescriptorSetLayout,
+                               nullptr);
+  delete _culling;
+}
+
+void linkDepthPyramidToGPUCulling(const Renderer &_renderer,
+                                  const GPUCulling &_culling,
+                                  const DepthPyramid &_pyramid) {
+  VkDescriptorImageInfo imageInfo = {};
+  imageInfo.sampler = _pyramid.Sampler;
+  imageInfo.imageView = _pyramid.View;
+  imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+  VkWriteDescriptorSet writeInfos[numFrames] = {};
+  for (int i = 0; i < numFrames; ++i) {
+    writeInfos[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeInfos[i].dstSet = _culling.DescriptorSets[i];
+    writeInfos[i].dstBinding = (uint32_t)CullBinding::DepthPyramid;
+    writeInfos[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    writeInfos[i].descriptorCount = 1;
+    writeInfos[i].pImageInfo = &imageInfo;
+  }
+  vkUpdateDescriptorSets(_renderer.Device, (uint32_t)std::size(writeInfos),
+                         writeInfos, 0, nullptr);
+}
+
+void beginGPUCulling(GPUCulling &_culling, const Frame &_frame) {
+  BB_ASSERT(_frame.Index < numFrames);
+
+  // The GPU is done with these, so the counts of their last use can be read.
+  GPUCullingStats &stats = _culling.Stats;
+  stats.NumFrustumCulled = 0;
+  stats.NumOcclusionCulled = 0;
+  stats.NumDrawnEarly = 0;
+  stats.NumVisibleInstances = 0;
+  const CullBatch *batches =
+      (const CullBatch *)_culling.BatchBuffers[_frame.Index]
+          .Allocation.MappedData;
+  const CullDrawCommands *drawCommands =
+      (const CullDrawCommands *)_culling.DrawCommandBuffers[_frame.Index]
+          .Allocation.MappedData;
+  for (uint32_t i = 0; i < _culling.FrameNumBatches[_frame.Index]; ++i) {
+    const CullDrawCommands &commands = drawCommands[i];
+    stats.NumFrustumCulled += batches[i].NumInstances - commands.NumInFrustum;
+    stats.NumOcclusionCulled +=
+        commands.NumInFrustum - commands.All.instanceCount;
+    stats.NumDrawnEarly += commands.Early.instanceCount;
+    stats.NumVisibleInstances += commands.All.instanceCount;
+  }
+
+  _culling.FrameIndex = _frame.Index;
+  _culling.FrameNumBatches[_frame.Index] = 0;
+  _culling.NumBatches = 0;
+  _culling.NumInstances = 0;
+  _culling.NumVisibilityIndices = 0;
+  _culling.MaxBatchInstances = 0;
+}
+
+void setGPUCullingView(GPUCulling &_culling, const Mat4 &_viewMat,
+                       const Mat4 &_projMat, float _nearZ) {
+  extractFrustumPlanes(_projMat * _viewMat, _culling.FrustumPlanes);
+
+  CullViewBlock &view =
+      *(CullViewBlock *)_culling.ViewBuffers[_culling.FrameIndex]
+           .Allocation.MappedData;
+  view = {};
+  view.ViewMat = _viewMat;
+  view.ProjMat = _projMat;
+  std::copy(std::begin(_culling.FrustumPlanes),
+            std::end(_culling.FrustumPlanes), view.FrustumPlanes);
+  view.NearZ = _nearZ;
+}
+
+uint32_t addCullBatch(GPUCulling &_culling, const MeshBounds &_bounds,
+                      uint32_t _numIndices, const InstanceBlock *_instances,
+                      const uint32_t *_instanceIds, uint32_t _numInstances,
+                      uint32_t _numAllInstances) {
+  BB_ASSERT(_culling.NumBatches < maxNumCullBatches);
+  BB_ASSERT(_numInstances <= _numAllInstances);
+  BB_ASSERT(_culling.NumVisibilityIndices + _numAllInstances <=
+            maxNumCulledInstances);
+
+  uint32_t frameIndex = _culling.FrameIndex;
+  uint32_t batchIndex = _culling.NumBatches++;
+
+  InstanceBlock *instances =
+      (InstanceBlock *)_culling.InstanceBuffers[frameIndex]
+          .Allocation.MappedData;
+  memcpy(instances + _culling.NumInstances, _instances,
+         sizeof(InstanceBlock) * _numInstances);
+  uint32_t *instanceIds =
+      (uint32_t *)_culling.InstanceIdBuffers[frameIndex].Allocation.MappedData;
+  memcpy(instanceIds + _culling.NumInstances, _instanceIds,
+         sizeof(uint32_t) * _numInstances);
+
+  CullBatch &batch =
+      ((CullBatch *)_culling.BatchBuffers[frameIndex]
+           .Allocation.MappedData)[batchIndex];
+  batch = {};
+  batch.BoundsCenter = _bounds.Center;
+  batch.BoundsRadius = _bounds.Radius;
+  batch.FirstInstance = _culling.NumInstances;
+  batch.NumInstances = _numInstances;
+  batch.FirstVisibilityIndex = _culling.NumVisibilityIndices;
+
+  // Visible instances are packed from the start of the batch's range, which
+  // is bound as the instance buffer, so firstInstance stays 0 and
+  // drawIndirectFirstInstance isn't needed.
+  CullDrawCommands &drawCommands =
+      ((CullDrawCommands *)_culling.DrawCommandBuffers[frameIndex]
+           .Allocation.MappedData)[batchIndex];
+  drawCommands = {};
+  drawCommands.Early.indexCount = _numIndices;
+  drawCommands.All.indexCount = _numIndices;
+
+  _culling.NumInstances += _numInstances;
+  _culling.NumVisibilityIndices += _numAllInstances;
+  _culling.MaxBatchInstances =
+      std::max(_culling.MaxBatchInstances, _numInstances);
+
+  _culling.FrameNumBatches[frameIndex] = _culling.NumBatches;
+  _culling.Stats.NumBatches = _culling.NumBatches;
+  _culling.Stats.NumInstances = _culling.NumInstances;
+
+  return batchIndex;
+}
+
+void recordGPUCulling(const GPUCulling &_culling, VkCommandBuffer _cmdBuffer,
+                      const Frame &_frame, CullPhase _phase) {
+  BB_ASSERT(_culling.FrameIndex == _frame.Index);
+  if (_culling.NumBatches == 0) {
+    return;
+  }
+
+  // The visibility the last late phase wrote, and the instances the depth
+  // pre-pass may still be reading before the late phase adds to them.
+  VkMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask =
+      VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier(_cmdBuffer,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                           VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                           VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0,
+                       nullptr, 0, nullptr);
+
+  vkCmdBindPipeline(_cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    _culling.Pipeline);
+  vkCmdBindDescriptorSets(_cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          _culling.PipelineLayout, 0, 1,
+                          &_culling.DescriptorSets[_frame.Index], 0, nullptr);
+  uint32_t phase = (uint32_t)_phase;
+  vkCmdPushConstants(_cmdBuffer, _culling.PipelineLayout,
+                     VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(phase), &phase);
+
+  // One row of work groups per batch.
+  uint32_t numGroupsX =
+      (_culling.MaxBatchInstances + cullWorkGroupSize - 1) / cullWorkGroupSize;
+  vkCmdDispatch(_cmdBuffer, numGroupsX, _culling.NumBatches, 1);
+
+  // The counts are also read back on the CPU, see beginGPUCulling().
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+                          VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+                          VK_ACCESS_HOST_READ_BIT;
+  vkCmdPipelineBarrier(_cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                           VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+                           VK_PIPELINE_STAGE_HOST_BIT,
+                       0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void drawCullBatch(const GPUCulling &_culling, VkCommandBuffer _cmdBuffer,
+                   const Frame &_frame, uint32_t _batch) {
+  const CullBatch &batch =
+      ((const CullBatch *)_culling.BatchBuffers[_frame.Index]
+           .Allocation.MappedData)[_batch];
+  VkDeviceSize instanceOffset = sizeof(InstanceBlock) * batch.FirstInstance;
+  vkCmdBindVertexBuffers(_cmdBuffer, 1, 1,
+                         &_culling.VisibleInstanceBuffers[_frame.Index].Handle,
+                         &instanceOffset);
+
+  VkDeviceSize commandOffset = sizeof(CullDrawCommands) * _batch;
+  commandOffset += (_culling.DrawList == CullDrawList::Early)
+                       ? offsetof(CullDrawCommands, Early)
+                       : offsetof(CullDrawCommands, All);
+  vkCmdDrawIndexedIndirect(
+      _cmdBuffer, _culling.DrawCommandBuffers[_frame.Index].Handle,
+      commandOffset, 1, sizeof(VkDrawIndexedIndirectCommand));
+}
+
+} // namespace bb
@@ -0,0 +1,163 @@
+#pragma once
+#include "render.h"
+#include "depth_pyramid.h"
+
+namespace bb {
+
+// Scenes don't draw their instances directly. Every frame they hand each mesh
+// and its instances over as a batch, a compute pass culls the instances and
+// packs the visible ones together, and the mesh is drawn with one indirect
+// draw whose instance count the compute pass wrote. The number of draw calls
+// only depends on the number of meshes.
+//
+// Occlusion culling takes two phases. The early phase picks the instances
+// that were visible last frame and are still in the frustum, and these are
+// drawn into the depth pre-pass. A depth pyramid is built from that, and the
+// late phase tests every instance in the frustum against it. The ones that
+// pass are visible next frame, and the ones the early phase didn't pick are
+// added to the draws of the frame.
+constexpr uint32_t maxNumCullBatches = 256;
+constexpr uint32_t maxNumCulledInstances = 32 * 1024;
+// Matches local_size_x of cull_instances.comp.
+constexpr uint32_t cullWorkGroupSize = 64;
+
+// Matches CULL_PHASE_* in cull_instances.comp.
+enum class CullPhase {
+  // Frustum culling only.
+  FrustumOnly,
+  Early,
+  Late,
+  COUNT
+};
+
+// Which of the commands of a batch drawCullBatch() draws.
+enum class CullDrawList {
+  // What the early phase picked.
+  Early,
+  // Everything visible.
+  All,
+  COUNT
+};
+
+// Matches Batch in cull_instances.comp.
+struct CullBatch {
+  Float3 BoundsCenter;
+  float BoundsRadius;
+  uint32_t FirstInstance;
+  uint32_t NumInstances;
+  uint32_t FirstVisibilityIndex;
+  uint32_t Padding;
+};
+
+// Matches DrawCommands in cull_instances.comp. The instances of Early are the
+// first ones of All.
+struct CullDrawCommands {
+  VkDrawIndexedIndirectCommand Early;
+  VkDrawIndexedIndirectCommand All;
+  uint32_t NumInFrustum;
+  uint32_t Padding;
+};
+
+// Matches CullView in cull_instances.comp.
+struct CullViewBlock {
+  Mat4 ViewMat;
+  Mat4 ProjMat;
+  // World space, pointing inwards. See extractFrustumPlanes().
+  Float4 FrustumPlanes[6];
+  float NearZ;
+  float Padding[3];
+};
+
+struct GPUCullingStats {
+  uint32_t NumBatches;
+  uint32_t NumInstances;
+  // Read back from the last time the current frame's buffers were used.
+  uint32_t NumFrustumCulled;
+  uint32_t NumOcclusionCulled;
+  uint32_t NumDrawnEarly;
+  uint32_t NumVisibleInstances;
+};
+
+struct GPUCulling {
+  VkDescriptorSetLayout DescriptorSetLayout;
+  VkDescriptorPool DescriptorPool;
+  VkPipelineLayout PipelineLayout;
+  VkPipeline Pipeline;
+
+  // Each frame in flight owns one copy of these. Instances, their ids, batches
+  // and the view are written by the CPU, the draw commands are written by the
+  // CPU with no instances and counted up by the GPU.
+  Buffer InstanceBuffers[numFrames];
+  Buffer InstanceIdBuffers[numFrames];
+  Buffer BatchBuffers[numFrames];
+  Buffer DrawCommandBuffers[numFrames];
+  Buffer VisibleInstanceBuffers[numFrames];
+  Buffer ViewBuffers[numFrames];
+  VkDescriptorSet DescriptorSets[numFrames];
+  uint32_t FrameNumBatches[numFrames];
+
+  // Whether each instance passed the late phase, by the index it has among all
+  // the instances of a frame before the CPU culls any. Scenes add their
+  // batches in the same order every frame, so the index sticks to the
+  // instance no matter what the CPU culls. It only changes when a scene adds
+  // or removes instances, and the early phase then picks from a stale guess
+  // for a frame, which costs some overdraw but nothing goes missing.
+  Buffer VisibilityBuffer;
+
+  bool IsOcclusionCullingEnabled = true;
+
+  // Of the frame being built.
+  uint32_t FrameIndex;
+  uint32_t NumBatches;
+  uint32_t NumInstances;
+  uint32_t NumVisibilityIndices;
+  uint32_t MaxBatchInstances;
+  // Of the view of setGPUCullingView(), world space. See
+  // extractFrustumPlanes().
+  Float4 FrustumPlanes[6];
+  // Set while recording, scenes draw whatever this selects.
+  CullDrawList DrawList = CullDrawList::All;
+
+  GPUCullingStats Stats;
+};
+
+GPUCulling *createGPUCulling(const Renderer &_renderer,
+                             const Shader &_cullShader);
+void destroyGPUCulling(const Renderer &_renderer, GPUCulling *_culling);
+
+// Points the late phase of every frame at _pyramid. Has to be called again
+// whenever the pyramid is resized.
+void linkDepthPyramidToGPUCulling(const Renderer &_renderer,
+                                  const GPUCulling &_culling,
+                                  const DepthPyramid &_pyramid);
+
+// Call once the fence of _frame has been waited on, before any batch is added.
+void beginGPUCulling(GPUCulling &_culling, const Frame &_frame);
+
+// The view the instances of the current frame are culled against.
+void setGPUCullingView(GPUCulling &_culling, const Mat4 &_viewMat,
+                       const Mat4 &_projMat, float _nearZ);
+
+// Copies _instances into the buffers of the current frame. Every instance is
+// drawn with the first _numIndices indices of whatever index buffer is bound.
+// _instanceIds holds the index each of _instances has among the
+// _numAllInstances instances of the mesh, before any were culled on the CPU.
+// _numInstances may be 0. Returns the batch to pass to drawCullBatch().
+uint32_t addCullBatch(GPUCulling &_culling, const MeshBounds &_bounds,
+                      uint32_t _numIndices, const InstanceBlock *_instances,
+                      const uint32_t *_instanceIds, uint32_t _numInstances,
+                      uint32_t _numAllInstances);
+
+// Records one phase of the culling pass. Has to be called outside of a render
+// pass, either with CullPhase::FrustumOnly alone or with CullPhase::Early and
+// then CullPhase::Late once the depth pyramid is built.
+void recordGPUCulling(const GPUCulling &_culling, VkCommandBuffer _cmdBuffer,
+                      const Frame &_frame, CullPhase _phase);
+
+// Binds the visible instances of _batch to vertex binding 1 and draws the ones
+// _culling.DrawList selects. The vertex and index buffers of the mesh have to
+// be bound already.
+void drawCullBatch(const GPUCulling &_culling, VkCommandBuffer _cmdBuffer,
+                   const Frame &_frame, uint32_t _batch);
+
+} // namespace bb
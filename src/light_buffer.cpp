@@ -0,0 +1,208 @@
+#include "light_buffer.h"
+#include <algorithm>
+
+namespace bb {
+
+static Buffer createLightGPUBuffer(const Renderer &_renderer,
+                                   uint32_t _capacity) {
+  return createBuffer(_renderer, sizeof(Light) * _capacity,
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                          VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+}
+
+static Buffer createLightStagingBuffer(const Renderer &_renderer,
+                                       uint32_t _capacity) {
+  return createBuffer(_renderer, sizeof(Light) * _capacity,
+                      VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+}
+
+LightBuffer *createLightBuffer(const Renderer &_renderer) {
+  LightBuffer *lightBuffer = new LightBuffer();
+  lightBuffer->Capacity = initialLightBufferCapacity;
+  lightBuffer->GPUBuffer =
+      createLightGPUBuffer(_renderer, lightBuffer->Capacity);
+  for (Buffer &stagingBuffer : lightBuffer->StagingBuffers) {
+    stagingBuffer = createLightStagingBuffer(_renderer, lightBuffer->Capacity);
+  }
+  return lightBuffer;
+}
+
+void destroyLightBuffer(const Renderer &_renderer, LightBuffer *_lightBuffer) {
+  for (RetiredLightBuffer &retired : _lightBuffer->RetiredBuffers) {
+    destroyBuffer(_renderer, retired.Buffer);
+  }
+  for (Buffer &stagingBuffer : _lightBuffer->StagingBuffers) {
+    destroyBuffer(_renderer, stagingBuffer);
+  }
+  destroyBuffer(_renderer, _lightBuffer->GPUBuffer);
+  delete _lightBuffer;
+}
+
+void updateLightBuffer(const Renderer &_renderer, LightBuffer &_lightBuffer,
+                       SceneBase &_scene, const Frame &_frame,
+                       uint64_t _frameNumber) {
+  LightUploadStats &stats = _lightBuffer.Stats;
+  stats.NumUploadedLights = 0;
+  stats.NumRegions = 0;
+
+  std::vector<RetiredLightBuffer> &retiredBuffers = _lightBuffer.RetiredBuffers;
+  for (auto it = retiredBuffers.begin(); it != retiredBuffers.end();) {
+    if (_frameNumber - it->RetiredFrameNumber >= numFrames) {
+      destroyBuffer(_renderer, it->Buffer);
+      it = retiredBuffers.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  uint32_t numLights = (uint32_t)_scene.Lights.size();
+  bool isFullUpload = _scene.Id != _lightBuffer.UploadedSceneId;
+
+  if (numLights > _lightBuffer.Capacity) {
+    uint32_t capacity = _lightBuffer.Capacity;
+    while (capacity < numLights) {
+      capacity *= 2;
+    }
+    retiredBuffers.push_back({_lightBuffer.GPUBuffer, _frameNumber});
+    _lightBuffer.GPUBuffer = createLightGPUBuffer(_renderer, capacity);
+    _lightBuffer.Capacity = capacity;
+    ++stats.NumGrows;
+    isFullUpload = true;
+    BB_LOG_INFO("Light buffer grown to {} lights", capacity);
+  }
+
+  std::vector<LightRange> ranges;
+  if (isFullUpload) {
+    if (numLights > 0) {
+      ranges.push_back({0, numLights});
+    }
+  } else {
+    // Lights may have been removed since their range was marked.
+    for (const LightRange &range : _scene.DirtyLightRanges) {
+      uint32_t last = std::min(range.First + range.Count, numLights);
+      if (range.First < last) {
+        ranges.push_back({range.First, last - range.First});
+      }
+    }
+
+    // Merging a range may make it reach others, so ranges are only known not
+    // to overlap once they are sorted.
+    std::sort(ranges.begin(), ranges.end(),
+              [](const LightRange &_a, const LightRange &_b) {
+                return _a.First < _b.First;
+              });
+    uint32_t numMergedRanges = 0;
+    for (const LightRange &range : ranges) {
+      if (numMergedRanges > 0) {
+        LightRange &prev = ranges[numMergedRanges - 1];
+        uint32_t prevLast = prev.First + prev.Count;
+        if (range.First <= prevLast) {
+          prev.Count = std::max(prevLast, range.First + range.Count) -
+                       prev.First;
+          continue;
+        }
+      }
+      ranges[numMergedRanges++] = range;
+    }
+    ranges.resize(numMergedRanges);
+
+    if (ranges.size() > maxLightUploadRegions) {
+      uint32_t first = ranges[0].First;
+      uint32_t last = ranges[0].First + ranges[0].Count;
+      for (const LightRange &range : ranges) {
+        first = std::min(first, range.First);
+        last = std::max(last, range.First + range.Count);
+      }
+      ranges = {{first, last - first}};
+    }
+  }
+  _scene.DirtyLightRanges.clear();
+  _lightBuffer.UploadedSceneId = _scene.Id;
+
+  // Ranges are packed back to back. They don't overlap and all end before
+  // numLights, so they never add up to more than the capacity.
+  Buffer &stagingBuffer = _lightBuffer.StagingBuffers[_frame.Index];
+  if (stagingBuffer.Size < sizeof(Light) * _lightBuffer.Capacity) {
+    destroyBuffer(_renderer, stagingBuffer);
+    stagingBuffer = createLightStagingBuffer(_renderer, _lightBuffer.Capacity);
+  }
+
+  std::vector<VkBufferCopy> &copies = _lightBuffer.PendingCopies[_frame.Index];
+  copies.clear();
+  uint8_t *stagingData = (uint8_t *)stagingBuffer.Allocation.MappedData;
+  VkDeviceSize stagingOffset = 0;
+  for (const LightRange &range : ranges) {
+    VkBufferCopy copy = {};
+    copy.srcOffset = stagingOffset;
+    copy.dstOffset = sizeof(Light) * range.First;
+    copy.size = sizeof(Light) * range.Count;
+    BB_ASSERT(stagingOffset + copy.size <= stagingBuffer.Size);
+    memcpy(stagingData + stagingOffset, &_scene.Lights[range.First],
+           copy.size);
+    copies.push_back(copy);
+
+    stagingOffset += copy.size;
+    stats.NumUploadedLights += range.Count;
+  }
+  stats.NumRegions = (uint32_t)copies.size();
+
+  VkBuffer &linkedBuffer = _lightBuffer.LinkedBuffers[_frame.Index];
+  if (linkedBuffer != _lightBuffer.GPUBuffer.Handle) {
+    VkDescriptorBufferInfo bufferInfo = {};
+    bufferInfo.buffer = _lightBuffer.GPUBuffer.Handle;
+    bufferInfo.offset = 0;
+    bufferInfo.range = VK_WHOLE_SIZE;
+
+    // uLights
+    VkWriteDescriptorSet writeInfo = {};
+    writeInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeInfo.dstSet = _frame.FrameDescriptorSet;
+    writeInfo.dstBinding = 4;
+    writeInfo.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writeInfo.descriptorCount = 1;
+    writeInfo.pBufferInfo = &bufferInfo;
+    vkUpdateDescriptorSets(_renderer.Device, 1, &writeInfo, 0, nullptr);
+
+    linkedBuffer = _lightBuffer.GPUBuffer.Handle;
+  }
+}
+
+void recordLightBufferUploads(const LightBuffer &_lightBuffer,
+                              VkCommandBuffer _cmdBuffer, const Frame &_frame) {
+  const std::vector<VkBufferCopy> &copies =
+      _lightBuffer.PendingCopies[_frame.Index];
+  if (copies.empty()) {
+    return;
+  }
+
+  VkPipelineStageFlags shaderStages = VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                                      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+
+  // The previous frame may still be reading the lights.
+  VkBufferMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = _lightBuffer.GPUBuffer.Handle;
+  barrier.offset = 0;
+  barrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(_cmdBuffer, shaderStages,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1,
+                       &barrier, 0, nullptr);
+
+  vkCmdCopyBuffer(_cmdBuffer, _lightBuffer.StagingBuffers[_frame.Index].Handle,
+                  _lightBuffer.GPUBuffer.Handle, (uint32_t)copies.size(),
+                  copies.data());
+
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(_cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       shaderStages, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+} // namespace bb
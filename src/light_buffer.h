@@ -0,0 +1,65 @@
+#pragma once
+#include "render.h"
+#include "scene.h"
+#include <vector>
+
+namespace bb {
+
+constexpr uint32_t initialLightBufferCapacity = 1024;
+// A frame with more dirty ranges than this uploads the one range covering all
+// of them, to keep the copy regions down.
+constexpr uint32_t maxLightUploadRegions = 16;
+
+struct LightUploadStats {
+  // Of the last update.
+  uint32_t NumUploadedLights;
+  uint32_t NumRegions;
+  // Since startup.
+  uint32_t NumGrows;
+};
+
+struct RetiredLightBuffer {
+  Buffer Buffer;
+  uint64_t RetiredFrameNumber;
+};
+
+// The lights of the current scene, in one device local storage buffer that is
+// kept across frames. Only the ranges the scene marks dirty are copied in,
+// through a staging buffer owned by each frame in flight. The buffer doubles
+// in size whenever a scene outgrows it, and everything is uploaded again.
+struct LightBuffer {
+  Buffer GPUBuffer;
+  uint32_t Capacity;
+
+  Buffer StagingBuffers[numFrames];
+  // Recorded into each frame's command buffer before its render pass.
+  std::vector<VkBufferCopy> PendingCopies[numFrames];
+  // What the light binding of each frame's descriptor set points at. Only
+  // changed once that frame's fence has been waited on.
+  VkBuffer LinkedBuffers[numFrames];
+
+  // Frames in flight may still read these.
+  std::vector<RetiredLightBuffer> RetiredBuffers;
+
+  // SceneBase::Id of the lights in GPUBuffer.
+  uint32_t UploadedSceneId;
+
+  LightUploadStats Stats;
+};
+
+LightBuffer *createLightBuffer(const Renderer &_renderer);
+void destroyLightBuffer(const Renderer &_renderer, LightBuffer *_lightBuffer);
+
+// Call once the fence of _frame has been waited on. Takes the dirty light
+// ranges of _scene, writes them into the staging buffer of _frame and points
+// _frame's descriptor set at the current buffer.
+void updateLightBuffer(const Renderer &_renderer, LightBuffer &_lightBuffer,
+                       SceneBase &_scene, const Frame &_frame,
+                       uint64_t _frameNumber);
+
+// Records the copies updateLightBuffer() queued for _frame. Has to be called
+// outside of a render pass.
+void recordLightBufferUploads(const LightBuffer &_lightBuffer,
+                              VkCommandBuffer _cmdBuffer, const Frame &_frame);
+
+} // namespace bb
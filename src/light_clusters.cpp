@@ -0,0 +1,237 @@
+#include "light_clusters.h"
+#include "util.h"
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+#include <random>
+
+namespace bb {
+
+LightClusters *createLightClusters(const Renderer &_renderer) {
+  LightClusters *clusters = new LightClusters();
+
+  VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  for (int i = 0; i < numFrames; ++i) {
+    clusters->ClusterBuffers[i] =
+        createBuffer(_renderer, sizeof(LightCluster) * numLightClusters,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, properties);
+    clusters->IndexBuffers[i] =
+        createBuffer(_renderer, sizeof(uint32_t) * maxNumClusterLightIndices,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, properties);
+  }
+
+  clusters->ClusterCounts.resize(numLightClusters);
+  clusters->Clusters.resize(numLightClusters);
+
+  return clusters;
+}
+
+void destroyLightClusters(const Renderer &_renderer, LightClusters *_clusters) {
+  for (int i = 0; i < numFrames; ++i) {
+    destroyBuffer(_renderer, _clusters->IndexBuffers[i]);
+    destroyBuffer(_renderer, _clusters->ClusterBuffers[i]);
+  }
+  delete _clusters;
+}
+
+void linkLightClustersToDescriptorSet(const Renderer &_renderer,
+                                      const LightClusters &_clusters,
+                                      const Frame &_frame) {
+  const Buffer *buffers[] = {&_clusters.ClusterBuffers[_frame.Index],
+                             &_clusters.IndexBuffers[_frame.Index]};
+
+  VkDescriptorBufferInfo bufferInfos[std::size(buffers)] = {};
+  VkWriteDescriptorSet writeInfos[std::size(buffers)] = {};
+  for (uint32_t i = 0; i < std::size(buffers); ++i) {
+    bufferInfos[i].buffer = buffers[i]->Handle;
+    bufferInfos[i].offset = 0;
+    bufferInfos[i].range = VK_WHOLE_SIZE;
+
+    // uLightClusters and uClusterLightIndices
+    writeInfos[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeInfos[i].dstSet = _frame.FrameDescriptorSet;
+    writeInfos[i].dstBinding = 5 + i;
+    writeInfos[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writeInfos[i].descriptorCount = 1;
+    writeInfos[i].pBufferInfo = &bufferInfos[i];
+  }
+
+  vkUpdateDescriptorSets(_renderer.Device, (uint32_t)std::size(writeInfos),
+                         writeInfos, 0, nullptr);
+}
+
+void getLightClusterDepthParams(const LightClusterView &_view, float *_outScale,
+                                float *_outBias) {
+  float logDepthRange = logf(_view.FarZ / _view.NearZ);
+  *_outScale = (float)numLightClustersZ / logDepthRange;
+  *_outBias = -(float)numLightClustersZ * logf(_view.NearZ) / logDepthRange;
+}
+
+static uint32_t getClusterTile(float _ndc, uint32_t _numTiles) {
+  float tile = floorf((_ndc * 0.5f + 0.5f) * (float)_numTiles);
+  return (uint32_t)std::clamp(tile, 0.f, (float)(_numTiles - 1));
+}
+
+static uint32_t getClusterSlice(float _z, float _depthScale,
+                                float _depthBias) {
+  float slice = floorf(logf(_z) * _depthScale + _depthBias);
+  return (uint32_t)std::clamp(slice, 0.f, (float)(numLightClustersZ - 1));
+}
+
+static uint32_t getClusterIndex(uint32_t _x, uint32_t _y, uint32_t _z) {
+  return _x + numLightClustersX * (_y + numLightClustersY * _z);
+}
+
+const LightClusterStats &binLightsIntoClusters(LightClusters &_clusters,
+                                               uint32_t _frameIndex,
+                                               const Light *_lights,
+                                               uint32_t _numLights,
+                                               const LightClusterView &_view) {
+  BB_ASSERT(_frameIndex < numFrames);
+  Time startTime = getCurrentTime();
+
+  LightClusterStats &stats = _clusters.Stats;
+  stats = {};
+
+  // Directional lights reach every pixel, so they aren't binned. They go first
+  // in the index list instead.
+  uint32_t *gpuIndices =
+      (uint32_t *)_clusters.IndexBuffers[_frameIndex].Allocation.MappedData;
+  for (uint32_t i = 0; i < _numLights; ++i) {
+    if ((_lights[i].Type == LightType::Directional) &&
+        (stats.NumDirectionalLights < maxNumClusterLightIndices)) {
+      gpuIndices[stats.NumDirectionalLights++] = i;
+    }
+  }
+
+  float depthScale, depthBias;
+  getLightClusterDepthParams(_view, &depthScale, &depthBias);
+  float projY = 1.f / tanf(degToRad(_view.FovYDegrees) * 0.5f);
+  float projX = projY / _view.AspectRatio;
+  Float4 viewRows[3] = {_view.ViewMat.row(0), _view.ViewMat.row(1),
+                        _view.ViewMat.row(2)};
+
+  std::vector<uint32_t> &counts = _clusters.ClusterCounts;
+  std::fill(counts.begin(), counts.end(), 0);
+  _clusters.Bounds.clear();
+
+  for (uint32_t i = 0; i < _numLights; ++i) {
+    const Light &light = _lights[i];
+    if (light.Type == LightType::Directional) {
+      continue;
+    }
+
+    Float4 posWorld = {light.Pos.X, light.Pos.Y, light.Pos.Z, 1.f};
+    float x = dot(viewRows[0], posWorld);
+    float y = dot(viewRows[1], posWorld);
+    float z = dot(viewRows[2], posWorld);
+    float range = light.Radius;
+    if ((z + range <= _view.NearZ) || (z - range >= _view.FarZ)) {
+      continue;
+    }
+    float minZ = std::max(z - range, _view.NearZ);
+    float maxZ = std::min(z + range, _view.FarZ);
+
+    // The screen extent of the light's view space bounding box, clipped to
+    // the near plane. x / z and y / z are extreme at the corners.
+    float minNDC[2] = {FLT_MAX, FLT_MAX};
+    float maxNDC[2] = {-FLT_MAX, -FLT_MAX};
+    for (float cornerZ : {minZ, maxZ}) {
+      for (float cornerX : {x - range, x + range}) {
+        float ndcX = projX * cornerX / cornerZ;
+        minNDC[0] = std::min(minNDC[0], ndcX);
+        maxNDC[0] = std::max(maxNDC[0], ndcX);
+      }
+      for (float cornerY : {y - range, y + range}) {
+        // Clip space y points down.
+        float ndcY = -projY * cornerY / cornerZ;
+        minNDC[1] = std::min(minNDC[1], ndcY);
+        maxNDC[1] = std::max(maxNDC[1], ndcY);
+      }
+    }
+    if ((maxNDC[0] < -1.f) || (minNDC[0] > 1.f) || (maxNDC[1] < -1.f) ||
+        (minNDC[1] > 1.f)) {
+      continue;
+    }
+
+    LightClusterBounds bounds = {};
+    bounds.LightIndex = i;
+    bounds.MinZ = minZ;
+    bounds.MaxZ = maxZ;
+    bounds.Min[0] = getClusterTile(minNDC[0], numLightClustersX);
+    bounds.Max[0] = getClusterTile(maxNDC[0], numLightClustersX);
+    bounds.Min[1] = getClusterTile(minNDC[1], numLightClustersY);
+    bounds.Max[1] = getClusterTile(maxNDC[1], numLightClustersY);
+    bounds.Min[2] = getClusterSlice(minZ, depthScale, depthBias);
+    bounds.Max[2] = getClusterSlice(maxZ, depthScale, depthBias);
+
+    for (uint32_t cz = bounds.Min[2]; cz <= bounds.Max[2]; ++cz) {
+      for (uint32_t cy = bounds.Min[1]; cy <= bounds.Max[1]; ++cy) {
+        for (uint32_t cx = bounds.Min[0]; cx <= bounds.Max[0]; ++cx) {
+          ++counts[getClusterIndex(cx, cy, cz)];
+        }
+      }
+    }
+    _clusters.Bounds.push_back(bounds);
+  }
+  stats.NumVisibleLights = (uint32_t)_clusters.Bounds.size();
+
+  // Lay the lists out back to back. counts becomes the capacity of each list.
+  std::vector<LightCluster> &clusters = _clusters.Clusters;
+  uint32_t numIndices = stats.NumDirectionalLights;
+  for (uint32_t i = 0; i < numLightClusters; ++i) {
+    if (numIndices + counts[i] > maxNumClusterLightIndices) {
+      counts[i] = maxNumClusterLightIndices - numIndices;
+      stats.IsOverflowed = true;
+    }
+    clusters[i].Offset = numIndices;
+    clusters[i].NumLights = 0;
+    numIndices += counts[i];
+    stats.MaxLightsPerCluster = std::max(stats.MaxLightsPerCluster, counts[i]);
+  }
+  stats.NumIndices = numIndices;
+
+  for (const LightClusterBounds &bounds : _clusters.Bounds) {
+    for (uint32_t cz = bounds.Min[2]; cz <= bounds.Max[2]; ++cz) {
+      for (uint32_t cy = bounds.Min[1]; cy <= bounds.Max[1]; ++cy) {
+        for (uint32_t cx = bounds.Min[0]; cx <= bounds.Max[0]; ++cx) {
+          uint32_t clusterIndex = getClusterIndex(cx, cy, cz);
+          LightCluster &cluster = clusters[clusterIndex];
+          if (cluster.NumLights < counts[clusterIndex]) {
+            gpuIndices[cluster.Offset + cluster.NumLights++] =
+                bounds.LightIndex;
+          }
+        }
+      }
+    }
+  }
+
+  memcpy(_clusters.ClusterBuffers[_frameIndex].Allocation.MappedData,
+         clusters.data(), sizeof(LightCluster) * numLightClusters);
+
+  stats.BinningTime = getElapsedTimeInSeconds(startTime, getCurrentTime());
+  return stats;
+}
+
+void generateStressTestLights(std::vector<Light> &_lights,
+                              uint32_t _numLights) {
+  // Same lights every run, so that timings can be compared.
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> horizontal(-50.f, 50.f);
+  std::uniform_real_distribution<float> vertical(-9.5f, -7.f);
+  std::uniform_real_distribution<float> channel(0.2f, 1.f);
+
+  _lights.reserve(_lights.size() + _numLights);
+  for (uint32_t i = 0; i < _numLights; ++i) {
+    Light light = {};
+    light.Type = LightType::Point;
+    light.Pos = {horizontal(rng), vertical(rng), horizontal(rng)};
+    light.Color = {channel(rng), channel(rng), channel(rng)};
+    light.Intensity = 2.f;
+    light.Radius = 3.f;
+    _lights.push_back(light);
+  }
+}
+
+} // namespace bb
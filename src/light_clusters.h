@@ -0,0 +1,98 @@
+#pragma once
+#include "render.h"
+#include <vector>
+
+namespace bb {
+
+// Lights are binned into a grid of view space froxels on the CPU every frame:
+// the screen is split into tiles, and the view depth into slices that grow
+// exponentially from the near plane. The lighting shaders look up the cluster
+// of each pixel and only go through the lights listed for it. The grid size
+// matches light_clusters.glsl.
+constexpr uint32_t numLightClustersX = 16;
+constexpr uint32_t numLightClustersY = 9;
+constexpr uint32_t numLightClustersZ = 24;
+constexpr uint32_t numLightClusters =
+    numLightClustersX * numLightClustersY * numLightClustersZ;
+
+// Capacity of the light index lists of a frame, which start with the
+// directional lights. Lights that don't fit are dropped from the clusters that
+// come last.
+constexpr uint32_t maxNumClusterLightIndices = 512 * 1024;
+
+// A range of lights in the index list of a frame. Matches uLightClusters.
+struct LightCluster {
+  uint32_t Offset;
+  uint32_t NumLights;
+};
+
+struct LightClusterView {
+  Mat4 ViewMat;
+  float FovYDegrees;
+  float AspectRatio;
+  float NearZ;
+  float FarZ;
+};
+
+struct LightClusterStats {
+  uint32_t NumDirectionalLights;
+  // Point and spot lights that touch at least one cluster.
+  uint32_t NumVisibleLights;
+  uint32_t NumIndices;
+  uint32_t MaxLightsPerCluster;
+  bool IsOverflowed;
+  float BinningTime;
+};
+
+// The cluster froxel range a light covers, inclusive. Spot lights are binned
+// as spheres of their radius.
+struct LightClusterBounds {
+  uint32_t LightIndex;
+  // View depth range of the light, clipped to the near and far planes.
+  float MinZ;
+  float MaxZ;
+  uint32_t Min[3];
+  uint32_t Max[3];
+};
+
+struct LightClusters {
+  // Each frame in flight owns one copy of every buffer, written after its
+  // fence has been waited on. The lights themselves are in LightBuffer.
+  Buffer ClusterBuffers[numFrames];
+  Buffer IndexBuffers[numFrames];
+
+  // Kept around so binning doesn't allocate every frame. The clusters are
+  // built here and copied over once done, to not read back from mapped memory.
+  std::vector<LightClusterBounds> Bounds;
+  std::vector<uint32_t> ClusterCounts;
+  std::vector<LightCluster> Clusters;
+
+  LightClusterStats Stats;
+};
+
+LightClusters *createLightClusters(const Renderer &_renderer);
+void destroyLightClusters(const Renderer &_renderer, LightClusters *_clusters);
+
+// Points the cluster bindings of _frame's frame descriptor set at the buffers
+// owned by _frame.Index.
+void linkLightClustersToDescriptorSet(const Renderer &_renderer,
+                                      const LightClusters &_clusters,
+                                      const Frame &_frame);
+
+// The shaders find the depth slice of a view depth z as
+// log(z) * _outScale + _outBias.
+void getLightClusterDepthParams(const LightClusterView &_view, float *_outScale,
+                                float *_outBias);
+
+// Writes the clusters of _lights into the buffers of _frameIndex, indexing
+// _lights as they are. Call once the fence of that frame has been waited on.
+const LightClusterStats &binLightsIntoClusters(LightClusters &_clusters,
+                                               uint32_t _frameIndex,
+                                               const Light *_lights,
+                                               uint32_t _numLights,
+                                               const LightClusterView &_view);
+
+// Dim point lights scattered over the scene, for stress testing.
+void generateStressTestLights(std::vector<Light> &_lights, uint32_t _numLights);
+
+} // namespace bb
@@ -7,6 +7,17 @@
 #include "render.h"
 #include "type_conversion.h"
 #include "resource.h"
+#include "staging.h"
+#include "frame_ring.h"
+#include "pipeline_cache.h"
+#include "thread_pool.h"
+#include "task_graph.h"
+#include "shader_reload.h"
+#include "light_clusters.h"
+#include "light_buffer.h"
+#include "gpu_culling.h"
+#include "file_io.h"
+#include "memory_report.h"
 #include "scene.h"
 #include "external/volk.h"
 #include "external/SDL2/SDL.h"
@@ -29,34 +40,219 @@
 #include <algorithm>
 #include <optional>
 #include <numeric>
+#include <functional>
+#include <unordered_set>
 #include <stdio.h>
 #include <stdint.h>
 #include <assert.h>
 
 namespace bb {
 
-constexpr int numFrames = 2;
-
 static Gizmo gGizmo;
 static GBufferVisualize gBufferVisualize;
 static TBNVisualize gTBN;
 static LightSources gLightSources;
+static LightVolumes gLightVolumes;
 
 static StandardPipelineLayout gStandardPipelineLayout;
 
+// The light clusters are built for the same projection the view renders with.
+constexpr float cameraFovYDegrees = 60.f;
+constexpr float cameraNearZ = 0.1f;
+constexpr float cameraFarZ = 1000.f;
+
+// Spot lights wider than this are drawn with a sphere volume, since their
+// cone would get much larger. Matches light_volume.vert.
+constexpr float lightVolumeMinConeCos = 0.5f;
+
+// The depth buffer is reversed, see Mat4::perspective().
+static float getDepthBufferValue(float _viewZ) {
+  return cameraNearZ * (cameraFarZ - _viewZ) /
+         (_viewZ * (cameraFarZ - cameraNearZ));
+}
+
+static void drawLightVolumes(VkCommandBuffer _cmdBuffer) {
+  vkCmdBindPipeline(_cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                    gLightVolumes.Pipeline);
+
+  EnumArray<LightVolumeShape, const Buffer *> vertexBuffers = {
+      &gLightSources.VertexBuffer, &gLightVolumes.ConeVertexBuffer};
+  EnumArray<LightVolumeShape, const Buffer *> indexBuffers = {
+      &gLightSources.IndexBuffer, &gLightVolumes.ConeIndexBuffer};
+  EnumArray<LightVolumeShape, uint32_t> numIndices = {
+      gLightSources.NumIndices, gLightVolumes.NumConeIndices};
+
+  for (LightVolumeShape shape : AllEnums<LightVolumeShape>) {
+    const std::vector<LightVolumeDraw> &draws = gLightVolumes.Draws[shape];
+    if (draws.empty()) {
+      continue;
+    }
+
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(_cmdBuffer, 0, 1, &vertexBuffers[shape]->Handle,
+                           &offset);
+    vkCmdBindIndexBuffer(_cmdBuffer, indexBuffers[shape]->Handle, 0,
+                         VK_INDEX_TYPE_UINT32);
+    // The vertex shader finds the light through its instance index.
+    for (const LightVolumeDraw &draw : draws) {
+      if (gLightVolumes.UseDepthBounds) {
+        vkCmdSetDepthBounds(_cmdBuffer, draw.MinDepth, draw.MaxDepth);
+      }
+      vkCmdDrawIndexed(_cmdBuffer, numIndices[shape], 1, 0, 0,
+                       draw.LightIndex);
+    }
+  }
+}
+
+struct PipelineVariant {
+  ShaderPermutation Permutation;
+  VkPipeline Handle;
+};
+
+// A pipeline gets a variant per ShaderPermutation it's drawn with, built the
+// first time it's needed. Every variant is rebuilt when one of its shaders is
+// hot reloaded.
+struct ReloadablePipeline {
+  const char *Name;
+  std::vector<Shader *> Shaders;
+  std::function<VkPipeline(const ShaderPermutation &)> Create;
+  // The variant recorded this frame.
+  VkPipeline *Handle;
+  // Permutation constants the shaders declare. Set at startup and never
+  // changed, since variants are keyed by it.
+  uint32_t SpecConstantMask;
+  // By getShaderPermutationKey().
+  std::unordered_map<uint64_t, PipelineVariant> Variants;
+  // Keys of the variants being compiled in the background. Only touched by the
+  // render loop.
+  std::unordered_set<uint64_t> CompilingVariants;
+};
+
+// Compute pipelines have layouts of their own and no variants. They are
+// rebuilt when their shader is hot reloaded.
+struct ReloadableComputePipeline {
+  const char *Name;
+  Shader *ComputeShader;
+  VkPipelineLayout Layout;
+  VkPipeline *Handle;
+};
+
+// A variant compiled in the background, waiting to be added to its pipeline
+// at the next frame boundary.
+struct CompiledPipelineVariant {
+  ReloadablePipeline *Pipeline;
+  uint64_t Key;
+  PipelineVariant Variant;
+  // The variant is stale if shaders or the render pass changed after this.
+  uint64_t Generation;
+  Time RequestTime;
+};
+
+struct PipelineVariantStats {
+  // Frames that waited on a variant being compiled on the render thread.
+  uint32_t NumHitches;
+  float TotalHitchTime;
+  float MaxHitchTime;
+
+  // Draws of the full permutation while the variant was compiling.
+  uint32_t NumFallbackDraws;
+
+  // From the first frame a variant was asked for to the frame it was drawn.
+  uint32_t NumAsyncVariants;
+  float LastTimeToSpecialized;
+  float MaxTimeToSpecialized;
+  float TotalTimeToSpecialized;
+};
+
+struct PipelineSwap {
+  VkPipeline *Handle;
+  VkPipeline NewPipeline;
+};
+
+// A replaced pipeline, destroyed once every frame that may use it is done.
+struct RetiredPipeline {
+  VkPipeline Handle;
+  uint64_t RetiredFrameNumber;
+};
+
 enum class SceneType { Triangle, ShaderBalls, COUNT };
 
 static EnumArray<SceneType, const char *> gSceneLabels = {"Triangle",
                                                           "Shader Balls"};
 static EnumArray<SceneType, SceneBase *> gScenes;
 static SceneType gCurrentSceneType = SceneType::ShaderBalls;
+static SceneType gRequestedSceneType = gCurrentSceneType;
+static SceneBase *gPlaceholderScene;
+
+// Only one scene is constructed in the background at a time.
+static SceneType gLoadingSceneType;
+static SceneLoadState *gSceneLoadState;
 
-void recordCommand(VkRenderPass _deferredRenderPass,
+static SceneBase *getCurrentScene() {
+  SceneBase *scene = gScenes[gCurrentSceneType];
+  return scene ? scene : gPlaceholderScene;
+}
+
+static void startSceneLoad(ThreadPool &_threadPool,
+                           CommonSceneResources *_common,
+                           SceneType _sceneType) {
+  BB_ASSERT(!gSceneLoadState);
+  SceneLoadState *loadState = new SceneLoadState();
+  gSceneLoadState = loadState;
+  gLoadingSceneType = _sceneType;
+
+  enqueueJob(_threadPool, [_common, _sceneType, loadState] {
+    SceneBase *scene = nullptr;
+    switch (_sceneType) {
+    case SceneType::Triangle:
+      scene = new TriangleScene(_common, loadState);
+      break;
+    case SceneType::ShaderBalls:
+      scene = new ShaderBallScene(_common, loadState);
+      break;
+    }
+
+    // Every upload of the scene has been submitted by now, so waiting for the
+    // last submitted serial is enough to know that they are resident.
+    loadState->Scene = scene;
+    loadState->UploadSerial =
+        getLastSubmittedStagingSerial(*_common->Renderer->StagingRing);
+    loadState->Progress = 1.f;
+    loadState->IsConstructed = true;
+  });
+}
+
+// Switches to the requested scene between frames once it's ready to be drawn,
+// and starts constructing it if it isn't.
+static void updateSceneLoad(ThreadPool &_threadPool,
+                            CommonSceneResources *_common) {
+  if (gSceneLoadState && gSceneLoadState->IsConstructed &&
+      isStagingSerialComplete(*_common->Renderer->StagingRing,
+                              gSceneLoadState->UploadSerial)) {
+    gScenes[gLoadingSceneType] = gSceneLoadState->Scene;
+    delete gSceneLoadState;
+    gSceneLoadState = nullptr;
+  }
+
+  if (gScenes[gRequestedSceneType]) {
+    gCurrentSceneType = gRequestedSceneType;
+  } else if (!gSceneLoadState) {
+    startSceneLoad(_threadPool, _common, gRequestedSceneType);
+  }
+}
+
+void recordCommand(VkRenderPass _depthPrepassRenderPass,
+                   VkFramebuffer _depthPrepassFramebuffer,
+                   VkRenderPass _deferredRenderPass,
                    VkFramebuffer _deferredFramebuffer,
+                   VkPipeline _depthPrepassPipeline,
+                   VkPipeline _forwardDepthPrepassPipeline,
                    VkPipeline _forwardPipeline, VkPipeline _gBufferPipeline,
                    VkPipeline _brdfPipeline, VkPipeline _hdrToneMappingPipeline,
-                   VkExtent2D _swapChainExtent, const Frame &_frame) {
-  SceneBase *currentScene = gScenes[gCurrentSceneType];
+                   VkExtent2D _swapChainExtent, const LightBuffer &_lightBuffer,
+                   GPUCulling &_culling, const DepthPyramid &_depthPyramid,
+                   const Frame &_frame) {
+  SceneBase *currentScene = getCurrentScene();
 
   VkCommandBufferBeginInfo cmdBeginInfo = {};
   cmdBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -67,13 +263,57 @@ void recordCommand(VkRenderPass _deferredRenderPass,
 
   BB_VK_ASSERT(vkBeginCommandBuffer(cmdBuffer, &cmdBeginInfo));
 
+  recordLightBufferUploads(_lightBuffer, cmdBuffer, _frame);
+
   vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
                           gStandardPipelineLayout.Handle, 0, 1,
-                          &_frame.FrameDescriptorSet, 0, nullptr);
+                          &_frame.FrameDescriptorSet, 1,
+                          &_frame.FrameUniformOffset);
 
   vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
                           gStandardPipelineLayout.Handle, 1, 1,
-                          &_frame.ViewDescriptorSet, 0, nullptr);
+                          &_frame.ViewDescriptorSet, 1,
+                          &_frame.ViewUniformOffset);
+
+  bool isOcclusionCullingEnabled = _culling.IsOcclusionCullingEnabled;
+  recordGPUCulling(_culling, cmdBuffer, _frame,
+                   isOcclusionCullingEnabled ? CullPhase::Early
+                                             : CullPhase::FrustumOnly);
+
+  // The deferred render pass loads depth from here, so this also runs with
+  // nothing to draw.
+  {
+    VkRenderPassBeginInfo prepassInfo = {};
+    prepassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    prepassInfo.renderPass = _depthPrepassRenderPass;
+    prepassInfo.framebuffer = _depthPrepassFramebuffer;
+    prepassInfo.renderArea.offset = {0, 0};
+    prepassInfo.renderArea.extent = _swapChainExtent;
+    VkClearValue clearDepth = {};
+    clearDepth.depthStencil = {0.f, 0};
+    prepassInfo.clearValueCount = 1;
+    prepassInfo.pClearValues = &clearDepth;
+    vkCmdBeginRenderPass(cmdBuffer, &prepassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    setViewportAndScissor(cmdBuffer, {0, 0}, _swapChainExtent);
+
+    if (isOcclusionCullingEnabled) {
+      vkCmdBindPipeline(
+          cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+          (currentScene->SceneRenderPassType == RenderPassType::Deferred)
+              ? _depthPrepassPipeline
+              : _forwardDepthPrepassPipeline);
+      _culling.DrawList = CullDrawList::Early;
+      currentScene->drawScene(_frame);
+    }
+
+    vkCmdEndRenderPass(cmdBuffer);
+  }
+
+  if (isOcclusionCullingEnabled) {
+    recordDepthPyramid(_depthPyramid, cmdBuffer);
+    recordGPUCulling(_culling, cmdBuffer, _frame, CullPhase::Late);
+  }
+  _culling.DrawList = CullDrawList::All;
 
   VkRenderPassBeginInfo renderPassInfo = {};
   renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
@@ -85,6 +325,7 @@ void recordCommand(VkRenderPass _deferredRenderPass,
   renderPassInfo.clearValueCount = clearValues.size();
   renderPassInfo.pClearValues = clearValues.data();
   vkCmdBeginRenderPass(cmdBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+  setViewportAndScissor(cmdBuffer, {0, 0}, _swapChainExtent);
 
   if (currentScene->SceneRenderPassType == RenderPassType::Deferred) {
     vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
@@ -93,33 +334,33 @@ void recordCommand(VkRenderPass _deferredRenderPass,
   }
 
   vkCmdNextSubpass(cmdBuffer, VK_SUBPASS_CONTENTS_INLINE);
-  if (currentScene->SceneRenderPassType == RenderPassType::Deferred &&
-      gBufferVisualize.CurrentOption ==
-          GBufferVisualizingOption::RenderedScene) {
+  bool isVisualizingGBuffer =
+      gBufferVisualize.CurrentOption != GBufferVisualizingOption::RenderedScene;
+  if (isVisualizingGBuffer) {
+    // Drawn here rather than after forward lighting, since depth can only be
+    // sampled while it's read only.
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      gBufferVisualize.Pipeline);
 
+    vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
+  } else if (currentScene->SceneRenderPassType == RenderPassType::Deferred) {
     vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
                       _brdfPipeline);
 
     vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
+
+    drawLightVolumes(cmdBuffer);
   }
 
   vkCmdNextSubpass(cmdBuffer, VK_SUBPASS_CONTENTS_INLINE);
 
-  if (currentScene->SceneRenderPassType == RenderPassType::Forward) {
+  if (currentScene->SceneRenderPassType == RenderPassType::Forward &&
+      !isVisualizingGBuffer) {
     vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
                       _forwardPipeline);
     currentScene->drawScene(_frame);
   }
 
-  if (gBufferVisualize.CurrentOption !=
-      GBufferVisualizingOption::RenderedScene) {
-
-    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                      gBufferVisualize.Pipeline);
-
-    vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
-  }
-
   vkCmdNextSubpass(cmdBuffer, VK_SUBPASS_CONTENTS_INLINE);
   vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
                     _hdrToneMappingPipeline);
@@ -135,13 +376,11 @@ void recordCommand(VkRenderPass _deferredRenderPass,
       currentScene->drawScene(_frame);
     }
 
-    VkDeviceSize offsets[2] = {};
-    VkBuffer vertexBuffers[2] = {gLightSources.VertexBuffer.Handle,
-                                 gLightSources.InstanceBuffer.Handle};
-
+    VkDeviceSize offset = 0;
     vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
                       gLightSources.Pipeline);
-    vkCmdBindVertexBuffers(cmdBuffer, 0, 2, vertexBuffers, offsets);
+    vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &gLightSources.VertexBuffer.Handle,
+                           &offset);
     vkCmdBindIndexBuffer(cmdBuffer, gLightSources.IndexBuffer.Handle, 0,
                          VK_INDEX_TYPE_UINT32);
     vkCmdDrawIndexed(cmdBuffer, gLightSources.NumIndices,
@@ -159,11 +398,16 @@ void recordCommand(VkRenderPass _deferredRenderPass,
     clearDepthRegion.baseArrayLayer = 0;
     vkCmdClearAttachments(cmdBuffer, 1, &clearDepth, 1, &clearDepthRegion);
 
+    // The gizmo is drawn into the top right corner.
+    setViewportAndScissor(cmdBuffer, clearDepthRegion.rect.offset,
+                          clearDepthRegion.rect.extent);
+
     vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
                       gGizmo.Pipeline);
 
+    VkDeviceSize gizmoOffset = 0;
     vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &gGizmo.VertexBuffer.Handle,
-                           offsets);
+                           &gizmoOffset);
     vkCmdBindIndexBuffer(cmdBuffer, gGizmo.IndexBuffer.Handle, 0,
                          VK_INDEX_TYPE_UINT32);
   }
@@ -181,6 +425,16 @@ void recordCommand(VkRenderPass _deferredRenderPass,
 int main(int _argc, char **_argv) {
   using namespace bb;
 
+  Time startupBeginTime = getCurrentTime();
+
+  // --memory-report <path>: dump the device memory usage as JSON on exit.
+  std::string memoryReportPath;
+  for (int i = 1; i < _argc; ++i) {
+    if ((strcmp(_argv[i], "--memory-report") == 0) && (i + 1 < _argc)) {
+      memoryReportPath = _argv[++i];
+    }
+  }
+
   SetProcessDPIAware();
   SetProcessDpiAwareness(PROCESS_PER_MONITOR_DPI_AWARE);
 
@@ -195,6 +449,10 @@ int main(int _argc, char **_argv) {
       "Bibim Renderer", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, width,
       height, SDL_WINDOW_VULKAN | SDL_WINDOW_RESIZABLE);
 
+  // The renderer reads the pipeline cache through file_io.
+  ThreadPool *threadPool = createThreadPool();
+  initFileIO(*threadPool);
+
   Renderer renderer = createRenderer(window);
   commonSceneResources.Renderer = &renderer;
 
@@ -206,18 +464,23 @@ int main(int _argc, char **_argv) {
   VkCommandPool transientCmdPool;
   BB_VK_ASSERT(vkCreateCommandPool(renderer.Device, &transientCmdPoolCreateInfo,
                                    nullptr, &transientCmdPool));
-  commonSceneResources.TransientCmdPool = transientCmdPool;
 
-  gStandardPipelineLayout = createStandardPipelineLayout(renderer);
   commonSceneResources.StandardPipelineLayout = &gStandardPipelineLayout;
 
   initResourceRoot();
 
+  // Everything that has to be ready before the first frame is expressed as a
+  // graph of tasks, so that file I/O, decoding and pipeline compilation can
+  // overlap. Each task writes only to the variables it's responsible for.
+  TaskGraph *startupGraph = createTaskGraph(*threadPool);
+
   // Load gizmo model
   std::vector<GizmoVertex> gizmoVertices;
   std::vector<uint32_t> gizmoIndices;
-  {
+  Task *gizmoMeshTask = addTask(*startupGraph, "Gizmo mesh", [&] {
     Assimp::Importer importer;
+    // The .mtl next to the .obj is opened through the same IO system.
+    importer.SetIOHandler(createResourceIOSystem());
     const aiScene *gizmoScene = importer.ReadFile(
         createCommonResourcePath("gizmo.obj"), aiProcess_Triangulate);
 
@@ -280,56 +543,154 @@ int main(int _argc, char **_argv) {
         gizmoIndices.push_back(baseIndex + face.mIndices[2]);
       }
     }
-  }
-
-  Shader gBufferVertShader = createShaderFromFile(renderer, "gbuffer.vert.spv");
-  Shader gBufferFragShader = createShaderFromFile(renderer, "gbuffer.frag.spv");
-
-  Shader brdfVertShader = createShaderFromFile(renderer, "brdf.vert.spv");
-  Shader brdfFragShader = createShaderFromFile(renderer, "brdf.frag.spv");
-
-  Shader forwardBrdfVertShader =
-      createShaderFromFile(renderer, "forward_brdf.vert.spv");
-  Shader forwardBrdfFragShader =
-      createShaderFromFile(renderer, "forward_brdf.frag.spv");
+  });
+
+  // Hot reload finds shaders by their file name.
+  std::unordered_map<std::string, Shader *> shadersByFileName;
+  auto addShaderTask = [&](Shader &_shader, const char *_filePath) {
+    shadersByFileName[_filePath] = &_shader;
+    return addTask(*startupGraph, fmt::format("Shader {}", _filePath),
+                   [&renderer, &_shader, _filePath] {
+                     _shader = createShaderFromFile(renderer, _filePath);
+                   });
+  };
 
-  Shader hdrToneMappingVertShader =
-      createShaderFromFile(renderer, "hdr_tone_mapping.vert.spv");
-  Shader hdrToneMappingFragShader =
-      createShaderFromFile(renderer, "hdr_tone_mapping.frag.spv");
+  Shader gBufferVertShader;
+  Shader gBufferFragShader;
+  Task *gBufferVertShaderTask =
+      addShaderTask(gBufferVertShader, "gbuffer.vert.spv");
+  Task *gBufferFragShaderTask =
+      addShaderTask(gBufferFragShader, "gbuffer.frag.spv");
+
+  Shader brdfVertShader;
+  Shader brdfFragShader;
+  Task *brdfVertShaderTask = addShaderTask(brdfVertShader, "brdf.vert.spv");
+  Task *brdfFragShaderTask = addShaderTask(brdfFragShader, "brdf.frag.spv");
+
+  Shader forwardBrdfVertShader;
+  Shader forwardBrdfFragShader;
+  Task *forwardBrdfVertShaderTask =
+      addShaderTask(forwardBrdfVertShader, "forward_brdf.vert.spv");
+  Task *forwardBrdfFragShaderTask =
+      addShaderTask(forwardBrdfFragShader, "forward_brdf.frag.spv");
+
+  Shader hdrToneMappingVertShader;
+  Shader hdrToneMappingFragShader;
+  Task *hdrToneMappingVertShaderTask =
+      addShaderTask(hdrToneMappingVertShader, "hdr_tone_mapping.vert.spv");
+  Task *hdrToneMappingFragShaderTask =
+      addShaderTask(hdrToneMappingFragShader, "hdr_tone_mapping.frag.spv");
 
   gTBN.IsSupported = renderer.PhysicalDeviceFeatures.geometryShader == VK_TRUE;
-
-  gTBN.VertShader = createShaderFromFile(renderer, "tbn.vert.spv");
-  gTBN.GeomShader = createShaderFromFile(renderer, "tbn.geom.spv");
-  gTBN.FragShader = createShaderFromFile(renderer, "tbn.frag.spv");
-
-  gGizmo.VertShader = createShaderFromFile(renderer, "gizmo.vert.spv");
-  gGizmo.FragShader = createShaderFromFile(renderer, "gizmo.frag.spv");
-
-  gLightSources.VertShader = createShaderFromFile(renderer, "light.vert.spv");
-  gLightSources.FragShader = createShaderFromFile(renderer, "light.frag.spv");
-
-  gBufferVisualize.VertShader =
-      createShaderFromFile(renderer, "buffer_visualize.vert.spv");
-  gBufferVisualize.FragShader =
-      createShaderFromFile(renderer, "buffer_visualize.frag.spv");
-
-  PBRMaterialSet materialSet = createPBRMaterialSet(renderer, transientCmdPool);
+  gLightVolumes.UseDepthBounds =
+      renderer.PhysicalDeviceFeatures.depthBounds == VK_TRUE;
+
+  Task *tbnVertShaderTask = addShaderTask(gTBN.VertShader, "tbn.vert.spv");
+  Task *tbnGeomShaderTask = addShaderTask(gTBN.GeomShader, "tbn.geom.spv");
+  Task *tbnFragShaderTask = addShaderTask(gTBN.FragShader, "tbn.frag.spv");
+
+  Task *gizmoVertShaderTask =
+      addShaderTask(gGizmo.VertShader, "gizmo.vert.spv");
+  Task *gizmoFragShaderTask =
+      addShaderTask(gGizmo.FragShader, "gizmo.frag.spv");
+
+  Task *lightVertShaderTask =
+      addShaderTask(gLightSources.VertShader, "light.vert.spv");
+  Task *lightFragShaderTask =
+      addShaderTask(gLightSources.FragShader, "light.frag.spv");
+
+  Task *bufferVisualizeVertShaderTask =
+      addShaderTask(gBufferVisualize.VertShader, "buffer_visualize.vert.spv");
+  Task *bufferVisualizeFragShaderTask =
+      addShaderTask(gBufferVisualize.FragShader, "buffer_visualize.frag.spv");
+
+  Task *lightVolumeVertShaderTask =
+      addShaderTask(gLightVolumes.VertShader, "light_volume.vert.spv");
+  Task *lightVolumeFragShaderTask =
+      addShaderTask(gLightVolumes.FragShader, "light_volume.frag.spv");
+
+  // Not part of the standard layout, the culling passes have their own.
+  Shader cullInstancesShader;
+  addShaderTask(cullInstancesShader, "cull_instances.comp.spv");
+  Shader depthPyramidShader;
+  addShaderTask(depthPyramidShader, "depth_pyramid.comp.spv");
+
+  // The standard layout is generated from the bindings every shader declares,
+  // so it waits for all of them.
+  const Shader *standardShaders[] = {
+      &gBufferVertShader,          &gBufferFragShader,
+      &brdfVertShader,             &brdfFragShader,
+      &forwardBrdfVertShader,      &forwardBrdfFragShader,
+      &hdrToneMappingVertShader,   &hdrToneMappingFragShader,
+      &gTBN.VertShader,            &gTBN.GeomShader,
+      &gTBN.FragShader,            &gGizmo.VertShader,
+      &gGizmo.FragShader,          &gLightSources.VertShader,
+      &gLightSources.FragShader,   &gBufferVisualize.VertShader,
+      &gBufferVisualize.FragShader, &gLightVolumes.VertShader,
+      &gLightVolumes.FragShader,
+  };
+  Task *standardPipelineLayoutTask = addTask(
+      *startupGraph, "Standard pipeline layout",
+      [&] {
+        gStandardPipelineLayout = createStandardPipelineLayout(
+            renderer, standardShaders, (uint32_t)std::size(standardShaders));
+      },
+      {gBufferVertShaderTask, gBufferFragShaderTask, brdfVertShaderTask,
+       brdfFragShaderTask, forwardBrdfVertShaderTask,
+       forwardBrdfFragShaderTask, hdrToneMappingVertShaderTask,
+       hdrToneMappingFragShaderTask, tbnVertShaderTask, tbnGeomShaderTask,
+       tbnFragShaderTask, gizmoVertShaderTask, gizmoFragShaderTask,
+       lightVertShaderTask, lightFragShaderTask, bufferVisualizeVertShaderTask,
+       bufferVisualizeFragShaderTask, lightVolumeVertShaderTask,
+       lightVolumeFragShaderTask});
+
+  // Every image is decoded by its own task, and each material is uploaded as
+  // soon as all of its images are ready so that the staging ring keeps
+  // getting recycled.
+  PBRMaterialSet materialSet = {};
   commonSceneResources.MaterialSet = &materialSet;
+  ImageLoader materialImageLoader;
+  beginPBRMaterialSetLoad(renderer, materialSet, materialImageLoader);
+  submitImageFileReads(materialImageLoader);
+
+  Task *materialSetTask = addTask(*startupGraph, "Material set", [&] {
+    finishPBRMaterialSetLoad(materialSet);
+  });
+  for (size_t i = 0; i < materialSet.Materials.size(); ++i) {
+    const std::string &materialName = materialSet.Materials[i].Name;
+    ImageLoadFromFileTask **imageLoadTasks =
+        &materialImageLoader.Tasks[i * PBRMaterial::NumImages];
+
+    Task *uploadTask = addTask(
+        *startupGraph, fmt::format("Upload {}", materialName),
+        [&renderer, imageLoadTasks] {
+          submitImageLoads(renderer, imageLoadTasks, PBRMaterial::NumImages);
+        });
+    addTaskDependency(*materialSetTask, *uploadTask);
+
+    for (uint32_t j = 0; j < PBRMaterial::NumImages; ++j) {
+      ImageLoadFromFileTask *imageLoadTask = imageLoadTasks[j];
+      Task *decodeTask = addTask(
+          *startupGraph,
+          fmt::format("Decode {}/{}", materialName,
+                      getFileName(imageLoadTask->FilePath)),
+          [imageLoadTask] { runImageLoadTask(*imageLoadTask); });
+      addTaskDependency(*uploadTask, *decodeTask);
+    }
+  }
 
-  // Create a descriptor pool corresponding to the standard pipeline layout
-  VkDescriptorPool standardDescriptorPool = createStandardDescriptorPool(
-      renderer, gStandardPipelineLayout,
-      {numFrames, 1, (uint32_t)materialSet.Materials.size(), 1});
+  RenderPass depthPrepassRenderPass;
   RenderPass deferredRenderPass;
 
+  VkPipeline depthPrepassPipeline;
+  VkPipeline forwardDepthPrepassPipeline;
   VkPipeline forwardPipeline;
   VkPipeline gBufferPipeline;
   VkPipeline brdfPipeline;
   VkPipeline hdrToneMappingPipeline;
 
   PipelineParams forwardPipelineParams = {};
+  forwardPipelineParams.Name = "Forward";
   const Shader *forwardShaders[] = {&forwardBrdfVertShader,
                                     &forwardBrdfFragShader};
   forwardPipelineParams.Shaders = forwardShaders;
@@ -347,9 +708,9 @@ int main(int _argc, char **_argv) {
       (uint32_t)DeferredSubpassType::ForwardLighting;
   forwardPipelineParams.DepthStencil.DepthTestEnable = true;
   forwardPipelineParams.DepthStencil.DepthWriteEnable = true;
-  forwardPipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
 
   PipelineParams gBufferPipelineParams = {};
+  gBufferPipelineParams.Name = "GBuffer";
   const Shader *gBufferShaders[] = {&gBufferVertShader, &gBufferFragShader};
   gBufferPipelineParams.Shaders = gBufferShaders;
   gBufferPipelineParams.NumShaders = std::size(gBufferShaders);
@@ -365,9 +726,26 @@ int main(int _argc, char **_argv) {
   gBufferPipelineParams.Subpass = (uint32_t)DeferredSubpassType::GBufferWrite;
   gBufferPipelineParams.DepthStencil.DepthTestEnable = true;
   gBufferPipelineParams.DepthStencil.DepthWriteEnable = true;
-  gBufferPipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
+
+  // Only the vertex shader of the pass the scene is drawn in, so that the
+  // depth written here is what that pass writes again.
+  PipelineParams depthPrepassPipelineParams = {};
+  depthPrepassPipelineParams.VertexInput.Bindings = Vertex::Bindings.data();
+  depthPrepassPipelineParams.VertexInput.NumBindings = Vertex::Bindings.size();
+  depthPrepassPipelineParams.VertexInput.Attributes = Vertex::Attributes.data();
+  depthPrepassPipelineParams.VertexInput.NumAttributes =
+      Vertex::Attributes.size();
+  depthPrepassPipelineParams.InputAssembly.Topology =
+      VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+  depthPrepassPipelineParams.Rasterizer.PolygonMode = VK_POLYGON_MODE_FILL;
+  depthPrepassPipelineParams.Rasterizer.CullMode = VK_CULL_MODE_BACK_BIT;
+  depthPrepassPipelineParams.Blend.NumColorBlends = 0;
+  depthPrepassPipelineParams.Subpass = 0;
+  depthPrepassPipelineParams.DepthStencil.DepthTestEnable = true;
+  depthPrepassPipelineParams.DepthStencil.DepthWriteEnable = true;
 
   PipelineParams brdfPipelineParams = {};
+  brdfPipelineParams.Name = "BRDF";
   const Shader *brdfShaders[] = {&brdfVertShader, &brdfFragShader};
   brdfPipelineParams.Shaders = brdfShaders;
   brdfPipelineParams.NumShaders = std::size(brdfShaders);
@@ -377,11 +755,11 @@ int main(int _argc, char **_argv) {
   brdfPipelineParams.Rasterizer.CullMode = VK_CULL_MODE_BACK_BIT;
   brdfPipelineParams.Blend.NumColorBlends = 1;
   brdfPipelineParams.Subpass = (uint32_t)DeferredSubpassType::Lighting;
-  brdfPipelineParams.DepthStencil.DepthTestEnable = true;
-  brdfPipelineParams.DepthStencil.DepthWriteEnable = true;
-  brdfPipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
+  brdfPipelineParams.DepthStencil.DepthTestEnable = false;
+  brdfPipelineParams.DepthStencil.DepthWriteEnable = false;
 
   PipelineParams hdrToneMappingPipelineParams = {};
+  hdrToneMappingPipelineParams.Name = "HDR Tone Mapping";
   const Shader *hdrToneMappingShaders[] = {&hdrToneMappingVertShader,
                                            &hdrToneMappingFragShader};
   hdrToneMappingPipelineParams.Shaders = hdrToneMappingShaders;
@@ -394,19 +772,149 @@ int main(int _argc, char **_argv) {
   hdrToneMappingPipelineParams.Subpass = (uint32_t)DeferredSubpassType::HDR;
   hdrToneMappingPipelineParams.DepthStencil.DepthTestEnable = false;
   hdrToneMappingPipelineParams.DepthStencil.DepthWriteEnable = false;
-  hdrToneMappingPipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
+
+  VkFormat gbufferFormats[numGBufferAttachments];
+  getGBufferAttachmentFormats(renderer, gbufferFormats);
 
   SwapChain swapChain;
+  VkFramebuffer depthPrepassFramebuffer = VK_NULL_HANDLE;
   std::vector<VkFramebuffer> deferredFramebuffers;
   Image gbufferAttachmentImages[numGBufferAttachments] = {};
   Image hdrAttachmentImage = {};
+  // Everything in here is released at once on resize.
+  LinearMemoryPool *renderTargetMemoryPool = createLinearMemoryPool(
+      *renderer.MemoryAllocator, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+      DeviceMemoryCategory::Attachment, 64 * 1024 * 1024);
+  RenderPassAttachmentMemoryReport attachmentMemoryReport = {};
+  // Written by the geometry pass and read back by lighting.
+  uint32_t gbufferBytesPerPixel = 0;
+
+  // Whether each G-buffer/HDR attachment shares memory with another one. The
+  // render pass is built with these flags.
+  bool mayAttachmentsAlias[numGBufferAttachments + 1] = {};
+
+  // G-buffer and HDR attachments
+  auto createAttachmentImages = [&] {
+    {
+      RenderPassAttachmentParams attachmentParams[numGBufferAttachments + 1] =
+          {};
+      for (uint32_t i = 0; i < numGBufferAttachments; ++i) {
+        RenderPassAttachmentParams &params = attachmentParams[i];
+        params.Image.Format = gbufferFormats[i];
+        params.Image.Width = swapChain.Extent.width;
+        params.Image.Height = swapChain.Extent.height;
+        // Only read as input attachments, so the G-buffer can be transient
+        // and never leave tile memory.
+        params.Image.Usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                             VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+        params.FirstSubpass = (uint32_t)DeferredSubpassType::GBufferWrite;
+        params.LastSubpass = (uint32_t)DeferredSubpassType::Lighting;
+      }
 
-  auto initReloadableResources = [&] {
-    swapChain = createSwapChain(renderer, width, height, nullptr);
+      RenderPassAttachmentParams &hdrParams =
+          attachmentParams[numGBufferAttachments];
+      hdrParams.Image.Format = hdrAttachmentFormat;
+      hdrParams.Image.Width = swapChain.Extent.width;
+      hdrParams.Image.Height = swapChain.Extent.height;
+      hdrParams.Image.Usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                              VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+      hdrParams.FirstSubpass = (uint32_t)DeferredSubpassType::Lighting;
+      hdrParams.LastSubpass = (uint32_t)DeferredSubpassType::HDR;
+
+      Image attachmentImages[numGBufferAttachments + 1] = {};
+      attachmentMemoryReport = createRenderPassAttachments(
+          renderer, attachmentParams, (uint32_t)std::size(attachmentParams),
+          *renderTargetMemoryPool, attachmentImages, mayAttachmentsAlias);
+      for (uint32_t i = 0; i < numGBufferAttachments; ++i) {
+        gbufferAttachmentImages[i] = attachmentImages[i];
+      }
+      hdrAttachmentImage = attachmentImages[numGBufferAttachments];
 
-    gBufferVisualize.ViewportExtent.width = width;
-    gBufferVisualize.ViewportExtent.height = height;
+      gbufferBytesPerPixel = getFormatSize(swapChain.DepthFormat);
+      for (VkFormat format : gbufferFormats) {
+        gbufferBytesPerPixel += getFormatSize(format);
+      }
 
+      const float mb = 1024.f * 1024.f;
+      BB_LOG_INFO("G-buffer: {} bytes per pixel, depth included",
+                  gbufferBytesPerPixel);
+      BB_LOG_INFO("Attachment memory: {:.2f} MB -> {:.2f} MB ({} aliased, {} "
+                  "lazily allocated)",
+                  attachmentMemoryReport.SeparateBytes / mb,
+                  (attachmentMemoryReport.AliasedBytes +
+                   attachmentMemoryReport.LazyBytes) /
+                      mb,
+                  attachmentMemoryReport.NumAliased,
+                  attachmentMemoryReport.NumLazy);
+    }
+  };
+
+  // Depth of the instances the early culling phase picks, which the depth
+  // pyramid is built from.
+  auto createDepthPrepassRenderPass = [&] {
+    VkAttachmentDescription depthAttachment = {};
+    depthAttachment.format = swapChain.DepthFormat;
+    depthAttachment.samples = swapChain.NumDepthSamples;
+    depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    // Sampled by the depth pyramid, then loaded by the deferred render pass.
+    depthAttachment.finalLayout =
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+
+    VkAttachmentReference depthAttachmentRef = {
+        0,
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    };
+
+    VkSubpassDescription subpass = {};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+    VkSubpassDependency dependencies[2] = {};
+    // The last frame's deferred render pass and depth pyramid are done with
+    // depth.
+    dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[0].dstSubpass = 0;
+    dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                                   VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                                   VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependencies[0].srcAccessMask =
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependencies[0].dstAccessMask =
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+    dependencies[1].srcSubpass = 0;
+    dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependencies[1].dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                                   VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                                   VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependencies[1].srcAccessMask =
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependencies[1].dstAccessMask =
+        VK_ACCESS_SHADER_READ_BIT |
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+    VkRenderPassCreateInfo renderPassCreateInfo = {};
+    renderPassCreateInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    renderPassCreateInfo.attachmentCount = 1;
+    renderPassCreateInfo.pAttachments = &depthAttachment;
+    renderPassCreateInfo.subpassCount = 1;
+    renderPassCreateInfo.pSubpasses = &subpass;
+    renderPassCreateInfo.dependencyCount = (uint32_t)std::size(dependencies);
+    renderPassCreateInfo.pDependencies = dependencies;
+
+    BB_VK_ASSERT(vkCreateRenderPass(renderer.Device, &renderPassCreateInfo,
+                                    nullptr, &depthPrepassRenderPass.Handle));
+  };
+
+  auto createDeferredRenderPass = [&] {
     // clang-format off
     // All render passes' first and second attachments' format and sampel should be following:
     // 0 - Color Attachment (swapChain.ColorFormat, VK_SAMPLE_COUNT_1_BIT)
@@ -431,45 +939,51 @@ int main(int _argc, char **_argv) {
           attachments[DeferredAttachmentType::Depth];
       depthAttachment.format = swapChain.DepthFormat;
       depthAttachment.samples = swapChain.NumDepthSamples;
-      depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+      // Starts from what the depth pre-pass drew.
+      depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
       depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
       depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
       depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-      depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      depthAttachment.initialLayout =
+          VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
       depthAttachment.finalLayout =
           VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
       VkAttachmentDescription gbufferColorAttachment = {};
-      gbufferColorAttachment.format = VK_FORMAT_R16G16B16A16_SFLOAT;
       gbufferColorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
       gbufferColorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-      gbufferColorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+      // Nothing reads the G-buffer after the render pass.
+      gbufferColorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
       gbufferColorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
       gbufferColorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
       gbufferColorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
       gbufferColorAttachment.finalLayout =
           VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
-      attachments[DeferredAttachmentType::GBufferPosition] =
-          gbufferColorAttachment;
-      attachments[DeferredAttachmentType::GBufferNormal] =
-          gbufferColorAttachment;
-      attachments[DeferredAttachmentType::GBufferAlbedo] =
-          gbufferColorAttachment;
-      attachments[DeferredAttachmentType::GBufferMRAH] = gbufferColorAttachment;
-      attachments[DeferredAttachmentType::GBufferMaterialIndex] =
-          gbufferColorAttachment;
+      for (uint32_t i = 0; i < numGBufferAttachments; ++i) {
+        VkAttachmentDescription &attachment =
+            attachments
+                .data()[(uint32_t)DeferredAttachmentType::GBufferNormal + i];
+        attachment = gbufferColorAttachment;
+        attachment.format = gbufferFormats[i];
+        if (mayAttachmentsAlias[i]) {
+          attachment.flags = VK_ATTACHMENT_DESCRIPTION_MAY_ALIAS_BIT;
+        }
+      }
 
       VkAttachmentDescription &hdrAttachment =
           attachments[DeferredAttachmentType::HDR];
       hdrAttachment.format = VK_FORMAT_R16G16B16A16_SFLOAT;
       hdrAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
       hdrAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-      hdrAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+      hdrAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
       hdrAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
       hdrAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
       hdrAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
       hdrAttachment.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+      if (mayAttachmentsAlias[numGBufferAttachments]) {
+        hdrAttachment.flags = VK_ATTACHMENT_DESCRIPTION_MAY_ALIAS_BIT;
+      }
 
       VkAttachmentReference finalColorAttachmentRef = {
           (uint32_t)DeferredAttachmentType::Color,
@@ -481,11 +995,15 @@ int main(int _argc, char **_argv) {
           VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
       };
 
-      VkAttachmentReference gbufferReadonlyAttachmentRefs[] = {
-          {
-              (uint32_t)DeferredAttachmentType::GBufferPosition,
-              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-          },
+      // Lighting only reads depth, for the depth bounds test of the light
+      // volumes and to rebuild positions.
+      VkAttachmentReference depthReadonlyAttachmentRef = {
+          (uint32_t)DeferredAttachmentType::Depth,
+          VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+      };
+
+      // Matches the input_attachment_index of uGbuffer and uDepthBuffer.
+      VkAttachmentReference lightingInputAttachmentRefs[] = {
           {
               (uint32_t)DeferredAttachmentType::GBufferNormal,
               VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
@@ -498,17 +1016,10 @@ int main(int _argc, char **_argv) {
               (uint32_t)DeferredAttachmentType::GBufferMRAH,
               VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
           },
-          {
-              (uint32_t)DeferredAttachmentType::GBufferMaterialIndex,
-              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-          },
+          depthReadonlyAttachmentRef,
       };
 
       VkAttachmentReference gbufferColorAttachmentRefs[] = {
-          {
-              (uint32_t)DeferredAttachmentType::GBufferPosition,
-              VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-          },
           {
               (uint32_t)DeferredAttachmentType::GBufferNormal,
               VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
@@ -521,10 +1032,6 @@ int main(int _argc, char **_argv) {
               (uint32_t)DeferredAttachmentType::GBufferMRAH,
               VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
           },
-          {
-              (uint32_t)DeferredAttachmentType::GBufferMaterialIndex,
-              VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-          },
       };
 
       VkAttachmentReference hdrColorAttachmentRef = {
@@ -551,12 +1058,14 @@ int main(int _argc, char **_argv) {
       subpasses[DeferredSubpassType::Lighting].pipelineBindPoint =
           VK_PIPELINE_BIND_POINT_GRAPHICS;
       subpasses[DeferredSubpassType::Lighting].inputAttachmentCount =
-          std::size(gbufferReadonlyAttachmentRefs);
+          std::size(lightingInputAttachmentRefs);
       subpasses[DeferredSubpassType::Lighting].pInputAttachments =
-          gbufferReadonlyAttachmentRefs;
+          lightingInputAttachmentRefs;
       subpasses[DeferredSubpassType::Lighting].colorAttachmentCount = 1;
       subpasses[DeferredSubpassType::Lighting].pColorAttachments =
           &hdrColorAttachmentRef;
+      subpasses[DeferredSubpassType::Lighting].pDepthStencilAttachment =
+          &depthReadonlyAttachmentRef;
 
       subpasses[DeferredSubpassType::ForwardLighting].pipelineBindPoint =
           VK_PIPELINE_BIND_POINT_GRAPHICS;
@@ -583,19 +1092,23 @@ int main(int _argc, char **_argv) {
       subpasses[DeferredSubpassType::Overlay].pDepthStencilAttachment =
           &depthAttachmentRef;
 
-      VkSubpassDependency subpassDependencies[6] = {};
+      VkSubpassDependency subpassDependencies[7] = {};
       subpassDependencies[0].srcSubpass =
           (uint32_t)DeferredSubpassType::GBufferWrite;
       subpassDependencies[0].dstSubpass =
           (uint32_t)DeferredSubpassType::Lighting;
       subpassDependencies[0].srcStageMask =
-          VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+          VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+          VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
       subpassDependencies[0].dstStageMask =
-          VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+          VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+          VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
       subpassDependencies[0].srcAccessMask =
-          VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+          VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+          VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
       subpassDependencies[0].dstAccessMask =
-          VK_ACCESS_INPUT_ATTACHMENT_READ_BIT;
+          VK_ACCESS_INPUT_ATTACHMENT_READ_BIT |
+          VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
 
       subpassDependencies[1].srcSubpass =
           (uint32_t)DeferredSubpassType::GBufferWrite;
@@ -614,14 +1127,21 @@ int main(int _argc, char **_argv) {
           (uint32_t)DeferredSubpassType::Lighting;
       subpassDependencies[2].dstSubpass =
           (uint32_t)DeferredSubpassType::ForwardLighting;
+      // Forward lighting writes the depth lighting has read.
       subpassDependencies[2].srcStageMask =
-          VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+          VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+          VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+          VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+          VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
       subpassDependencies[2].dstStageMask =
-          VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+          VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+          VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+          VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
       subpassDependencies[2].srcAccessMask =
           VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
       subpassDependencies[2].dstAccessMask =
-          VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+          VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+          VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
       subpassDependencies[3].srcSubpass =
           (uint32_t)DeferredSubpassType::Lighting;
@@ -660,6 +1180,30 @@ int main(int _argc, char **_argv) {
           VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
           VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
 
+      // Every subpass only reads the pixel it writes, which lets tiled GPUs
+      // keep the attachments on chip between subpasses.
+      for (VkSubpassDependency &dependency : subpassDependencies) {
+        dependency.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+      }
+
+      // The depth pyramid samples depth before the G-buffer pass writes it.
+      // Not by region, the pyramid reads all of it.
+      subpassDependencies[6].srcSubpass = VK_SUBPASS_EXTERNAL;
+      subpassDependencies[6].dstSubpass =
+          (uint32_t)DeferredSubpassType::GBufferWrite;
+      subpassDependencies[6].srcStageMask =
+          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+          VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+      subpassDependencies[6].dstStageMask =
+          VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+          VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+      subpassDependencies[6].srcAccessMask =
+          VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+      subpassDependencies[6].dstAccessMask =
+          VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+          VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+      subpassDependencies[6].dependencyFlags = 0;
+
       VkRenderPassCreateInfo renderPassCreateInfo = {};
       renderPassCreateInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
       renderPassCreateInfo.attachmentCount = attachments.size();
@@ -673,26 +1217,22 @@ int main(int _argc, char **_argv) {
       BB_VK_ASSERT(vkCreateRenderPass(renderer.Device, &renderPassCreateInfo,
                                       nullptr, &deferredRenderPass.Handle));
     }
+  };
 
-    for (Image &image : gbufferAttachmentImages) {
-      ImageParams params = {};
-      params.Format = gbufferAttachmentFormat;
-      params.Width = swapChain.Extent.width;
-      params.Height = swapChain.Extent.height;
-      params.Usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
-                     VK_IMAGE_USAGE_SAMPLED_BIT |
-                     VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
-      image = createImage(renderer, params);
-    }
+  auto createDeferredFramebuffers = [&] {
+    {
+      VkFramebufferCreateInfo fbCreateInfo = {};
+      fbCreateInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+      fbCreateInfo.renderPass = depthPrepassRenderPass.Handle;
+      fbCreateInfo.attachmentCount = 1;
+      fbCreateInfo.pAttachments = &swapChain.DepthImageView;
+      fbCreateInfo.width = swapChain.Extent.width;
+      fbCreateInfo.height = swapChain.Extent.height;
+      fbCreateInfo.layers = 1;
 
-    ImageParams hdrImageParams = {};
-    hdrImageParams.Format = hdrAttachmentFormat;
-    hdrImageParams.Width = swapChain.Extent.width;
-    hdrImageParams.Height = swapChain.Extent.height;
-    hdrImageParams.Usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
-                           VK_IMAGE_USAGE_SAMPLED_BIT |
-                           VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
-    hdrAttachmentImage = createImage(renderer, hdrImageParams);
+      BB_VK_ASSERT(vkCreateFramebuffer(renderer.Device, &fbCreateInfo, nullptr,
+                                       &depthPrepassFramebuffer));
+    }
 
     deferredFramebuffers.resize(swapChain.NumColorImages);
     // Create deferred framebuffer
@@ -703,8 +1243,7 @@ int main(int _argc, char **_argv) {
       EnumArray<DeferredAttachmentType, VkImageView> attachments = {
           swapChain.ColorImageViews[i],    swapChain.DepthImageView,
           gbufferAttachmentImages[0].View, gbufferAttachmentImages[1].View,
-          gbufferAttachmentImages[2].View, gbufferAttachmentImages[3].View,
-          gbufferAttachmentImages[4].View, hdrAttachmentImage.View,
+          gbufferAttachmentImages[2].View, hdrAttachmentImage.View,
       };
       fbCreateInfo.attachmentCount = attachments.size();
       fbCreateInfo.pAttachments = attachments.data();
@@ -715,269 +1254,778 @@ int main(int _argc, char **_argv) {
       BB_VK_ASSERT(vkCreateFramebuffer(renderer.Device, &fbCreateInfo, nullptr,
                                        &deferredFramebuffers[i]));
     }
+  };
 
-    forwardPipelineParams.Viewport.Extent = {(float)swapChain.Extent.width,
-                                             (float)swapChain.Extent.height};
-    forwardPipelineParams.Viewport.ScissorExtent = {
-        (int)swapChain.Extent.width, (int)swapChain.Extent.height};
-    forwardPipelineParams.RenderPass = deferredRenderPass.Handle;
-    forwardPipeline = createPipeline(renderer, forwardPipelineParams);
-    gBufferPipelineParams.Viewport.Extent = {(float)swapChain.Extent.width,
-                                             (float)swapChain.Extent.height};
-    gBufferPipelineParams.Viewport.ScissorExtent = {
-        (int)swapChain.Extent.width, (int)swapChain.Extent.height};
-    gBufferPipelineParams.RenderPass = deferredRenderPass.Handle;
-    gBufferPipeline = createPipeline(renderer, gBufferPipelineParams);
-    brdfPipelineParams.Viewport.Extent = {(float)swapChain.Extent.width,
-                                          (float)swapChain.Extent.height};
-    brdfPipelineParams.Viewport.ScissorExtent = {(int)swapChain.Extent.width,
-                                                 (int)swapChain.Extent.height};
-    brdfPipelineParams.RenderPass = deferredRenderPass.Handle;
-    brdfPipeline = createPipeline(renderer, brdfPipelineParams);
-    hdrToneMappingPipelineParams.Viewport.Extent = {
-        (float)swapChain.Extent.width, (float)swapChain.Extent.height};
-    hdrToneMappingPipelineParams.Viewport.ScissorExtent = {
-        (int)swapChain.Extent.width, (int)swapChain.Extent.height};
-    hdrToneMappingPipelineParams.RenderPass = deferredRenderPass.Handle;
-    hdrToneMappingPipeline =
-        createPipeline(renderer, hdrToneMappingPipelineParams);
-
-    // Gizmo Pipeline
-    {
-      const Shader *shaders[] = {&gGizmo.VertShader, &gGizmo.FragShader};
-      PipelineParams pipelineParams = {};
-      pipelineParams.Shaders = shaders;
-      pipelineParams.NumShaders = std::size(shaders);
-
-      auto bindings = GizmoVertex::getBindingDescs();
-      auto attributes = GizmoVertex::getAttributeDescs();
-      pipelineParams.VertexInput.Bindings = bindings.data();
-      pipelineParams.VertexInput.NumBindings = bindings.size();
-      pipelineParams.VertexInput.Attributes = attributes.data();
-      pipelineParams.VertexInput.NumAttributes = attributes.size();
-
-      pipelineParams.InputAssembly.Topology =
-          VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-      pipelineParams.Viewport.Offset = {
-          (float)swapChain.Extent.width - gGizmo.ViewportExtent,
-          0,
-      };
-      pipelineParams.Viewport.Extent = {(float)gGizmo.ViewportExtent,
-                                        (float)gGizmo.ViewportExtent};
-      pipelineParams.Viewport.ScissorOffset = {
-          (int)pipelineParams.Viewport.Offset.X,
-          (int)pipelineParams.Viewport.Offset.Y,
+  auto initRenderTargets = [&] {
+    swapChain = createSwapChain(renderer, width, height, nullptr);
+    createAttachmentImages();
+    createDepthPrepassRenderPass();
+    createDeferredRenderPass();
+    createDeferredFramebuffers();
+  };
+
+  // Everything whose size follows the window, except the swap chain.
+  auto destroySizedRenderTargets = [&] {
+    vkDestroyFramebuffer(renderer.Device, depthPrepassFramebuffer, nullptr);
+    depthPrepassFramebuffer = VK_NULL_HANDLE;
+    for (VkFramebuffer fb : deferredFramebuffers) {
+      vkDestroyFramebuffer(renderer.Device, fb, nullptr);
+    }
+    deferredFramebuffers.clear();
+
+    destroyImage(renderer, hdrAttachmentImage);
+    for (Image &image : gbufferAttachmentImages) {
+      destroyImage(renderer, image);
+    }
+    resetLinearMemoryPool(*renderTargetMemoryPool);
+  };
+
+  // Pipelines only depend on the render pass; viewport and scissor are
+  // dynamic.
+  auto createDepthPrepassPipeline = [&](const ShaderPermutation &_permutation) {
+    const Shader *shaders[] = {&gBufferVertShader};
+    PipelineParams pipelineParams = depthPrepassPipelineParams;
+    pipelineParams.Name = "Depth Pre-Pass";
+    pipelineParams.Shaders = shaders;
+    pipelineParams.NumShaders = std::size(shaders);
+    pipelineParams.Permutation = &_permutation;
+    pipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
+    pipelineParams.RenderPass = depthPrepassRenderPass.Handle;
+    return createPipeline(renderer, pipelineParams);
+  };
+
+  auto createForwardDepthPrepassPipeline =
+      [&](const ShaderPermutation &_permutation) {
+        const Shader *shaders[] = {&forwardBrdfVertShader};
+        PipelineParams pipelineParams = depthPrepassPipelineParams;
+        pipelineParams.Name = "Forward Depth Pre-Pass";
+        pipelineParams.Shaders = shaders;
+        pipelineParams.NumShaders = std::size(shaders);
+        pipelineParams.Permutation = &_permutation;
+        pipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
+        pipelineParams.RenderPass = depthPrepassRenderPass.Handle;
+        return createPipeline(renderer, pipelineParams);
       };
-      pipelineParams.Viewport.ScissorExtent = {(int)gGizmo.ViewportExtent,
-                                               (int)gGizmo.ViewportExtent};
 
-      pipelineParams.Rasterizer.PolygonMode = VK_POLYGON_MODE_FILL;
-      pipelineParams.Rasterizer.CullMode = VK_CULL_MODE_BACK_BIT;
+  auto createForwardPipeline = [&](const ShaderPermutation &_permutation) {
+    PipelineParams pipelineParams = forwardPipelineParams;
+    pipelineParams.Permutation = &_permutation;
+    pipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
+    pipelineParams.RenderPass = deferredRenderPass.Handle;
+    return createPipeline(renderer, pipelineParams);
+  };
 
-      pipelineParams.Blend.NumColorBlends = 1;
-      pipelineParams.Subpass = (uint32_t)DeferredSubpassType::Overlay;
+  auto createGBufferPipeline = [&](const ShaderPermutation &_permutation) {
+    PipelineParams pipelineParams = gBufferPipelineParams;
+    pipelineParams.Permutation = &_permutation;
+    pipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
+    pipelineParams.RenderPass = deferredRenderPass.Handle;
+    return createPipeline(renderer, pipelineParams);
+  };
 
-      pipelineParams.DepthStencil.DepthTestEnable = true;
-      pipelineParams.DepthStencil.DepthWriteEnable = true;
-      pipelineParams.PipelineLayout = forwardPipelineParams.PipelineLayout;
-      pipelineParams.RenderPass = deferredRenderPass.Handle;
+  auto createBRDFPipeline = [&](const ShaderPermutation &_permutation) {
+    PipelineParams pipelineParams = brdfPipelineParams;
+    pipelineParams.Permutation = &_permutation;
+    pipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
+    pipelineParams.RenderPass = deferredRenderPass.Handle;
+    return createPipeline(renderer, pipelineParams);
+  };
 
-      gGizmo.Pipeline = createPipeline(renderer, pipelineParams);
-    }
+  auto createHDRToneMappingPipeline = [&](const ShaderPermutation
+                                              &_permutation) {
+    PipelineParams pipelineParams = hdrToneMappingPipelineParams;
+    pipelineParams.Permutation = &_permutation;
+    pipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
+    pipelineParams.RenderPass = deferredRenderPass.Handle;
+    return createPipeline(renderer, pipelineParams);
+  };
 
-    // TBN visualization pipeline
-    {
-      PipelineParams tbnPipelineParams = {};
-      const Shader *tbnShaders[] = {&gTBN.VertShader, &gTBN.GeomShader,
-                                    &gTBN.FragShader};
-
-      tbnPipelineParams.Shaders = tbnShaders;
-      tbnPipelineParams.NumShaders = std::size(tbnShaders);
-      tbnPipelineParams.InputAssembly.Topology =
-          VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-
-      auto bindings = Vertex::getBindingDescs();
-      auto attributes = Vertex::getAttributeDescs();
-      tbnPipelineParams.VertexInput.Bindings = bindings.data();
-      tbnPipelineParams.VertexInput.NumBindings = bindings.size();
-      tbnPipelineParams.VertexInput.Attributes = attributes.data();
-      tbnPipelineParams.VertexInput.NumAttributes = attributes.size();
-
-      tbnPipelineParams.Viewport.Extent = {(float)swapChain.Extent.width,
-                                           (float)swapChain.Extent.height};
-      tbnPipelineParams.Viewport.ScissorExtent = {(int)swapChain.Extent.width,
-                                                  (int)swapChain.Extent.height};
-      tbnPipelineParams.RenderPass = deferredRenderPass.Handle;
-
-      tbnPipelineParams.Rasterizer.PolygonMode = VK_POLYGON_MODE_FILL;
-      tbnPipelineParams.Rasterizer.CullMode = VK_CULL_MODE_BACK_BIT;
-      tbnPipelineParams.Blend.NumColorBlends = 1;
-
-      tbnPipelineParams.Subpass = (uint32_t)DeferredSubpassType::Overlay;
-      tbnPipelineParams.DepthStencil.DepthTestEnable = true;
-      tbnPipelineParams.DepthStencil.DepthWriteEnable = false;
-      tbnPipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
-
-      gTBN.Pipeline = createPipeline(renderer, tbnPipelineParams);
-    }
+  auto createGizmoPipeline = [&](const ShaderPermutation &_permutation) {
+    const Shader *shaders[] = {&gGizmo.VertShader, &gGizmo.FragShader};
+    PipelineParams pipelineParams = {};
+    pipelineParams.Name = "Gizmo";
+    pipelineParams.Permutation = &_permutation;
+    pipelineParams.Shaders = shaders;
+    pipelineParams.NumShaders = std::size(shaders);
 
-    // Light Sources Pipeline
-    {
-      PipelineParams pipelineParams = {};
-      const Shader *shaders[] = {&gLightSources.VertShader,
-                                 &gLightSources.FragShader};
-      pipelineParams.Shaders = shaders;
-      pipelineParams.NumShaders = std::size(shaders);
+    auto bindings = GizmoVertex::getBindingDescs();
+    auto attributes = GizmoVertex::getAttributeDescs();
+    pipelineParams.VertexInput.Bindings = bindings.data();
+    pipelineParams.VertexInput.NumBindings = bindings.size();
+    pipelineParams.VertexInput.Attributes = attributes.data();
+    pipelineParams.VertexInput.NumAttributes = attributes.size();
 
-      auto bindings = LightSourceVertex::getBindingDescs();
-      auto attributes = LightSourceVertex::getAttributeDescs();
+    pipelineParams.InputAssembly.Topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
 
-      pipelineParams.VertexInput.Bindings = bindings.data();
-      pipelineParams.VertexInput.NumBindings = bindings.size();
-      pipelineParams.VertexInput.Attributes = attributes.data();
-      pipelineParams.VertexInput.NumAttributes = attributes.size();
+    pipelineParams.Rasterizer.PolygonMode = VK_POLYGON_MODE_FILL;
+    pipelineParams.Rasterizer.CullMode = VK_CULL_MODE_BACK_BIT;
 
-      pipelineParams.Viewport.Extent = {(float)swapChain.Extent.width,
-                                        (float)swapChain.Extent.height};
-      pipelineParams.Viewport.ScissorExtent = {(int)swapChain.Extent.width,
-                                               (int)swapChain.Extent.height};
+    pipelineParams.Blend.NumColorBlends = 1;
+    pipelineParams.Subpass = (uint32_t)DeferredSubpassType::Overlay;
 
-      pipelineParams.InputAssembly.Topology =
-          VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    pipelineParams.DepthStencil.DepthTestEnable = true;
+    pipelineParams.DepthStencil.DepthWriteEnable = true;
+    pipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
+    pipelineParams.RenderPass = deferredRenderPass.Handle;
 
-      pipelineParams.Rasterizer.PolygonMode = VK_POLYGON_MODE_FILL;
-      pipelineParams.Rasterizer.CullMode = VK_CULL_MODE_BACK_BIT;
+    return createPipeline(renderer, pipelineParams);
+  };
 
-      pipelineParams.DepthStencil.DepthTestEnable = true;
-      pipelineParams.DepthStencil.DepthWriteEnable = true;
+  auto createTBNPipeline = [&](const ShaderPermutation &_permutation) {
+    PipelineParams tbnPipelineParams = {};
+    tbnPipelineParams.Name = "TBN";
+    tbnPipelineParams.Permutation = &_permutation;
+    const Shader *tbnShaders[] = {&gTBN.VertShader, &gTBN.GeomShader,
+                                  &gTBN.FragShader};
+
+    tbnPipelineParams.Shaders = tbnShaders;
+    tbnPipelineParams.NumShaders = std::size(tbnShaders);
+    tbnPipelineParams.InputAssembly.Topology =
+        VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+    auto bindings = Vertex::getBindingDescs();
+    auto attributes = Vertex::getAttributeDescs();
+    tbnPipelineParams.VertexInput.Bindings = bindings.data();
+    tbnPipelineParams.VertexInput.NumBindings = bindings.size();
+    tbnPipelineParams.VertexInput.Attributes = attributes.data();
+    tbnPipelineParams.VertexInput.NumAttributes = attributes.size();
+
+    tbnPipelineParams.RenderPass = deferredRenderPass.Handle;
+
+    tbnPipelineParams.Rasterizer.PolygonMode = VK_POLYGON_MODE_FILL;
+    tbnPipelineParams.Rasterizer.CullMode = VK_CULL_MODE_BACK_BIT;
+    tbnPipelineParams.Blend.NumColorBlends = 1;
+
+    tbnPipelineParams.Subpass = (uint32_t)DeferredSubpassType::Overlay;
+    tbnPipelineParams.DepthStencil.DepthTestEnable = true;
+    tbnPipelineParams.DepthStencil.DepthWriteEnable = false;
+    tbnPipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
+
+    return createPipeline(renderer, tbnPipelineParams);
+  };
 
-      pipelineParams.Blend.NumColorBlends = 1;
-      pipelineParams.Subpass = (uint32_t)DeferredSubpassType::Overlay;
+  auto createLightSourcesPipeline = [&](const ShaderPermutation &_permutation) {
+    PipelineParams pipelineParams = {};
+    pipelineParams.Name = "Light Sources";
+    pipelineParams.Permutation = &_permutation;
+    const Shader *shaders[] = {&gLightSources.VertShader,
+                               &gLightSources.FragShader};
+    pipelineParams.Shaders = shaders;
+    pipelineParams.NumShaders = std::size(shaders);
 
-      pipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
-      pipelineParams.RenderPass = deferredRenderPass.Handle;
+    auto bindings = LightSourceVertex::getBindingDescs();
+    auto attributes = LightSourceVertex::getAttributeDescs();
 
-      gLightSources.Pipeline = createPipeline(renderer, pipelineParams);
-    }
+    pipelineParams.VertexInput.Bindings = bindings.data();
+    pipelineParams.VertexInput.NumBindings = bindings.size();
+    pipelineParams.VertexInput.Attributes = attributes.data();
+    pipelineParams.VertexInput.NumAttributes = attributes.size();
 
-    // Buffer visualizer
-    {
-      const Shader *shaders[] = {&gBufferVisualize.VertShader,
-                                 &gBufferVisualize.FragShader};
-      PipelineParams pipelineParams = {};
-      pipelineParams.Shaders = shaders;
-      pipelineParams.NumShaders = std::size(shaders);
-
-      auto bindings = GizmoVertex::getBindingDescs();
-      auto attributes = GizmoVertex::getAttributeDescs();
-      pipelineParams.VertexInput.Bindings = bindings.data();
-      pipelineParams.VertexInput.NumBindings = bindings.size();
-      pipelineParams.VertexInput.Attributes = attributes.data();
-      pipelineParams.VertexInput.NumAttributes = attributes.size();
-
-      pipelineParams.InputAssembly.Topology =
-          VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-      pipelineParams.Viewport.Offset = {
-          0,
-          0,
-      };
-      pipelineParams.Viewport.Extent = {
-          (float)gBufferVisualize.ViewportExtent.width,
-          (float)gBufferVisualize.ViewportExtent.height};
-      pipelineParams.Viewport.ScissorOffset = {
-          (int)pipelineParams.Viewport.Offset.X,
-          (int)pipelineParams.Viewport.Offset.Y,
-      };
-      pipelineParams.Viewport.ScissorExtent = {
-          (int)gBufferVisualize.ViewportExtent.width,
-          (int)gBufferVisualize.ViewportExtent.height};
+    pipelineParams.InputAssembly.Topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
 
-      pipelineParams.Rasterizer.PolygonMode = VK_POLYGON_MODE_FILL;
-      pipelineParams.Rasterizer.CullMode = VK_CULL_MODE_BACK_BIT;
+    pipelineParams.Rasterizer.PolygonMode = VK_POLYGON_MODE_FILL;
+    pipelineParams.Rasterizer.CullMode = VK_CULL_MODE_BACK_BIT;
 
-      pipelineParams.Blend.NumColorBlends = 1;
-      pipelineParams.Subpass = (uint32_t)DeferredSubpassType::ForwardLighting;
+    pipelineParams.DepthStencil.DepthTestEnable = true;
+    pipelineParams.DepthStencil.DepthWriteEnable = true;
 
-      pipelineParams.DepthStencil.DepthTestEnable = false;
-      pipelineParams.DepthStencil.DepthWriteEnable = false;
-      pipelineParams.PipelineLayout = brdfPipelineParams.PipelineLayout;
-      pipelineParams.RenderPass = deferredRenderPass.Handle;
+    pipelineParams.Blend.NumColorBlends = 1;
+    pipelineParams.Subpass = (uint32_t)DeferredSubpassType::Overlay;
 
-      gBufferVisualize.Pipeline = createPipeline(renderer, pipelineParams);
-    }
+    pipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
+    pipelineParams.RenderPass = deferredRenderPass.Handle;
+
+    return createPipeline(renderer, pipelineParams);
   };
 
-  auto cleanupReloadableResources = [&] {
-    vkDestroyPipeline(renderer.Device, gLightSources.Pipeline, nullptr);
-    gLightSources.Pipeline = VK_NULL_HANDLE;
+  auto createBufferVisualizePipeline = [&](const ShaderPermutation &_permutation) {
+    const Shader *shaders[] = {&gBufferVisualize.VertShader,
+                               &gBufferVisualize.FragShader};
+    PipelineParams pipelineParams = {};
+    pipelineParams.Name = "Buffer Visualize";
+    pipelineParams.Permutation = &_permutation;
+    pipelineParams.Shaders = shaders;
+    pipelineParams.NumShaders = std::size(shaders);
 
-    vkDestroyPipeline(renderer.Device, gGizmo.Pipeline, nullptr);
-    gGizmo.Pipeline = VK_NULL_HANDLE;
+    auto bindings = GizmoVertex::getBindingDescs();
+    auto attributes = GizmoVertex::getAttributeDescs();
+    pipelineParams.VertexInput.Bindings = bindings.data();
+    pipelineParams.VertexInput.NumBindings = bindings.size();
+    pipelineParams.VertexInput.Attributes = attributes.data();
+    pipelineParams.VertexInput.NumAttributes = attributes.size();
 
-    vkDestroyPipeline(renderer.Device, gBufferVisualize.Pipeline, nullptr);
-    gBufferVisualize.Pipeline = VK_NULL_HANDLE;
+    pipelineParams.InputAssembly.Topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
 
-    vkDestroyPipeline(renderer.Device, gTBN.Pipeline, nullptr);
-    gTBN.Pipeline = VK_NULL_HANDLE;
+    pipelineParams.Rasterizer.PolygonMode = VK_POLYGON_MODE_FILL;
+    pipelineParams.Rasterizer.CullMode = VK_CULL_MODE_BACK_BIT;
 
-    destroyImage(renderer, hdrAttachmentImage);
-    for (Image &image : gbufferAttachmentImages) {
-      destroyImage(renderer, image);
+    pipelineParams.Blend.NumColorBlends = 1;
+    pipelineParams.Subpass = (uint32_t)DeferredSubpassType::Lighting;
+
+    pipelineParams.DepthStencil.DepthTestEnable = false;
+    pipelineParams.DepthStencil.DepthWriteEnable = false;
+    pipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
+    pipelineParams.RenderPass = deferredRenderPass.Handle;
+
+    return createPipeline(renderer, pipelineParams);
+  };
+
+  auto createLightVolumesPipeline = [&](const ShaderPermutation &_permutation) {
+    PipelineParams pipelineParams = {};
+    pipelineParams.Name = "Light Volumes";
+    pipelineParams.Permutation = &_permutation;
+    const Shader *shaders[] = {&gLightVolumes.VertShader,
+                               &gLightVolumes.FragShader};
+    pipelineParams.Shaders = shaders;
+    pipelineParams.NumShaders = std::size(shaders);
+
+    auto bindings = LightSourceVertex::getBindingDescs();
+    auto attributes = LightSourceVertex::getAttributeDescs();
+    pipelineParams.VertexInput.Bindings = bindings.data();
+    pipelineParams.VertexInput.NumBindings = bindings.size();
+    pipelineParams.VertexInput.Attributes = attributes.data();
+    pipelineParams.VertexInput.NumAttributes = attributes.size();
+
+    pipelineParams.InputAssembly.Topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+    // Back faces stay in view when the camera is inside the volume. Which
+    // pixels the light reaches in depth is left to the depth bounds test, and
+    // to the falloff where it isn't supported.
+    pipelineParams.Rasterizer.PolygonMode = VK_POLYGON_MODE_FILL;
+    pipelineParams.Rasterizer.CullMode = VK_CULL_MODE_FRONT_BIT;
+
+    pipelineParams.DepthStencil.DepthTestEnable = false;
+    pipelineParams.DepthStencil.DepthWriteEnable = false;
+    pipelineParams.DepthStencil.DepthBoundsTestEnable =
+        gLightVolumes.UseDepthBounds;
+
+    pipelineParams.Blend.NumColorBlends = 1;
+    pipelineParams.Blend.Additive = true;
+    pipelineParams.Subpass = (uint32_t)DeferredSubpassType::Lighting;
+
+    pipelineParams.PipelineLayout = gStandardPipelineLayout.Handle;
+    pipelineParams.RenderPass = deferredRenderPass.Handle;
+
+    return createPipeline(renderer, pipelineParams);
+  };
+
+  ReloadablePipeline reloadablePipelines[] = {
+      {"Depth Pre-Pass",
+       {&gBufferVertShader},
+       createDepthPrepassPipeline,
+       &depthPrepassPipeline},
+      {"Forward Depth Pre-Pass",
+       {&forwardBrdfVertShader},
+       createForwardDepthPrepassPipeline,
+       &forwardDepthPrepassPipeline},
+      {"Forward",
+       {&forwardBrdfVertShader, &forwardBrdfFragShader},
+       createForwardPipeline,
+       &forwardPipeline},
+      {"GBuffer",
+       {&gBufferVertShader, &gBufferFragShader},
+       createGBufferPipeline,
+       &gBufferPipeline},
+      {"BRDF",
+       {&brdfVertShader, &brdfFragShader},
+       createBRDFPipeline,
+       &brdfPipeline},
+      {"HDR Tone Mapping",
+       {&hdrToneMappingVertShader, &hdrToneMappingFragShader},
+       createHDRToneMappingPipeline,
+       &hdrToneMappingPipeline},
+      {"Gizmo",
+       {&gGizmo.VertShader, &gGizmo.FragShader},
+       createGizmoPipeline,
+       &gGizmo.Pipeline},
+      {"TBN",
+       {&gTBN.VertShader, &gTBN.GeomShader, &gTBN.FragShader},
+       createTBNPipeline,
+       &gTBN.Pipeline},
+      {"Light Sources",
+       {&gLightSources.VertShader, &gLightSources.FragShader},
+       createLightSourcesPipeline,
+       &gLightSources.Pipeline},
+      {"Buffer Visualize",
+       {&gBufferVisualize.VertShader, &gBufferVisualize.FragShader},
+       createBufferVisualizePipeline,
+       &gBufferVisualize.Pipeline},
+      {"Light Volumes",
+       {&gLightVolumes.VertShader, &gLightVolumes.FragShader},
+       createLightVolumesPipeline,
+       &gLightVolumes.Pipeline},
+  };
+
+  // Every pipeline is independent of the others, so they are compiled on the
+  // thread pool. Rebuilds every variant built so far.
+  auto createPipelines = [&] {
+    TaskGraph *pipelineGraph = createTaskGraph(*threadPool);
+    for (ReloadablePipeline &pipeline : reloadablePipelines) {
+      for (auto &[key, variant] : pipeline.Variants) {
+        addTask(*pipelineGraph,
+                fmt::format("Pipeline {} ({})", pipeline.Name,
+                            getShaderPermutationName(variant.Permutation)),
+                [&pipeline, &variant = variant] {
+                  variant.Handle = pipeline.Create(variant.Permutation);
+                });
+      }
     }
+    runTaskGraph(*pipelineGraph);
+    destroyTaskGraph(pipelineGraph);
+    mergeThreadPipelineCaches(renderer, *renderer.PipelineCache);
+  };
 
-    for (VkFramebuffer fb : deferredFramebuffers) {
-      vkDestroyFramebuffer(renderer.Device, fb, nullptr);
+  // The variants are kept so that createPipelines() rebuilds them.
+  auto destroyPipelines = [&] {
+    for (ReloadablePipeline &pipeline : reloadablePipelines) {
+      for (auto &[key, variant] : pipeline.Variants) {
+        vkDestroyPipeline(renderer.Device, variant.Handle, nullptr);
+        variant.Handle = VK_NULL_HANDLE;
+      }
+      *pipeline.Handle = VK_NULL_HANDLE;
     }
-    deferredFramebuffers.clear();
+  };
 
-    vkDestroyPipeline(renderer.Device, hdrToneMappingPipeline, nullptr);
-    vkDestroyPipeline(renderer.Device, forwardPipeline, nullptr);
-    vkDestroyPipeline(renderer.Device, gBufferPipeline, nullptr);
-    vkDestroyPipeline(renderer.Device, brdfPipeline, nullptr);
+  // Recreates the swap chain, the attachments and the framebuffers. The render
+  // pass and the pipelines are kept unless the new swap chain has different
+  // formats, or the attachments alias differently than before. Returns whether
+  // they were kept.
+  auto resizeRenderTargets = [&] {
+    destroySizedRenderTargets();
+
+    SwapChain oldSwapChain = swapChain;
+    swapChain = createSwapChain(renderer, width, height, &oldSwapChain);
+    // destroySwapChain() clears the old swap chain, so compare before that.
+    bool isSwapChainCompatible =
+        (swapChain.ColorFormat == oldSwapChain.ColorFormat) &&
+        (swapChain.DepthFormat == oldSwapChain.DepthFormat) &&
+        (swapChain.NumColorSamples == oldSwapChain.NumColorSamples) &&
+        (swapChain.NumDepthSamples == oldSwapChain.NumDepthSamples);
+    destroySwapChain(renderer, oldSwapChain);
+
+    bool oldMayAttachmentsAlias[std::size(mayAttachmentsAlias)];
+    std::copy(std::begin(mayAttachmentsAlias), std::end(mayAttachmentsAlias),
+              oldMayAttachmentsAlias);
+    createAttachmentImages();
+
+    bool isRenderPassCompatible =
+        isSwapChainCompatible &&
+        std::equal(std::begin(mayAttachmentsAlias),
+                   std::end(mayAttachmentsAlias), oldMayAttachmentsAlias);
+    if (!isRenderPassCompatible) {
+      BB_LOG_INFO("Render pass changed on resize, rebuilding pipelines");
+      destroyPipelines();
+      vkDestroyRenderPass(renderer.Device, depthPrepassRenderPass.Handle,
+                          nullptr);
+      vkDestroyRenderPass(renderer.Device, deferredRenderPass.Handle, nullptr);
+      createDepthPrepassRenderPass();
+      createDeferredRenderPass();
+      createPipelines();
+    }
+
+    createDeferredFramebuffers();
+    return isRenderPassCompatible;
+  };
 
-    forwardPipeline = VK_NULL_HANDLE;
-    gBufferPipeline = VK_NULL_HANDLE;
-    brdfPipeline = VK_NULL_HANDLE;
+  auto cleanupRenderTargets = [&] {
+    destroyPipelines();
+    destroySizedRenderTargets();
 
+    vkDestroyRenderPass(renderer.Device, depthPrepassRenderPass.Handle,
+                        nullptr);
+    depthPrepassRenderPass.Handle = VK_NULL_HANDLE;
     vkDestroyRenderPass(renderer.Device, deferredRenderPass.Handle, nullptr);
     deferredRenderPass.Handle = VK_NULL_HANDLE;
 
     destroySwapChain(renderer, swapChain);
   };
 
-  initReloadableResources();
+  Task *renderTargetsTask =
+      addTask(*startupGraph, "Render targets", initRenderTargets);
+
+  // Only the full permutation is built up front; it renders anything, so the
+  // smaller variants are built once a frame asks for them.
+  for (ReloadablePipeline &pipeline : reloadablePipelines) {
+    addTask(
+        *startupGraph, fmt::format("Pipeline {}", pipeline.Name),
+        [&pipeline] {
+          for (const Shader *shader : pipeline.Shaders) {
+            pipeline.SpecConstantMask |= shader->Reflection.SpecConstantMask;
+          }
+          PipelineVariant variant = {};
+          variant.Permutation = maskShaderPermutation(
+              getFullShaderPermutation(), pipeline.SpecConstantMask);
+          variant.Handle = pipeline.Create(variant.Permutation);
+          pipeline.Variants[getShaderPermutationKey(variant.Permutation)] =
+              variant;
+          *pipeline.Handle = variant.Handle;
+        },
+        {renderTargetsTask, standardPipelineLayoutTask});
+  }
 
-  std::vector<LightSourceVertex> lightSourceVertices;
-  std::vector<uint32_t> lightSourceIndices;
-  {
-    std::vector<Vertex> sphereVertices;
-    generateUVSphereMesh(sphereVertices, lightSourceIndices, 0.1f, 16, 16);
-    lightSourceVertices.reserve(sphereVertices.size());
-    for (const Vertex &v : sphereVertices) {
-      lightSourceVertices.push_back({v.Pos});
+  addTask(*startupGraph, "Light source buffers", [&] {
+    std::vector<LightSourceVertex> lightSourceVertices;
+    std::vector<uint32_t> lightSourceIndices;
+    {
+      std::vector<Vertex> sphereVertices;
+      generateUVSphereMesh(sphereVertices, lightSourceIndices, 0.1f, 16, 16);
+      lightSourceVertices.reserve(sphereVertices.size());
+      for (const Vertex &v : sphereVertices) {
+        lightSourceVertices.push_back({v.Pos});
+      }
     }
-  }
 
-  gLightSources.VertexBuffer = createDeviceLocalBufferFromMemory(
-      renderer, transientCmdPool, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-      sizeBytes32(lightSourceVertices), lightSourceVertices.data());
-  gLightSources.IndexBuffer = createDeviceLocalBufferFromMemory(
-      renderer, transientCmdPool, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-      sizeBytes32(lightSourceIndices), lightSourceIndices.data());
-  gLightSources.NumIndices = lightSourceIndices.size();
-
-  gLightSources.InstanceBuffer = createBuffer(
-      renderer, sizeof(int) * MAX_NUM_LIGHTS, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
-          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-
-  gGizmo.VertexBuffer = createDeviceLocalBufferFromMemory(
-      renderer, transientCmdPool, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-      sizeBytes32(gizmoVertices), gizmoVertices.data());
-  gGizmo.IndexBuffer = createDeviceLocalBufferFromMemory(
-      renderer, transientCmdPool, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-      sizeBytes32(gizmoIndices), gizmoIndices.data());
-  gGizmo.NumIndices = gizmoIndices.size();
+    gLightSources.VertexBuffer = createDeviceLocalBufferFromMemory(
+        renderer, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+        sizeBytes32(lightSourceVertices), lightSourceVertices.data());
+    gLightSources.IndexBuffer = createDeviceLocalBufferFromMemory(
+        renderer, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+        sizeBytes32(lightSourceIndices), lightSourceIndices.data());
+    gLightSources.NumIndices = lightSourceIndices.size();
+
+    std::vector<Vertex> coneVertices;
+    std::vector<uint32_t> coneIndices;
+    generateConeMesh(coneVertices, coneIndices);
+    std::vector<LightSourceVertex> lightVolumeVertices;
+    lightVolumeVertices.reserve(coneVertices.size());
+    for (const Vertex &v : coneVertices) {
+      lightVolumeVertices.push_back({v.Pos});
+    }
+    gLightVolumes.ConeVertexBuffer = createDeviceLocalBufferFromMemory(
+        renderer, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+        sizeBytes32(lightVolumeVertices), lightVolumeVertices.data());
+    gLightVolumes.ConeIndexBuffer = createDeviceLocalBufferFromMemory(
+        renderer, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, sizeBytes32(coneIndices),
+        coneIndices.data());
+    gLightVolumes.NumConeIndices = coneIndices.size();
+  });
+
+  addTask(
+      *startupGraph, "Gizmo buffers",
+      [&] {
+        gGizmo.VertexBuffer = createDeviceLocalBufferFromMemory(
+            renderer, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+            sizeBytes32(gizmoVertices), gizmoVertices.data());
+        gGizmo.IndexBuffer = createDeviceLocalBufferFromMemory(
+            renderer, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+            sizeBytes32(gizmoIndices), gizmoIndices.data());
+        gGizmo.NumIndices = gizmoIndices.size();
+      },
+      {gizmoMeshTask});
+
+  runTaskGraph(*startupGraph);
+  printTaskGraphReport(*startupGraph, "Startup");
+  mergeThreadPipelineCaches(renderer, *renderer.PipelineCache);
+  PipelineCreationStats startupPipelineStats =
+      takePipelineCreationStats(*renderer.PipelineCache);
+  PipelineCreationStats resizePipelineStats = {};
+  float lastResizeTime = 0.f;
+  printPipelineCreationReport(*renderer.PipelineCache, startupPipelineStats,
+                              "Startup pipelines");
+  destroyTaskGraph(startupGraph);
+  destroyImageLoader(materialImageLoader);
+
+  // Shader hot reload. Affected pipelines are rebuilt on the reloader's thread
+  // while the old ones keep rendering, then swapped in between frames.
+  // pipelineBuildMutex guards the shaders and anything pipeline creation reads.
+  // pipelineVariantsMutex guards adding variants and pipelineGeneration, which
+  // changes whenever the shaders or the render pass do. Locks are taken in the
+  // order they are declared.
+  std::mutex pipelineBuildMutex;
+  std::mutex pipelineVariantsMutex;
+  std::mutex pipelineSwapMutex;
+  std::vector<PipelineSwap> pendingPipelineSwaps;
+  std::vector<RetiredPipeline> retiredPipelines;
+  uint64_t pipelineGeneration = 0;
+  uint64_t frameNumber = 0;
+  // Registered under pipelineBuildMutex once they are created.
+  std::vector<ReloadableComputePipeline> reloadableComputePipelines;
+
+  // Variants are compiled one at a time on a thread of their own. Not on the
+  // shared pool: its jobs can run on threads that already hold
+  // pipelineBuildMutex while they wait for a task graph.
+  ThreadPool *pipelineCompilePool = createThreadPool(1);
+  std::vector<CompiledPipelineVariant> compiledPipelineVariants;
+  bool compileVariantsAsync = true;
+  PipelineVariantStats variantStats = {};
+
+  auto reloadShaders = [&](const std::vector<std::string> &_spvFileNames) {
+    std::scoped_lock buildLock(pipelineBuildMutex);
+    Time reloadStartTime = getCurrentTime();
+
+    std::vector<const Shader *> reloadedShaders;
+    for (const std::string &fileName : _spvFileNames) {
+      auto found = shadersByFileName.find(fileName);
+      if (found == shadersByFileName.end()) {
+        continue;
+      }
+
+      Shader &shader = *found->second;
+      Shader newShader = createShaderFromFile(renderer, fileName);
+      // The layouts of compute pipelines are made for their own shader.
+      const ShaderReflection &layoutReflection =
+          endsWith(fileName, ".comp.spv") ? shader.Reflection
+                                          : gStandardPipelineLayout.Reflection;
+      if (!isShaderReflectionSubset(newShader.Reflection, layoutReflection)) {
+        BB_LOG_WARNING("{} changed its resource bindings, restart to apply it",
+                       fileName);
+        destroyShader(renderer, newShader);
+        continue;
+      }
+      // Pipeline variants are keyed by the constants their shaders had at
+      // startup.
+      if ((newShader.Reflection.SpecConstantMask &
+           ~shader.Reflection.SpecConstantMask) != 0) {
+        BB_LOG_WARNING("{} added specialization constants, restart to apply "
+                       "it",
+                       fileName);
+        destroyShader(renderer, newShader);
+        continue;
+      }
+
+      // Pipelines don't need the module they were created from anymore.
+      destroyShader(renderer, shader);
+      shader = newShader;
+      reloadedShaders.push_back(&shader);
+    }
+
+    std::vector<PipelineSwap> swaps;
+    std::vector<std::pair<ReloadablePipeline *, PipelineVariant *>> rebuilds;
+    // Only held while the variants are collected; the render thread adds
+    // variants under it every frame. Variants are never removed and pointers
+    // to them survive inserts, so they are rebuilt without it.
+    {
+      std::scoped_lock variantsLock(pipelineVariantsMutex);
+      if (!reloadedShaders.empty()) {
+        ++pipelineGeneration;
+      }
+      for (ReloadablePipeline &pipeline : reloadablePipelines) {
+        bool isAffected = std::any_of(
+            pipeline.Shaders.begin(), pipeline.Shaders.end(),
+            [&reloadedShaders](const Shader *_shader) {
+              return std::find(reloadedShaders.begin(), reloadedShaders.end(),
+                               _shader) != reloadedShaders.end();
+            });
+        if (isAffected) {
+          for (auto &[key, variant] : pipeline.Variants) {
+            swaps.push_back({&variant.Handle, VK_NULL_HANDLE});
+            rebuilds.push_back({&pipeline, &variant});
+          }
+        }
+      }
+    }
+
+    TaskGraph *reloadGraph = createTaskGraph(*threadPool);
+    for (size_t i = 0; i < swaps.size(); ++i) {
+      auto [pipeline, variant] = rebuilds[i];
+      PipelineSwap &swap = swaps[i];
+      addTask(*reloadGraph,
+              fmt::format("Pipeline {} ({})", pipeline->Name,
+                          getShaderPermutationName(variant->Permutation)),
+              [&swap, pipeline = pipeline, variant = variant] {
+                swap.NewPipeline = pipeline->Create(variant->Permutation);
+              });
+    }
+    runTaskGraph(*reloadGraph);
+    destroyTaskGraph(reloadGraph);
+
+    for (const ReloadableComputePipeline &pipeline :
+         reloadableComputePipelines) {
+      if (std::find(reloadedShaders.begin(), reloadedShaders.end(),
+                    pipeline.ComputeShader) != reloadedShaders.end()) {
+        swaps.push_back({pipeline.Handle,
+                         createComputePipeline(renderer, pipeline.Name,
+                                               *pipeline.ComputeShader,
+                                               pipeline.Layout)});
+      }
+    }
+
+    mergeThreadPipelineCaches(renderer, *renderer.PipelineCache);
+    PipelineCreationStats reloadStats =
+        takePipelineCreationStats(*renderer.PipelineCache);
+
+    {
+      std::scoped_lock swapLock(pipelineSwapMutex);
+      pendingPipelineSwaps.insert(pendingPipelineSwaps.end(), swaps.begin(),
+                                  swaps.end());
+    }
+
+    BB_LOG_INFO("Reloaded {} shaders and {} pipelines in {:.2f} ms",
+                reloadedShaders.size(), reloadStats.NumPipelines,
+                getElapsedTimeInSeconds(reloadStartTime, getCurrentTime()) *
+                    1000.f);
+  };
+
+  auto destroyRetiredPipelines = [&](bool _isDeviceIdle) {
+    // A pipeline retired before frame N was last recorded into frame N - 1,
+    // which is certainly done once frame N - 1 + numFrames is about to start.
+    auto firstDone = std::stable_partition(
+        retiredPipelines.begin(), retiredPipelines.end(),
+        [&](const RetiredPipeline &_retired) {
+          return !_isDeviceIdle &&
+                 (frameNumber - _retired.RetiredFrameNumber < numFrames);
+        });
+    for (auto it = firstDone; it != retiredPipelines.end(); ++it) {
+      vkDestroyPipeline(renderer.Device, it->Handle, nullptr);
+    }
+    retiredPipelines.erase(firstDone, retiredPipelines.end());
+  };
+
+  auto discardPendingPipelineSwaps = [&] {
+    std::scoped_lock swapLock(pipelineSwapMutex);
+    for (const PipelineSwap &swap : pendingPipelineSwaps) {
+      vkDestroyPipeline(renderer.Device, swap.NewPipeline, nullptr);
+    }
+    pendingPipelineSwaps.clear();
+  };
+
+  // Called at the frame boundary, after waiting for the frame's fence.
+  auto applyPipelineSwaps = [&] {
+    {
+      std::scoped_lock swapLock(pipelineSwapMutex);
+      for (const PipelineSwap &swap : pendingPipelineSwaps) {
+        retiredPipelines.push_back({*swap.Handle, frameNumber});
+        *swap.Handle = swap.NewPipeline;
+      }
+      pendingPipelineSwaps.clear();
+    }
+
+    destroyRetiredPipelines(false);
+  };
+
+  // Builds the variant on the render thread, which stalls the frame.
+  auto buildPipelineVariant = [&](ReloadablePipeline &_pipeline, uint64_t _key,
+                                  const ShaderPermutation &_permutation) {
+    std::scoped_lock buildLock(pipelineBuildMutex);
+    PipelineVariant variant = {};
+    variant.Permutation = _permutation;
+    variant.Handle = _pipeline.Create(_permutation);
+
+    std::scoped_lock variantsLock(pipelineVariantsMutex);
+    return _pipeline.Variants.emplace(_key, variant).first;
+  };
+
+  auto compilePipelineVariantAsync = [&](ReloadablePipeline &_pipeline,
+                                         uint64_t _key,
+                                         const ShaderPermutation &_permutation) {
+    Time requestTime = getCurrentTime();
+    enqueueJob(*pipelineCompilePool, [&, pipeline = &_pipeline, _key,
+                                      _permutation, requestTime] {
+      CompiledPipelineVariant compiled = {};
+      compiled.Pipeline = pipeline;
+      compiled.Key = _key;
+      compiled.RequestTime = requestTime;
+      {
+        std::scoped_lock buildLock(pipelineBuildMutex);
+        compiled.Variant.Permutation = _permutation;
+        compiled.Variant.Handle = pipeline->Create(_permutation);
+        compiled.Generation = pipelineGeneration;
+      }
+
+      std::scoped_lock swapLock(pipelineSwapMutex);
+      compiledPipelineVariants.push_back(compiled);
+    });
+  };
+
+  // Called at the frame boundary. Variants that went stale while compiling are
+  // dropped, and compiled again if they are still needed.
+  auto addCompiledPipelineVariants = [&] {
+    std::vector<CompiledPipelineVariant> compiledVariants;
+    {
+      std::scoped_lock swapLock(pipelineSwapMutex);
+      compiledVariants.swap(compiledPipelineVariants);
+    }
+
+    for (const CompiledPipelineVariant &compiled : compiledVariants) {
+      ReloadablePipeline &pipeline = *compiled.Pipeline;
+      pipeline.CompilingVariants.erase(compiled.Key);
+
+      bool isAdded = false;
+      {
+        std::scoped_lock variantsLock(pipelineVariantsMutex);
+        // The variant may also have been built on the render thread meanwhile.
+        if (compiled.Generation == pipelineGeneration) {
+          isAdded =
+              pipeline.Variants.emplace(compiled.Key, compiled.Variant).second;
+        }
+      }
+      if (!isAdded) {
+        vkDestroyPipeline(renderer.Device, compiled.Variant.Handle, nullptr);
+        continue;
+      }
+
+      float timeToSpecialized =
+          getElapsedTimeInSeconds(compiled.RequestTime, getCurrentTime());
+      ++variantStats.NumAsyncVariants;
+      variantStats.LastTimeToSpecialized = timeToSpecialized;
+      variantStats.MaxTimeToSpecialized =
+          std::max(variantStats.MaxTimeToSpecialized, timeToSpecialized);
+      variantStats.TotalTimeToSpecialized += timeToSpecialized;
+      BB_LOG_INFO("{} variant ({}) ready after {:.2f} ms", pipeline.Name,
+                  getShaderPermutationName(compiled.Variant.Permutation),
+                  timeToSpecialized * 1000.f);
+    }
+  };
+
+  // Only while the device is idle.
+  auto destroyCompiledPipelineVariants = [&] {
+    std::scoped_lock swapLock(pipelineSwapMutex);
+    for (const CompiledPipelineVariant &compiled : compiledPipelineVariants) {
+      vkDestroyPipeline(renderer.Device, compiled.Variant.Handle, nullptr);
+    }
+    compiledPipelineVariants.clear();
+  };
+
+  // Points every pipeline at its variant for _permutation. A variant that
+  // hasn't been needed before is either compiled in the background while the
+  // full permutation, which renders everything, stands in for it, or built
+  // right away.
+  auto selectPipelineVariants = [&](const ShaderPermutation &_permutation) {
+    Time hitchStartTime = getCurrentTime();
+    bool isHitch = false;
+
+    for (ReloadablePipeline &pipeline : reloadablePipelines) {
+      ShaderPermutation permutation =
+          maskShaderPermutation(_permutation, pipeline.SpecConstantMask);
+      uint64_t key = getShaderPermutationKey(permutation);
+
+      auto found = pipeline.Variants.find(key);
+      if (found == pipeline.Variants.end()) {
+        if (compileVariantsAsync) {
+          if (pipeline.CompilingVariants.insert(key).second) {
+            compilePipelineVariantAsync(pipeline, key, permutation);
+          }
+          found = pipeline.Variants.find(getShaderPermutationKey(
+              maskShaderPermutation(getFullShaderPermutation(),
+                                    pipeline.SpecConstantMask)));
+          BB_ASSERT(found != pipeline.Variants.end());
+          ++variantStats.NumFallbackDraws;
+        } else {
+          found = buildPipelineVariant(pipeline, key, permutation);
+          isHitch = true;
+        }
+      }
+      *pipeline.Handle = found->second.Handle;
+    }
+
+    if (isHitch) {
+      float hitchTime =
+          getElapsedTimeInSeconds(hitchStartTime, getCurrentTime());
+      ++variantStats.NumHitches;
+      variantStats.TotalHitchTime += hitchTime;
+      variantStats.MaxHitchTime = std::max(variantStats.MaxHitchTime, hitchTime);
+      BB_LOG_WARNING("Frame waited {:.2f} ms for pipeline variants",
+                     hitchTime * 1000.f);
+    }
+  };
+
+  ShaderReloader *shaderReloader =
+      createShaderReloader(createShaderPath(""), reloadShaders);
+
+  // Create a descriptor pool corresponding to the standard pipeline layout
+  VkDescriptorPool standardDescriptorPool = createStandardDescriptorPool(
+      renderer, gStandardPipelineLayout,
+      {numFrames, 1, (uint32_t)materialSet.Materials.size(), 1});
 
   // Imgui descriptor pool and descriptor sets
   VkDescriptorPool imguiDescriptorPool = {};
@@ -1005,17 +2053,44 @@ int main(int _argc, char **_argv) {
                                         &imguiDescriptorPool));
   }
 
+  FrameRing frameRing =
+      createFrameRing(renderer, defaultFrameRingSegmentSize, numFrames);
+
   std::vector<Frame> frames;
   for (int i = 0; i < numFrames; ++i) {
     VkImageView gbufferAttachments[numGBufferAttachments] = {};
     for (uint32_t i = 0; i < numGBufferAttachments; ++i) {
       gbufferAttachments[i] = gbufferAttachmentImages[i].View;
     }
-    frames.push_back(createFrame(renderer, gStandardPipelineLayout,
-                                 standardDescriptorPool, materialSet,
-                                 gbufferAttachments, hdrAttachmentImage.View));
+    frames.push_back(createFrame(
+        renderer, gStandardPipelineLayout, standardDescriptorPool, materialSet,
+        gbufferAttachments, hdrAttachmentImage.View, swapChain.DepthImageView,
+        frameRing.RingBuffer.Handle));
+    frames.back().Index = (uint32_t)i;
   }
 
+  LightBuffer *lightBuffer = createLightBuffer(renderer);
+  LightClusters *lightClusters = createLightClusters(renderer);
+  for (const Frame &frame : frames) {
+    linkLightClustersToDescriptorSet(renderer, *lightClusters, frame);
+  }
+  GPUCulling *culling = createGPUCulling(renderer, cullInstancesShader);
+  commonSceneResources.Culling = culling;
+  DepthPyramid *depthPyramid = createDepthPyramid(renderer, depthPyramidShader);
+  resizeDepthPyramid(renderer, *depthPyramid, swapChain.Extent,
+                     swapChain.DepthImageView);
+  linkDepthPyramidToGPUCulling(renderer, *culling, *depthPyramid);
+  {
+    std::scoped_lock buildLock(pipelineBuildMutex);
+    reloadableComputePipelines.push_back(
+        {"Cull Instances", &cullInstancesShader, culling->PipelineLayout,
+         &culling->Pipeline});
+    reloadableComputePipelines.push_back(
+        {"Depth Pyramid", &depthPyramidShader, depthPyramid->PipelineLayout,
+         &depthPyramid->Pipeline});
+  }
+  int numStressTestLights = 0;
+
   std::vector<FrameSync> frameSyncObjects;
   for (int i = 0; i < numFrames; ++i) {
     FrameSync syncObject = {};
@@ -1040,33 +2115,60 @@ int main(int _argc, char **_argv) {
   // Important : You need to delete every cmd used by swapchain
   // through queue. Dont forget to add it here too when you add another cmd.
   auto onWindowResize = [&] {
-    int width = 0, height = 0;
+    int newWidth = 0, newHeight = 0;
 
     if (SDL_GetWindowFlags(window) & SDL_WINDOW_MINIMIZED)
       SDL_WaitEvent(nullptr);
 
-    SDL_GetWindowSize(window, &width, &height);
-    if (width == 0 || height == 0)
+    SDL_GetWindowSize(window, &newWidth, &newHeight);
+    if (newWidth == 0 || newHeight == 0)
       return;
+    width = newWidth;
+    height = newHeight;
+
+    Time resizeStartTime = getCurrentTime();
 
-    vkDeviceWaitIdle(
-        renderer.Device); // Ensure that device finished using swap chain.
+    waitForDeviceIdle(
+        renderer); // Ensure that device finished using swap chain.
 
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(
         renderer.PhysicalDevice, renderer.Surface,
         &renderer.SwapChainSupportDetails.Capabilities);
 
-    cleanupReloadableResources();
-    initReloadableResources();
+    {
+      std::scoped_lock buildLock(pipelineBuildMutex);
+      destroyRetiredPipelines(true);
+      if (!resizeRenderTargets()) {
+        // Every pipeline was just rebuilt from the current shaders, against
+        // the new render pass the pending ones weren't built for.
+        discardPendingPipelineSwaps();
+        std::scoped_lock variantsLock(pipelineVariantsMutex);
+        ++pipelineGeneration;
+      }
+    }
+    resizePipelineStats = takePipelineCreationStats(*renderer.PipelineCache);
+    if (resizePipelineStats.NumPipelines > 0) {
+      printPipelineCreationReport(*renderer.PipelineCache, resizePipelineStats,
+                                  "Resize pipelines");
+    }
 
     for (Frame &frame : frames) {
       VkImageView gbufferAttachments[numGBufferAttachments] = {};
       for (uint32_t i = 0; i < numGBufferAttachments; ++i) {
         gbufferAttachments[i] = gbufferAttachmentImages[i].View;
       }
-      linkExternalAttachmentsToDescriptorSet(
-          renderer, frame, gbufferAttachments, hdrAttachmentImage.View);
+      linkExternalAttachmentsToDescriptorSet(renderer, frame,
+                                             gbufferAttachments,
+                                             hdrAttachmentImage.View,
+                                             swapChain.DepthImageView);
     }
+    resizeDepthPyramid(renderer, *depthPyramid, swapChain.Extent,
+                       swapChain.DepthImageView);
+    linkDepthPyramidToGPUCulling(renderer, *culling, *depthPyramid);
+
+    lastResizeTime = getElapsedTimeInSeconds(resizeStartTime, getCurrentTime());
+    BB_LOG_INFO("Resized to {}x{} in {:.2f} ms", swapChain.Extent.width,
+                swapChain.Extent.height, lastResizeTime * 1000.f);
   };
 
   uint32_t currentFrameIndex = 0;
@@ -1085,7 +2187,7 @@ int main(int _argc, char **_argv) {
   initInfo.Device = renderer.Device;
   initInfo.QueueFamily = renderer.QueueFamilyIndex;
   initInfo.Queue = renderer.Queue;
-  initInfo.PipelineCache = nullptr;
+  initInfo.PipelineCache = renderer.PipelineCache->Handle;
   initInfo.DescriptorPool = imguiDescriptorPool;
   initInfo.Allocator = nullptr;
   initInfo.MinImageCount = numFrames;
@@ -1114,16 +2216,20 @@ int main(int _argc, char **_argv) {
     endInfo.commandBufferCount = 1;
     endInfo.pCommandBuffers = &cmdBuffer;
     BB_VK_ASSERT(vkEndCommandBuffer(cmdBuffer));
-    BB_VK_ASSERT(vkQueueSubmit(renderer.Queue, 1, &endInfo, VK_NULL_HANDLE));
-    BB_VK_ASSERT(vkQueueWaitIdle(renderer.Queue));
+    submitToQueue(renderer, endInfo, VK_NULL_HANDLE);
+    waitForDeviceIdle(renderer);
 
     ImGui_ImplVulkan_DestroyFontUploadObjects();
   }
 
+  gPlaceholderScene = new PlaceholderScene(&commonSceneResources);
+
   FreeLookCamera cam = {};
   Input input = {};
 
   bool running = true;
+  bool isFirstFrame = true;
+  ShaderPermutation currentPermutation = getFullShaderPermutation();
 
   Time lastTime = getCurrentTime();
 
@@ -1155,33 +2261,32 @@ int main(int _argc, char **_argv) {
     ImGui::NewFrame();
 
     if (ImGui::Begin("Scene")) {
-      if (ImGui::BeginCombo("Select Scene", gSceneLabels[gCurrentSceneType])) {
+      if (ImGui::BeginCombo("Select Scene",
+                            gSceneLabels[gRequestedSceneType])) {
 
         for (SceneType sceneType : AllEnums<SceneType>) {
           if (ImGui::Selectable(gSceneLabels[sceneType],
-                                sceneType == gCurrentSceneType)) {
+                                sceneType == gRequestedSceneType)) {
 
-            gCurrentSceneType = sceneType;
+            gRequestedSceneType = sceneType;
             ImGui::SetItemDefaultFocus();
           }
         }
         ImGui::EndCombo();
       }
-    }
-    ImGui::End();
 
-    if (!gScenes[gCurrentSceneType]) {
-      switch (gCurrentSceneType) {
-      case SceneType::Triangle:
-        gScenes[gCurrentSceneType] = new TriangleScene(&commonSceneResources);
-        break;
-      case SceneType::ShaderBalls:
-        gScenes[gCurrentSceneType] = new ShaderBallScene(&commonSceneResources);
-        break;
+      if (gSceneLoadState) {
+        std::string loadingLabel =
+            fmt::format("Loading {}", gSceneLabels[gLoadingSceneType]);
+        ImGui::ProgressBar(gSceneLoadState->Progress, ImVec2(-1, 0),
+                           loadingLabel.c_str());
       }
     }
+    ImGui::End();
 
-    SceneBase *currentScene = gScenes[gCurrentSceneType];
+    updateSceneLoad(*threadPool, &commonSceneResources);
+
+    SceneBase *currentScene = getCurrentScene();
 
     if (ImGui::Begin("Render Setting")) {
       EnumArray<RenderPassType, const char *> renderPassOptionLabels = {
@@ -1261,6 +2366,10 @@ int main(int _argc, char **_argv) {
         dt;
     cam.Pos += camMovement;
 
+    // Nothing the GPU reads is touched here, so this runs before waiting for
+    // the frame slot and overlaps with the frames still in flight.
+    currentScene->updateScene(dt);
+
     Frame &currentFrame = frames[currentFrameIndex];
     const FrameSync &frameSyncObject = frameSyncObjects[currentFrameIndex];
 
@@ -1278,20 +2387,35 @@ int main(int _argc, char **_argv) {
                     VK_TRUE, UINT64_MAX);
     vkResetFences(renderer.Device, 1, &frameSyncObject.FrameAvailableFence);
 
+    applyPipelineSwaps();
+    addCompiledPipelineVariants();
+    ++frameNumber;
+
+    // The GPU is done with everything this frame wrote into the ring last time.
+    beginFrameRingSegment(frameRing, currentFrameIndex);
+    beginGPUCulling(*culling, currentFrame);
+
+    ViewUniformBlock viewUniformBlock = {};
+    viewUniformBlock.ViewMat = cam.getViewMatrix();
+    viewUniformBlock.ProjMat =
+        Mat4::perspective(cameraFovYDegrees, (float)width / (float)height,
+                          cameraNearZ, cameraFarZ);
+    Mat4 viewProjMat = viewUniformBlock.ProjMat * viewUniformBlock.ViewMat;
+    viewUniformBlock.InvViewProjMat = viewProjMat.inverse();
+    viewUniformBlock.ViewPos = cam.Pos;
+    setGPUCullingView(*culling, viewUniformBlock.ViewMat,
+                      viewUniformBlock.ProjMat, cameraNearZ);
+
+    // The scene hands over only the instances in view.
+    currentScene->cullScene();
+    currentScene->writeFrameData(currentFrame);
+
     VkFramebuffer currentDeferredFramebuffer =
         deferredFramebuffers[currentSwapChainImageIndex];
 
     currentFrameIndex = (currentFrameIndex + 1) % (uint32_t)frames.size();
 
-    currentScene->updateScene(dt);
-
     FrameUniformBlock frameUniformBlock = {};
-    BB_ASSERT(currentScene->Lights.size() <
-              std::size(frameUniformBlock.Lights));
-    frameUniformBlock.NumLights = currentScene->Lights.size();
-    gLightSources.NumLights = frameUniformBlock.NumLights;
-    memcpy(frameUniformBlock.Lights, currentScene->Lights.data(),
-           sizeBytes32(currentScene->Lights));
 
     if (gBufferVisualize.CurrentOption !=
         GBufferVisualizingOption::RenderedScene) {
@@ -1312,42 +2436,285 @@ int main(int _argc, char **_argv) {
       if (enableToneMapping) {
         ImGui::SliderFloat("Exposure", &exposure, 0.1f, 10.f);
       }
+
+      if (ImGui::CollapsingHeader("Staging Ring")) {
+        StagingRingStats stagingStats =
+            getStagingRingStats(*renderer.StagingRing);
+        const float mb = 1024.f * 1024.f;
+        ImGui::ProgressBar((float)stagingStats.Used / stagingStats.Capacity);
+        guiTextFmt("Occupancy: {:.2f} / {:.2f} MB (Peak: {:.2f} MB)",
+                   stagingStats.Used / mb, stagingStats.Capacity / mb,
+                   stagingStats.PeakUsed / mb);
+        guiTextFmt("Allocations: {} (Dedicated: {})",
+                   stagingStats.NumAllocations,
+                   stagingStats.NumDedicatedAllocations);
+        guiTextFmt("Submissions: {}", stagingStats.NumSubmissions);
+        guiTextFmt("Stalls: {} ({:.3f}s)", stagingStats.NumStalls,
+                   stagingStats.StallTime);
+      }
+
+      if (ImGui::CollapsingHeader("Frame Ring")) {
+        const float kb = 1024.f;
+        ImGui::ProgressBar((float)frameRing.Head / frameRing.SegmentSize);
+        guiTextFmt("Segment: {} / {} ({:.2f} / {:.2f} KB, Peak: {:.2f} KB)",
+                   frameRing.CurrentSegment + 1, frameRing.NumSegments,
+                   frameRing.Head / kb, frameRing.SegmentSize / kb,
+                   frameRing.PeakUsed / kb);
+      }
+
+      if (ImGui::CollapsingHeader("Pipeline Cache")) {
+        const PipelineCache &pipelineCache = *renderer.PipelineCache;
+        guiTextFmt("File: {}", pipelineCache.FilePath);
+        guiTextFmt("State: {} ({:.2f} KB loaded)",
+                   getPipelineCacheStateName(pipelineCache.LoadState),
+                   pipelineCache.NumLoadedBytes / 1024.f);
+        if (pipelineCache.LoadState == PipelineCacheState::Rejected) {
+          guiTextFmt("Rejected: {}", pipelineCache.RejectReason);
+        }
+        guiTextFmt("Startup: {} pipelines in {:.2f} ms",
+                   startupPipelineStats.NumPipelines,
+                   startupPipelineStats.Time * 1000.f);
+        guiTextFmt("Last resize: {:.2f} ms ({} pipelines in {:.2f} ms)",
+                   lastResizeTime * 1000.f, resizePipelineStats.NumPipelines,
+                   resizePipelineStats.Time * 1000.f);
+
+        if (ImGui::TreeNode("Startup pipelines")) {
+          for (const PipelineCreationRecord &record :
+               startupPipelineStats.Records) {
+            guiTextFmt("{}: {:.2f} ms", record.Name, record.Time * 1000.f);
+          }
+          ImGui::TreePop();
+        }
+      }
+
+      if (ImGui::CollapsingHeader("Light Clusters")) {
+        ImGui::SliderInt("Stress test lights", &numStressTestLights, 0,
+                         50000);
+        const LightClusterStats &stats = lightClusters->Stats;
+        guiTextFmt("Grid: {}x{}x{}", numLightClustersX, numLightClustersY,
+                   numLightClustersZ);
+        guiTextFmt("Directional lights: {}", stats.NumDirectionalLights);
+        guiTextFmt("Visible lights: {}", stats.NumVisibleLights);
+        guiTextFmt("Light indices: {} / {}{}", stats.NumIndices,
+                   maxNumClusterLightIndices,
+                   stats.IsOverflowed ? " (overflowed)" : "");
+        guiTextFmt("Max lights per cluster: {}", stats.MaxLightsPerCluster);
+        guiTextFmt("Binning: {:.3f} ms", stats.BinningTime * 1000.f);
+        guiTextFmt("Light volumes: {} spheres, {} cones",
+                   gLightVolumes.Draws[LightVolumeShape::Sphere].size(),
+                   gLightVolumes.Draws[LightVolumeShape::Cone].size());
+        guiTextFmt("Depth bounds test: {}",
+                   gLightVolumes.UseDepthBounds ? "On" : "Not supported");
+
+        ImGui::Separator();
+        const LightUploadStats &uploadStats = lightBuffer->Stats;
+        guiTextFmt("Light buffer: {} lights ({} grows)",
+                   lightBuffer->Capacity, uploadStats.NumGrows);
+        guiTextFmt("Uploaded: {} lights in {} regions",
+                   uploadStats.NumUploadedLights, uploadStats.NumRegions);
+      }
+
+      if (ImGui::CollapsingHeader("CPU Culling")) {
+        const SceneCullStats &stats = currentScene->CullStats;
+        guiTextFmt("Visible instances: {} / {}", stats.NumVisibleInstances,
+                   stats.NumInstances);
+      }
+
+      if (ImGui::CollapsingHeader("GPU Culling")) {
+        const GPUCullingStats &stats = culling->Stats;
+        guiTextFmt("Batches: {} / {}", stats.NumBatches, maxNumCullBatches);
+        guiTextFmt("Instances: {} / {}", stats.NumInstances,
+                   maxNumCulledInstances);
+        ImGui::Checkbox("Occlusion culling",
+                        &culling->IsOcclusionCullingEnabled);
+        guiTextFmt("Frustum culled: {}", stats.NumFrustumCulled);
+        guiTextFmt("Occlusion culled: {}", stats.NumOcclusionCulled);
+        guiTextFmt("Visible instances: {} ({} early, {} late)",
+                   stats.NumVisibleInstances, stats.NumDrawnEarly,
+                   stats.NumVisibleInstances - stats.NumDrawnEarly);
+        guiTextFmt("Depth pyramid: {} levels, {}x{}", depthPyramid->NumLevels,
+                   depthPyramid->LevelExtents[0].width,
+                   depthPyramid->LevelExtents[0].height);
+      }
+
+      if (ImGui::CollapsingHeader("Shader Permutations")) {
+        ImGui::Checkbox("Compile variants in the background",
+                        &compileVariantsAsync);
+        guiTextFmt("Current: {}",
+                   getShaderPermutationName(currentPermutation));
+        guiTextFmt("Hitches: {} ({:.2f} ms total, {:.2f} ms max)",
+                   variantStats.NumHitches,
+                   variantStats.TotalHitchTime * 1000.f,
+                   variantStats.MaxHitchTime * 1000.f);
+        guiTextFmt("Fallback draws: {}", variantStats.NumFallbackDraws);
+        if (variantStats.NumAsyncVariants > 0) {
+          guiTextFmt("Time to specialized: {:.2f} ms last, {:.2f} ms avg, "
+                     "{:.2f} ms max ({} variants)",
+                     variantStats.LastTimeToSpecialized * 1000.f,
+                     variantStats.TotalTimeToSpecialized /
+                         variantStats.NumAsyncVariants * 1000.f,
+                     variantStats.MaxTimeToSpecialized * 1000.f,
+                     variantStats.NumAsyncVariants);
+        }
+        for (const ReloadablePipeline &pipeline : reloadablePipelines) {
+          guiTextFmt("{}: {} variants", pipeline.Name,
+                     pipeline.Variants.size());
+        }
+      }
+
+      if (ImGui::CollapsingHeader("Device Memory")) {
+        const float mb = 1024.f * 1024.f;
+        guiTextFmt("Memory objects: {} / {}",
+                   renderer.MemoryAllocator->NumMemoryObjects,
+                   renderer.MemoryAllocator->MaxNumMemoryObjects);
+        std::vector<DeviceHeapStats> heapStats =
+            getDeviceHeapStats(*renderer.MemoryAllocator);
+        for (uint32_t i = 0; i < (uint32_t)heapStats.size(); ++i) {
+          const DeviceHeapStats &stats = heapStats[i];
+          ImGui::Separator();
+          guiTextFmt("Heap {} ({}, {:.0f} MB)", i,
+                     stats.IsDeviceLocal ? "Device Local" : "Host",
+                     stats.HeapSize / mb);
+          ImGui::ProgressBar((float)stats.Usage / stats.Budget);
+          guiTextFmt("Usage: {:.2f} / {:.2f} MB{}", stats.Usage / mb,
+                     stats.Budget / mb,
+                     renderer.MemoryAllocator->HasMemoryBudget
+                         ? ""
+                         : " (VK_EXT_memory_budget unavailable)");
+          guiTextFmt("Blocks: {} ({:.2f} MB)", stats.NumBlocks,
+                     stats.BlockBytes / mb);
+          guiTextFmt("Allocations: {} ({:.2f} MB, {:.2f} MB requested)",
+                     stats.NumAllocations, stats.UsedBytes / mb,
+                     stats.RequestedBytes / mb);
+          guiTextFmt("Largest free range: {:.2f} MB (Fragmentation: {:.1f}%)",
+                     stats.LargestFreeRange / mb, stats.Fragmentation * 100.f);
+          guiTextFmt("Dedicated: {} ({:.2f} MB)",
+                     stats.NumDedicatedAllocations, stats.DedicatedBytes / mb);
+          guiTextFmt("Linear pool chunks: {} ({:.2f} MB)",
+                     stats.NumLinearPoolChunks, stats.LinearPoolBytes / mb);
+        }
+
+        ImGui::Separator();
+        EnumArray<DeviceMemoryCategory, DeviceCategoryStats> categoryStats =
+            getDeviceCategoryStats(*renderer.MemoryAllocator);
+        for (DeviceMemoryCategory category : AllEnums<DeviceMemoryCategory>) {
+          const DeviceCategoryStats &stats = categoryStats[category];
+          guiTextFmt("{}: {} ({:.2f} MB, Peak: {:.2f} MB)",
+                     getDeviceMemoryCategoryName(category),
+                     stats.NumAllocations, stats.Bytes / mb,
+                     stats.PeakBytes / mb);
+        }
+
+        if (ImGui::TreeNode("Textures by material")) {
+          for (const MaterialMemoryUsage &usage :
+               getMaterialMemoryUsage(materialSet)) {
+            guiTextFmt("{}: {} images, {:.2f} MB", usage.Name,
+                       usage.NumImages, usage.Bytes / mb);
+          }
+          ImGui::TreePop();
+        }
+
+        ImGui::Separator();
+        guiTextFmt("G-buffer: {} bytes per pixel ({:.2f} MB)",
+                   gbufferBytesPerPixel,
+                   (float)gbufferBytesPerPixel * swapChain.Extent.width *
+                       swapChain.Extent.height / mb);
+        guiTextFmt("Attachments: {:.2f} MB as separate allocations",
+                   attachmentMemoryReport.SeparateBytes / mb);
+        guiTextFmt("Aliased block: {:.2f} MB ({} attachments share memory)",
+                   attachmentMemoryReport.AliasedBytes / mb,
+                   attachmentMemoryReport.NumAliased);
+        guiTextFmt("Lazily allocated: {} ({:.2f} MB reserved)",
+                   attachmentMemoryReport.NumLazy,
+                   attachmentMemoryReport.LazyBytes / mb);
+      }
+
+      if (ImGui::CollapsingHeader("File I/O")) {
+        FileIOStats fileIOStats = getFileIOStats();
+        guiTextFmt("Reads: {} (Failed: {})", fileIOStats.NumReads,
+                   fileIOStats.NumFailedReads);
+        guiTextFmt("Batches: {}", fileIOStats.NumBatches);
+        guiTextFmt("Read: {:.2f} MB",
+                   fileIOStats.NumBytesRead / (1024.f * 1024.f));
+      }
     }
     ImGui::End();
 
-    frameUniformBlock.EnableToneMapping = enableToneMapping;
     frameUniformBlock.Exposure = exposure;
 
-    {
-      void *data;
-      vkMapMemory(renderer.Device, currentFrame.FrameUniformBuffer.Memory, 0,
-                  sizeof(FrameUniformBlock), 0, &data);
-      memcpy(data, &frameUniformBlock, sizeof(FrameUniformBlock));
-      vkUnmapMemory(renderer.Device, currentFrame.FrameUniformBuffer.Memory);
+    // Stress test lights are appended to the scene's own lights, and only
+    // uploaded when their count changes.
+    std::vector<Light> &sceneLights = currentScene->Lights;
+    if (currentScene->NumStressTestLights != (uint32_t)numStressTestLights) {
+      uint32_t first =
+          (uint32_t)sceneLights.size() - currentScene->NumStressTestLights;
+      sceneLights.resize(first);
+      generateStressTestLights(sceneLights, (uint32_t)numStressTestLights);
+      currentScene->markLightsDirty(first, (uint32_t)numStressTestLights);
+      currentScene->NumStressTestLights = (uint32_t)numStressTestLights;
+    }
+    updateLightBuffer(renderer, *lightBuffer, *currentScene, currentFrame,
+                      frameNumber);
+
+    LightClusterView lightClusterView = {};
+    lightClusterView.ViewMat = cam.getViewMatrix();
+    lightClusterView.FovYDegrees = cameraFovYDegrees;
+    lightClusterView.AspectRatio = (float)width / (float)height;
+    lightClusterView.NearZ = cameraNearZ;
+    lightClusterView.FarZ = cameraFarZ;
+    const LightClusterStats &lightClusterStats = binLightsIntoClusters(
+        *lightClusters, currentFrame.Index, sceneLights.data(),
+        (uint32_t)sceneLights.size(), lightClusterView);
+    frameUniformBlock.NumLights = (int)sceneLights.size();
+    frameUniformBlock.NumDirectionalLights =
+        (int)lightClusterStats.NumDirectionalLights;
+
+    // Lights outside every cluster aren't visible, so they don't get a volume
+    // either.
+    for (std::vector<LightVolumeDraw> &draws : gLightVolumes.Draws) {
+      draws.clear();
+    }
+    for (const LightClusterBounds &bounds : lightClusters->Bounds) {
+      const Light &light = sceneLights[bounds.LightIndex];
+      LightVolumeShape shape = ((light.Type == LightType::Spot) &&
+                                (light.OuterCutOff >= lightVolumeMinConeCos))
+                                   ? LightVolumeShape::Cone
+                                   : LightVolumeShape::Sphere;
+      LightVolumeDraw draw = {};
+      draw.LightIndex = bounds.LightIndex;
+      draw.MinDepth = getDepthBufferValue(bounds.MaxZ);
+      draw.MaxDepth = getDepthBufferValue(bounds.MinZ);
+      gLightVolumes.Draws[shape].push_back(draw);
     }
 
-    ViewUniformBlock viewUniformBlock = {};
-    viewUniformBlock.ViewMat = cam.getViewMatrix();
-    viewUniformBlock.ProjMat =
-        Mat4::perspective(60.f, (float)width / (float)height, 0.1f, 1000.f);
-    viewUniformBlock.ViewPos = cam.Pos;
-    viewUniformBlock.EnableNormalMap = enableNormalMap;
+    // Every light gets a marker, the stress test ones included.
+    gLightSources.NumLights = (uint32_t)sceneLights.size();
 
-    {
-      void *data;
-      vkMapMemory(renderer.Device, currentFrame.ViewUniformBuffer.Memory, 0,
-                  sizeof(ViewUniformBlock), 0, &data);
-      memcpy(data, &viewUniformBlock, sizeof(ViewUniformBlock));
-      vkUnmapMemory(renderer.Device, currentFrame.ViewUniformBuffer.Memory);
-    }
+    currentPermutation = selectShaderPermutation(
+        sceneLights.data(), (uint32_t)sceneLights.size(), enableNormalMap,
+        enableToneMapping);
+    selectPipelineVariants(currentPermutation);
+
+    currentFrame.FrameUniformOffset =
+        (uint32_t)pushToFrameRing(frameRing, &frameUniformBlock, 1).Offset;
+
+    getLightClusterDepthParams(lightClusterView,
+                               &viewUniformBlock.ClusterDepthScale,
+                               &viewUniformBlock.ClusterDepthBias);
+
+    currentFrame.ViewUniformOffset =
+        (uint32_t)pushToFrameRing(frameRing, &viewUniformBlock, 1).Offset;
 
     vkResetCommandPool(renderer.Device, currentFrame.CmdPool,
                        VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
 
     ImGui::Render();
-    recordCommand(deferredRenderPass.Handle, currentDeferredFramebuffer,
+    recordCommand(depthPrepassRenderPass.Handle, depthPrepassFramebuffer,
+                  deferredRenderPass.Handle, currentDeferredFramebuffer,
+                  depthPrepassPipeline, forwardDepthPrepassPipeline,
                   forwardPipeline, gBufferPipeline, brdfPipeline,
-                  hdrToneMappingPipeline, swapChain.Extent, currentFrame);
+                  hdrToneMappingPipeline, swapChain.Extent, *lightBuffer,
+                  *culling, *depthPyramid, currentFrame);
 
     VkSubmitInfo submitInfo = {};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -1361,8 +2728,7 @@ int main(int _argc, char **_argv) {
     submitInfo.commandBufferCount = 1;
     submitInfo.pCommandBuffers = &currentFrame.CmdBuffer;
 
-    BB_VK_ASSERT(vkQueueSubmit(renderer.Queue, 1, &submitInfo,
-                               frameSyncObject.FrameAvailableFence));
+    submitToQueue(renderer, submitInfo, frameSyncObject.FrameAvailableFence);
 
     VkPresentInfoKHR presentInfo = {};
     presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -1372,20 +2738,48 @@ int main(int _argc, char **_argv) {
     presentInfo.pSwapchains = &swapChain.Handle;
     presentInfo.pImageIndices = &currentSwapChainImageIndex;
 
-    VkResult queuePresentResult =
-        vkQueuePresentKHR(renderer.Queue, &presentInfo);
+    VkResult queuePresentResult = presentToQueue(renderer, presentInfo);
+    if (isFirstFrame) {
+      printLine("Time to first frame: {:.3f}s",
+                getElapsedTimeInSeconds(startupBeginTime, getCurrentTime()));
+      isFirstFrame = false;
+    }
     if (queuePresentResult == VK_ERROR_OUT_OF_DATE_KHR ||
         queuePresentResult == VK_SUBOPTIMAL_KHR) {
       onWindowResize();
     }
   }
 
-  vkDeviceWaitIdle(renderer.Device);
+  if (shaderReloader) {
+    destroyShaderReloader(shaderReloader);
+  }
+  destroyThreadPool(pipelineCompilePool);
+
+  // Let the scene that is being constructed finish before tearing anything
+  // down.
+  destroyThreadPool(threadPool);
+  shutdownFileIO();
+  shutdownResourceRoot();
+  waitForDeviceIdle(renderer);
+
+  if (!memoryReportPath.empty() &&
+      writeDeviceMemoryReport(memoryReportPath, *renderer.MemoryAllocator,
+                              materialSet)) {
+    BB_LOG_INFO("Device memory report written to {}", memoryReportPath);
+  }
+
+  if (gSceneLoadState) {
+    delete gSceneLoadState->Scene;
+    delete gSceneLoadState;
+    gSceneLoadState = nullptr;
+  }
 
   for (SceneBase *&scene : gScenes) {
     delete scene;
     scene = nullptr;
   }
+  delete gPlaceholderScene;
+  gPlaceholderScene = nullptr;
 
   ImGui_ImplVulkan_Shutdown();
   ImGui_ImplSDL2_Shutdown();
@@ -1408,13 +2802,23 @@ int main(int _argc, char **_argv) {
   vkDestroyDescriptorPool(renderer.Device, standardDescriptorPool, nullptr);
   vkDestroyDescriptorPool(renderer.Device, imguiDescriptorPool, nullptr);
 
-  destroyBuffer(renderer, gLightSources.InstanceBuffer);
+  destroyDepthPyramid(renderer, depthPyramid);
+  destroyGPUCulling(renderer, culling);
+  destroyLightClusters(renderer, lightClusters);
+  destroyLightBuffer(renderer, lightBuffer);
+  destroyFrameRing(renderer, frameRing);
+  destroyBuffer(renderer, gLightVolumes.ConeIndexBuffer);
+  destroyBuffer(renderer, gLightVolumes.ConeVertexBuffer);
   destroyBuffer(renderer, gLightSources.IndexBuffer);
   destroyBuffer(renderer, gLightSources.VertexBuffer);
   destroyBuffer(renderer, gGizmo.IndexBuffer);
   destroyBuffer(renderer, gGizmo.VertexBuffer);
 
-  cleanupReloadableResources();
+  discardPendingPipelineSwaps();
+  destroyRetiredPipelines(true);
+  destroyCompiledPipelineVariants();
+  cleanupRenderTargets();
+  destroyLinearMemoryPool(renderTargetMemoryPool);
 
   destroyStandardPipelineLayout(renderer, gStandardPipelineLayout);
 
@@ -1422,6 +2826,10 @@ int main(int _argc, char **_argv) {
 
   vkDestroyCommandPool(renderer.Device, transientCmdPool, nullptr);
 
+  destroyShader(renderer, depthPyramidShader);
+  destroyShader(renderer, cullInstancesShader);
+  destroyShader(renderer, gLightVolumes.VertShader);
+  destroyShader(renderer, gLightVolumes.FragShader);
   destroyShader(renderer, gLightSources.VertShader);
   destroyShader(renderer, gLightSources.FragShader);
   destroyShader(renderer, gGizmo.VertShader);
@@ -0,0 +1,110 @@
+#include "memory_report.h"
+#include "util.h"
+#include <stdio.h>
+
+namespace bb {
+
+static MaterialMemoryUsage getMaterialMemoryUsage(const PBRMaterial &_material,
+                                                  const std::string &_name) {
+  MaterialMemoryUsage usage = {};
+  usage.Name = _name;
+  for (const Image &image : _material.Maps) {
+    if (image.Handle != VK_NULL_HANDLE) {
+      ++usage.NumImages;
+      usage.Bytes += image.Allocation.Size;
+    }
+  }
+  return usage;
+}
+
+std::vector<MaterialMemoryUsage>
+getMaterialMemoryUsage(const PBRMaterialSet &_materialSet) {
+  std::vector<MaterialMemoryUsage> usages;
+  usages.reserve(_materialSet.Materials.size() + 1);
+  usages.push_back(
+      getMaterialMemoryUsage(_materialSet.DefaultMaterial, "(default)"));
+  for (const PBRMaterial &material : _materialSet.Materials) {
+    usages.push_back(getMaterialMemoryUsage(material, material.Name));
+  }
+  return usages;
+}
+
+static std::string escapeJSONString(const std::string &_str) {
+  std::string result;
+  result.reserve(_str.size());
+  for (char ch : _str) {
+    if ((ch == '"') || (ch == '\\')) {
+      result += '\\';
+      result += ch;
+    } else if ((unsigned char)ch < 0x20) {
+      result += fmt::format("\\u{:04x}", (int)ch);
+    } else {
+      result += ch;
+    }
+  }
+  return result;
+}
+
+bool writeDeviceMemoryReport(const std::string &_filePath,
+                             DeviceMemoryAllocator &_allocator,
+                             const PBRMaterialSet &_materialSet) {
+  std::vector<DeviceHeapStats> heapStats = getDeviceHeapStats(_allocator);
+  EnumArray<DeviceMemoryCategory, DeviceCategoryStats> categoryStats =
+      getDeviceCategoryStats(_allocator);
+  std::vector<MaterialMemoryUsage> materialUsages =
+      getMaterialMemoryUsage(_materialSet);
+
+  std::string json = "{\n";
+  json += fmt::format("  \"hasMemoryBudget\": {},\n",
+                      _allocator.HasMemoryBudget ? "true" : "false");
+
+  json += "  \"heaps\": [\n";
+  for (size_t i = 0; i < heapStats.size(); ++i) {
+    const DeviceHeapStats &stats = heapStats[i];
+    json += fmt::format(
+        "    {{\"index\": {}, \"deviceLocal\": {}, \"size\": {}, "
+        "\"budget\": {}, \"usage\": {}, \"blockBytes\": {}, "
+        "\"dedicatedBytes\": {}, \"linearPoolBytes\": {}}}{}\n",
+        i, stats.IsDeviceLocal ? "true" : "false", stats.HeapSize,
+        stats.Budget, stats.Usage, stats.BlockBytes, stats.DedicatedBytes,
+        stats.LinearPoolBytes, (i + 1 < heapStats.size()) ? "," : "");
+  }
+  json += "  ],\n";
+
+  json += "  \"categories\": {\n";
+  for (DeviceMemoryCategory category : AllEnums<DeviceMemoryCategory>) {
+    const DeviceCategoryStats &stats = categoryStats[category];
+    json += fmt::format(
+        "    \"{}\": {{\"allocations\": {}, \"bytes\": {}, "
+        "\"peakBytes\": {}}}{}\n",
+        getDeviceMemoryCategoryName(category), stats.NumAllocations,
+        stats.Bytes, stats.PeakBytes,
+        ((int)category + 1 < (int)DeviceMemoryCategory::COUNT) ? "," : "");
+  }
+  json += "  },\n";
+
+  json += "  \"materials\": [\n";
+  for (size_t i = 0; i < materialUsages.size(); ++i) {
+    const MaterialMemoryUsage &usage = materialUsages[i];
+    json += fmt::format(
+        "    {{\"name\": \"{}\", \"images\": {}, \"bytes\": {}}}{}\n",
+        escapeJSONString(usage.Name), usage.NumImages, usage.Bytes,
+        (i + 1 < materialUsages.size()) ? "," : "");
+  }
+  json += "  ]\n";
+  json += "}\n";
+
+  FILE *f = fopen(_filePath.c_str(), "wb");
+  if (!f) {
+    BB_LOG_ERROR("Failed to open {} for writing", _filePath);
+    return false;
+  }
+  bool isWritten = fwrite(json.data(), 1, json.size(), f) == json.size();
+  fclose(f);
+  if (!isWritten) {
+    BB_LOG_ERROR("Failed to write {}", _filePath);
+  }
+  return isWritten;
+}
+
+} // namespace bb
@@ -0,0 +1,24 @@
+#pragma once
+#include "render.h"
+#include <string>
+#include <vector>
+
+namespace bb {
+
+struct MaterialMemoryUsage {
+  std::string Name;
+  uint32_t NumImages;
+  VkDeviceSize Bytes;
+};
+
+// Texture memory of every material, the default material first.
+std::vector<MaterialMemoryUsage>
+getMaterialMemoryUsage(const PBRMaterialSet &_materialSet);
+
+// Dumps the heap budgets, the per-category accounting and the per-material
+// texture usage as JSON. Returns false if the file can't be written.
+bool writeDeviceMemoryReport(const std::string &_filePath,
+                             DeviceMemoryAllocator &_allocator,
+                             const PBRMaterialSet &_materialSet);
+
+} // namespace bb
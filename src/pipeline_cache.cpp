@@ -0,0 +1,259 @@
+#include "pipeline_cache.h"
+#include "file_io.h"
+#include "render.h"
+#include "util.h"
+#include "enum_array.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#ifdef BB_WINDOWS
+#include <Windows.h>
+#endif
+
+namespace bb {
+
+static uint64_t hashPipelineCacheData(const uint8_t *_data, size_t _size) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < _size; ++i) {
+    hash ^= _data[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Returns nullptr if the file is fine, otherwise why it isn't.
+static const char *
+validatePipelineCacheFile(const VkPhysicalDeviceProperties &_properties,
+                          const std::vector<uint8_t> &_contents) {
+  if (_contents.size() < sizeof(PipelineCacheFileHeader)) {
+    return "file is truncated";
+  }
+
+  PipelineCacheFileHeader header;
+  memcpy(&header, _contents.data(), sizeof(header));
+  if ((header.Magic != pipelineCacheMagic) ||
+      (header.Version != pipelineCacheVersion)) {
+    return "unknown file format";
+  }
+  if ((header.VendorID != _properties.vendorID) ||
+      (header.DeviceID != _properties.deviceID)) {
+    return "written by a different device";
+  }
+  if (header.DriverVersion != _properties.driverVersion) {
+    return "written by a different driver version";
+  }
+  if (memcmp(header.PipelineCacheUUID, _properties.pipelineCacheUUID,
+             VK_UUID_SIZE) != 0) {
+    return "pipeline cache UUID mismatch";
+  }
+  if (header.DataSize != _contents.size() - sizeof(header)) {
+    return "data size mismatch";
+  }
+
+  const uint8_t *data = _contents.data() + sizeof(header);
+  if (header.DataHash != hashPipelineCacheData(data, header.DataSize)) {
+    return "data is corrupted";
+  }
+
+  // The driver checks its own header too, but a mismatch there would just
+  // silently give an empty cache.
+  struct {
+    uint32_t HeaderSize;
+    uint32_t HeaderVersion;
+    uint32_t VendorID;
+    uint32_t DeviceID;
+    uint8_t PipelineCacheUUID[VK_UUID_SIZE];
+  } vkHeader;
+  if (header.DataSize < sizeof(vkHeader)) {
+    return "data is truncated";
+  }
+  memcpy(&vkHeader, data, sizeof(vkHeader));
+  if ((vkHeader.HeaderVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE) ||
+      (vkHeader.VendorID != _properties.vendorID) ||
+      (vkHeader.DeviceID != _properties.deviceID) ||
+      (memcmp(vkHeader.PipelineCacheUUID, _properties.pipelineCacheUUID,
+              VK_UUID_SIZE) != 0)) {
+    return "driver header mismatch";
+  }
+
+  return nullptr;
+}
+
+PipelineCache *loadPipelineCache(const Renderer &_renderer,
+                                 const std::string &_filePath) {
+  PipelineCache *cache = new PipelineCache();
+  cache->FilePath = _filePath;
+  cache->LoadState = PipelineCacheState::Cold;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(_renderer.PhysicalDevice, &properties);
+
+  VkPipelineCacheCreateInfo cacheCreateInfo = {};
+  cacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+
+  std::vector<uint8_t> contents;
+  if (readWholeFile(_filePath, contents)) {
+    if (const char *reason = validatePipelineCacheFile(properties, contents)) {
+      cache->LoadState = PipelineCacheState::Rejected;
+      cache->RejectReason = reason;
+      BB_LOG_WARNING("Ignoring pipeline cache {}: {}", _filePath, reason);
+    } else {
+      cache->LoadState = PipelineCacheState::Warm;
+      cache->NumLoadedBytes = contents.size() - sizeof(PipelineCacheFileHeader);
+      cacheCreateInfo.initialDataSize = cache->NumLoadedBytes;
+      cacheCreateInfo.pInitialData =
+          contents.data() + sizeof(PipelineCacheFileHeader);
+    }
+  }
+
+  BB_VK_ASSERT(vkCreatePipelineCache(_renderer.Device, &cacheCreateInfo,
+                                     nullptr, &cache->Handle));
+
+  return cache;
+}
+
+bool savePipelineCache(const Renderer &_renderer, const PipelineCache &_cache) {
+  size_t dataSize = 0;
+  BB_VK_ASSERT(vkGetPipelineCacheData(_renderer.Device, _cache.Handle,
+                                      &dataSize, nullptr));
+  std::vector<uint8_t> contents(sizeof(PipelineCacheFileHeader) + dataSize);
+  uint8_t *data = contents.data() + sizeof(PipelineCacheFileHeader);
+  BB_VK_ASSERT(
+      vkGetPipelineCacheData(_renderer.Device, _cache.Handle, &dataSize, data));
+  contents.resize(sizeof(PipelineCacheFileHeader) + dataSize);
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(_renderer.PhysicalDevice, &properties);
+
+  PipelineCacheFileHeader header = {};
+  header.Magic = pipelineCacheMagic;
+  header.Version = pipelineCacheVersion;
+  header.VendorID = properties.vendorID;
+  header.DeviceID = properties.deviceID;
+  header.DriverVersion = properties.driverVersion;
+  memcpy(header.PipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+  header.DataSize = dataSize;
+  header.DataHash = hashPipelineCacheData(data, dataSize);
+  memcpy(contents.data(), &header, sizeof(header));
+
+  std::string tempFilePath = _cache.FilePath + ".tmp";
+  FILE *f = fopen(tempFilePath.c_str(), "wb");
+  if (!f) {
+    BB_LOG_ERROR("Failed to open {} for writing", tempFilePath);
+    return false;
+  }
+  bool isWritten =
+      (fwrite(contents.data(), 1, contents.size(), f) == contents.size()) &&
+      (fflush(f) == 0);
+  fclose(f);
+  if (!isWritten) {
+    BB_LOG_ERROR("Failed to write {}", tempFilePath);
+    remove(tempFilePath.c_str());
+    return false;
+  }
+
+#ifdef BB_WINDOWS
+  bool isRenamed = MoveFileExA(tempFilePath.c_str(), _cache.FilePath.c_str(),
+                               MOVEFILE_REPLACE_EXISTING |
+                                   MOVEFILE_WRITE_THROUGH);
+#else
+  bool isRenamed =
+      rename(tempFilePath.c_str(), _cache.FilePath.c_str()) == 0;
+#endif
+  if (!isRenamed) {
+    BB_LOG_ERROR("Failed to replace {}", _cache.FilePath);
+    remove(tempFilePath.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+void destroyPipelineCache(const Renderer &_renderer, PipelineCache *_cache) {
+  BB_ASSERT(_cache->ThreadCaches.empty());
+  vkDestroyPipelineCache(_renderer.Device, _cache->Handle, nullptr);
+  delete _cache;
+}
+
+const char *getPipelineCacheStateName(PipelineCacheState _state) {
+  static const EnumArray<PipelineCacheState, const char *> names = {
+      "Cold", "Rejected", "Warm"};
+  return names[_state];
+}
+
+VkPipelineCache getThreadPipelineCache(const Renderer &_renderer,
+                                       PipelineCache &_cache) {
+  std::scoped_lock lock(_cache.Mutex);
+  VkPipelineCache &threadCache = _cache.ThreadCaches[std::this_thread::get_id()];
+  if (threadCache == VK_NULL_HANDLE) {
+    size_t dataSize = 0;
+    BB_VK_ASSERT(vkGetPipelineCacheData(_renderer.Device, _cache.Handle,
+                                        &dataSize, nullptr));
+    std::vector<uint8_t> data(dataSize);
+    BB_VK_ASSERT(vkGetPipelineCacheData(_renderer.Device, _cache.Handle,
+                                        &dataSize, data.data()));
+
+    VkPipelineCacheCreateInfo cacheCreateInfo = {};
+    cacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cacheCreateInfo.initialDataSize = dataSize;
+    cacheCreateInfo.pInitialData = data.data();
+    BB_VK_ASSERT(vkCreatePipelineCache(_renderer.Device, &cacheCreateInfo,
+                                       nullptr, &threadCache));
+  }
+  return threadCache;
+}
+
+void mergeThreadPipelineCaches(const Renderer &_renderer,
+                               PipelineCache &_cache) {
+  std::scoped_lock lock(_cache.Mutex);
+  if (_cache.ThreadCaches.empty()) {
+    return;
+  }
+
+  std::vector<VkPipelineCache> threadCaches;
+  threadCaches.reserve(_cache.ThreadCaches.size());
+  for (const auto &[threadID, threadCache] : _cache.ThreadCaches) {
+    threadCaches.push_back(threadCache);
+  }
+  BB_VK_ASSERT(vkMergePipelineCaches(_renderer.Device, _cache.Handle,
+                                     (uint32_t)threadCaches.size(),
+                                     threadCaches.data()));
+  for (VkPipelineCache threadCache : threadCaches) {
+    vkDestroyPipelineCache(_renderer.Device, threadCache, nullptr);
+  }
+  _cache.ThreadCaches.clear();
+}
+
+void recordPipelineCreation(PipelineCache &_cache, const char *_name,
+                            float _time) {
+  std::scoped_lock lock(_cache.Mutex);
+  ++_cache.Stats.NumPipelines;
+  _cache.Stats.Time += _time;
+  _cache.Stats.Records.push_back({_name ? _name : "(unnamed)", _time});
+}
+
+PipelineCreationStats takePipelineCreationStats(PipelineCache &_cache) {
+  std::scoped_lock lock(_cache.Mutex);
+  PipelineCreationStats stats = _cache.Stats;
+  _cache.Stats = {};
+  return stats;
+}
+
+void printPipelineCreationReport(const PipelineCache &_cache,
+                                 const PipelineCreationStats &_stats,
+                                 std::string_view _title) {
+  std::vector<PipelineCreationRecord> records = _stats.Records;
+  std::sort(records.begin(), records.end(),
+            [](const PipelineCreationRecord &_a,
+               const PipelineCreationRecord &_b) { return _a.Time > _b.Time; });
+
+  printLine("{}: {} pipelines, {:.2f}ms of compilation ({} cache)", _title,
+            _stats.NumPipelines, _stats.Time * 1000.f,
+            getPipelineCacheStateName(_cache.LoadState));
+  for (const PipelineCreationRecord &record : records) {
+    printLine("  {:>8.2f}ms  {}", record.Time * 1000.f, record.Name);
+  }
+}
+
+} // namespace bb
@@ -0,0 +1,92 @@
+#pragma once
+#include "external/volk.h"
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace bb {
+
+struct Renderer;
+
+// The VkPipelineCache of the renderer is kept on disk between runs. The file
+// is the cache data prefixed with PipelineCacheFileHeader, and it is only used
+// if it was written by the same device and driver and isn't corrupted.
+// Otherwise pipelines are built from scratch, and the file is replaced on
+// shutdown.
+constexpr uint32_t pipelineCacheMagic = 0x43504242; // "BBPC"
+constexpr uint32_t pipelineCacheVersion = 1;
+constexpr char defaultPipelineCacheFilePath[] = "pipeline_cache.bin";
+
+struct PipelineCacheFileHeader {
+  uint32_t Magic;
+  uint32_t Version;
+  uint32_t VendorID;
+  uint32_t DeviceID;
+  uint32_t DriverVersion;
+  uint8_t PipelineCacheUUID[VK_UUID_SIZE];
+  uint64_t DataSize;
+  // 64-bit FNV-1a of the data.
+  uint64_t DataHash;
+};
+
+enum class PipelineCacheState { Cold, Rejected, Warm, COUNT };
+
+struct PipelineCreationRecord {
+  std::string Name;
+  float Time;
+};
+
+struct PipelineCreationStats {
+  uint32_t NumPipelines;
+  // Sum of every creation, so with several threads compiling at once this is
+  // more than the wall clock time it took.
+  float Time;
+  std::vector<PipelineCreationRecord> Records;
+};
+
+struct PipelineCache {
+  VkPipelineCache Handle;
+  std::string FilePath;
+  PipelineCacheState LoadState;
+  // Why the file was rejected, if it was.
+  std::string RejectReason;
+  size_t NumLoadedBytes;
+
+  std::mutex Mutex;
+  PipelineCreationStats Stats;
+  // Pipelines are compiled into a cache owned by the compiling thread, so that
+  // threads don't contend on the lock of the shared one. They are seeded with
+  // the contents of Handle and merged back into it by
+  // mergeThreadPipelineCaches().
+  std::unordered_map<std::thread::id, VkPipelineCache> ThreadCaches;
+};
+
+PipelineCache *loadPipelineCache(const Renderer &_renderer,
+                                 const std::string &_filePath);
+// Writes the cache to a temporary file and renames it over the old one, so
+// that a crash in the middle never leaves a truncated cache behind.
+bool savePipelineCache(const Renderer &_renderer, const PipelineCache &_cache);
+void destroyPipelineCache(const Renderer &_renderer, PipelineCache *_cache);
+
+const char *getPipelineCacheStateName(PipelineCacheState _state);
+
+// Thread-safe.
+VkPipelineCache getThreadPipelineCache(const Renderer &_renderer,
+                                       PipelineCache &_cache);
+// Must not be called while pipelines are being created.
+void mergeThreadPipelineCaches(const Renderer &_renderer, PipelineCache &_cache);
+
+// Thread-safe.
+void recordPipelineCreation(PipelineCache &_cache, const char *_name,
+                            float _time);
+// Returns what was recorded since the last call, and starts over.
+PipelineCreationStats takePipelineCreationStats(PipelineCache &_cache);
+// Prints how long each pipeline took, slowest first.
+void printPipelineCreationReport(const PipelineCache &_cache,
+                                 const PipelineCreationStats &_stats,
+                                 std::string_view _title);
+
+} // namespace bb
@@ -1,5 +1,7 @@
 #include "render.h"
+#include "pipeline_cache.h"
 #include "resource.h"
+#include "staging.h"
 #include "type_conversion.h"
 #include "external/SDL2/SDL_vulkan.h"
 #include "external/stb_image.h"
@@ -10,6 +12,8 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL vulkanDebugCallback(
     VkDebugUtilsMessageSeverityFlagBitsEXT _severity,
     VkDebugUtilsMessageTypeFlagsEXT _type,
     const VkDebugUtilsMessengerCallbackDataEXT *_callbackData, void *_userData);
+static bool isDeviceExtensionSupported(VkPhysicalDevice _physicalDevice,
+                                       const char *_extensionName);
 static bool
 checkPhysicalDevice(VkPhysicalDevice _physicalDevice, VkSurfaceKHR _surface,
                     const std::vector<const char *> &_deviceExtensions,
@@ -132,6 +136,13 @@ Renderer createRenderer(SDL_Window *_window) {
   }
   BB_ASSERT(result.PhysicalDevice != VK_NULL_HANDLE);
 
+  // Optional extensions
+  bool hasMemoryBudget = isDeviceExtensionSupported(
+      result.PhysicalDevice, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+  if (hasMemoryBudget) {
+    deviceExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+  }
+
   std::unordered_map<uint32_t, VkQueue> queueMap;
   float queuePriority = 1.f;
   VkDeviceQueueCreateInfo queueCreateInfo = {};
@@ -152,11 +163,23 @@ Renderer createRenderer(SDL_Window *_window) {
                               &result.Device));
 
   vkGetDeviceQueue(result.Device, result.QueueFamilyIndex, 0, &result.Queue);
+  result.QueueMutex = new std::mutex();
+
+  result.MemoryAllocator = createDeviceMemoryAllocator(
+      result.PhysicalDevice, result.Device, hasMemoryBudget);
+  result.StagingRing = createStagingRing(result, defaultStagingRingSize);
+  result.PipelineCache = loadPipelineCache(result, defaultPipelineCacheFilePath);
 
   return result;
 }
 
 void destroyRenderer(Renderer &_renderer) {
+  mergeThreadPipelineCaches(_renderer, *_renderer.PipelineCache);
+  savePipelineCache(_renderer, *_renderer.PipelineCache);
+  destroyPipelineCache(_renderer, _renderer.PipelineCache);
+  destroyStagingRing(_renderer.StagingRing);
+  destroyDeviceMemoryAllocator(_renderer.MemoryAllocator);
+  delete _renderer.QueueMutex;
   vkDestroyDevice(_renderer.Device, nullptr);
   vkDestroySurfaceKHR(_renderer.Instance, _renderer.Surface, nullptr);
   if (_renderer.DebugMessenger != VK_NULL_HANDLE) {
@@ -239,6 +262,146 @@ uint32_t findMemoryType(const Renderer &_renderer, uint32_t _typeFilter,
   return 0;
 }
 
+static DeviceMemoryCategory
+getBufferMemoryCategory(VkBufferUsageFlags _usage,
+                        VkMemoryPropertyFlags _properties) {
+  if (_usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT) {
+    return DeviceMemoryCategory::Uniform;
+  }
+  if (_usage & (VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                VK_BUFFER_USAGE_INDEX_BUFFER_BIT)) {
+    // Host visible vertex buffers hold instance data that is rewritten every
+    // frame, which is closer to uniforms than to meshes.
+    return (_properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+               ? DeviceMemoryCategory::Uniform
+               : DeviceMemoryCategory::Mesh;
+  }
+  if (_usage == VK_BUFFER_USAGE_TRANSFER_SRC_BIT) {
+    return DeviceMemoryCategory::Staging;
+  }
+  return DeviceMemoryCategory::Other;
+}
+
+static DeviceMemoryCategory getImageMemoryCategory(VkImageUsageFlags _usage) {
+  if (_usage & (VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT)) {
+    return DeviceMemoryCategory::Attachment;
+  }
+  if (_usage & VK_IMAGE_USAGE_SAMPLED_BIT) {
+    return DeviceMemoryCategory::Texture;
+  }
+  return DeviceMemoryCategory::Other;
+}
+
+DeviceAllocation allocateBufferMemory(const Renderer &_renderer,
+                                      VkBuffer _buffer,
+                                      VkBufferUsageFlags _usage,
+                                      VkMemoryPropertyFlags _properties) {
+  VkBufferMemoryRequirementsInfo2 requirementsInfo = {};
+  requirementsInfo.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2;
+  requirementsInfo.buffer = _buffer;
+
+  VkMemoryDedicatedRequirements dedicatedRequirements = {};
+  dedicatedRequirements.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+  VkMemoryRequirements2 requirements = {};
+  requirements.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+  requirements.pNext = &dedicatedRequirements;
+  vkGetBufferMemoryRequirements2(_renderer.Device, &requirementsInfo,
+                                 &requirements);
+
+  DeviceAllocationParams params = {};
+  params.Requirements = requirements.memoryRequirements;
+  params.Properties = _properties;
+  params.ResourceKind = DeviceResourceKind::Buffer;
+  params.Category = getBufferMemoryCategory(_usage, _properties);
+  params.IsDedicated = dedicatedRequirements.requiresDedicatedAllocation ||
+                       dedicatedRequirements.prefersDedicatedAllocation;
+  params.DedicatedBuffer = _buffer;
+  DeviceAllocation allocation =
+      allocateDeviceMemory(*_renderer.MemoryAllocator, params);
+
+  BB_VK_ASSERT(vkBindBufferMemory(_renderer.Device, _buffer, allocation.Memory,
+                                  allocation.Offset));
+  return allocation;
+}
+
+DeviceAllocation allocateImageMemory(const Renderer &_renderer, VkImage _image,
+                                     VkImageUsageFlags _usage,
+                                     LinearMemoryPool *_pool) {
+  VkImageMemoryRequirementsInfo2 requirementsInfo = {};
+  requirementsInfo.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
+  requirementsInfo.image = _image;
+
+  VkMemoryDedicatedRequirements dedicatedRequirements = {};
+  dedicatedRequirements.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+  VkMemoryRequirements2 requirements = {};
+  requirements.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+  requirements.pNext = &dedicatedRequirements;
+  vkGetImageMemoryRequirements2(_renderer.Device, &requirementsInfo,
+                                &requirements);
+
+  DeviceAllocation allocation;
+  if (_pool && !dedicatedRequirements.requiresDedicatedAllocation) {
+    allocation =
+        allocateFromLinearMemoryPool(*_pool, requirements.memoryRequirements);
+  } else {
+    bool isAttachment =
+        _usage & (VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                  VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
+
+    DeviceAllocationParams params = {};
+    params.Requirements = requirements.memoryRequirements;
+    params.Properties = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    params.ResourceKind = DeviceResourceKind::Image;
+    params.Category = getImageMemoryCategory(_usage);
+    params.IsDedicated =
+        dedicatedRequirements.requiresDedicatedAllocation ||
+        dedicatedRequirements.prefersDedicatedAllocation ||
+        (isAttachment &&
+         (requirements.memoryRequirements.size >= largeAttachmentSize));
+    params.DedicatedImage = _image;
+    allocation = allocateDeviceMemory(*_renderer.MemoryAllocator, params);
+  }
+
+  BB_VK_ASSERT(vkBindImageMemory(_renderer.Device, _image, allocation.Memory,
+                                 allocation.Offset));
+  return allocation;
+}
+
+void submitToQueue(const Renderer &_renderer, const VkSubmitInfo &_submitInfo,
+                   VkFence _fence) {
+  std::scoped_lock lock(*_renderer.QueueMutex);
+  BB_VK_ASSERT(vkQueueSubmit(_renderer.Queue, 1, &_submitInfo, _fence));
+}
+
+VkResult presentToQueue(const Renderer &_renderer,
+                        const VkPresentInfoKHR &_presentInfo) {
+  std::scoped_lock lock(*_renderer.QueueMutex);
+  return vkQueuePresentKHR(_renderer.Queue, &_presentInfo);
+}
+
+void setViewportAndScissor(VkCommandBuffer _cmdBuffer, VkOffset2D _offset,
+                           VkExtent2D _extent) {
+  VkViewport viewport = {};
+  viewport.x = (float)_offset.x;
+  viewport.y = (float)_offset.y;
+  viewport.width = (float)_extent.width;
+  viewport.height = (float)_extent.height;
+  viewport.minDepth = 0.f;
+  viewport.maxDepth = 1.f;
+  vkCmdSetViewport(_cmdBuffer, 0, 1, &viewport);
+
+  VkRect2D scissor = {};
+  scissor.offset = _offset;
+  scissor.extent = _extent;
+  vkCmdSetScissor(_cmdBuffer, 0, 1, &scissor);
+}
+
+void waitForDeviceIdle(const Renderer &_renderer) {
+  std::scoped_lock lock(*_renderer.QueueMutex);
+  BB_VK_ASSERT(vkDeviceWaitIdle(_renderer.Device));
+}
+
 VkSurfaceFormatKHR SwapChainSupportDetails::chooseSurfaceFormat() const {
   for (const VkSurfaceFormatKHR &format : Formats) {
     if ((format.format == VK_FORMAT_R8G8B8A8_SRGB ||
@@ -279,6 +442,23 @@ VkExtent2D SwapChainSupportDetails::chooseExtent(uint32_t _width,
   }
 }
 
+bool isDeviceExtensionSupported(VkPhysicalDevice _physicalDevice,
+                                const char *_extensionName) {
+  uint32_t numExtensions;
+  std::vector<VkExtensionProperties> extensionProperties;
+  vkEnumerateDeviceExtensionProperties(_physicalDevice, nullptr, &numExtensions,
+                                       nullptr);
+  extensionProperties.resize(numExtensions);
+  vkEnumerateDeviceExtensionProperties(_physicalDevice, nullptr, &numExtensions,
+                                       extensionProperties.data());
+  for (const VkExtensionProperties &properties : extensionProperties) {
+    if (strcmp(_extensionName, properties.extensionName) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
 bool checkPhysicalDevice(VkPhysicalDevice _physicalDevice,
                          VkSurfaceKHR _surface,
                          const std::vector<const char *> &_deviceExtensions,
@@ -448,28 +628,19 @@ SwapChain createSwapChain(const Renderer &_renderer, uint32_t _width,
   depthImageCreateInfo.format = swapChain.DepthFormat;
   depthImageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
   depthImageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  depthImageCreateInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+  // The deferred lighting passes rebuild positions from depth, and the depth
+  // pyramid for occlusion culling is reduced from it.
+  depthImageCreateInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                               VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT |
+                               VK_IMAGE_USAGE_SAMPLED_BIT;
   depthImageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
   depthImageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
   depthImageCreateInfo.flags = 0;
   BB_VK_ASSERT(vkCreateImage(_renderer.Device, &depthImageCreateInfo, nullptr,
                              &swapChain.DepthImage));
 
-  VkMemoryRequirements memRequirements;
-  vkGetImageMemoryRequirements(_renderer.Device, swapChain.DepthImage,
-                               &memRequirements);
-
-  VkMemoryAllocateInfo depthImageMemoryAllocInfo = {};
-  depthImageMemoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  depthImageMemoryAllocInfo.allocationSize = memRequirements.size;
-  depthImageMemoryAllocInfo.memoryTypeIndex =
-      findMemoryType(_renderer, memRequirements.memoryTypeBits,
-                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-  BB_VK_ASSERT(vkAllocateMemory(_renderer.Device, &depthImageMemoryAllocInfo,
-                                nullptr, &swapChain.DepthImageMemory));
-
-  BB_VK_ASSERT(vkBindImageMemory(_renderer.Device, swapChain.DepthImage,
-                                 swapChain.DepthImageMemory, 0));
+  swapChain.DepthImageAllocation = allocateImageMemory(
+      _renderer, swapChain.DepthImage, depthImageCreateInfo.usage);
 
   VkImageViewCreateInfo depthImageViewCreateInfo = {};
   depthImageViewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -494,7 +665,8 @@ void destroySwapChain(const Renderer &_renderer, SwapChain &_swapChain) {
   }
   vkDestroyImageView(_renderer.Device, _swapChain.DepthImageView, nullptr);
   vkDestroyImage(_renderer.Device, _swapChain.DepthImage, nullptr);
-  vkFreeMemory(_renderer.Device, _swapChain.DepthImageMemory, nullptr);
+  freeDeviceMemory(*_renderer.MemoryAllocator,
+                   _swapChain.DepthImageAllocation);
   vkDestroySwapchainKHR(_renderer.Device, _swapChain.Handle, nullptr);
   _swapChain = {};
 }
@@ -638,10 +810,6 @@ LightSourceVertex::BindingDescs LightSourceVertex::getBindingDescs() {
   bindings[0].stride = sizeof(LightSourceVertex);
   bindings[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
-  bindings[1].binding = 1;
-  bindings[1].stride = sizeof(int);
-  bindings[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
-
   return bindings;
 }
 
@@ -652,11 +820,6 @@ LightSourceVertex::AttributeDescs LightSourceVertex::getAttributeDescs() {
   attributes[0].format = VK_FORMAT_R32G32B32_SFLOAT;
   attributes[0].offset = offsetof(LightSourceVertex, Pos);
 
-  attributes[1].binding = 1;
-  attributes[1].location = 1;
-  attributes[1].format = VK_FORMAT_R32_SINT;
-  attributes[1].offset = 0;
-
   return attributes;
 }
 
@@ -674,53 +837,29 @@ Buffer createBuffer(const Renderer &_renderer, VkDeviceSize _size,
   BB_VK_ASSERT(vkCreateBuffer(_renderer.Device, &bufferCreateInfo, nullptr,
                               &result.Handle));
 
-  VkMemoryRequirements memRequirements;
-  vkGetBufferMemoryRequirements(_renderer.Device, result.Handle,
-                                &memRequirements);
-
-  VkMemoryAllocateInfo allocInfo = {};
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.allocationSize = memRequirements.size;
-  allocInfo.memoryTypeIndex =
-      findMemoryType(_renderer, memRequirements.memoryTypeBits, _properties);
-
-  BB_VK_ASSERT(
-      vkAllocateMemory(_renderer.Device, &allocInfo, nullptr, &result.Memory));
-  BB_VK_ASSERT(
-      vkBindBufferMemory(_renderer.Device, result.Handle, result.Memory, 0));
+  result.Allocation =
+      allocateBufferMemory(_renderer, result.Handle, _usage, _properties);
 
   result.Size = _size;
 
   return result;
 };
 
-Buffer createStagingBuffer(const Renderer &_renderer,
-                           const Buffer &_orgBuffer) {
-  Buffer result =
-      createBuffer(_renderer, _orgBuffer.Size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                       VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-  return result;
-}
-
 Buffer createDeviceLocalBufferFromMemory(const Renderer &_renderer,
-                                         VkCommandPool _cmdPool,
                                          VkBufferUsageFlags _usage,
                                          VkDeviceSize _size,
                                          const void *_data) {
   VkBufferUsageFlags usage = _usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
   Buffer buffer = createBuffer(_renderer, _size, usage,
                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-  Buffer stagingBuffer = createStagingBuffer(_renderer, buffer);
-  void *dst;
-  vkMapMemory(_renderer.Device, stagingBuffer.Memory, 0, stagingBuffer.Size, 0,
-              &dst);
-  memcpy(dst, _data, _size);
-  vkUnmapMemory(_renderer.Device, stagingBuffer.Memory);
 
-  copyBuffer(_renderer, _cmdPool, buffer, stagingBuffer, _size);
+  StagingRing &stagingRing = *_renderer.StagingRing;
+  StagingAllocation staging = allocateStagingMemory(stagingRing, _size);
+  memcpy(staging.Data, _data, _size);
 
-  destroyBuffer(_renderer, stagingBuffer);
+  StagingBatch *batch = beginStagingBatch(stagingRing);
+  recordStagedBufferCopy(batch->CmdBuffer, staging, buffer.Handle);
+  submitStagingBatch(stagingRing, batch, &staging, 1);
 
   return buffer;
 }
@@ -728,49 +867,11 @@ Buffer createDeviceLocalBufferFromMemory(const Renderer &_renderer,
 void destroyBuffer(const Renderer &_renderer, Buffer &_buffer) {
   vkDestroyBuffer(_renderer.Device, _buffer.Handle, nullptr);
   _buffer.Handle = VK_NULL_HANDLE;
-  vkFreeMemory(_renderer.Device, _buffer.Memory, nullptr);
-  _buffer.Memory = VK_NULL_HANDLE;
-}
-
-void copyBuffer(const Renderer &_renderer, VkCommandPool _cmdPool,
-                Buffer &_dstBuffer, Buffer &_srcBuffer, VkDeviceSize _size) {
-  VkCommandBufferAllocateInfo cmdBufferAllocInfo = {};
-  cmdBufferAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-  cmdBufferAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  cmdBufferAllocInfo.commandPool = _cmdPool;
-  cmdBufferAllocInfo.commandBufferCount = 1;
-  VkCommandBuffer cmdBuffer;
-  BB_VK_ASSERT(vkAllocateCommandBuffers(_renderer.Device, &cmdBufferAllocInfo,
-                                        &cmdBuffer));
-
-  VkCommandBufferBeginInfo cmdBeginInfo = {};
-  cmdBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  cmdBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-  BB_VK_ASSERT(vkBeginCommandBuffer(cmdBuffer, &cmdBeginInfo));
-
-  VkBufferCopy copyRegion = {};
-  copyRegion.srcOffset = 0;
-  copyRegion.dstOffset = 0;
-  copyRegion.size = _size;
-  vkCmdCopyBuffer(cmdBuffer, _srcBuffer.Handle, _dstBuffer.Handle, 1,
-                  &copyRegion);
-
-  BB_VK_ASSERT(vkEndCommandBuffer(cmdBuffer));
-
-  VkSubmitInfo submitInfo = {};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &cmdBuffer;
-  vkQueueSubmit(_renderer.Queue, 1, &submitInfo, VK_NULL_HANDLE);
-  vkQueueWaitIdle(_renderer.Queue);
-
-  vkFreeCommandBuffers(_renderer.Device, cmdBufferAllocInfo.commandPool, 1,
-                       &cmdBuffer);
+  freeDeviceMemory(*_renderer.MemoryAllocator, _buffer.Allocation);
 }
 
-Image createImage(const Renderer &_renderer, const ImageParams &_params) {
-  Image image = {};
-
+static VkImage createImageHandle(const Renderer &_renderer,
+                                 const ImageParams &_params) {
   VkImageCreateInfo imageCreateInfo = {};
   imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
   imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -785,67 +886,101 @@ Image createImage(const Renderer &_renderer, const ImageParams &_params) {
   imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
   imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
 
-  BB_VK_ASSERT(vkCreateImage(_renderer.Device, &imageCreateInfo, nullptr,
-                             &image.Handle));
-
-  VkMemoryRequirements memRequirements;
-  vkGetImageMemoryRequirements(_renderer.Device, image.Handle,
-                               &memRequirements);
-
-  VkMemoryAllocateInfo textureImageMemoryAllocateInfo = {};
-  textureImageMemoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  textureImageMemoryAllocateInfo.allocationSize = memRequirements.size;
-  textureImageMemoryAllocateInfo.memoryTypeIndex =
-      findMemoryType(_renderer, memRequirements.memoryTypeBits,
-                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-  BB_VK_ASSERT(vkAllocateMemory(_renderer.Device,
-                                &textureImageMemoryAllocateInfo, nullptr,
-                                &image.Memory));
-
+  VkImage handle;
   BB_VK_ASSERT(
-      vkBindImageMemory(_renderer.Device, image.Handle, image.Memory, 0));
+      vkCreateImage(_renderer.Device, &imageCreateInfo, nullptr, &handle));
+  return handle;
+}
 
+static VkImageView createImageView(const Renderer &_renderer, VkImage _image,
+                                   VkFormat _format) {
   VkImageViewCreateInfo imageViewCreateInfo = {};
   imageViewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-  imageViewCreateInfo.image = image.Handle;
+  imageViewCreateInfo.image = _image;
   imageViewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-  imageViewCreateInfo.format = _params.Format;
+  imageViewCreateInfo.format = _format;
   imageViewCreateInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
   imageViewCreateInfo.subresourceRange.baseMipLevel = 0;
   imageViewCreateInfo.subresourceRange.levelCount = 1;
   imageViewCreateInfo.subresourceRange.baseArrayLayer = 0;
   imageViewCreateInfo.subresourceRange.layerCount = 1;
-  BB_VK_ASSERT(vkCreateImageView(_renderer.Device, &imageViewCreateInfo,
-                                 nullptr, &image.View));
 
+  VkImageView view;
+  BB_VK_ASSERT(
+      vkCreateImageView(_renderer.Device, &imageViewCreateInfo, nullptr, &view));
+  return view;
+}
+
+uint32_t getFormatSize(VkFormat _format) {
+  switch (_format) {
+  case VK_FORMAT_R8G8B8A8_UNORM:
+  case VK_FORMAT_R8G8B8A8_SRGB:
+  case VK_FORMAT_B8G8R8A8_UNORM:
+  case VK_FORMAT_B8G8R8A8_SRGB:
+  case VK_FORMAT_R16G16_SNORM:
+  case VK_FORMAT_R16G16_SFLOAT:
+  case VK_FORMAT_D32_SFLOAT:
+    return 4;
+  case VK_FORMAT_R16G16B16A16_SFLOAT:
+    return 8;
+  default:
+    BB_ASSERT(false);
+    return 0;
+  }
+}
+
+void getGBufferAttachmentFormats(
+    const Renderer &_renderer, VkFormat (&_outFormats)[numGBufferAttachments]) {
+  std::copy(std::begin(gbufferAttachmentFormats),
+            std::end(gbufferAttachmentFormats), _outFormats);
+
+  for (VkFormat &format : _outFormats) {
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties(_renderer.PhysicalDevice, format,
+                                        &properties);
+    if (properties.optimalTilingFeatures &
+        VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT) {
+      continue;
+    }
+    // The other formats are required to be renderable.
+    BB_ASSERT(&format == &_outFormats[0]);
+    BB_LOG_INFO("G-buffer normals fall back to R16G16_SFLOAT, R16G16_SNORM "
+                "isn't renderable");
+    format = fallbackGBufferNormalFormat;
+  }
+}
+
+Image createImage(const Renderer &_renderer, const ImageParams &_params) {
+  Image image = {};
+  image.Handle = createImageHandle(_renderer, _params);
+  image.Allocation = allocateImageMemory(_renderer, image.Handle,
+                                         _params.Usage, _params.MemoryPool);
+  image.View = createImageView(_renderer, image.Handle, _params.Format);
   return image;
 }
 
 Image createImageFromFile(const Renderer &_renderer,
-                          VkCommandPool _transientCmdPool,
                           const std::string &_filePath) {
   Image result = {};
 
+  std::vector<uint8_t> fileStorage;
+  ResourceRange fileContents;
+  if (!loadResourceFile(_filePath, fileStorage, fileContents))
+    return {};
+
   Int2 textureDims = {};
   int numChannels;
-  stbi_uc *pixels = stbi_load(_filePath.c_str(), &textureDims.X, &textureDims.Y,
-                              &numChannels, STBI_rgb_alpha);
+  stbi_uc *pixels = stbi_load_from_memory(
+      fileContents.Data, (int)fileContents.Size, &textureDims.X,
+      &textureDims.Y, &numChannels, STBI_rgb_alpha);
   if (!pixels)
     return {};
 
   VkDeviceSize textureSize = textureDims.X * textureDims.Y * 4;
 
-  Buffer textureStagingBuffer =
-      createBuffer(_renderer, textureSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                       VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-  void *data;
-  vkMapMemory(_renderer.Device, textureStagingBuffer.Memory, 0, textureSize, 0,
-              &data);
-  memcpy(data, pixels, textureSize);
-  vkUnmapMemory(_renderer.Device, textureStagingBuffer.Memory);
+  StagingRing &stagingRing = *_renderer.StagingRing;
+  StagingAllocation staging = allocateStagingMemory(stagingRing, textureSize);
+  memcpy(staging.Data, pixels, textureSize);
 
   stbi_image_free(pixels);
 
@@ -869,90 +1004,12 @@ Image createImageFromFile(const Renderer &_renderer,
   BB_VK_ASSERT(vkCreateImage(_renderer.Device, &imageCreateInfo, nullptr,
                              &result.Handle));
 
-  VkMemoryRequirements memRequirements;
-  vkGetImageMemoryRequirements(_renderer.Device, result.Handle,
-                               &memRequirements);
-
-  VkMemoryAllocateInfo textureImageMemoryAllocateInfo = {};
-  textureImageMemoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  textureImageMemoryAllocateInfo.allocationSize = memRequirements.size;
-  textureImageMemoryAllocateInfo.memoryTypeIndex =
-      findMemoryType(_renderer, memRequirements.memoryTypeBits,
-                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  result.Allocation =
+      allocateImageMemory(_renderer, result.Handle, imageCreateInfo.usage);
 
-  BB_VK_ASSERT(vkAllocateMemory(_renderer.Device,
-                                &textureImageMemoryAllocateInfo, nullptr,
-                                &result.Memory));
-
-  BB_VK_ASSERT(
-      vkBindImageMemory(_renderer.Device, result.Handle, result.Memory, 0));
-
-  VkCommandBufferAllocateInfo cmdBufferAllocInfo = {};
-  cmdBufferAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-  cmdBufferAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  cmdBufferAllocInfo.commandPool = _transientCmdPool;
-  cmdBufferAllocInfo.commandBufferCount = 1;
-
-  VkCommandBuffer cmdBuffer;
-  BB_VK_ASSERT(vkAllocateCommandBuffers(_renderer.Device, &cmdBufferAllocInfo,
-                                        &cmdBuffer));
-
-  VkCommandBufferBeginInfo cmdBeginInfo = {};
-  cmdBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  cmdBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-  BB_VK_ASSERT(vkBeginCommandBuffer(cmdBuffer, &cmdBeginInfo));
-  VkImageMemoryBarrier barrier = {};
-  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-
-  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-  barrier.srcAccessMask = 0;
-  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-  barrier.image = result.Handle;
-  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  barrier.subresourceRange.baseMipLevel = 0;
-  barrier.subresourceRange.levelCount = 1;
-  barrier.subresourceRange.baseArrayLayer = 0;
-  barrier.subresourceRange.layerCount = 1;
-  vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
-                       nullptr, 1, &barrier);
-  VkBufferImageCopy region = {};
-  region.bufferOffset = 0;
-  region.bufferRowLength = 0;
-  region.bufferImageHeight = 0;
-  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  region.imageSubresource.mipLevel = 0;
-  region.imageSubresource.baseArrayLayer = 0;
-  region.imageSubresource.layerCount = 1;
-  region.imageOffset = {0, 0, 0};
-  region.imageExtent = int2ToExtent3D(textureDims);
-  vkCmdCopyBufferToImage(cmdBuffer, textureStagingBuffer.Handle, result.Handle,
-                         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-  barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-  vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0,
-                       nullptr, 1, &barrier);
-  BB_VK_ASSERT(vkEndCommandBuffer(cmdBuffer));
-
-  VkSubmitInfo submitInfo = {};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &cmdBuffer;
-  BB_VK_ASSERT(vkQueueSubmit(_renderer.Queue, 1, &submitInfo, VK_NULL_HANDLE));
-  BB_VK_ASSERT(vkQueueWaitIdle(_renderer.Queue));
-  vkFreeCommandBuffers(_renderer.Device, _transientCmdPool, 1, &cmdBuffer);
-
-  destroyBuffer(_renderer, textureStagingBuffer);
+  StagingBatch *batch = beginStagingBatch(stagingRing);
+  recordStagedImageCopy(batch->CmdBuffer, staging, result.Handle, textureDims);
+  submitStagingBatch(stagingRing, batch, &staging, 1);
 
   VkImageViewCreateInfo imageViewCreateInfo = {};
   imageViewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -973,10 +1030,154 @@ Image createImageFromFile(const Renderer &_renderer,
 void destroyImage(const Renderer &_renderer, Image &_image) {
   vkDestroyImageView(_renderer.Device, _image.View, nullptr);
   vkDestroyImage(_renderer.Device, _image.Handle, nullptr);
-  vkFreeMemory(_renderer.Device, _image.Memory, nullptr);
+  freeDeviceMemory(*_renderer.MemoryAllocator, _image.Allocation);
   _image = {};
 }
 
+RenderPassAttachmentMemoryReport
+createRenderPassAttachments(const Renderer &_renderer,
+                            const RenderPassAttachmentParams *_params,
+                            uint32_t _numAttachments, LinearMemoryPool &_pool,
+                            Image *_outImages, bool *_outMayAlias) {
+  RenderPassAttachmentMemoryReport report = {};
+
+  const VkImageUsageFlags attachmentUsages =
+      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+      VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+      VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+
+  struct Placement {
+    uint32_t Index;
+    VkMemoryRequirements Requirements;
+    VkDeviceSize Offset;
+  };
+  std::vector<Placement> placements;
+
+  for (uint32_t i = 0; i < _numAttachments; ++i) {
+    ImageParams imageParams = _params[i].Image;
+    imageParams.MemoryPool = nullptr;
+    _outMayAlias[i] = false;
+
+    bool canBeTransient = (imageParams.Usage & ~attachmentUsages) == 0;
+    if (canBeTransient) {
+      imageParams.Usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+    }
+
+    Image &image = _outImages[i];
+    image = {};
+    image.Handle = createImageHandle(_renderer, imageParams);
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(_renderer.Device, image.Handle,
+                                 &requirements);
+    report.SeparateBytes += requirements.size;
+
+    if (canBeTransient &&
+        hasDeviceMemoryType(*_renderer.MemoryAllocator,
+                            requirements.memoryTypeBits,
+                            VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT)) {
+      DeviceAllocationParams allocationParams = {};
+      allocationParams.Requirements = requirements;
+      allocationParams.Properties = VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+      allocationParams.ResourceKind = DeviceResourceKind::Image;
+      allocationParams.Category = DeviceMemoryCategory::Attachment;
+      allocationParams.IsDedicated = true;
+      allocationParams.DedicatedImage = image.Handle;
+      image.Allocation =
+          allocateDeviceMemory(*_renderer.MemoryAllocator, allocationParams);
+      BB_VK_ASSERT(vkBindImageMemory(_renderer.Device, image.Handle,
+                                     image.Allocation.Memory,
+                                     image.Allocation.Offset));
+      image.View = createImageView(_renderer, image.Handle, imageParams.Format);
+
+      ++report.NumLazy;
+      report.LazyBytes += requirements.size;
+      continue;
+    }
+
+    placements.push_back({i, requirements, 0});
+  }
+
+  // Place the biggest attachments first, each one at the lowest offset that
+  // doesn't overlap an attachment that is alive at the same time.
+  std::sort(placements.begin(), placements.end(),
+            [](const Placement &_a, const Placement &_b) {
+              return _a.Requirements.size > _b.Requirements.size;
+            });
+
+  auto areAliveTogether = [&](const Placement &_a, const Placement &_b) {
+    const RenderPassAttachmentParams &a = _params[_a.Index];
+    const RenderPassAttachmentParams &b = _params[_b.Index];
+    return (a.FirstSubpass <= b.LastSubpass) &&
+           (b.FirstSubpass <= a.LastSubpass);
+  };
+  auto doMemoryRangesOverlap = [](const Placement &_a, const Placement &_b) {
+    return (_a.Offset < _b.Offset + _b.Requirements.size) &&
+           (_b.Offset < _a.Offset + _a.Requirements.size);
+  };
+
+  VkMemoryRequirements blockRequirements = {};
+  blockRequirements.memoryTypeBits = ~0u;
+  blockRequirements.alignment = 1;
+  for (size_t i = 0; i < placements.size(); ++i) {
+    Placement &placement = placements[i];
+    VkDeviceSize alignment = placement.Requirements.alignment;
+
+    bool isMoved = true;
+    while (isMoved) {
+      isMoved = false;
+      for (size_t j = 0; j < i; ++j) {
+        const Placement &other = placements[j];
+        if (areAliveTogether(placement, other) &&
+            doMemoryRangesOverlap(placement, other)) {
+          placement.Offset =
+              (other.Offset + other.Requirements.size + alignment - 1) /
+              alignment * alignment;
+          isMoved = true;
+        }
+      }
+    }
+
+    blockRequirements.size = std::max(
+        blockRequirements.size, placement.Offset + placement.Requirements.size);
+    blockRequirements.alignment =
+        std::max(blockRequirements.alignment, alignment);
+    blockRequirements.memoryTypeBits &= placement.Requirements.memoryTypeBits;
+  }
+  // Every attachment here is an optimal tiling image on the same device, so
+  // they're expected to agree on a memory type.
+  BB_ASSERT(placements.empty() || blockRequirements.memoryTypeBits);
+
+  DeviceAllocation blockAllocation = {};
+  if (!placements.empty()) {
+    blockAllocation = allocateFromLinearMemoryPool(_pool, blockRequirements);
+    report.AliasedBytes = blockRequirements.size;
+  }
+
+  for (const Placement &placement : placements) {
+    for (const Placement &other : placements) {
+      if ((&other != &placement) && doMemoryRangesOverlap(placement, other)) {
+        _outMayAlias[placement.Index] = true;
+      }
+    }
+    if (_outMayAlias[placement.Index]) {
+      ++report.NumAliased;
+    }
+
+    Image &image = _outImages[placement.Index];
+    image.Allocation = blockAllocation;
+    image.Allocation.Offset += placement.Offset;
+    image.Allocation.Size = placement.Requirements.size;
+    BB_VK_ASSERT(vkBindImageMemory(_renderer.Device, image.Handle,
+                                   image.Allocation.Memory,
+                                   image.Allocation.Offset));
+    image.View = createImageView(_renderer, image.Handle,
+                                 _params[placement.Index].Image.Format);
+  }
+
+  return report;
+}
+
 VkPipelineShaderStageCreateInfo Shader::getStageInfo() const {
   VkPipelineShaderStageCreateInfo stageInfo = {};
   stageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -996,27 +1197,29 @@ Shader createShaderFromFile(const Renderer &_renderer,
     result.Stage = VK_SHADER_STAGE_FRAGMENT_BIT;
   } else if (endsWith(_filePath, ".geom.spv")) {
     result.Stage = VK_SHADER_STAGE_GEOMETRY_BIT;
+  } else if (endsWith(_filePath, ".comp.spv")) {
+    result.Stage = VK_SHADER_STAGE_COMPUTE_BIT;
   } else {
     BB_ASSERT(false);
   }
 
   std::string fileAbsPath = createShaderPath(_filePath);
 
-  FILE *f = fopen(fileAbsPath.c_str(), "rb");
-  BB_ASSERT(f);
-  fseek(f, 0, SEEK_END);
-  long fileSize = ftell(f);
-  rewind(f);
-  uint8_t *contents = new uint8_t[fileSize];
-  fread(contents, sizeof(*contents), fileSize, f);
+  std::vector<uint8_t> storage;
+  ResourceRange contents;
+  bool isRead = loadResourceFile(fileAbsPath, storage, contents);
+  BB_ASSERT(isRead);
 
   VkShaderModuleCreateInfo createInfo = {};
   createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-  createInfo.codeSize = fileSize;
-  createInfo.pCode = (uint32_t *)contents;
+  createInfo.codeSize = contents.Size;
+  createInfo.pCode = (const uint32_t *)contents.Data;
 
   BB_VK_ASSERT(vkCreateShaderModule(_renderer.Device, &createInfo, nullptr,
                                     &result.Handle));
+  result.Reflection = reflectSPIRV((const uint32_t *)contents.Data,
+                                   contents.Size / sizeof(uint32_t),
+                                   result.Stage);
 
 #if BB_DEBUG
   {
@@ -1030,9 +1233,6 @@ Shader createShaderFromFile(const Renderer &_renderer,
   }
 #endif
 
-  delete[] contents;
-  fclose(f);
-
   return result;
 }
 
@@ -1041,12 +1241,109 @@ void destroyShader(const Renderer &_renderer, Shader &_shader) {
   _shader = {};
 }
 
+// Light count buckets a permutation's MaxNumLights is rounded up to.
+constexpr uint32_t permutationLightCounts[] = {4, 16, MAX_NUM_LIGHTS};
+
+static_assert(sizeof(ShaderPermutation) ==
+                  sizeof(uint32_t) * (size_t)PermutationConstant::COUNT,
+              "Every ShaderPermutation field is one specialization constant");
+
+ShaderPermutation getFullShaderPermutation() {
+  ShaderPermutation permutation = {};
+  permutation.LightTypeMask = (1u << (uint32_t)LightType::Point) |
+                              (1u << (uint32_t)LightType::Spot) |
+                              (1u << (uint32_t)LightType::Directional);
+  permutation.MaxNumLights = MAX_NUM_LIGHTS;
+  permutation.EnableNormalMap = VK_TRUE;
+  permutation.EnableToneMapping = VK_TRUE;
+  return permutation;
+}
+
+ShaderPermutation maskShaderPermutation(const ShaderPermutation &_permutation,
+                                        uint32_t _specConstantMask) {
+  ShaderPermutation full = getFullShaderPermutation();
+  const uint32_t *src = (const uint32_t *)&_permutation;
+  const uint32_t *fullValues = (const uint32_t *)&full;
+
+  ShaderPermutation masked;
+  uint32_t *dst = (uint32_t *)&masked;
+  for (uint32_t i = 0; i < (uint32_t)PermutationConstant::COUNT; ++i) {
+    dst[i] = (_specConstantMask & (1u << i)) ? src[i] : fullValues[i];
+  }
+  return masked;
+}
+
+uint64_t getShaderPermutationKey(const ShaderPermutation &_permutation) {
+  BB_ASSERT(_permutation.LightTypeMask < (1u << 8));
+  BB_ASSERT(_permutation.MaxNumLights < (1u << 16));
+  return (uint64_t)_permutation.LightTypeMask |
+         ((uint64_t)_permutation.MaxNumLights << 8) |
+         ((uint64_t)_permutation.EnableNormalMap << 24) |
+         ((uint64_t)_permutation.EnableToneMapping << 25);
+}
+
+std::string getShaderPermutationName(const ShaderPermutation &_permutation) {
+  std::string lightTypes;
+  const char *typeNames[] = {"Point", "Spot", "Directional"};
+  for (uint32_t i = 0; i < std::size(typeNames); ++i) {
+    if (_permutation.LightTypeMask & (1u << i)) {
+      lightTypes += lightTypes.empty() ? "" : "|";
+      lightTypes += typeNames[i];
+    }
+  }
+  return fmt::format("Lights {} x{}{}{}",
+                     lightTypes.empty() ? "None" : lightTypes,
+                     _permutation.MaxNumLights,
+                     _permutation.EnableNormalMap ? ", Normal Map" : "",
+                     _permutation.EnableToneMapping ? ", Tone Mapping" : "");
+}
+
+ShaderPermutation selectShaderPermutation(const Light *_lights,
+                                          uint32_t _numLights,
+                                          bool _enableNormalMap,
+                                          bool _enableToneMapping) {
+  ShaderPermutation permutation = {};
+  for (uint32_t i = 0; i < _numLights; ++i) {
+    permutation.LightTypeMask |= 1u << (uint32_t)_lights[i].Type;
+  }
+  // There can be more lights than that in total, but no loop goes further.
+  permutation.MaxNumLights = MAX_NUM_LIGHTS;
+  for (uint32_t lightCount : permutationLightCounts) {
+    if (_numLights <= lightCount) {
+      permutation.MaxNumLights = lightCount;
+      break;
+    }
+  }
+  permutation.EnableNormalMap = _enableNormalMap ? VK_TRUE : VK_FALSE;
+  permutation.EnableToneMapping = _enableToneMapping ? VK_TRUE : VK_FALSE;
+  return permutation;
+}
+
 VkPipeline createPipeline(const Renderer &_renderer,
                           const PipelineParams &_params) {
+  // Every stage gets every constant; entries for ids a module doesn't declare
+  // are ignored.
+  VkSpecializationMapEntry specEntries[(size_t)PermutationConstant::COUNT];
+  for (uint32_t i = 0; i < (uint32_t)PermutationConstant::COUNT; ++i) {
+    specEntries[i].constantID = i;
+    specEntries[i].offset = i * sizeof(uint32_t);
+    specEntries[i].size = sizeof(uint32_t);
+  }
+  VkSpecializationInfo specInfo = {};
+  specInfo.mapEntryCount = (uint32_t)std::size(specEntries);
+  specInfo.pMapEntries = specEntries;
+  specInfo.dataSize = sizeof(ShaderPermutation);
+  specInfo.pData = _params.Permutation;
+
   std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
   shaderStages.reserve(_params.NumShaders);
   for (int i = 0; i < _params.NumShaders; ++i) {
-    shaderStages.push_back(_params.Shaders[i]->getStageInfo());
+    VkPipelineShaderStageCreateInfo stageInfo =
+        _params.Shaders[i]->getStageInfo();
+    if (_params.Permutation) {
+      stageInfo.pSpecializationInfo = &specInfo;
+    }
+    shaderStages.push_back(stageInfo);
   }
 
   VkPipelineVertexInputStateCreateInfo vertexInputState = {};
@@ -1066,26 +1363,23 @@ VkPipeline createPipeline(const Renderer &_renderer,
   inputAssemblyState.topology = _params.InputAssembly.Topology;
   inputAssemblyState.primitiveRestartEnable = VK_FALSE;
 
-  VkViewport viewport = {};
-  viewport.x = _params.Viewport.Offset.X;
-  viewport.y = _params.Viewport.Offset.Y;
-  viewport.width = _params.Viewport.Extent.X;
-  viewport.height = _params.Viewport.Extent.Y;
-  viewport.minDepth = 0.f;
-  viewport.maxDepth = 1.f;
-
-  VkRect2D scissor = {};
-  scissor.offset.x = _params.Viewport.ScissorOffset.X;
-  scissor.offset.y = _params.Viewport.ScissorOffset.Y;
-  scissor.extent.width = _params.Viewport.ScissorExtent.X;
-  scissor.extent.height = _params.Viewport.ScissorExtent.Y;
-
+  // Viewport and scissor are set while recording, so that pipelines don't
+  // have to be rebuilt when the window is resized.
   VkPipelineViewportStateCreateInfo viewportState = {};
   viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
   viewportState.viewportCount = 1;
-  viewportState.pViewports = &viewport;
   viewportState.scissorCount = 1;
-  viewportState.pScissors = &scissor;
+
+  VkDynamicState dynamicStates[] = {VK_DYNAMIC_STATE_VIEWPORT,
+                                    VK_DYNAMIC_STATE_SCISSOR,
+                                    VK_DYNAMIC_STATE_DEPTH_BOUNDS};
+  VkPipelineDynamicStateCreateInfo dynamicState = {};
+  dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamicState.dynamicStateCount = (uint32_t)std::size(dynamicStates);
+  if (!_params.DepthStencil.DepthBoundsTestEnable) {
+    --dynamicState.dynamicStateCount;
+  }
+  dynamicState.pDynamicStates = dynamicStates;
 
   VkPipelineRasterizationStateCreateInfo rasterizationState = {};
   rasterizationState.sType =
@@ -1119,7 +1413,8 @@ VkPipeline createPipeline(const Renderer &_renderer,
   depthStencilState.depthWriteEnable =
       _params.DepthStencil.DepthWriteEnable ? VK_TRUE : VK_FALSE;
   depthStencilState.depthCompareOp = VK_COMPARE_OP_GREATER_OR_EQUAL;
-  depthStencilState.depthBoundsTestEnable = VK_FALSE;
+  depthStencilState.depthBoundsTestEnable =
+      _params.DepthStencil.DepthBoundsTestEnable ? VK_TRUE : VK_FALSE;
   depthStencilState.minDepthBounds = 1.f;
   depthStencilState.maxDepthBounds = 0.f;
   depthStencilState.stencilTestEnable = VK_FALSE;
@@ -1128,12 +1423,15 @@ VkPipeline createPipeline(const Renderer &_renderer,
   colorBlendAttachmentState.colorWriteMask =
       VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
       VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-  colorBlendAttachmentState.blendEnable = VK_FALSE;
+  colorBlendAttachmentState.blendEnable =
+      _params.Blend.Additive ? VK_TRUE : VK_FALSE;
   colorBlendAttachmentState.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
-  colorBlendAttachmentState.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
+  colorBlendAttachmentState.dstColorBlendFactor =
+      _params.Blend.Additive ? VK_BLEND_FACTOR_ONE : VK_BLEND_FACTOR_ZERO;
   colorBlendAttachmentState.colorBlendOp = VK_BLEND_OP_ADD;
   colorBlendAttachmentState.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-  colorBlendAttachmentState.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+  colorBlendAttachmentState.dstAlphaBlendFactor =
+      _params.Blend.Additive ? VK_BLEND_FACTOR_ONE : VK_BLEND_FACTOR_ZERO;
   colorBlendAttachmentState.alphaBlendOp = VK_BLEND_OP_ADD;
 
   std::vector<VkPipelineColorBlendAttachmentState> colorBlendAttachmentStates(
@@ -1162,23 +1460,56 @@ VkPipeline createPipeline(const Renderer &_renderer,
   pipelineCreateInfo.pMultisampleState = &multisampleState;
   pipelineCreateInfo.pDepthStencilState = &depthStencilState;
   pipelineCreateInfo.pColorBlendState = &colorBlendState;
-  pipelineCreateInfo.pDynamicState = nullptr;
+  pipelineCreateInfo.pDynamicState = &dynamicState;
   pipelineCreateInfo.layout = _params.PipelineLayout;
   pipelineCreateInfo.renderPass = _params.RenderPass;
   pipelineCreateInfo.subpass = _params.Subpass;
   pipelineCreateInfo.basePipelineHandle = VK_NULL_HANDLE;
   pipelineCreateInfo.basePipelineIndex = -1;
 
+  VkPipelineCache pipelineCache =
+      getThreadPipelineCache(_renderer, *_renderer.PipelineCache);
+
   VkPipeline pipeline;
-  BB_VK_ASSERT(vkCreateGraphicsPipelines(_renderer.Device, VK_NULL_HANDLE, 1,
+  Time creationStartTime = getCurrentTime();
+  BB_VK_ASSERT(vkCreateGraphicsPipelines(_renderer.Device, pipelineCache, 1,
                                          &pipelineCreateInfo, nullptr,
                                          &pipeline));
+  recordPipelineCreation(
+      *_renderer.PipelineCache, _params.Name,
+      getElapsedTimeInSeconds(creationStartTime, getCurrentTime()));
+
+  return pipeline;
+}
+
+VkPipeline createComputePipeline(const Renderer &_renderer, const char *_name,
+                                 const Shader &_shader,
+                                 VkPipelineLayout _pipelineLayout) {
+  BB_ASSERT(_shader.Stage == VK_SHADER_STAGE_COMPUTE_BIT);
+
+  VkComputePipelineCreateInfo pipelineCreateInfo = {};
+  pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipelineCreateInfo.stage = _shader.getStageInfo();
+  pipelineCreateInfo.layout = _pipelineLayout;
+  pipelineCreateInfo.basePipelineHandle = VK_NULL_HANDLE;
+  pipelineCreateInfo.basePipelineIndex = -1;
+
+  VkPipelineCache pipelineCache =
+      getThreadPipelineCache(_renderer, *_renderer.PipelineCache);
+
+  VkPipeline pipeline;
+  Time creationStartTime = getCurrentTime();
+  BB_VK_ASSERT(vkCreateComputePipelines(_renderer.Device, pipelineCache, 1,
+                                        &pipelineCreateInfo, nullptr,
+                                        &pipeline));
+  recordPipelineCreation(
+      *_renderer.PipelineCache, _name,
+      getElapsedTimeInSeconds(creationStartTime, getCurrentTime()));
 
   return pipeline;
 }
 
 PBRMaterial createPBRMaterialFromFiles(const Renderer &_renderer,
-                                       VkCommandPool _transientCmdPool,
                                        const std::string &_rootPath) {
   // TODO(ilgwon): Convert _rootPath to absolute path if it's not already.
   PBRMaterial result = {};
@@ -1200,21 +1531,21 @@ PBRMaterial createPBRMaterialFromFiles(const Renderer &_renderer,
   enqueueImageLoadTask(loader, _renderer, joinPaths(_rootPath, "height.png"),
                        result.Maps[PBRMapType::Height]);
 
-  finalizeAllImageLoads(loader, _renderer, _transientCmdPool);
+  finalizeAllImageLoads(loader, _renderer);
 
 #if 0
   result.Maps[PBRMapType::Albedo] = createImageFromFile(
-      _renderer, _transientCmdPool, joinPaths(_rootPath, "albedo.png"));
+      _renderer, joinPaths(_rootPath, "albedo.png"));
   result.Maps[PBRMapType::Metallic] = createImageFromFile(
-      _renderer, _transientCmdPool, joinPaths(_rootPath, "metallic.png"));
+      _renderer, joinPaths(_rootPath, "metallic.png"));
   result.Maps[PBRMapType::Roughness] = createImageFromFile(
-      _renderer, _transientCmdPool, joinPaths(_rootPath, "roughness.png"));
+      _renderer, joinPaths(_rootPath, "roughness.png"));
   result.Maps[PBRMapType::AO] = createImageFromFile(
-      _renderer, _transientCmdPool, joinPaths(_rootPath, "ao.png"));
+      _renderer, joinPaths(_rootPath, "ao.png"));
   result.Maps[PBRMapType::Normal] = createImageFromFile(
-      _renderer, _transientCmdPool, joinPaths(_rootPath, "normal.png"));
+      _renderer, joinPaths(_rootPath, "normal.png"));
   result.Maps[PBRMapType::Height] = createImageFromFile(
-      _renderer, _transientCmdPool, joinPaths(_rootPath, "height.png"));
+      _renderer, joinPaths(_rootPath, "height.png"));
 #endif
 
 #if BB_DEBUG
@@ -1240,79 +1571,65 @@ void destroyPBRMaterial(const Renderer &_renderer, PBRMaterial &_material) {
   _material = {};
 }
 
-PBRMaterialSet createPBRMaterialSet(const Renderer &_renderer,
-                                    VkCommandPool _cmdPool) {
+PBRMaterialSet createPBRMaterialSet(const Renderer &_renderer) {
   PBRMaterialSet materialSet = {};
 
-  std::vector<std::string> pbrDirs;
+  ImageLoader loader;
+  BB_DEFER(destroyImageLoader(loader));
 
-  {
-    WIN32_FIND_DATA fileFindData;
-    std::string pbrRoot = createCommonResourcePath("pbr/*");
-    HANDLE findHandle = FindFirstFileA(pbrRoot.c_str(), &fileFindData);
+  beginPBRMaterialSetLoad(_renderer, materialSet, loader);
+  finalizeAllImageLoads(loader, _renderer);
+  finishPBRMaterialSetLoad(materialSet);
 
-    do {
-      if ((strcmp(fileFindData.cFileName, ".") != 0) &&
-          (strcmp(fileFindData.cFileName, "..") != 0) &&
-          (fileFindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+  return materialSet;
+}
 
-        pbrDirs.push_back(
-            createCommonResourcePath(joinPaths("pbr", fileFindData.cFileName)));
-#if 0
-        PBRMaterial material = createPBRMaterialFromFiles(
-            _renderer, _cmdPool,
-            createCommonResourcePath(joinPaths("pbr", fileFindData.cFileName)));
-
-        if (strcmp(fileFindData.cFileName, "default") == 0) {
-          materialSet.DefaultMaterial = std::move(material);
-        } else {
-          materialSet.Materials.push_back(std::move(material));
-        }
-#endif
-      }
-    } while (FindNextFileA(findHandle, &fileFindData));
-    FindClose(findHandle);
+void beginPBRMaterialSetLoad(const Renderer &_renderer,
+                             PBRMaterialSet &_materialSet,
+                             ImageLoader &_loader) {
+  std::vector<std::string> pbrDirs =
+      listSubdirectories(createCommonResourcePath("pbr"));
+  for (std::string &pbrDir : pbrDirs) {
+    pbrDir = createCommonResourcePath(joinPaths("pbr", pbrDir));
   }
 
-  ImageLoader loader;
-  BB_DEFER(destroyImageLoader(loader));
-
-  materialSet.Materials.resize(pbrDirs.size());
-  for (size_t i = 0; i < materialSet.Materials.size(); ++i) {
-    PBRMaterial &material = materialSet.Materials[i];
+  _materialSet.Materials.resize(pbrDirs.size());
+  for (size_t i = 0; i < _materialSet.Materials.size(); ++i) {
+    PBRMaterial &material = _materialSet.Materials[i];
 
     material.Name = getFileName(pbrDirs[i]);
 
-    enqueueImageLoadTask(loader, _renderer, joinPaths(pbrDirs[i], "albedo.png"),
+    enqueueImageLoadTask(_loader, _renderer,
+                         joinPaths(pbrDirs[i], "albedo.png"),
                          material.Maps[PBRMapType::Albedo]);
-    enqueueImageLoadTask(loader, _renderer,
+    enqueueImageLoadTask(_loader, _renderer,
                          joinPaths(pbrDirs[i], "metallic.png"),
                          material.Maps[PBRMapType::Metallic]);
-    enqueueImageLoadTask(loader, _renderer,
+    enqueueImageLoadTask(_loader, _renderer,
                          joinPaths(pbrDirs[i], "roughness.png"),
                          material.Maps[PBRMapType::Roughness]);
-    enqueueImageLoadTask(loader, _renderer, joinPaths(pbrDirs[i], "ao.png"),
+    enqueueImageLoadTask(_loader, _renderer, joinPaths(pbrDirs[i], "ao.png"),
                          material.Maps[PBRMapType::AO]);
-    enqueueImageLoadTask(loader, _renderer, joinPaths(pbrDirs[i], "normal.png"),
+    enqueueImageLoadTask(_loader, _renderer,
+                         joinPaths(pbrDirs[i], "normal.png"),
                          material.Maps[PBRMapType::Normal]);
-    enqueueImageLoadTask(loader, _renderer, joinPaths(pbrDirs[i], "height.png"),
+    enqueueImageLoadTask(_loader, _renderer,
+                         joinPaths(pbrDirs[i], "height.png"),
                          material.Maps[PBRMapType::Height]);
   }
+}
 
-  finalizeAllImageLoads(loader, _renderer, _cmdPool);
-
-  for (size_t i = 0; i < materialSet.Materials.size(); ++i) {
-    PBRMaterial &material = materialSet.Materials[i];
+void finishPBRMaterialSetLoad(PBRMaterialSet &_materialSet) {
+  for (size_t i = 0; i < _materialSet.Materials.size(); ++i) {
+    PBRMaterial &material = _materialSet.Materials[i];
     if (material.Name == "default") {
-      std::swap(material, materialSet.Materials.back());
+      std::swap(material, _materialSet.Materials.back());
       break;
     }
   }
 
-  materialSet.DefaultMaterial = materialSet.Materials.back();
-  materialSet.Materials.pop_back();
-
-  return materialSet;
+  _materialSet.DefaultMaterial = _materialSet.Materials.back();
+  _materialSet.Materials.pop_back();
 }
 
 void destroyPBRMaterialSet(const Renderer &_renderer,
@@ -1370,72 +1687,77 @@ createImmutableSamplers(const Renderer &_renderer) {
   return immutableSamplers;
 }
 
-StandardPipelineLayout createStandardPipelineLayout(const Renderer &_renderer) {
+StandardPipelineLayout
+createStandardPipelineLayout(const Renderer &_renderer,
+                             const Shader *const *_shaders,
+                             uint32_t _numShaders) {
   StandardPipelineLayout layout = {};
 
   layout.ImmutableSamplers = std::move(createImmutableSamplers(_renderer));
 
-  VkDescriptorSetLayoutBinding bindings[16] = {};
-  for (size_t i = 0; i < std::size(bindings); ++i) {
-    bindings[i].binding = (uint32_t)i;
-    bindings[i].stageFlags =
-        VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+  std::vector<const ShaderReflection *> reflections(_numShaders);
+  for (uint32_t i = 0; i < _numShaders; ++i) {
+    reflections[i] = &_shaders[i]->Reflection;
+  }
+  layout.Reflection = mergeShaderReflections(reflections.data(), _numShaders);
+  const ShaderReflection &merged = layout.Reflection;
+  for (const ReflectedBinding &reflected : merged.Bindings) {
+    if (reflected.Set >= (uint32_t)DescriptorFrequency::COUNT) {
+      BB_LOG_ERROR("Set {} binding {} doesn't belong to any descriptor "
+                   "frequency",
+                   reflected.Set, reflected.Binding);
+      BB_ASSERT(false);
+    }
   }
-  VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
-  descriptorSetLayoutCreateInfo.sType =
-      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-  descriptorSetLayoutCreateInfo.pBindings = bindings;
 
-  // Create descriptor set layouts with the predefined metadata
-  {
-    EnumArray<DescriptorFrequency, std::vector<DescriptorBinding>>
-        bindingsTable = {{
-            // PerFrame
-            {
-                {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1},
-                {VK_DESCRIPTOR_TYPE_SAMPLER,
-                 (uint32_t)layout.ImmutableSamplers.size()},
-                {VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, numGBufferAttachments},
-                {VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 1},
-            },
-            // PerView
-            {
-                {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1},
-            },
-            // PerMaterial
-            {
-                {VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
-                 (uint32_t)PBRMaterial::NumImages},
-            },
-            // PerDraw
-            {},
-        }};
-
-    for (auto frequency : AllEnums<DescriptorFrequency>) {
-
-      uint32_t numBindings = 0;
-
-      for (auto [descriptorType, numDescriptors] : bindingsTable[frequency]) {
-        VkDescriptorSetLayoutBinding &binding = bindings[numBindings++];
-        binding.descriptorType = descriptorType;
-        binding.descriptorCount = numDescriptors;
-        if ((frequency == DescriptorFrequency::PerFrame) &&
-            (descriptorType == VK_DESCRIPTOR_TYPE_SAMPLER)) {
-          binding.pImmutableSamplers = layout.ImmutableSamplers.data();
-        }
+  // Create descriptor set layouts from the bindings the shaders declare
+  for (DescriptorFrequency frequency : AllEnums<DescriptorFrequency>) {
+    DescriptorSetLayout &descriptorSetLayout =
+        layout.DescriptorSetLayouts[frequency];
+
+    VkDescriptorSetLayoutBinding bindings[maxNumDescriptorBindings] = {};
+    uint32_t numBindings = 0;
+
+    for (const ReflectedBinding &reflected : merged.Bindings) {
+      if (reflected.Set != (uint32_t)frequency) {
+        continue;
       }
+      BB_ASSERT(numBindings < maxNumDescriptorBindings);
 
-      descriptorSetLayoutCreateInfo.bindingCount = numBindings;
+      VkDescriptorType descriptorType = reflected.Type;
+      if ((descriptorType == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) &&
+          ((frequency == DescriptorFrequency::PerFrame) ||
+           (frequency == DescriptorFrequency::PerView))) {
+        descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+      }
 
-      BB_VK_ASSERT(vkCreateDescriptorSetLayout(
-          _renderer.Device, &descriptorSetLayoutCreateInfo, nullptr,
-          &layout.DescriptorSetLayouts[frequency].Handle));
-      std::copy(bindingsTable[frequency].begin(),
-                bindingsTable[frequency].end(),
-                layout.DescriptorSetLayouts[frequency].Bindings);
-      layout.DescriptorSetLayouts[frequency].NumBindings =
-          bindingsTable[frequency].size();
+      VkDescriptorSetLayoutBinding &binding = bindings[numBindings];
+      binding.binding = reflected.Binding;
+      binding.descriptorType = descriptorType;
+      binding.descriptorCount = reflected.NumDescriptors;
+      binding.stageFlags = reflected.Stages;
+      if ((frequency == DescriptorFrequency::PerFrame) &&
+          (descriptorType == VK_DESCRIPTOR_TYPE_SAMPLER)) {
+        BB_ASSERT(reflected.NumDescriptors == layout.ImmutableSamplers.size());
+        binding.pImmutableSamplers = layout.ImmutableSamplers.data();
+      }
+
+      descriptorSetLayout.Bindings[numBindings] = {
+          reflected.Binding, descriptorType, reflected.NumDescriptors};
+      ++numBindings;
     }
+    descriptorSetLayout.NumBindings = numBindings;
+
+    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
+    descriptorSetLayoutCreateInfo.sType =
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptorSetLayoutCreateInfo.bindingCount = numBindings;
+    descriptorSetLayoutCreateInfo.pBindings = bindings;
+
+    BB_VK_ASSERT(vkCreateDescriptorSetLayout(_renderer.Device,
+                                             &descriptorSetLayoutCreateInfo,
+                                             nullptr,
+                                             &descriptorSetLayout.Handle));
   }
 
   VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {};
@@ -1451,8 +1773,17 @@ StandardPipelineLayout createStandardPipelineLayout(const Renderer &_renderer) {
   pipelineLayoutCreateInfo.setLayoutCount =
       (uint32_t)descriptorSetLayouts.size();
   pipelineLayoutCreateInfo.pSetLayouts = descriptorSetLayouts.data();
-  vkCreatePipelineLayout(_renderer.Device, &pipelineLayoutCreateInfo, nullptr,
-                         &layout.Handle);
+
+  if (merged.PushConstantSize > 0) {
+    layout.PushConstantRange.stageFlags = merged.PushConstantStages;
+    layout.PushConstantRange.offset = 0;
+    layout.PushConstantRange.size = merged.PushConstantSize;
+    pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+    pipelineLayoutCreateInfo.pPushConstantRanges = &layout.PushConstantRange;
+  }
+
+  BB_VK_ASSERT(vkCreatePipelineLayout(
+      _renderer.Device, &pipelineLayoutCreateInfo, nullptr, &layout.Handle));
 
   return layout;
 }
@@ -1478,7 +1809,10 @@ VkDescriptorPool createStandardDescriptorPool(
   EnumArray<DescriptorFrequency, uint32_t> numTotalSets;
   uint32_t numAllSets = 0;
   for (DescriptorFrequency frequency : AllEnums<DescriptorFrequency>) {
-    if (frequency == DescriptorFrequency::PerFrame) {
+    if (_layout.DescriptorSetLayouts[frequency].NumBindings == 0) {
+      // Nothing to bind, so no set of this frequency is ever allocated.
+      numTotalSets[frequency] = 0;
+    } else if (frequency == DescriptorFrequency::PerFrame) {
       numTotalSets[frequency] = _numSets[frequency];
     } else {
       numTotalSets[frequency] =
@@ -1532,7 +1866,8 @@ Frame createFrame(
     const StandardPipelineLayout &_standardPipelineLayout,
     VkDescriptorPool _descriptorPool, const PBRMaterialSet &_materialSet,
     const VkImageView (&_gbufferAttachments)[numGBufferAttachments],
-    VkImageView _hdrAttachment) {
+    VkImageView _hdrAttachment, VkImageView _depthAttachment,
+    VkBuffer _uniformRingBuffer) {
   Frame frame = {};
 
   // Allocate descriptor sets
@@ -1572,16 +1907,6 @@ Frame createFrame(
                                           frame.MaterialDescriptorSets.data()));
   }
 
-  frame.FrameUniformBuffer = createBuffer(
-      _renderer, sizeof(FrameUniformBlock), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-  frame.ViewUniformBuffer = createBuffer(
-      _renderer, sizeof(ViewUniformBlock), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
   // Link descriptor sets to actual resources
   {
     std::vector<VkWriteDescriptorSet> writeInfos;
@@ -1591,24 +1916,24 @@ Frame createFrame(
     // FrameData
     writeInfo.dstSet = frame.FrameDescriptorSet;
     writeInfo.dstBinding = 0;
-    writeInfo.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    writeInfo.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     writeInfo.descriptorCount = 1;
     VkDescriptorBufferInfo frameUniformBufferInfo = {};
-    frameUniformBufferInfo.buffer = frame.FrameUniformBuffer.Handle;
+    frameUniformBufferInfo.buffer = _uniformRingBuffer;
     frameUniformBufferInfo.offset = 0;
-    frameUniformBufferInfo.range = frame.FrameUniformBuffer.Size;
+    frameUniformBufferInfo.range = sizeof(FrameUniformBlock);
     writeInfo.pBufferInfo = &frameUniformBufferInfo;
     writeInfos.push_back(writeInfo);
 
     // ViewData
     writeInfo.dstSet = frame.ViewDescriptorSet;
     writeInfo.dstBinding = 0;
-    writeInfo.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    writeInfo.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     writeInfo.descriptorCount = 1;
     VkDescriptorBufferInfo viewUniformBufferInfo = {};
-    viewUniformBufferInfo.buffer = frame.ViewUniformBuffer.Handle;
+    viewUniformBufferInfo.buffer = _uniformRingBuffer;
     viewUniformBufferInfo.offset = 0;
-    viewUniformBufferInfo.range = frame.ViewUniformBuffer.Size;
+    viewUniformBufferInfo.range = sizeof(ViewUniformBlock);
     writeInfo.pBufferInfo = &viewUniformBufferInfo;
     writeInfos.push_back(writeInfo);
 
@@ -1660,7 +1985,8 @@ Frame createFrame(
                            writeInfos.data(), 0, nullptr);
 
     linkExternalAttachmentsToDescriptorSet(_renderer, frame,
-                                           _gbufferAttachments, _hdrAttachment);
+                                           _gbufferAttachments, _hdrAttachment,
+                                           _depthAttachment);
   }
 
   {
@@ -1686,16 +2012,13 @@ Frame createFrame(
 
 void destroyFrame(const Renderer &_renderer, Frame &_frame) {
   vkDestroyCommandPool(_renderer.Device, _frame.CmdPool, nullptr);
-
-  destroyBuffer(_renderer, _frame.ViewUniformBuffer);
-  destroyBuffer(_renderer, _frame.FrameUniformBuffer);
   _frame = {};
 }
 
 void linkExternalAttachmentsToDescriptorSet(
     const Renderer &_renderer, Frame &_frame,
     const VkImageView (&_gbufferAttachments)[numGBufferAttachments],
-    VkImageView _hdrAttachment) {
+    VkImageView _hdrAttachment, VkImageView _depthAttachment) {
   std::vector<VkWriteDescriptorSet> writeInfos;
 
   VkDescriptorImageInfo gbufferImageInfos[numGBufferAttachments] = {};
@@ -1704,11 +2027,12 @@ void linkExternalAttachmentsToDescriptorSet(
     gbufferImageInfos[i].imageView = _gbufferAttachments[i];
   }
 
+  // All of them are input attachments.
   VkWriteDescriptorSet writeInfo = {};
   writeInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
   writeInfo.dstSet = _frame.FrameDescriptorSet;
   writeInfo.dstBinding = 2;
-  writeInfo.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+  writeInfo.descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
   writeInfo.descriptorCount = std::size(gbufferImageInfos);
   writeInfo.pImageInfo = gbufferImageInfos;
   writeInfos.push_back(writeInfo);
@@ -1721,6 +2045,16 @@ void linkExternalAttachmentsToDescriptorSet(
   writeInfo.pImageInfo = &hdrImageInfo;
   writeInfos.push_back(writeInfo);
 
+  // Read while the lighting subpass also uses it as a read only depth
+  // attachment.
+  VkDescriptorImageInfo depthImageInfo = {};
+  depthImageInfo.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+  depthImageInfo.imageView = _depthAttachment;
+  writeInfo.dstBinding = 7;
+  writeInfo.descriptorCount = 1;
+  writeInfo.pImageInfo = &depthImageInfo;
+  writeInfos.push_back(writeInfo);
+
   vkUpdateDescriptorSets(_renderer.Device, writeInfos.size(), writeInfos.data(),
                          0, nullptr);
 }
@@ -1862,6 +2196,98 @@ void generateUVSphereMesh(std::vector<Vertex> &_vertices,
   appendMesh(_vertices, _indices, newVertices, newIndices);
 }
 
+void generateConeMesh(std::vector<Vertex> &_vertices,
+                      std::vector<uint32_t> &_indices, float _radius,
+                      float _height, int _division) {
+  BB_ASSERT(_division >= 3);
+
+  // Corners of a polygon whose edges touch the circle of _radius.
+  float ringRadius = _radius / cosf(pi32 / (float)_division);
+
+  std::vector<Vertex> newVertices;
+  newVertices.reserve(_division + 2);
+  std::vector<uint32_t> newIndices;
+  newIndices.reserve(6 * _division);
+
+  Vertex apex = {};
+  apex.Normal = {0, 0, -1};
+  newVertices.push_back(apex);
+
+  Vertex baseCenter = {};
+  baseCenter.Pos = {0, 0, _height};
+  baseCenter.Normal = {0, 0, 1};
+  newVertices.push_back(baseCenter);
+
+  for (int i = 0; i < _division; ++i) {
+    float rad = twoPi32 * ((float)i / (float)_division);
+    Vertex vertex = {};
+    vertex.Pos = {ringRadius * cosf(rad), ringRadius * sinf(rad), _height};
+    vertex.Normal = Float3{cosf(rad), sinf(rad), 0}.normalize();
+    newVertices.push_back(vertex);
+  }
+
+  // Same winding as the other meshes, front faces point outwards.
+  for (int i = 0; i < _division; ++i) {
+    uint32_t ring = 2 + i;
+    uint32_t nextRing = 2 + (i + 1) % _division;
+    newIndices.push_back(0);
+    newIndices.push_back(nextRing);
+    newIndices.push_back(ring);
+
+    newIndices.push_back(1);
+    newIndices.push_back(ring);
+    newIndices.push_back(nextRing);
+  }
+
+  appendMesh(_vertices, _indices, newVertices, newIndices);
+}
+
+MeshBounds computeMeshBounds(const Vertex *_vertices, uint32_t _numVertices) {
+  MeshBounds bounds = {};
+  if (_numVertices == 0) {
+    return bounds;
+  }
+
+  Float3 minPos = _vertices[0].Pos;
+  Float3 maxPos = _vertices[0].Pos;
+  for (uint32_t i = 1; i < _numVertices; ++i) {
+    const Float3 &pos = _vertices[i].Pos;
+    minPos = {std::min(minPos.X, pos.X), std::min(minPos.Y, pos.Y),
+              std::min(minPos.Z, pos.Z)};
+    maxPos = {std::max(maxPos.X, pos.X), std::max(maxPos.Y, pos.Y),
+              std::max(maxPos.Z, pos.Z)};
+  }
+  bounds.Center = (minPos + maxPos) * 0.5f;
+
+  float radiusSq = 0.f;
+  for (uint32_t i = 0; i < _numVertices; ++i) {
+    radiusSq =
+        std::max(radiusSq, (_vertices[i].Pos - bounds.Center).lengthSq());
+  }
+  bounds.Radius = sqrtf(radiusSq);
+
+  return bounds;
+}
+
+MeshBounds transformMeshBounds(const MeshBounds &_bounds,
+                               const Mat4 &_modelMat) {
+  Float3 axes[3];
+  for (int i = 0; i < 3; ++i) {
+    Float4 column = _modelMat.column(i);
+    axes[i] = {column.X, column.Y, column.Z};
+  }
+  Float4 translation = _modelMat.column(3);
+
+  MeshBounds bounds = {};
+  bounds.Center = axes[0] * _bounds.Center.X + axes[1] * _bounds.Center.Y +
+                  axes[2] * _bounds.Center.Z +
+                  Float3{translation.X, translation.Y, translation.Z};
+  float maxScaleSq = std::max(
+      axes[0].lengthSq(), std::max(axes[1].lengthSq(), axes[2].lengthSq()));
+  bounds.Radius = _bounds.Radius * sqrtf(maxScaleSq);
+  return bounds;
+}
+
 #if BB_DEBUG
 void labelGPUResource(const Renderer &_renderer, const Image &_image,
                       const std::string &_name) {
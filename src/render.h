@@ -6,12 +6,18 @@
 // - Color
 #include "vector_math.h"
 #include "enum_array.h"
+#include "device_memory.h"
+#include "shader_reflection.h"
 #include "external/volk.h"
 #include "external/SDL2/SDL.h"
 #include <array>
+#include <mutex>
 
 namespace bb {
 
+struct StagingRing;
+struct PipelineCache;
+
 struct SwapChainSupportDetails {
   VkSurfaceCapabilitiesKHR Capabilities;
   std::vector<VkSurfaceFormatKHR> Formats;
@@ -36,6 +42,15 @@ struct Renderer {
                                // changes when a window is resized.
   uint32_t QueueFamilyIndex;
   VkQueue Queue;
+  // Uploads are submitted from worker threads too, so every access to Queue
+  // has to be guarded by this.
+  std::mutex *QueueMutex;
+
+  DeviceMemoryAllocator *MemoryAllocator;
+  StagingRing *StagingRing;
+  // Shared by every pipeline creation, and loaded from/saved to disk by
+  // createRenderer()/destroyRenderer().
+  PipelineCache *PipelineCache;
 };
 
 Renderer createRenderer(SDL_Window *_window);
@@ -43,6 +58,27 @@ void destroyRenderer(Renderer &_renderer);
 uint32_t findMemoryType(const Renderer &_renderer, uint32_t _typeFilter,
                         VkMemoryPropertyFlags _properties);
 
+void submitToQueue(const Renderer &_renderer, const VkSubmitInfo &_submitInfo,
+                   VkFence _fence);
+VkResult presentToQueue(const Renderer &_renderer,
+                        const VkPresentInfoKHR &_presentInfo);
+void waitForDeviceIdle(const Renderer &_renderer);
+// Every pipeline has dynamic viewport and scissor state, so they must be set
+// before drawing.
+void setViewportAndScissor(VkCommandBuffer _cmdBuffer, VkOffset2D _offset,
+                           VkExtent2D _extent);
+
+// Allocate memory for the resource from the renderer's allocator and bind it.
+// Free it with freeDeviceMemory().
+DeviceAllocation allocateBufferMemory(const Renderer &_renderer,
+                                      VkBuffer _buffer,
+                                      VkBufferUsageFlags _usage,
+                                      VkMemoryPropertyFlags _properties);
+// Large attachments get memory of their own, unless _pool is given.
+DeviceAllocation allocateImageMemory(const Renderer &_renderer, VkImage _image,
+                                     VkImageUsageFlags _usage,
+                                     LinearMemoryPool *_pool = nullptr);
+
 struct SwapChain {
   VkSwapchainKHR Handle;
   VkFormat ColorFormat;
@@ -56,7 +92,7 @@ struct SwapChain {
   std::vector<VkImageView> ColorImageViews;
   VkImage DepthImage;
   VkImageView DepthImageView;
-  VkDeviceMemory DepthImageMemory;
+  DeviceAllocation DepthImageAllocation;
 };
 
 SwapChain createSwapChain(const Renderer &_renderer, uint32_t _width,
@@ -69,17 +105,16 @@ enum class LightType : int { Point = 0, Spot, Directional };
 enum class DeferredAttachmentType {
   Color,
   Depth,
-  GBufferPosition,
+  // World position isn't stored, the lighting passes rebuild it from depth.
   GBufferNormal,
   GBufferAlbedo,
   GBufferMRAH,
-  GBufferMaterialIndex,
   HDR,
   COUNT
 };
 constexpr uint32_t numGBufferAttachments =
     (uint32_t)DeferredAttachmentType::HDR -
-    (uint32_t)DeferredAttachmentType::GBufferPosition;
+    (uint32_t)DeferredAttachmentType::GBufferNormal;
 
 enum class DeferredSubpassType {
   GBufferWrite,
@@ -90,7 +125,17 @@ enum class DeferredSubpassType {
   COUNT
 };
 
-constexpr VkFormat gbufferAttachmentFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
+// Octahedral normal, albedo, metallic/roughness/AO/height. See gbuffer.glsl.
+constexpr VkFormat gbufferAttachmentFormats[numGBufferAttachments] = {
+    VK_FORMAT_R16G16_SNORM, VK_FORMAT_R8G8B8A8_SRGB, VK_FORMAT_R8G8B8A8_UNORM};
+// Rendering to R16G16_SNORM is optional. The normal encoding works as is with
+// this one.
+constexpr VkFormat fallbackGBufferNormalFormat = VK_FORMAT_R16G16_SFLOAT;
+
+// gbufferAttachmentFormats, with the normal format replaced by the fallback
+// if the device can't render to it.
+void getGBufferAttachmentFormats(const Renderer &_renderer,
+                                 VkFormat (&_outFormats)[numGBufferAttachments]);
 constexpr VkFormat hdrAttachmentFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
 
 struct InstanceBlock {
@@ -131,32 +176,28 @@ struct GizmoVertex {
 struct LightSourceVertex {
   Float3 Pos;
 
-  VERTEX_BINDINGS_DECL(2);
-  VERTEX_ATTRIBUTES_DECL(2);
+  VERTEX_BINDINGS_DECL(1);
+  VERTEX_ATTRIBUTES_DECL(1);
 };
 
 struct Buffer {
   VkBuffer Handle;
-  VkDeviceMemory Memory;
+  DeviceAllocation Allocation;
   uint32_t Size;
 };
 
 Buffer createBuffer(const Renderer &_renderer, VkDeviceSize _size,
                     VkBufferUsageFlags _usage,
                     VkMemoryPropertyFlags _properties);
-Buffer createStagingBuffer(const Renderer &_renderer, const Buffer &_orgBuffer);
 Buffer createDeviceLocalBufferFromMemory(const Renderer &_renderer,
-                                         VkCommandPool _cmdPool,
                                          VkBufferUsageFlags _usage,
                                          VkDeviceSize _size, const void *_data);
 
 void destroyBuffer(const Renderer &_renderer, Buffer &_buffer);
-void copyBuffer(const Renderer &_renderer, VkCommandPool _cmdPool,
-                Buffer &_dstBuffer, Buffer &_srcBuffer, VkDeviceSize _size);
 
 struct Image {
   VkImage Handle;
-  VkDeviceMemory Memory;
+  DeviceAllocation Allocation;
   VkImageView View;
 };
 
@@ -165,17 +206,53 @@ struct ImageParams {
   uint32_t Width;
   uint32_t Height;
   VkImageUsageFlags Usage;
+  LinearMemoryPool *MemoryPool = nullptr;
 };
 
 Image createImage(const Renderer &_renderer, const ImageParams &_params);
+// Bytes per texel of the formats render targets are created with.
+uint32_t getFormatSize(VkFormat _format);
 Image createImageFromFile(const Renderer &_renderer,
-                          VkCommandPool _transientCmdPool,
                           const std::string &_filePath);
 void destroyImage(const Renderer &_renderer, Image &_image);
 
+// An attachment that is only ever used inside a single render pass.
+struct RenderPassAttachmentParams {
+  // MemoryPool is ignored.
+  ImageParams Image;
+  // Range of subpasses the attachment is used in, counting reads through
+  // sampled image descriptors too.
+  uint32_t FirstSubpass;
+  uint32_t LastSubpass;
+};
+
+struct RenderPassAttachmentMemoryReport {
+  // What the attachments took when each one had memory of its own.
+  VkDeviceSize SeparateBytes;
+  // Size of the block the non-transient attachments are placed in.
+  VkDeviceSize AliasedBytes;
+  uint32_t NumAliased;
+  uint32_t NumLazy;
+  VkDeviceSize LazyBytes;
+};
+
+// Attachments whose usage is limited to attachment bits get
+// TRANSIENT_ATTACHMENT usage and lazily allocated memory, if the device has
+// such a memory type. Everything else is placed in a single allocation from
+// _pool, where attachments with disjoint subpass ranges share memory.
+// _outMayAlias[i] is set if attachment i shares memory with another one, in
+// which case its description needs VK_ATTACHMENT_DESCRIPTION_MAY_ALIAS_BIT.
+// The images are destroyed with destroyImage() as usual.
+RenderPassAttachmentMemoryReport
+createRenderPassAttachments(const Renderer &_renderer,
+                            const RenderPassAttachmentParams *_params,
+                            uint32_t _numAttachments, LinearMemoryPool &_pool,
+                            Image *_outImages, bool *_outMayAlias);
+
 struct Shader {
   VkShaderStageFlagBits Stage;
   VkShaderModule Handle;
+  ShaderReflection Reflection;
 
   VkPipelineShaderStageCreateInfo getStageInfo() const;
 };
@@ -188,7 +265,43 @@ struct RenderPass {
   VkRenderPass Handle;
 };
 
+// Values baked into pipelines through specialization constants, so that the
+// shaders don't branch on them per pixel. Constant ids follow the field order
+// and match permutation.glsl.
+enum class PermutationConstant {
+  LightTypeMask,
+  MaxNumLights,
+  EnableNormalMap,
+  EnableToneMapping,
+  COUNT
+};
+
+struct ShaderPermutation {
+  // Bit per LightType the shaders have to handle.
+  uint32_t LightTypeMask;
+  // Lights past this are ignored.
+  uint32_t MaxNumLights;
+  VkBool32 EnableNormalMap;
+  VkBool32 EnableToneMapping;
+};
+
+// Every light type and feature, which is also what the shaders default to.
+ShaderPermutation getFullShaderPermutation();
+// _permutation with the constants outside _specConstantMask reset to the full
+// permutation's, so that pipelines don't get variants for constants their
+// shaders never read.
+ShaderPermutation maskShaderPermutation(const ShaderPermutation &_permutation,
+                                        uint32_t _specConstantMask);
+uint64_t getShaderPermutationKey(const ShaderPermutation &_permutation);
+std::string getShaderPermutationName(const ShaderPermutation &_permutation);
+
 struct PipelineParams {
+  // Only used for reporting.
+  const char *Name;
+
+  // nullptr keeps the defaults the shaders declare.
+  const ShaderPermutation *Permutation;
+
   const Shader **Shaders;
   int NumShaders;
 
@@ -203,13 +316,6 @@ struct PipelineParams {
     VkPrimitiveTopology Topology;
   } InputAssembly;
 
-  struct {
-    Float2 Offset;
-    Float2 Extent;
-    Int2 ScissorOffset;
-    Int2 ScissorExtent;
-  } Viewport;
-
   struct {
     VkPolygonMode PolygonMode;
     VkCullModeFlags CullMode;
@@ -218,10 +324,14 @@ struct PipelineParams {
   struct {
     bool DepthTestEnable;
     bool DepthWriteEnable;
+    // The bounds are dynamic state. Needs the depthBounds feature.
+    bool DepthBoundsTestEnable;
   } DepthStencil;
 
   struct {
     uint32_t NumColorBlends;
+    // Adds to the attachments instead of overwriting them.
+    bool Additive;
   } Blend;
 
   uint32_t Subpass;
@@ -232,6 +342,10 @@ struct PipelineParams {
 
 VkPipeline createPipeline(const Renderer &_renderer,
                           const PipelineParams &_params);
+// Compute pipelines don't go through shader permutations.
+VkPipeline createComputePipeline(const Renderer &_renderer, const char *_name,
+                                 const Shader &_shader,
+                                 VkPipelineLayout _pipelineLayout);
 enum class PBRMapType {
   Albedo,
   Metallic,
@@ -249,7 +363,6 @@ struct PBRMaterial {
 };
 
 PBRMaterial createPBRMaterialFromFiles(const Renderer &_renderer,
-                                       VkCommandPool _transientCmdPool,
                                        const std::string &_rootPath);
 void destroyPBRMaterial(const Renderer &_renderer, PBRMaterial &_material);
 
@@ -258,8 +371,16 @@ struct PBRMaterialSet {
   PBRMaterial DefaultMaterial;
 };
 
-PBRMaterialSet createPBRMaterialSet(const Renderer &_renderer,
-                                    VkCommandPool _cmdPool);
+PBRMaterialSet createPBRMaterialSet(const Renderer &_renderer);
+// createPBRMaterialSet() split in two for callers that run the image loads
+// themselves. The tasks of material i are
+// _loader.Tasks[i * PBRMaterial::NumImages, (i + 1) * PBRMaterial::NumImages),
+// and all of them have to be run and submitted (see submitImageLoads()) before
+// finishPBRMaterialSetLoad(). _materialSet must not move in between.
+void beginPBRMaterialSetLoad(const Renderer &_renderer,
+                             PBRMaterialSet &_materialSet,
+                             struct ImageLoader &_loader);
+void finishPBRMaterialSetLoad(PBRMaterialSet &_materialSet);
 void destroyPBRMaterialSet(const Renderer &_renderer,
                            PBRMaterialSet &_materialSet);
 
@@ -277,6 +398,7 @@ enum class DescriptorFrequency {
 enum class SamplerType { Nearest, Linear, COUNT };
 
 struct DescriptorBinding {
+  uint32_t Binding;
   VkDescriptorType Type;
   uint32_t NumDescriptors;
 };
@@ -293,12 +415,23 @@ struct StandardPipelineLayout {
   EnumArray<SamplerType, VkSampler> ImmutableSamplers;
   EnumArray<DescriptorFrequency, DescriptorSetLayout> DescriptorSetLayouts;
   VkPipelineLayout Handle;
+  VkPushConstantRange PushConstantRange;
+  // What the layout was generated from. A shader can replace one of the
+  // shaders it was created with as long as it fits in this.
+  ShaderReflection Reflection;
 };
 
 EnumArray<SamplerType, VkSampler>
 createImmutableSamplers(const Renderer &_renderer);
 
-StandardPipelineLayout createStandardPipelineLayout(const Renderer &_renderer);
+// The descriptor set layouts and push constant range are generated from the
+// bindings _shaders declare, so every shader that uses the layout has to be
+// passed. Uniform buffers of the PerFrame and PerView sets live in the frame
+// ring and are made dynamic, and the PerFrame samplers are the immutable ones.
+StandardPipelineLayout
+createStandardPipelineLayout(const Renderer &_renderer,
+                             const Shader *const *_shaders,
+                             uint32_t _numShaders);
 
 void destroyStandardPipelineLayout(const Renderer &_renderer,
                                    StandardPipelineLayout &_layout);
@@ -315,31 +448,55 @@ struct alignas(16) Light {
   Float3 Color;
   float InnerCutOff;
   float OuterCutOff;
+  // Point and spot lights fade out to nothing at this distance.
+  float Radius;
 };
 
-#define MAX_NUM_LIGHTS 100
+// Lights live in a storage buffer that grows as needed, see light_buffer.h.
+// This only bounds how many lights a single shader loop goes through, i.e. the
+// directional lights and the lights of one cluster.
+#define MAX_NUM_LIGHTS 16384
 struct FrameUniformBlock {
   int NumLights;
-  Light Lights[MAX_NUM_LIGHTS];
+  int NumDirectionalLights;
   int VisualizedGBufferAttachmentIndex;
-  int EnableToneMapping;
   float Exposure;
 };
 
 struct ViewUniformBlock {
   Mat4 ViewMat;
   Mat4 ProjMat;
+  // Rebuilds world positions from the depth buffer.
+  Mat4 InvViewProjMat;
   Float3 ViewPos;
-  int EnableNormalMap;
+  // Depth slice of the light clusters, see getLightClusterDepthParams().
+  float ClusterDepthScale;
+  float ClusterDepthBias;
 };
 
+// The smallest permutation that renders _lights the same as the full one.
+// Light counts are rounded up to a few buckets to keep the number of variants
+// down.
+ShaderPermutation selectShaderPermutation(const Light *_lights,
+                                          uint32_t _numLights,
+                                          bool _enableNormalMap,
+                                          bool _enableToneMapping);
+
+// Number of frames in flight.
+constexpr int numFrames = 2;
+
 struct Frame {
+  // Resources that have one copy per frame in flight are indexed by this.
+  uint32_t Index;
+
   VkDescriptorSet FrameDescriptorSet;
   VkDescriptorSet ViewDescriptorSet;
   std::vector<VkDescriptorSet> MaterialDescriptorSets;
 
-  Buffer FrameUniformBuffer;
-  Buffer ViewUniformBuffer;
+  // FrameData and ViewData live in the frame ring. The descriptors point at the
+  // start of the ring buffer, and these are bound as their dynamic offsets.
+  uint32_t FrameUniformOffset;
+  uint32_t ViewUniformOffset;
 
   VkCommandPool CmdPool;
   VkCommandBuffer CmdBuffer;
@@ -356,13 +513,14 @@ Frame createFrame(
     const StandardPipelineLayout &_standardPipelineLayout,
     VkDescriptorPool _descriptorPool, const PBRMaterialSet &_materialSet,
     const VkImageView (&_gbufferAttachments)[numGBufferAttachments],
-    VkImageView _hdrAttachment);
+    VkImageView _hdrAttachment, VkImageView _depthAttachment,
+    VkBuffer _uniformRingBuffer);
 void destroyFrame(const Renderer &_renderer, Frame &_frame);
 
 void linkExternalAttachmentsToDescriptorSet(
     const Renderer &_renderer, Frame &_frame,
     const VkImageView (&_gbufferAttachments)[numGBufferAttachments],
-    VkImageView _hdrAttachment);
+    VkImageView _hdrAttachment, VkImageView _depthAttachment);
 
 void generatePlaneMesh(std::vector<Vertex> &_vertices,
                        std::vector<uint32_t> &_indices);
@@ -376,6 +534,24 @@ void generateUVSphereMesh(std::vector<Vertex> &_vertices,
                           int _horizontalDivision = 16,
                           int _verticalDivision = 16);
 
+// Closed cone with its apex at the origin, opening towards +Z. The sides are
+// flat, and touch a round cone of _radius from outside.
+void generateConeMesh(std::vector<Vertex> &_vertices,
+                      std::vector<uint32_t> &_indices, float _radius = 1.f,
+                      float _height = 1.f, int _division = 16);
+
+// Bounding sphere of a mesh in its own space, around the center of its box.
+struct MeshBounds {
+  Float3 Center;
+  float Radius;
+};
+
+MeshBounds computeMeshBounds(const Vertex *_vertices, uint32_t _numVertices);
+// The radius is scaled by the largest scale of _modelMat, same as in
+// cull_instances.comp.
+MeshBounds transformMeshBounds(const MeshBounds &_bounds,
+                               const Mat4 &_modelMat);
+
 #if BB_DEBUG
 void labelGPUResource(const Renderer &_renderer, const Image &_image,
                       const std::string &_name);
@@ -6,6 +6,10 @@
 #include "external/stb_image.h"
 #include "external/SDL2/SDL.h"
 #include "external/toml.h"
+#include "external/assimp/IOSystem.hpp"
+#include "external/assimp/DefaultIOSystem.h"
+#include "external/assimp/MemoryIOWrapper.h"
+#include <ctype.h>
 #include <string_view>
 #ifdef BB_WINDOWS
 #include <Windows.h>
@@ -15,6 +19,7 @@ namespace bb {
 
 static std::string gCommonResourceRoot;
 static std::string gShaderRoot;
+static ResourcePack *gResourcePack;
 
 static bool isSeparator(char _ch) { return (_ch == '\\') || (_ch == '/'); }
 
@@ -141,9 +146,31 @@ void initResourceRoot() {
       joinPaths(exeDir, getString(tomlResourcePath, "common_root"));
   gShaderRoot = joinPaths(exeDir, getString(tomlResourcePath, "shader_root"));
 
+  // The pack is optional; without it everything is read from loose files.
+  if (toml_raw_in(tomlResourcePath, "pack")) {
+    std::string packPath =
+        joinPaths(exeDir, getString(tomlResourcePath, "pack"));
+    gResourcePack = mountResourcePack(packPath);
+    if (gResourcePack) {
+      BB_LOG_INFO("Mounted resource pack {} ({} files)", packPath,
+                  gResourcePack->Header->NumEntries);
+    } else {
+      BB_LOG_WARNING("Failed to mount resource pack {}, falling back to loose "
+                     "files",
+                     packPath);
+    }
+  }
+
   toml_free(config);
 }
 
+void shutdownResourceRoot() {
+  if (gResourcePack) {
+    unmountResourcePack(gResourcePack);
+    gResourcePack = nullptr;
+  }
+}
+
 std::string createCommonResourcePath(std::string_view _relPath) {
   std::string absPath = joinPaths(gCommonResourceRoot, _relPath);
   return absPath;
@@ -154,10 +181,128 @@ std::string createShaderPath(std::string_view _relPath) {
   return absPath;
 }
 
+// The pack holds the common resource root, so only paths under it can be
+// packed.
+static bool getPackRelativePath(std::string_view _absPath,
+                                std::string_view &_relPath) {
+  std::string_view root = gCommonResourceRoot;
+  if (_absPath.size() <= root.size()) {
+    return false;
+  }
+
+  for (size_t i = 0; i < root.size(); ++i) {
+    char a = _absPath[i];
+    char b = root[i];
+    if (isSeparator(a) && isSeparator(b)) {
+      continue;
+    }
+    if (tolower((unsigned char)a) != tolower((unsigned char)b)) {
+      return false;
+    }
+  }
+  if (!isSeparator(_absPath[root.size()])) {
+    return false;
+  }
+
+  _relPath = _absPath.substr(root.size() + 1);
+  return true;
+}
+
+bool findPackedFile(std::string_view _absPath, ResourceRange &_range) {
+  std::string_view relPath;
+  if (!gResourcePack || !getPackRelativePath(_absPath, relPath)) {
+    return false;
+  }
+  return findPackedResource(*gResourcePack, relPath, _range);
+}
+
+bool loadResourceFile(const std::string &_absPath,
+                      std::vector<uint8_t> &_storage, ResourceRange &_range) {
+  if (findPackedFile(_absPath, _range)) {
+    return true;
+  }
+
+  if (!readWholeFile(_absPath, _storage)) {
+    return false;
+  }
+  _range.Data = _storage.data();
+  _range.Size = _storage.size();
+  return true;
+}
+
+std::vector<std::string> listSubdirectories(const std::string &_absDir) {
+  std::string_view relDir;
+  if (gResourcePack && getPackRelativePath(_absDir, relDir)) {
+    return listPackedSubdirectories(*gResourcePack, relDir);
+  }
+
+  std::vector<std::string> subdirs;
+#ifdef BB_WINDOWS
+  WIN32_FIND_DATAA findData;
+  HANDLE findHandle =
+      FindFirstFileA(joinPaths(_absDir, "*").c_str(), &findData);
+  if (findHandle == INVALID_HANDLE_VALUE) {
+    return subdirs;
+  }
+  BB_DEFER(FindClose(findHandle));
+
+  do {
+    if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+        (strcmp(findData.cFileName, ".") != 0) &&
+        (strcmp(findData.cFileName, "..") != 0)) {
+      subdirs.push_back(findData.cFileName);
+    }
+  } while (FindNextFileA(findHandle, &findData));
+#endif
+
+  return subdirs;
+}
+
+class ResourceIOSystem : public Assimp::IOSystem {
+public:
+  bool Exists(const char *_filePath) const override {
+    ResourceRange range;
+    return findPackedFile(_filePath, range) || LooseFiles.Exists(_filePath);
+  }
+
+  char getOsSeparator() const override { return nativePathSeparator; }
+
+  Assimp::IOStream *Open(const char *_filePath, const char *_mode) override {
+    ResourceRange range;
+    if (findPackedFile(_filePath, range)) {
+      return new Assimp::MemoryIOStream(range.Data, (size_t)range.Size);
+    }
+    return LooseFiles.Open(_filePath, _mode);
+  }
+
+  void Close(Assimp::IOStream *_file) override { delete _file; }
+
+private:
+  Assimp::DefaultIOSystem LooseFiles;
+};
+
+Assimp::IOSystem *createResourceIOSystem() { return new ResourceIOSystem(); }
+
 void runImageLoadTask(ImageLoadFromFileTask &_task) {
   int numChannels;
-  stbi_uc *pixels = stbi_load(_task.FilePath.c_str(), &_task.ImageDims.X,
-                              &_task.ImageDims.Y, &numChannels, STBI_rgb_alpha);
+  stbi_uc *pixels;
+  if (_task.PackedData.Data) {
+    pixels = stbi_load_from_memory(
+        _task.PackedData.Data, (int)_task.PackedData.Size, &_task.ImageDims.X,
+        &_task.ImageDims.Y, &numChannels, STBI_rgb_alpha);
+  } else if (_task.FileReads) {
+    waitForFileRead(*_task.FileReads, _task.FileReadIndex);
+    if (!_task.FileReads->Reads[_task.FileReadIndex].IsSucceeded) {
+      return;
+    }
+    pixels = stbi_load_from_memory(
+        _task.FileContents.data(), (int)_task.FileContents.size(),
+        &_task.ImageDims.X, &_task.ImageDims.Y, &numChannels, STBI_rgb_alpha);
+    _task.FileContents = {};
+  } else {
+    pixels = stbi_load(_task.FilePath.c_str(), &_task.ImageDims.X,
+                       &_task.ImageDims.Y, &numChannels, STBI_rgb_alpha);
+  }
   if (!pixels) {
     return;
   }
@@ -167,18 +312,8 @@ void runImageLoadTask(ImageLoadFromFileTask &_task) {
   VkDeviceSize textureSize = _task.ImageDims.X * _task.ImageDims.Y * 4;
   const Renderer &renderer = *_task.Renderer;
 
-  _task.StagingBuffer =
-      createBuffer(renderer, textureSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                       VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-  {
-    void *data;
-    vkMapMemory(renderer.Device, _task.StagingBuffer.Memory, 0, textureSize, 0,
-                &data);
-    memcpy(data, pixels, textureSize);
-    vkUnmapMemory(renderer.Device, _task.StagingBuffer.Memory);
-  }
+  _task.Staging = allocateStagingMemory(*renderer.StagingRing, textureSize);
+  memcpy(_task.Staging.Data, pixels, textureSize);
 
   Image *targetImage = _task.TargetImage;
 
@@ -202,27 +337,20 @@ void runImageLoadTask(ImageLoadFromFileTask &_task) {
   BB_VK_ASSERT(vkCreateImage(renderer.Device, &imageCreateInfo, nullptr,
                              &targetImage->Handle));
 
-  VkMemoryRequirements memRequirements;
-  vkGetImageMemoryRequirements(renderer.Device, targetImage->Handle,
-                               &memRequirements);
-
-  VkMemoryAllocateInfo textureImageMemoryAllocateInfo = {};
-  textureImageMemoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  textureImageMemoryAllocateInfo.allocationSize = memRequirements.size;
-  textureImageMemoryAllocateInfo.memoryTypeIndex =
-      findMemoryType(renderer, memRequirements.memoryTypeBits,
-                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-  BB_VK_ASSERT(vkAllocateMemory(renderer.Device,
-                                &textureImageMemoryAllocateInfo, nullptr,
-                                &targetImage->Memory));
-
-  BB_VK_ASSERT(vkBindImageMemory(renderer.Device, targetImage->Handle,
-                                 targetImage->Memory, 0));
+  targetImage->Allocation = allocateImageMemory(renderer, targetImage->Handle,
+                                                imageCreateInfo.usage);
 }
 
 void destroyImageLoader(ImageLoader &_loader) {
+  if (_loader.FileReads) {
+    destroyFileReadBatch(_loader.FileReads);
+    _loader.FileReads = nullptr;
+  }
   for (ImageLoadFromFileTask *task : _loader.Tasks) {
+    // Decoded but never submitted.
+    if (task->Staging.Handle != VK_NULL_HANDLE) {
+      freeStagingMemory(*task->Renderer->StagingRing, task->Staging);
+    }
     delete task;
   }
   _loader.Tasks.clear();
@@ -234,112 +362,98 @@ void enqueueImageLoadTask(ImageLoader &_loader, const Renderer &_renderer,
   task->Renderer = &_renderer;
   task->FilePath = _filePath;
   task->TargetImage = &_targetImage;
+  findPackedFile(task->FilePath, task->PackedData);
 
   _loader.Tasks.push_back(task);
 }
 
-void finalizeAllImageLoads(ImageLoader &_loader, const Renderer &_renderer,
-                           VkCommandPool _cmdPool) {
-  std::vector<HANDLE> threads;
-  std::vector<DWORD> threadIds;
-  threads.resize(_loader.Tasks.size());
-  threadIds.resize(_loader.Tasks.size());
-
-  SYSTEM_INFO sysinfo;
-  GetSystemInfo(&sysinfo);
-  int numCPUs = sysinfo.dwNumberOfProcessors;
-  int batch = MAXIMUM_WAIT_OBJECTS;
-
-  for (size_t i = 0; i < _loader.Tasks.size(); ++i) {
-    threads[i % batch] = CreateThread(
-        nullptr, 0,
-        [](LPVOID _param) -> DWORD {
-          ImageLoadFromFileTask *task = (ImageLoadFromFileTask *)_param;
-          runImageLoadTask(*task);
-          return 0;
-        },
-        _loader.Tasks[i], 0, &threadIds[i % batch]);
-    if ((i + 1) % batch == 0) {
-      WaitForMultipleObjects(batch, threads.data(), TRUE, INFINITE);
-    } else if (i == _loader.Tasks.size() - 1) {
-      WaitForMultipleObjects((i + 1) % batch, threads.data(), TRUE, INFINITE);
+void submitImageFileReads(ImageLoader &_loader) {
+  BB_ASSERT(!_loader.FileReads);
+
+  std::vector<FileRead> reads;
+  reads.reserve(_loader.Tasks.size());
+
+  for (ImageLoadFromFileTask *task : _loader.Tasks) {
+    if (task->PackedData.Data) {
+      continue;
+    }
+
+    FileRead read = {};
+    read.FilePath = task->FilePath;
+    // Missing maps are common (not every material has all of them), so they
+    // are just skipped.
+    if (!getFileSize(read.FilePath, read.Size)) {
+      continue;
+    }
+    task->FileContents.resize(read.Size);
+    read.Dest = task->FileContents.data();
+    task->FileReadIndex = (uint32_t)reads.size();
+    reads.push_back(std::move(read));
+  }
+
+  _loader.FileReads = submitFileReads(reads.data(), (uint32_t)reads.size());
+  for (ImageLoadFromFileTask *task : _loader.Tasks) {
+    if (!task->FileContents.empty()) {
+      task->FileReads = _loader.FileReads;
+    }
+  }
+}
+
+void finalizeAllImageLoads(ImageLoader &_loader, const Renderer &_renderer) {
+  if (!_loader.FileReads) {
+    submitImageFileReads(_loader);
+  }
+
+  const size_t numTasks = _loader.Tasks.size();
+  const size_t batch = MAXIMUM_WAIT_OBJECTS;
+  std::vector<HANDLE> threads(batch);
+  std::vector<DWORD> threadIds(batch);
+
+  // Uploads are submitted as soon as each batch of threads is done, so that the
+  // following batches can reuse the staging ring.
+  for (size_t batchBegin = 0; batchBegin < numTasks; batchBegin += batch) {
+    size_t batchEnd = std::min(batchBegin + batch, numTasks);
+    DWORD numThreads = (DWORD)(batchEnd - batchBegin);
+
+    for (size_t i = batchBegin; i < batchEnd; ++i) {
+      threads[i - batchBegin] = CreateThread(
+          nullptr, 0,
+          [](LPVOID _param) -> DWORD {
+            ImageLoadFromFileTask *task = (ImageLoadFromFileTask *)_param;
+            runImageLoadTask(*task);
+            return 0;
+          },
+          _loader.Tasks[i], 0, &threadIds[i - batchBegin]);
+    }
+    WaitForMultipleObjects(numThreads, threads.data(), TRUE, INFINITE);
+    for (DWORD i = 0; i < numThreads; ++i) {
+      CloseHandle(threads[i]);
     }
+
+    submitImageLoads(_renderer, &_loader.Tasks[batchBegin], numThreads);
   }
 
-  for (size_t i = 0; i < _loader.Tasks.size(); ++i) {
-    ImageLoadFromFileTask &task = *_loader.Tasks[i];
+  destroyImageLoader(_loader);
+}
+
+void submitImageLoads(const Renderer &_renderer,
+                      ImageLoadFromFileTask *const *_tasks,
+                      uint32_t _numTasks) {
+  StagingRing &stagingRing = *_renderer.StagingRing;
+  StagingBatch *stagingBatch = beginStagingBatch(stagingRing);
+  std::vector<StagingAllocation> stagingAllocations;
+  stagingAllocations.reserve(_numTasks);
+
+  for (uint32_t i = 0; i < _numTasks; ++i) {
+    ImageLoadFromFileTask &task = *_tasks[i];
     if (task.TargetImage->Handle == VK_NULL_HANDLE) {
       continue;
     }
 
-    VkCommandBufferAllocateInfo cmdBufferAllocInfo = {};
-    cmdBufferAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    cmdBufferAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    cmdBufferAllocInfo.commandPool = _cmdPool;
-    cmdBufferAllocInfo.commandBufferCount = 1;
-
-    VkCommandBuffer cmdBuffer;
-    BB_VK_ASSERT(vkAllocateCommandBuffers(_renderer.Device, &cmdBufferAllocInfo,
-                                          &cmdBuffer));
-
-    VkCommandBufferBeginInfo cmdBeginInfo = {};
-    cmdBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    cmdBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    BB_VK_ASSERT(vkBeginCommandBuffer(cmdBuffer, &cmdBeginInfo));
-    VkImageMemoryBarrier barrier = {};
-    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-
-    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-    barrier.srcAccessMask = 0;
-    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.image = task.TargetImage->Handle;
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
-    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
-                         nullptr, 1, &barrier);
-    VkBufferImageCopy region = {};
-    region.bufferOffset = 0;
-    region.bufferRowLength = 0;
-    region.bufferImageHeight = 0;
-    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    region.imageSubresource.mipLevel = 0;
-    region.imageSubresource.baseArrayLayer = 0;
-    region.imageSubresource.layerCount = 1;
-    region.imageOffset = {0, 0, 0};
-    region.imageExtent = int2ToExtent3D(task.ImageDims);
-    vkCmdCopyBufferToImage(cmdBuffer, task.StagingBuffer.Handle,
-                           task.TargetImage->Handle,
-                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr,
-                         0, nullptr, 1, &barrier);
-    BB_VK_ASSERT(vkEndCommandBuffer(cmdBuffer));
-
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &cmdBuffer;
-    BB_VK_ASSERT(
-        vkQueueSubmit(_renderer.Queue, 1, &submitInfo, VK_NULL_HANDLE));
-    BB_VK_ASSERT(vkQueueWaitIdle(_renderer.Queue));
-    vkFreeCommandBuffers(_renderer.Device, _cmdPool, 1, &cmdBuffer);
-
-    destroyBuffer(_renderer, task.StagingBuffer);
+    recordStagedImageCopy(stagingBatch->CmdBuffer, task.Staging,
+                          task.TargetImage->Handle, task.ImageDims);
+    stagingAllocations.push_back(task.Staging);
+    task.Staging = {};
 
     VkImageViewCreateInfo imageViewCreateInfo = {};
     imageViewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -355,14 +469,8 @@ void finalizeAllImageLoads(ImageLoader &_loader, const Renderer &_renderer,
                                    nullptr, &task.TargetImage->View));
   }
 
-  for (HANDLE thread : threads) {
-    CloseHandle(thread);
-  }
-
-  for (ImageLoadFromFileTask *task : _loader.Tasks) {
-    delete task;
-  }
-  _loader.Tasks.clear();
+  submitStagingBatch(stagingRing, stagingBatch, stagingAllocations.data(),
+                     (uint32_t)stagingAllocations.size());
 }
 
 } // namespace bb
\ No newline at end of file
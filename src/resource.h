@@ -1,9 +1,16 @@
 #pragma once
 #include "render.h"
+#include "staging.h"
+#include "file_io.h"
+#include "resource_pack.h"
 #include <string>
 #include <string_view>
 #include <vector>
 
+namespace Assimp {
+class IOSystem;
+}
+
 namespace bb {
 
 inline static const char nativePathSeparator = '\\';
@@ -11,30 +18,61 @@ bool isAbsolutePath(std::string_view _path);
 std::string joinPaths(std::string_view _a, std::string_view _b);
 std::string getFileName(std::string_view _path);
 
+// Also mounts the resource pack listed in config.toml, if there is one. Files
+// under the common resource root are then looked up in the pack first.
 void initResourceRoot();
+void shutdownResourceRoot();
 
 std::string createCommonResourcePath(std::string_view _relPath);
 std::string createShaderPath(std::string_view _relPath);
 
+// _absPath is expected to come from createCommonResourcePath() or
+// createShaderPath().
+bool findPackedFile(std::string_view _absPath, ResourceRange &_range);
+// Points _range into the mounted pack if the file is packed, otherwise reads
+// the loose file into _storage.
+bool loadResourceFile(const std::string &_absPath,
+                      std::vector<uint8_t> &_storage, ResourceRange &_range);
+std::vector<std::string> listSubdirectories(const std::string &_absDir);
+
+// For Assimp importers, so that models and the files they reference (.mtl,
+// ...) are read from the pack too. The importer takes ownership.
+Assimp::IOSystem *createResourceIOSystem();
+
 struct ImageLoadFromFileTask {
   const struct Renderer *Renderer;
   std::string FilePath;
   Image *TargetImage;
 
+  // Points into the resource pack if the file is packed.
+  ResourceRange PackedData = {};
+  // Set by submitImageFileReads(). Otherwise the file is read by
+  // runImageLoadTask() itself.
+  FileReadBatch *FileReads = nullptr;
+  uint32_t FileReadIndex = 0;
+  std::vector<uint8_t> FileContents;
+
   Int2 ImageDims;
-  Buffer StagingBuffer;
+  StagingAllocation Staging;
 };
 
 void runImageLoadTask(ImageLoadFromFileTask &_task);
 
 struct ImageLoader {
   std::vector<ImageLoadFromFileTask *> Tasks;
+  FileReadBatch *FileReads = nullptr;
 };
 
 void destroyImageLoader(ImageLoader &_loader);
 void enqueueImageLoadTask(ImageLoader &_loader, const Renderer &_renderer,
                           std::string_view _filePath, Image &_targetImage);
-void finalizeAllImageLoads(ImageLoader &_loader, const Renderer &_renderer,
-                           VkCommandPool _cmdPool);
+// Starts reading the files of every enqueued task in a single batch, so that
+// they're all in flight at once. Decoding waits for each file individually.
+void submitImageFileReads(ImageLoader &_loader);
+void finalizeAllImageLoads(ImageLoader &_loader, const Renderer &_renderer);
+// For tasks that have already been run by the caller: records their uploads
+// into a single staging batch and creates the image views.
+void submitImageLoads(const Renderer &_renderer,
+                      ImageLoadFromFileTask *const *_tasks, uint32_t _numTasks);
 
 } // namespace bb
\ No newline at end of file
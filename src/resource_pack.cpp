@@ -0,0 +1,191 @@
+#include "resource_pack.h"
+#include "util.h"
+#include <algorithm>
+#include <ctype.h>
+
+namespace bb {
+
+std::string normalizeResourcePath(std::string_view _relPath) {
+  std::string result;
+  result.reserve(_relPath.size());
+
+  size_t partBegin = 0;
+  for (size_t i = 0; i <= _relPath.size(); ++i) {
+    if (i < _relPath.size() && _relPath[i] != '/' && _relPath[i] != '\\') {
+      continue;
+    }
+
+    std::string_view part = _relPath.substr(partBegin, i - partBegin);
+    partBegin = i + 1;
+    if (part.empty() || part == ".") {
+      continue;
+    }
+
+    if (!result.empty()) {
+      result += '/';
+    }
+    for (char ch : part) {
+      result += (char)tolower((unsigned char)ch);
+    }
+  }
+
+  return result;
+}
+
+uint64_t hashResourcePath(std::string_view _normalizedPath) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (char ch : _normalizedPath) {
+    hash ^= (uint8_t)ch;
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Written so that a corrupt _offset + _size can't wrap around.
+static bool isRangeInside(uint64_t _offset, uint64_t _size, uint64_t _limit) {
+  return (_offset <= _limit) && (_size <= _limit - _offset);
+}
+
+static bool isValidResourcePack(const ResourcePack &_pack) {
+  const PackHeader &header = *_pack.Header;
+  if ((header.Magic != packMagic) || (header.Version != packVersion) ||
+      (sizeof(PackHeader) + (uint64_t)header.NumEntries * sizeof(PackEntry) >
+       header.PathsOffset) ||
+      !isRangeInside(header.PathsOffset, header.PathsSize, _pack.Size)) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < header.NumEntries; ++i) {
+    const PackEntry &entry = _pack.Entries[i];
+    if (!isRangeInside(entry.Offset, entry.Size, _pack.Size) ||
+        !isRangeInside(entry.PathOffset, entry.PathLength, header.PathsSize) ||
+        ((i > 0) && (_pack.Entries[i - 1].PathHash > entry.PathHash))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+ResourcePack *mountResourcePack(const std::string &_filePath) {
+#ifdef BB_WINDOWS
+  HANDLE fileHandle =
+      CreateFileA(_filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (fileHandle == INVALID_HANDLE_VALUE) {
+    return nullptr;
+  }
+
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(fileHandle, &fileSize) ||
+      (uint64_t)fileSize.QuadPart < sizeof(PackHeader)) {
+    CloseHandle(fileHandle);
+    return nullptr;
+  }
+
+  HANDLE mappingHandle =
+      CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!mappingHandle) {
+    CloseHandle(fileHandle);
+    return nullptr;
+  }
+
+  const uint8_t *data =
+      (const uint8_t *)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+  if (!data) {
+    CloseHandle(mappingHandle);
+    CloseHandle(fileHandle);
+    return nullptr;
+  }
+
+  ResourcePack *pack = new ResourcePack();
+  pack->FilePath = _filePath;
+  pack->Data = data;
+  pack->Size = (uint64_t)fileSize.QuadPart;
+  pack->FileHandle = fileHandle;
+  pack->MappingHandle = mappingHandle;
+
+  pack->Header = (const PackHeader *)pack->Data;
+  pack->Entries = (const PackEntry *)(pack->Data + sizeof(PackHeader));
+  pack->Paths = (const char *)(pack->Data + pack->Header->PathsOffset);
+
+  if (!isValidResourcePack(*pack)) {
+    BB_LOG_ERROR("{} is not a valid resource pack", _filePath);
+    unmountResourcePack(pack);
+    return nullptr;
+  }
+
+  return pack;
+#else
+  return nullptr;
+#endif
+}
+
+void unmountResourcePack(ResourcePack *_pack) {
+#ifdef BB_WINDOWS
+  UnmapViewOfFile(_pack->Data);
+  CloseHandle(_pack->MappingHandle);
+  CloseHandle(_pack->FileHandle);
+#endif
+  delete _pack;
+}
+
+static std::string_view getEntryPath(const ResourcePack &_pack,
+                                     const PackEntry &_entry) {
+  return std::string_view(_pack.Paths + _entry.PathOffset, _entry.PathLength);
+}
+
+bool findPackedResource(const ResourcePack &_pack, std::string_view _relPath,
+                        ResourceRange &_range) {
+  std::string path = normalizeResourcePath(_relPath);
+  uint64_t hash = hashResourcePath(path);
+
+  const PackEntry *entriesEnd = _pack.Entries + _pack.Header->NumEntries;
+  const PackEntry *entry = std::lower_bound(
+      _pack.Entries, entriesEnd, hash,
+      [](const PackEntry &_entry, uint64_t _hash) {
+        return _entry.PathHash < _hash;
+      });
+
+  // Entries with colliding hashes are next to each other.
+  for (; (entry != entriesEnd) && (entry->PathHash == hash); ++entry) {
+    if (getEntryPath(_pack, *entry) == path) {
+      _range.Data = _pack.Data + entry->Offset;
+      _range.Size = entry->Size;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+std::vector<std::string>
+listPackedSubdirectories(const ResourcePack &_pack, std::string_view _relDir) {
+  std::string prefix = normalizeResourcePath(_relDir);
+  if (!prefix.empty()) {
+    prefix += '/';
+  }
+
+  std::vector<std::string> subdirs;
+  for (uint32_t i = 0; i < _pack.Header->NumEntries; ++i) {
+    std::string_view path = getEntryPath(_pack, _pack.Entries[i]);
+    if (path.substr(0, prefix.size()) != prefix) {
+      continue;
+    }
+
+    std::string_view rest = path.substr(prefix.size());
+    size_t separator = rest.find('/');
+    if (separator == std::string_view::npos) {
+      continue;
+    }
+
+    std::string subdir(rest.substr(0, separator));
+    if (std::find(subdirs.begin(), subdirs.end(), subdir) == subdirs.end()) {
+      subdirs.push_back(std::move(subdir));
+    }
+  }
+
+  return subdirs;
+}
+
+} // namespace bb
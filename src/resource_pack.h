@@ -0,0 +1,81 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#ifdef BB_WINDOWS
+#include <Windows.h>
+#endif
+
+namespace bb {
+
+// A resource pack is a single file holding a whole resource tree. It's mapped
+// into memory once, and every file inside it is then just a pointer range into
+// the mapping. Packs are created by gen_pack.py, which has to be kept in sync
+// with the layout below:
+//
+//   PackHeader
+//   PackEntry[NumEntries], sorted by PathHash
+//   Paths (not null terminated, see normalizeResourcePath())
+//   File contents, each one starting at a multiple of DataAlignment
+//
+// Everything is little endian.
+constexpr uint32_t packMagic = 0x4B504242; // "BBPK"
+constexpr uint32_t packVersion = 1;
+
+struct PackHeader {
+  uint32_t Magic;
+  uint32_t Version;
+  uint32_t NumEntries;
+  uint32_t DataAlignment;
+  uint64_t PathsOffset;
+  uint64_t PathsSize;
+};
+static_assert(sizeof(PackHeader) == 32);
+
+struct PackEntry {
+  uint64_t PathHash;
+  uint64_t Offset;
+  uint64_t Size;
+  uint32_t PathOffset;
+  uint32_t PathLength;
+};
+static_assert(sizeof(PackEntry) == 32);
+
+struct ResourceRange {
+  const uint8_t *Data;
+  uint64_t Size;
+};
+
+struct ResourcePack {
+  std::string FilePath;
+  const uint8_t *Data;
+  uint64_t Size;
+
+  const PackHeader *Header;
+  const PackEntry *Entries;
+  const char *Paths;
+
+#ifdef BB_WINDOWS
+  HANDLE FileHandle;
+  HANDLE MappingHandle;
+#endif
+};
+
+// Paths inside a pack are relative to the pack root, '/' separated and lower
+// case, since resources are looked up case insensitively on Windows anyway.
+std::string normalizeResourcePath(std::string_view _relPath);
+// 64-bit FNV-1a of a normalized path.
+uint64_t hashResourcePath(std::string_view _normalizedPath);
+
+// Returns nullptr if the file can't be mapped or isn't a valid pack.
+ResourcePack *mountResourcePack(const std::string &_filePath);
+void unmountResourcePack(ResourcePack *_pack);
+
+bool findPackedResource(const ResourcePack &_pack, std::string_view _relPath,
+                        ResourceRange &_range);
+// Names of the direct subdirectories of _relDir, in no particular order.
+std::vector<std::string>
+listPackedSubdirectories(const ResourcePack &_pack, std::string_view _relDir);
+
+} // namespace bb
@@ -9,11 +9,10 @@
 
 namespace bb {
 
-ShaderBallScene::ShaderBallScene(CommonSceneResources *_common)
-    : SceneBase(_common) {
+ShaderBallScene::ShaderBallScene(CommonSceneResources *_common,
+                                 SceneLoadState *_loadState)
+    : SceneBase(_common, _loadState) {
   const Renderer &renderer = *Common->Renderer;
-  VkCommandPool transientCmdPool = Common->TransientCmdPool;
-  const PBRMaterialSet &materialSet = *Common->MaterialSet;
 
   Lights.resize(3);
   Light *light = &Lights[0];
@@ -26,12 +25,14 @@ ShaderBallScene::ShaderBallScene(CommonSceneResources *_common)
   light->Type = LightType::Point;
   light->Color = {1, 0.8f, 0.8f};
   light->Intensity = 50;
+  light->Radius = 20;
   ++light;
   light->Pos = {4, 2, 0};
   light->Dir = {0, -1, 0};
   light->Type = LightType::Point;
   light->Color = {0.8f, 1, 0.8f};
   light->Intensity = 50;
+  light->Radius = 20;
   light->InnerCutOff = degToRad(30);
   light->OuterCutOff = degToRad(25);
 
@@ -43,22 +44,32 @@ ShaderBallScene::ShaderBallScene(CommonSceneResources *_common)
     Plane.VertexBuffer = createVertexBuffer(planeVertices);
     Plane.IndexBuffer = createIndexBuffer(planeIndices);
     Plane.NumIndices = planeIndices.size();
+    Plane.Bounds =
+        computeMeshBounds(planeVertices.data(), (uint32_t)planeVertices.size());
 
     Plane.InstanceData.resize(Plane.NumInstances);
     InstanceBlock &planeInstanceData = Plane.InstanceData[0];
     planeInstanceData.ModelMat =
         Mat4::translate({0, -10, 0}) * Mat4::scale({100.f, 100.f, 100.f});
     planeInstanceData.InvModelMat = planeInstanceData.ModelMat.inverse();
-    Plane.InstanceBuffer = createInstanceBuffer(Plane.NumInstances);
-    updateInstanceBufferMemory(Plane.InstanceBuffer, Plane.InstanceData);
   }
 
+  reportLoadProgress(0.1f);
+
   // Setup shaderball buffers
   {
+    std::vector<uint8_t> shaderBallStorage;
+    ResourceRange shaderBallFile;
+    bool isShaderBallRead =
+        loadResourceFile(createCommonResourcePath("ShaderBall.fbx"),
+                         shaderBallStorage, shaderBallFile);
+    BB_ASSERT(isShaderBallRead);
+
     Assimp::Importer importer;
-    const aiScene *shaderBallScene =
-        importer.ReadFile(createCommonResourcePath("ShaderBall.fbx"),
-                          aiProcess_Triangulate | aiProcess_CalcTangentSpace);
+    const aiScene *shaderBallScene = importer.ReadFileFromMemory(
+        shaderBallFile.Data, (size_t)shaderBallFile.Size,
+        aiProcess_Triangulate | aiProcess_CalcTangentSpace, "fbx");
+    reportLoadProgress(0.7f);
     const aiMesh *shaderBallMesh = shaderBallScene->mMeshes[0];
     std::vector<Vertex> shaderBallVertices;
     shaderBallVertices.reserve(shaderBallMesh->mNumFaces * 3);
@@ -78,13 +89,26 @@ ShaderBallScene::ShaderBallScene(CommonSceneResources *_common)
       }
     }
 
+    // The vertices aren't shared between faces, but culled meshes are drawn
+    // indexed.
+    std::vector<uint32_t> shaderBallIndices(shaderBallVertices.size());
+    std::iota(shaderBallIndices.begin(), shaderBallIndices.end(), 0);
+
     ShaderBall.VertexBuffer = createVertexBuffer(shaderBallVertices);
-    ShaderBall.NumVertices = shaderBallVertices.size();
+    ShaderBall.IndexBuffer = createIndexBuffer(shaderBallIndices);
+    ShaderBall.NumIndices = shaderBallIndices.size();
+    ShaderBall.Bounds = computeMeshBounds(shaderBallVertices.data(),
+                                          (uint32_t)shaderBallVertices.size());
 
     ShaderBall.InstanceData.resize(ShaderBall.NumInstances);
-    ShaderBall.InstanceBuffer = createInstanceBuffer(ShaderBall.NumInstances);
   }
 
+  reportLoadProgress(0.9f);
+}
+
+void ShaderBallScene::registerGUITextures() {
+  const PBRMaterialSet &materialSet = *Common->MaterialSet;
+
   VkSampler materialImageSampler =
       Common->StandardPipelineLayout->ImmutableSamplers[SamplerType::Nearest];
 
@@ -112,22 +136,27 @@ ShaderBallScene::ShaderBallScene(CommonSceneResources *_common)
 
     GUI.MaterialTextureIds.push_back(textureIds);
   }
+
+  GUI.AreTexturesRegistered = true;
 }
 
 ShaderBallScene::~ShaderBallScene() {
   const Renderer &renderer = *Common->Renderer;
 
-  destroyBuffer(renderer, ShaderBall.InstanceBuffer);
+  destroyBuffer(renderer, ShaderBall.IndexBuffer);
   destroyBuffer(renderer, ShaderBall.VertexBuffer);
 
   destroyBuffer(renderer, Plane.IndexBuffer);
-  destroyBuffer(renderer, Plane.InstanceBuffer);
   destroyBuffer(renderer, Plane.VertexBuffer);
 }
 
 void ShaderBallScene::updateGUI(float _dt) {
   const PBRMaterialSet &materialSet = *Common->MaterialSet;
 
+  if (!GUI.AreTexturesRegistered) {
+    registerGUITextures();
+  }
+
   if (ImGui::Begin("Shader Balls")) {
     for (size_t i = 0; i < ShaderBall.InstanceData.size(); ++i) {
       std::string label = fmt::format("Shader Ball {}", i);
@@ -170,8 +199,6 @@ void ShaderBallScene::updateGUI(float _dt) {
 }
 
 void ShaderBallScene::updateScene(float _dt) {
-  const Renderer &renderer = *Common->Renderer;
-
   // ShaderBall.Angle += 30.f * dt;
   if (ShaderBall.Angle > 360) {
     ShaderBall.Angle -= 360;
@@ -185,9 +212,13 @@ void ShaderBallScene::updateScene(float _dt) {
     ShaderBall.InstanceData[i].InvModelMat =
         ShaderBall.InstanceData[i].ModelMat.inverse();
   }
+}
 
-  updateInstanceBufferMemory(ShaderBall.InstanceBuffer,
-                             ShaderBall.InstanceData);
+void ShaderBallScene::writeFrameData(const Frame &_frame) {
+  ShaderBall.Batch = addCullBatch(ShaderBall.Bounds, ShaderBall.NumIndices,
+                                  ShaderBall.InstanceData);
+  Plane.Batch =
+      addCullBatch(Plane.Bounds, Plane.NumIndices, Plane.InstanceData);
 }
 
 void ShaderBallScene::drawScene(const Frame &_frame) {
@@ -199,15 +230,16 @@ void ShaderBallScene::drawScene(const Frame &_frame) {
       cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, standardPipelineLayout.Handle, 2, 1,
       &_frame.MaterialDescriptorSets[GUI.SelectedMaterial], 0, nullptr);
 
+  const GPUCulling &culling = *Common->Culling;
   VkDeviceSize offset = 0;
   vkCmdBindVertexBuffers(cmd, 0, 1, &ShaderBall.VertexBuffer.Handle, &offset);
-  vkCmdBindVertexBuffers(cmd, 1, 1, &ShaderBall.InstanceBuffer.Handle, &offset);
-  vkCmdDraw(cmd, ShaderBall.NumVertices, ShaderBall.NumInstances, 0, 0);
+  vkCmdBindIndexBuffer(cmd, ShaderBall.IndexBuffer.Handle, 0,
+                       VK_INDEX_TYPE_UINT32);
+  drawCullBatch(culling, cmd, _frame, ShaderBall.Batch);
 
   vkCmdBindVertexBuffers(cmd, 0, 1, &Plane.VertexBuffer.Handle, &offset);
-  vkCmdBindVertexBuffers(cmd, 1, 1, &Plane.InstanceBuffer.Handle, &offset);
   vkCmdBindIndexBuffer(cmd, Plane.IndexBuffer.Handle, 0, VK_INDEX_TYPE_UINT32);
-  vkCmdDrawIndexed(cmd, Plane.NumIndices, Plane.NumInstances, 0, 0, 0);
+  drawCullBatch(culling, cmd, _frame, Plane.Batch);
 }
 
 } // namespace bb
\ No newline at end of file
@@ -1,6 +1,9 @@
 #pragma once
 #include "render.h"
+#include "gpu_culling.h"
 #include "external/imgui/imgui.h"
+#include <algorithm>
+#include <atomic>
 
 namespace bb {
 struct Gizmo {
@@ -29,7 +32,7 @@ enum class GBufferVisualizingOption {
   Normal,
   Albedo,
   MRHA,
-  MaterialIndex,
+  LightHeatmap,
   RenderedScene,
   COUNT
 };
@@ -39,13 +42,10 @@ struct GBufferVisualize {
   Shader VertShader;
   Shader FragShader;
 
-  VkExtent2D ViewportExtent;
-
   StandardPipelineLayout PipelineLayout;
 
   EnumArray<GBufferVisualizingOption, const char *> OptionLabels = {
-      "Position", "Normal",         "Albedo",
-      "MRHA",     "Material index", "Rendered Scene"};
+      "Position", "Normal", "Albedo", "MRHA", "Light Heatmap", "Rendered Scene"};
   GBufferVisualizingOption CurrentOption =
       GBufferVisualizingOption::RenderedScene;
 };
@@ -57,30 +57,99 @@ struct LightSources {
   Buffer VertexBuffer;
   Buffer IndexBuffer;
   uint32_t NumIndices;
-  Buffer InstanceBuffer;
+  // One instance per light of the light buffer.
   uint32_t NumLights;
 };
 
+enum class LightVolumeShape { Sphere, Cone, COUNT };
+
+struct LightVolumeDraw {
+  uint32_t LightIndex;
+  // Depth buffer values the light can touch, for the depth bounds test.
+  float MinDepth;
+  float MaxDepth;
+};
+
+// Point and spot lights of the deferred path are drawn as proxy volumes, so
+// only the pixels they cover get shaded. The sphere is the light source mesh.
+struct LightVolumes {
+  VkPipeline Pipeline;
+  Shader VertShader;
+  Shader FragShader;
+  Buffer ConeVertexBuffer;
+  Buffer ConeIndexBuffer;
+  uint32_t NumConeIndices;
+  bool UseDepthBounds;
+  // Collected every frame from the lights that ended up in a cluster.
+  EnumArray<LightVolumeShape, std::vector<LightVolumeDraw>> Draws;
+};
+
 enum class RenderPassType { Forward, Deferred, COUNT };
 
 // CommonSceneResources doesn't own actual resources, but only references of
 // them.
 struct CommonSceneResources {
   Renderer *Renderer;
-  VkCommandPool TransientCmdPool;
   StandardPipelineLayout *StandardPipelineLayout;
   PBRMaterialSet *MaterialSet;
+  GPUCulling *Culling;
+};
+
+struct SceneBase;
+
+// Shared between the main thread and the worker thread that constructs a scene.
+// The scene is ready to be drawn once IsConstructed is set and the staging
+// serial UploadSerial is complete.
+struct SceneLoadState {
+  std::atomic<float> Progress = 0.f;
+  std::atomic<bool> IsConstructed = false;
+  SceneBase *Scene = nullptr;
+  uint64_t UploadSerial = 0;
+};
+
+struct LightRange {
+  uint32_t First;
+  uint32_t Count;
+};
+
+struct SceneCullStats {
+  uint32_t NumInstances;
+  uint32_t NumVisibleInstances;
 };
 
 struct SceneBase {
+  inline static std::atomic<uint32_t> NextId = 1;
+
   CommonSceneResources *Common;
+  SceneLoadState *LoadState;
   RenderPassType SceneRenderPassType = RenderPassType::Deferred;
-  std::vector<Light> Lights;
+  // Tells the lights of this scene apart from the ones of any other scene.
+  const uint32_t Id = NextId++;
 
-  explicit SceneBase(CommonSceneResources *_common) : Common(_common) {}
+  // Lights stay on the GPU across frames, so whatever changes Lights after the
+  // scene is constructed has to mark what changed. See LightBuffer.
+  std::vector<Light> Lights;
+  std::vector<LightRange> DirtyLightRanges;
+  // The stress test appends this many lights to the scene's own ones.
+  uint32_t NumStressTestLights = 0;
+
+  SceneCullStats CullStats = {};
+  // Reused by addCullBatch() so that culling doesn't allocate every frame.
+  std::vector<InstanceBlock> VisibleInstances;
+  std::vector<uint32_t> VisibleInstanceIds;
+
+  explicit SceneBase(CommonSceneResources *_common,
+                     SceneLoadState *_loadState = nullptr)
+      : Common(_common), LoadState(_loadState) {}
   virtual ~SceneBase() = default;
   virtual void updateGUI(float _dt) = 0;
+  // CPU side only. Runs while earlier frames may still be executing, so it must
+  // not write anything the GPU reads.
   virtual void updateScene(float _dt) = 0;
+  // Runs once the fence of _frame has been waited on. Only the storage owned
+  // by _frame.Index may be written. Instances are handed to Common->Culling
+  // here, every frame, through addCullBatch().
+  virtual void writeFrameData(const Frame &_frame) {}
   virtual void drawScene(const Frame &_frame) = 0;
 
   template <typename Container>
@@ -88,9 +157,8 @@ struct SceneBase {
     static_assert(std::is_same_v<ELEMENT_TYPE(_vertices), Vertex>,
                   "Element type for _vertices is not Vertex!");
     const Renderer &renderer = *Common->Renderer;
-    VkCommandPool transientCmdPool = Common->TransientCmdPool;
     Buffer vertexBuffer = createDeviceLocalBufferFromMemory(
-        renderer, transientCmdPool, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+        renderer, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
         sizeBytes32(_vertices), std::data(_vertices));
     return vertexBuffer;
   }
@@ -100,44 +168,89 @@ struct SceneBase {
     static_assert(std::is_same_v<ELEMENT_TYPE(_indices), uint32_t>,
                   "Element type for _indices is not uint32_t!");
     const Renderer &renderer = *Common->Renderer;
-    VkCommandPool transientCmdPool = Common->TransientCmdPool;
     Buffer indexBuffer = createDeviceLocalBufferFromMemory(
-        renderer, transientCmdPool, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+        renderer, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
         sizeBytes32(_indices), std::data(_indices));
     return indexBuffer;
   }
 
-  Buffer createInstanceBuffer(uint32_t _numInstances) const {
-    const Renderer &renderer = *Common->Renderer;
-    Buffer instanceBuffer =
-        createBuffer(renderer, sizeof(InstanceBlock) * _numInstances,
-                     VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
-                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-    return instanceBuffer;
+  // Merged into the first range it touches, if any. updateLightBuffer() merges
+  // whatever still overlaps after that.
+  void markLightsDirty(uint32_t _first, uint32_t _count) {
+    if (_count == 0) {
+      return;
+    }
+    uint32_t last = _first + _count;
+    for (LightRange &range : DirtyLightRanges) {
+      uint32_t rangeLast = range.First + range.Count;
+      if ((_first <= rangeLast) && (range.First <= last)) {
+        range.First = std::min(range.First, _first);
+        range.Count = std::max(rangeLast, last) - range.First;
+        return;
+      }
+    }
+    DirtyLightRanges.push_back({_first, _count});
   }
 
+  void reportLoadProgress(float _progress) const {
+    if (LoadState) {
+      LoadState->Progress = _progress;
+    }
+  }
+
+  // Called before writeFrameData() every frame.
+  void cullScene() { CullStats = {}; }
+
+  // Only the instances inside the frustum of setGPUCullingView() are
+  // uploaded; the batch may end up with none. The GPU culls what's left
+  // further.
   template <typename Container>
-  void updateInstanceBufferMemory(const Buffer &_instanceBuffer,
-                                  const Container &_instanceData) const {
+  uint32_t addCullBatch(const MeshBounds &_bounds, uint32_t _numIndices,
+                        const Container &_instanceData) {
     static_assert(std::is_same_v<ELEMENT_TYPE(_instanceData), InstanceBlock>,
                   "Element type for _instanceData is not InstanceBlock!");
-    const Renderer &renderer = *Common->Renderer;
-
-    void *dst;
-    vkMapMemory(renderer.Device, _instanceBuffer.Memory, 0,
-                _instanceBuffer.Size, 0, &dst);
-    memcpy(dst, std::data(_instanceData), _instanceBuffer.Size);
-    vkUnmapMemory(renderer.Device, _instanceBuffer.Memory);
+    GPUCulling &culling = *Common->Culling;
+    VisibleInstances.clear();
+    VisibleInstanceIds.clear();
+    uint32_t instanceId = 0;
+    for (const InstanceBlock &instance : _instanceData) {
+      MeshBounds bounds = transformMeshBounds(_bounds, instance.ModelMat);
+      if (isSphereInFrustum(culling.FrustumPlanes, bounds.Center,
+                            bounds.Radius)) {
+        VisibleInstances.push_back(instance);
+        VisibleInstanceIds.push_back(instanceId);
+      }
+      ++instanceId;
+    }
+    CullStats.NumInstances += instanceId;
+    CullStats.NumVisibleInstances += (uint32_t)VisibleInstances.size();
+
+    return bb::addCullBatch(culling, _bounds, _numIndices,
+                            VisibleInstances.data(), VisibleInstanceIds.data(),
+                            (uint32_t)VisibleInstances.size(), instanceId);
   }
 };
 
+// Drawn while the first scene is still being constructed.
+struct PlaceholderScene : SceneBase {
+  explicit PlaceholderScene(CommonSceneResources *_common)
+      : SceneBase(_common) {}
+  void updateGUI(float _dt) override {}
+  void updateScene(float _dt) override {}
+  void drawScene(const Frame &_frame) override {}
+};
+
 struct TriangleScene : SceneBase {
   Buffer VertexBuffer;
-  uint32_t NumVertices;
-  Buffer InstanceBuffer;
+  Buffer IndexBuffer;
+  uint32_t NumIndices;
+  MeshBounds Bounds;
+  InstanceBlock InstanceData[1];
+  uint32_t Batch;
 
-  explicit TriangleScene(CommonSceneResources *_common) : SceneBase(_common) {
+  explicit TriangleScene(CommonSceneResources *_common,
+                         SceneLoadState *_loadState = nullptr)
+      : SceneBase(_common, _loadState) {
     Lights.resize(1);
     Light *light = &Lights[0];
     light->Dir = {-1, -1, 0};
@@ -151,22 +264,25 @@ struct TriangleScene : SceneBase {
         {{1, -1, 5}, {1, 0}},
         {{-1, -1, 5}, {0, 0}}};
     // clang-format on
+    uint32_t indices[] = {0, 1, 2};
     VertexBuffer = createVertexBuffer(vertices);
-    NumVertices = std::size(vertices);
-    InstanceBuffer = createInstanceBuffer(1);
-    InstanceBlock instanceData[1] = {};
-    instanceData[0].ModelMat = Mat4::identity();
-    instanceData[0].InvModelMat = Mat4::identity();
-    updateInstanceBufferMemory(InstanceBuffer, instanceData);
+    IndexBuffer = createIndexBuffer(indices);
+    NumIndices = std::size(indices);
+    Bounds = computeMeshBounds(vertices, (uint32_t)std::size(vertices));
+    InstanceData[0].ModelMat = Mat4::identity();
+    InstanceData[0].InvModelMat = Mat4::identity();
   }
 
   ~TriangleScene() override {
     const Renderer &renderer = *Common->Renderer;
-    destroyBuffer(renderer, InstanceBuffer);
+    destroyBuffer(renderer, IndexBuffer);
     destroyBuffer(renderer, VertexBuffer);
   }
   void updateGUI(float _dt) override {}
   void updateScene(float _dt) override {}
+  void writeFrameData(const Frame &_frame) override {
+    Batch = addCullBatch(Bounds, NumIndices, InstanceData);
+  }
   void drawScene(const Frame &_frame) override {
     VkCommandBuffer cmd = _frame.CmdBuffer;
     const StandardPipelineLayout &standardPipelineLayout =
@@ -178,8 +294,8 @@ struct TriangleScene : SceneBase {
 
     VkDeviceSize offset = 0;
     vkCmdBindVertexBuffers(cmd, 0, 1, &VertexBuffer.Handle, &offset);
-    vkCmdBindVertexBuffers(cmd, 1, 1, &InstanceBuffer.Handle, &offset);
-    vkCmdDraw(cmd, NumVertices, 1, 0, 0);
+    vkCmdBindIndexBuffer(cmd, IndexBuffer.Handle, 0, VK_INDEX_TYPE_UINT32);
+    drawCullBatch(*Common->Culling, cmd, _frame, Batch);
   }
 };
 
@@ -188,35 +304,45 @@ struct ShaderBallScene : SceneBase {
     Buffer VertexBuffer;
     Buffer IndexBuffer;
     uint32_t NumIndices;
+    MeshBounds Bounds;
 
     uint32_t NumInstances = 1;
     std::vector<InstanceBlock> InstanceData;
-    Buffer InstanceBuffer;
+    uint32_t Batch;
   } Plane;
 
   struct {
     Buffer VertexBuffer;
-    uint32_t NumVertices;
+    Buffer IndexBuffer;
+    uint32_t NumIndices;
+    MeshBounds Bounds;
 
     uint32_t NumInstances = 1;
     std::vector<InstanceBlock> InstanceData;
-    Buffer InstanceBuffer;
+    uint32_t Batch;
 
     float Angle = -90;
   } ShaderBall;
 
   struct {
+    // ImGui textures are registered on the main thread, the first time the GUI
+    // is drawn.
+    bool AreTexturesRegistered = false;
     EnumArray<PBRMapType, ImTextureID> DefaultMaterialTextureId;
     std::vector<EnumArray<PBRMapType, ImTextureID>> MaterialTextureIds;
     int SelectedMaterial = 1;
     int SelectedShaderBallInstance = -1;
   } GUI;
 
-  explicit ShaderBallScene(CommonSceneResources *_common);
+  explicit ShaderBallScene(CommonSceneResources *_common,
+                           SceneLoadState *_loadState = nullptr);
   ~ShaderBallScene() override;
   void updateGUI(float _dt) override;
   void updateScene(float _dt) override;
+  void writeFrameData(const Frame &_frame) override;
   void drawScene(const Frame &_frame) override;
+
+  void registerGUITextures();
 };
 
 } // namespace bb
\ No newline at end of file
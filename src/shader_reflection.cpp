@@ -0,0 +1,381 @@
+#include "shader_reflection.h"
+#include "util.h"
+#include <algorithm>
+
+namespace bb {
+
+// The handful of SPIR-V opcodes, decorations and enums needed to find the
+// resources of a module. See the SPIR-V specification, section 3.
+constexpr uint32_t spvMagicNumber = 0x07230203;
+
+constexpr uint32_t spvOpTypeBool = 20;
+constexpr uint32_t spvOpTypeInt = 21;
+constexpr uint32_t spvOpTypeFloat = 22;
+constexpr uint32_t spvOpTypeVector = 23;
+constexpr uint32_t spvOpTypeMatrix = 24;
+constexpr uint32_t spvOpTypeImage = 25;
+constexpr uint32_t spvOpTypeSampler = 26;
+constexpr uint32_t spvOpTypeSampledImage = 27;
+constexpr uint32_t spvOpTypeArray = 28;
+constexpr uint32_t spvOpTypeRuntimeArray = 29;
+constexpr uint32_t spvOpTypeStruct = 30;
+constexpr uint32_t spvOpTypePointer = 32;
+constexpr uint32_t spvOpConstant = 43;
+constexpr uint32_t spvOpVariable = 59;
+constexpr uint32_t spvOpDecorate = 71;
+constexpr uint32_t spvOpMemberDecorate = 72;
+
+constexpr uint32_t spvDecorationSpecId = 1;
+constexpr uint32_t spvDecorationBlock = 2;
+constexpr uint32_t spvDecorationBufferBlock = 3;
+constexpr uint32_t spvDecorationArrayStride = 6;
+constexpr uint32_t spvDecorationMatrixStride = 7;
+constexpr uint32_t spvDecorationBinding = 33;
+constexpr uint32_t spvDecorationDescriptorSet = 34;
+constexpr uint32_t spvDecorationOffset = 35;
+
+constexpr uint32_t spvStorageClassUniformConstant = 0;
+constexpr uint32_t spvStorageClassUniform = 2;
+constexpr uint32_t spvStorageClassPushConstant = 9;
+constexpr uint32_t spvStorageClassStorageBuffer = 12;
+
+constexpr uint32_t spvDimBuffer = 5;
+constexpr uint32_t spvDimSubpassData = 6;
+
+struct SPIRVInstruction {
+  uint32_t Op;
+  // Operands after the opcode word.
+  const uint32_t *Operands;
+  uint32_t NumOperands;
+};
+
+struct SPIRVId {
+  // The instruction that defines the id, if it's a type, a constant or a
+  // variable.
+  SPIRVInstruction Definition;
+
+  bool HasSet;
+  uint32_t Set;
+  bool HasBinding;
+  uint32_t Binding;
+  bool IsBlock;
+  bool IsBufferBlock;
+  uint32_t ArrayStride;
+
+  std::vector<uint32_t> MemberOffsets;
+  std::vector<uint32_t> MemberMatrixStrides;
+};
+
+struct SPIRVModule {
+  std::vector<SPIRVId> Ids;
+  std::vector<uint32_t> Variables;
+  uint32_t SpecConstantMask;
+};
+
+static SPIRVModule parseSPIRV(const uint32_t *_code, size_t _numWords) {
+  BB_ASSERT(_numWords >= 5);
+  BB_ASSERT(_code[0] == spvMagicNumber);
+
+  SPIRVModule module = {};
+  uint32_t bound = _code[3];
+  module.Ids.resize(bound);
+
+  auto getId = [&](uint32_t _id) -> SPIRVId & {
+    BB_ASSERT(_id < bound);
+    return module.Ids[_id];
+  };
+
+  size_t offset = 5;
+  while (offset < _numWords) {
+    uint32_t opWord = _code[offset];
+    uint32_t numWords = opWord >> 16;
+    BB_ASSERT((numWords > 0) && (offset + numWords <= _numWords));
+
+    SPIRVInstruction instruction = {};
+    instruction.Op = opWord & 0xffff;
+    instruction.Operands = _code + offset + 1;
+    instruction.NumOperands = numWords - 1;
+    const uint32_t *operands = instruction.Operands;
+
+    switch (instruction.Op) {
+    case spvOpTypeBool:
+    case spvOpTypeInt:
+    case spvOpTypeFloat:
+    case spvOpTypeVector:
+    case spvOpTypeMatrix:
+    case spvOpTypeImage:
+    case spvOpTypeSampler:
+    case spvOpTypeSampledImage:
+    case spvOpTypeArray:
+    case spvOpTypeRuntimeArray:
+    case spvOpTypeStruct:
+    case spvOpTypePointer:
+      getId(operands[0]).Definition = instruction;
+      break;
+    case spvOpConstant:
+      getId(operands[1]).Definition = instruction;
+      break;
+    case spvOpVariable:
+      getId(operands[1]).Definition = instruction;
+      module.Variables.push_back(operands[1]);
+      break;
+    case spvOpDecorate: {
+      SPIRVId &target = getId(operands[0]);
+      switch (operands[1]) {
+      case spvDecorationSpecId:
+        BB_ASSERT(operands[2] < 32);
+        module.SpecConstantMask |= 1u << operands[2];
+        break;
+      case spvDecorationDescriptorSet:
+        target.HasSet = true;
+        target.Set = operands[2];
+        break;
+      case spvDecorationBinding:
+        target.HasBinding = true;
+        target.Binding = operands[2];
+        break;
+      case spvDecorationBlock:
+        target.IsBlock = true;
+        break;
+      case spvDecorationBufferBlock:
+        target.IsBufferBlock = true;
+        break;
+      case spvDecorationArrayStride:
+        target.ArrayStride = operands[2];
+        break;
+      }
+      break;
+    }
+    case spvOpMemberDecorate: {
+      SPIRVId &target = getId(operands[0]);
+      uint32_t member = operands[1];
+      if (operands[2] == spvDecorationOffset) {
+        if (target.MemberOffsets.size() <= member) {
+          target.MemberOffsets.resize(member + 1);
+        }
+        target.MemberOffsets[member] = operands[3];
+      } else if (operands[2] == spvDecorationMatrixStride) {
+        if (target.MemberMatrixStrides.size() <= member) {
+          target.MemberMatrixStrides.resize(member + 1);
+        }
+        target.MemberMatrixStrides[member] = operands[3];
+      }
+      break;
+    }
+    }
+
+    offset += numWords;
+  }
+
+  return module;
+}
+
+static uint32_t getTypeSize(const SPIRVModule &_module, uint32_t _typeId,
+                            uint32_t _matrixStride = 0) {
+  const SPIRVId &type = _module.Ids[_typeId];
+  const uint32_t *operands = type.Definition.Operands;
+
+  switch (type.Definition.Op) {
+  case spvOpTypeBool:
+    return 4;
+  case spvOpTypeInt:
+  case spvOpTypeFloat:
+    return operands[1] / 8;
+  case spvOpTypeVector:
+    return getTypeSize(_module, operands[1]) * operands[2];
+  case spvOpTypeMatrix: {
+    uint32_t columnSize = _matrixStride > 0 ? _matrixStride
+                                            : getTypeSize(_module, operands[1]);
+    return columnSize * operands[2];
+  }
+  case spvOpTypeArray: {
+    const SPIRVId &length = _module.Ids[operands[2]];
+    BB_ASSERT(length.Definition.Op == spvOpConstant);
+    uint32_t stride = type.ArrayStride > 0
+                          ? type.ArrayStride
+                          : getTypeSize(_module, operands[1], _matrixStride);
+    return stride * length.Definition.Operands[2];
+  }
+  case spvOpTypeRuntimeArray:
+    return 0;
+  case spvOpTypeStruct: {
+    uint32_t size = 0;
+    for (uint32_t i = 1; i < type.Definition.NumOperands; ++i) {
+      uint32_t member = i - 1;
+      uint32_t memberOffset = member < type.MemberOffsets.size()
+                                  ? type.MemberOffsets[member]
+                                  : size;
+      uint32_t memberMatrixStride = member < type.MemberMatrixStrides.size()
+                                        ? type.MemberMatrixStrides[member]
+                                        : 0;
+      size = std::max(size, memberOffset + getTypeSize(_module, operands[i],
+                                                       memberMatrixStride));
+    }
+    return size;
+  }
+  default:
+    BB_ASSERT(false);
+    return 0;
+  }
+}
+
+static VkDescriptorType getDescriptorType(const SPIRVModule &_module,
+                                          uint32_t _storageClass,
+                                          uint32_t _typeId) {
+  const SPIRVId &type = _module.Ids[_typeId];
+  const uint32_t *operands = type.Definition.Operands;
+
+  switch (type.Definition.Op) {
+  case spvOpTypeSampler:
+    return VK_DESCRIPTOR_TYPE_SAMPLER;
+  case spvOpTypeSampledImage:
+    return VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  case spvOpTypeImage: {
+    uint32_t dim = operands[2];
+    bool isStorage = operands[6] == 2;
+    if (dim == spvDimSubpassData) {
+      return VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+    }
+    if (dim == spvDimBuffer) {
+      return isStorage ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER
+                       : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+    }
+    return isStorage ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE
+                     : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+  }
+  case spvOpTypeStruct:
+    if ((_storageClass == spvStorageClassStorageBuffer) ||
+        type.IsBufferBlock) {
+      return VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    }
+    BB_ASSERT(type.IsBlock);
+    return VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  default:
+    BB_ASSERT(false);
+    return VK_DESCRIPTOR_TYPE_MAX_ENUM;
+  }
+}
+
+ShaderReflection reflectSPIRV(const uint32_t *_code, size_t _numWords,
+                              VkShaderStageFlagBits _stage) {
+  SPIRVModule module = parseSPIRV(_code, _numWords);
+
+  ShaderReflection reflection = {};
+  reflection.SpecConstantMask = module.SpecConstantMask;
+  for (uint32_t variableId : module.Variables) {
+    const SPIRVId &variable = module.Ids[variableId];
+    uint32_t storageClass = variable.Definition.Operands[2];
+
+    const SPIRVId &pointerType = module.Ids[variable.Definition.Operands[0]];
+    BB_ASSERT(pointerType.Definition.Op == spvOpTypePointer);
+    uint32_t typeId = pointerType.Definition.Operands[2];
+
+    if (storageClass == spvStorageClassPushConstant) {
+      reflection.PushConstantSize =
+          std::max(reflection.PushConstantSize, getTypeSize(module, typeId));
+      reflection.PushConstantStages = _stage;
+      continue;
+    }
+
+    if ((storageClass != spvStorageClassUniformConstant) &&
+        (storageClass != spvStorageClassUniform) &&
+        (storageClass != spvStorageClassStorageBuffer)) {
+      continue;
+    }
+    if (!variable.HasSet || !variable.HasBinding) {
+      continue;
+    }
+
+    ReflectedBinding binding = {};
+    binding.Set = variable.Set;
+    binding.Binding = variable.Binding;
+    binding.NumDescriptors = 1;
+    binding.Stages = _stage;
+
+    const SPIRVId *type = &module.Ids[typeId];
+    if (type->Definition.Op == spvOpTypeArray) {
+      const SPIRVId &length = module.Ids[type->Definition.Operands[2]];
+      BB_ASSERT(length.Definition.Op == spvOpConstant);
+      binding.NumDescriptors = length.Definition.Operands[2];
+      typeId = type->Definition.Operands[1];
+    } else if (type->Definition.Op == spvOpTypeRuntimeArray) {
+      // Unsized arrays aren't used; there would be nothing to size pools by.
+      BB_ASSERT(false);
+    }
+    binding.Type = getDescriptorType(module, storageClass, typeId);
+
+    reflection.Bindings.push_back(binding);
+  }
+
+  return reflection;
+}
+
+ShaderReflection
+mergeShaderReflections(const ShaderReflection *const *_reflections,
+                       uint32_t _numReflections) {
+  ShaderReflection merged = {};
+
+  for (uint32_t i = 0; i < _numReflections; ++i) {
+    const ShaderReflection &reflection = *_reflections[i];
+
+    for (const ReflectedBinding &binding : reflection.Bindings) {
+      auto found = std::find_if(
+          merged.Bindings.begin(), merged.Bindings.end(),
+          [&binding](const ReflectedBinding &_other) {
+            return (_other.Set == binding.Set) &&
+                   (_other.Binding == binding.Binding);
+          });
+      if (found == merged.Bindings.end()) {
+        merged.Bindings.push_back(binding);
+        continue;
+      }
+
+      if (found->Type != binding.Type) {
+        BB_LOG_ERROR("Set {} binding {} is declared with different types",
+                     binding.Set, binding.Binding);
+        BB_ASSERT(false);
+      }
+      found->NumDescriptors =
+          std::max(found->NumDescriptors, binding.NumDescriptors);
+      found->Stages |= binding.Stages;
+    }
+
+    merged.PushConstantSize =
+        std::max(merged.PushConstantSize, reflection.PushConstantSize);
+    merged.PushConstantStages |= reflection.PushConstantStages;
+    merged.SpecConstantMask |= reflection.SpecConstantMask;
+  }
+
+  std::sort(merged.Bindings.begin(), merged.Bindings.end(),
+            [](const ReflectedBinding &_a, const ReflectedBinding &_b) {
+              return (_a.Set != _b.Set) ? (_a.Set < _b.Set)
+                                        : (_a.Binding < _b.Binding);
+            });
+
+  return merged;
+}
+
+bool isShaderReflectionSubset(const ShaderReflection &_reflection,
+                              const ShaderReflection &_layout) {
+  for (const ReflectedBinding &binding : _reflection.Bindings) {
+    auto found = std::find_if(
+        _layout.Bindings.begin(), _layout.Bindings.end(),
+        [&binding](const ReflectedBinding &_other) {
+          return (_other.Set == binding.Set) &&
+                 (_other.Binding == binding.Binding) &&
+                 (_other.Type == binding.Type) &&
+                 (_other.NumDescriptors >= binding.NumDescriptors) &&
+                 ((_other.Stages & binding.Stages) == binding.Stages);
+        });
+    if (found == _layout.Bindings.end()) {
+      return false;
+    }
+  }
+  return ((_layout.SpecConstantMask & _reflection.SpecConstantMask) ==
+          _reflection.SpecConstantMask) &&
+         (_reflection.PushConstantSize <= _layout.PushConstantSize) &&
+         ((_layout.PushConstantStages & _reflection.PushConstantStages) ==
+          _reflection.PushConstantStages);
+}
+
+} // namespace bb
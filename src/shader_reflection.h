@@ -0,0 +1,45 @@
+#pragma once
+#include "external/volk.h"
+#include <vector>
+
+namespace bb {
+
+struct ReflectedBinding {
+  uint32_t Set;
+  uint32_t Binding;
+  VkDescriptorType Type;
+  uint32_t NumDescriptors;
+  VkShaderStageFlags Stages;
+};
+
+// The descriptor bindings and push constants a shader module declares, read
+// straight from its SPIR-V. Uniform buffers are reported as
+// VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER; whether they are bound with dynamic
+// offsets is up to whoever builds the layout.
+struct ShaderReflection {
+  std::vector<ReflectedBinding> Bindings;
+  uint32_t PushConstantSize;
+  VkShaderStageFlags PushConstantStages;
+  // Bit per specialization constant_id the module declares.
+  uint32_t SpecConstantMask;
+};
+
+// Asserts on malformed SPIR-V.
+ShaderReflection reflectSPIRV(const uint32_t *_code, size_t _numWords,
+                              VkShaderStageFlagBits _stage);
+
+// Bindings of every reflection combined, sorted by set and then binding. The
+// same binding declared by several shaders has to have the same type; the
+// stages are or'ed together and the largest array size is kept.
+ShaderReflection
+mergeShaderReflections(const ShaderReflection *const *_reflections,
+                       uint32_t _numReflections);
+
+// Whether a pipeline layout built for _layout also fits _reflection, i.e.
+// every binding of _reflection is declared the same way in _layout. Also
+// requires _reflection not to declare specialization constants _layout doesn't,
+// since pipelines are keyed by the ones their shaders use.
+bool isShaderReflectionSubset(const ShaderReflection &_reflection,
+                              const ShaderReflection &_layout);
+
+} // namespace bb
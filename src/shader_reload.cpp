@@ -0,0 +1,190 @@
+#include "shader_reload.h"
+#include "util.h"
+#include "resource.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <unordered_set>
+
+namespace bb {
+
+namespace fs = std::filesystem;
+
+// How often the shader root is scanned for edits.
+constexpr auto shaderReloadPollInterval = std::chrono::milliseconds(250);
+
+static bool isShaderStageSource(const std::string &_fileName) {
+  return endsWith(_fileName, ".vert") || endsWith(_fileName, ".frag") ||
+         endsWith(_fileName, ".geom") || endsWith(_fileName, ".comp");
+}
+
+static bool isShaderSource(const std::string &_fileName) {
+  return isShaderStageSource(_fileName) || endsWith(_fileName, ".glsl");
+}
+
+static std::unordered_map<std::string, fs::file_time_type>
+scanShaderSources(const std::string &_shaderRoot) {
+  std::unordered_map<std::string, fs::file_time_type> writeTimes;
+  std::error_code error;
+  for (const fs::directory_entry &entry :
+       fs::directory_iterator(_shaderRoot, error)) {
+    std::string fileName = entry.path().filename().string();
+    if (entry.is_regular_file(error) && isShaderSource(fileName)) {
+      writeTimes[fileName] = entry.last_write_time(error);
+    }
+  }
+  return writeTimes;
+}
+
+// Only #include "file" relative to the shader root is supported, which is all
+// the shaders use.
+static void collectIncludes(const std::string &_shaderRoot,
+                            const std::string &_fileName,
+                            std::unordered_set<std::string> &_includes) {
+  FILE *f = fopen(joinPaths(_shaderRoot, _fileName).c_str(), "r");
+  if (!f) {
+    return;
+  }
+  BB_DEFER(fclose(f));
+
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    const char *cursor = line;
+    while ((*cursor == ' ') || (*cursor == '\t')) {
+      ++cursor;
+    }
+    if (strncmp(cursor, "#include", 8) != 0) {
+      continue;
+    }
+    const char *begin = strchr(cursor + 8, '"');
+    const char *end = begin ? strchr(begin + 1, '"') : nullptr;
+    if (!end) {
+      continue;
+    }
+
+    std::string include(begin + 1, end);
+    if (_includes.insert(include).second) {
+      collectIncludes(_shaderRoot, include, _includes);
+    }
+  }
+}
+
+static bool compileShader(const ShaderReloader &_reloader,
+                          const std::string &_fileName) {
+  std::string sourcePath = joinPaths(_reloader.ShaderRoot, _fileName);
+  std::string command = fmt::format("\"{}\" \"{}\" -o \"{}.spv\"",
+                                    _reloader.CompilerPath, sourcePath,
+                                    sourcePath);
+#ifdef BB_WINDOWS
+  // cmd.exe strips the outermost pair of quotes.
+  command = "\"" + command + "\"";
+#endif
+  return system(command.c_str()) == 0;
+}
+
+static void watchShaderSources(ShaderReloader &_reloader) {
+  std::unique_lock lock(_reloader.Mutex);
+  while (!_reloader.QuitRequested.wait_for(
+      lock, shaderReloadPollInterval, [&] { return _reloader.IsQuitting; })) {
+    lock.unlock();
+
+    std::unordered_map<std::string, fs::file_time_type> writeTimes =
+        scanShaderSources(_reloader.ShaderRoot);
+    std::unordered_set<std::string> changedFiles;
+    for (const auto &[fileName, writeTime] : writeTimes) {
+      auto found = _reloader.WriteTimes.find(fileName);
+      if ((found == _reloader.WriteTimes.end()) ||
+          (found->second != writeTime)) {
+        changedFiles.insert(fileName);
+      }
+    }
+    _reloader.WriteTimes = std::move(writeTimes);
+
+    if (!changedFiles.empty()) {
+      Time compileStartTime = getCurrentTime();
+      std::vector<std::string> spvFileNames;
+      uint32_t numFailed = 0;
+
+      for (const auto &[fileName, writeTime] : _reloader.WriteTimes) {
+        if (!isShaderStageSource(fileName)) {
+          continue;
+        }
+
+        bool isAffected = changedFiles.count(fileName) > 0;
+        if (!isAffected) {
+          std::unordered_set<std::string> includes;
+          collectIncludes(_reloader.ShaderRoot, fileName, includes);
+          for (const std::string &include : includes) {
+            if (changedFiles.count(include) > 0) {
+              isAffected = true;
+              break;
+            }
+          }
+        }
+        if (!isAffected) {
+          continue;
+        }
+
+        if (compileShader(_reloader, fileName)) {
+          spvFileNames.push_back(fileName + ".spv");
+        } else {
+          BB_LOG_ERROR("Failed to compile {}, keeping the old one", fileName);
+          ++numFailed;
+        }
+      }
+
+      BB_LOG_INFO("Recompiled {} shaders ({} failed) in {:.2f} ms",
+                  spvFileNames.size(), numFailed,
+                  getElapsedTimeInSeconds(compileStartTime, getCurrentTime()) *
+                      1000.f);
+      if (!spvFileNames.empty()) {
+        _reloader.OnShadersCompiled(spvFileNames);
+      }
+    }
+
+    lock.lock();
+  }
+}
+
+ShaderReloader *createShaderReloader(const std::string &_shaderRoot,
+                                     ShadersCompiledCallback _onCompiled) {
+  std::unordered_map<std::string, fs::file_time_type> writeTimes =
+      scanShaderSources(_shaderRoot);
+  if (writeTimes.empty()) {
+    return nullptr;
+  }
+
+  ShaderReloader *reloader = new ShaderReloader();
+  reloader->ShaderRoot = _shaderRoot;
+  reloader->OnShadersCompiled = std::move(_onCompiled);
+  reloader->WriteTimes = std::move(writeTimes);
+
+  // The build runs the SDK's glslc too.
+  if (const char *sdkPath = getenv("VULKAN_SDK")) {
+#ifdef BB_WINDOWS
+    reloader->CompilerPath = joinPaths(sdkPath, "Bin\\glslc.exe");
+#else
+    reloader->CompilerPath = joinPaths(sdkPath, "bin/glslc");
+#endif
+  } else {
+    reloader->CompilerPath = "glslc";
+  }
+
+  reloader->Thread = std::thread(watchShaderSources, std::ref(*reloader));
+  BB_LOG_INFO("Watching {} for shader edits", _shaderRoot);
+
+  return reloader;
+}
+
+void destroyShaderReloader(ShaderReloader *_reloader) {
+  {
+    std::scoped_lock lock(_reloader->Mutex);
+    _reloader->IsQuitting = true;
+  }
+  _reloader->QuitRequested.notify_one();
+  _reloader->Thread.join();
+  delete _reloader;
+}
+
+} // namespace bb
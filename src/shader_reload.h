@@ -0,0 +1,42 @@
+#pragma once
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace bb {
+
+// Called on the watcher thread with the .spv files that were rebuilt, relative
+// to the shader root (e.g. "brdf.frag.spv").
+using ShadersCompiledCallback =
+    std::function<void(const std::vector<std::string> &_spvFileNames)>;
+
+// Watches the GLSL sources under the shader root and recompiles the ones that
+// change with glslc, next to the sources like the build does. A source is also
+// recompiled when any file it #includes (directly or not) changes. Everything
+// runs on a thread of its own, so compiling never stalls the render loop.
+struct ShaderReloader {
+  std::string ShaderRoot;
+  std::string CompilerPath;
+  ShadersCompiledCallback OnShadersCompiled;
+
+  std::unordered_map<std::string, std::filesystem::file_time_type> WriteTimes;
+
+  std::thread Thread;
+  std::mutex Mutex;
+  std::condition_variable QuitRequested;
+  bool IsQuitting;
+};
+
+// Returns nullptr if the shader root has no GLSL sources to watch (e.g. a
+// deployed build that only ships .spv files).
+ShaderReloader *createShaderReloader(const std::string &_shaderRoot,
+                                     ShadersCompiledCallback _onCompiled);
+// Waits for a compile or callback in progress to finish.
+void destroyShaderReloader(ShaderReloader *_reloader);
+
+} // namespace bb
@@ -1,13 +1,54 @@
 #version 450
 
 #include "standard_sets.glsl"
+#include "subpass_inputs.glsl"
+#include "light_clusters.glsl"
+#include "gbuffer.glsl"
+
+// Match GBufferVisualizingOption.
+#define VISUALIZE_POSITION 0
+#define VISUALIZE_NORMAL 1
+#define VISUALIZE_ALBEDO 2
+#define VISUALIZE_MRAH 3
+#define VISUALIZE_LIGHT_HEATMAP 4
+// Clusters with this many lights or more show up red.
+#define HEATMAP_MAX_LIGHTS 32.0
 
 layout(location = 0) in vec2 vUV;
 layout(location = 0) out vec4 outColor;
+
+vec3 getHeatmapColor(float t) {
+  vec3 cold = mix(vec3(0, 0, 0.5), vec3(0, 1, 0), clamp(t * 2, 0, 1));
+  return mix(cold, vec3(1, 0, 0), clamp(t * 2 - 1, 0, 1));
+}
+
 void main() {
-  int index = uNumLights;
-  vec3 renderedBuffer =
-      texture(sampler2D(uGbuffer[uVisualizedGBufferAttachmentIndex], uSamplers[SMP_NEAREST]), vUV).rgb;
+  float depth = subpassLoad(uDepthBuffer).r;
+  if (isBackground(depth)) {
+    outColor = vec4(0, 0, 0, 1);
+    return;
+  }
+
+  vec3 renderedBuffer = vec3(0);
+  switch (uVisualizedGBufferAttachmentIndex) {
+  case VISUALIZE_POSITION:
+    renderedBuffer = getWorldPosFromDepth(vUV * 2 - 1, depth);
+    break;
+  case VISUALIZE_NORMAL:
+    renderedBuffer = decodeNormal(subpassLoad(uGbuffer[TEX_G_NORMAL]).rg);
+    break;
+  case VISUALIZE_ALBEDO:
+    renderedBuffer = subpassLoad(uGbuffer[TEX_G_ALBEDO]).rgb;
+    break;
+  case VISUALIZE_MRAH:
+    renderedBuffer = subpassLoad(uGbuffer[TEX_G_MRAH]).rgb;
+    break;
+  case VISUALIZE_LIGHT_HEATMAP: {
+    uint numLights = uLightClusters[getLightClusterIndex(getWorldPosFromDepth(vUV * 2 - 1, depth))].y;
+    renderedBuffer = getHeatmapColor(float(numLights) / HEATMAP_MAX_LIGHTS);
+    break;
+  }
+  }
 
   outColor = vec4(renderedBuffer, 1);
-}
\ No newline at end of file
+}
@@ -13,6 +13,10 @@ layout (location = 8) in mat4 aInvModel;
 // layout (location = 14) in float aRoughness;
 // layout (location = 15) in float aAO;
 
+// The depth pre-pass runs this without the rest of the pipeline, and the
+// depth it writes has to be matched exactly.
+invariant gl_Position;
+
 layout (location = 0) out vec2 vUV;
 layout (location = 1) out vec3 vPosWorld;
 layout (location = 2) out vec3 vNormalWorld;
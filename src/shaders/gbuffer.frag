@@ -1,17 +1,17 @@
 #version 450
 
 #include "standard_sets.glsl"
+#include "permutation.glsl"
+#include "gbuffer.glsl"
 
 layout (location = 0) in vec4 vPosWorld;
 layout (location = 1) in vec2 vUV;
 layout (location = 2) in vec3 vNormalWorld;
 layout (location = 3) in mat3 vTBN;
 
-layout (location = 0) out vec4 outPosWorld;
-layout (location = 1) out vec3 outNormal;
-layout (location = 2) out vec3 outAlbedo;
-layout (location = 3) out vec4 outMRAH; // Metallic, Roughness, AO, Height
-layout (location = 4) out vec3 outMaterialIndex;
+layout (location = 0) out vec2 outNormal;
+layout (location = 1) out vec3 outAlbedo;
+layout (location = 2) out vec4 outMRAH; // Metallic, Roughness, AO, Height
 
 
 void main() 
@@ -21,13 +21,13 @@ void main()
     float ao = texture(sampler2D(uMaterialTextures[TEX_AO], uSamplers[SMP_LINEAR]), vUV).r;
     float height = texture(sampler2D(uMaterialTextures[TEX_HEIGHT], uSamplers[SMP_LINEAR]), vUV).r;
 
-    outPosWorld = vPosWorld;
-    if (uEnableNormalMap != 0) {
-        outNormal = vTBN * (texture(sampler2D(uMaterialTextures[TEX_NORMAL], uSamplers[SMP_LINEAR]), vUV).xyz * 2 - 1);
+    vec3 normal;
+    if (PERM_ENABLE_NORMAL_MAP) {
+        normal = vTBN * (texture(sampler2D(uMaterialTextures[TEX_NORMAL], uSamplers[SMP_LINEAR]), vUV).xyz * 2 - 1);
     } else {
-        outNormal = vNormalWorld;
+        normal = vNormalWorld;
     }
+    outNormal = encodeNormal(normalize(normal));
     outAlbedo = texture(sampler2D(uMaterialTextures[TEX_ALBEDO], uSamplers[SMP_LINEAR]), vUV).rgb;
     outMRAH = vec4(metallic, roughness, ao, height);
-    outMaterialIndex = vec3(1,0,0); // Not in use?
 }
\ No newline at end of file
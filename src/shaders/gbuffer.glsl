@@ -0,0 +1,32 @@
+// Needs standard_sets.glsl. Packing of the G-buffer, see DeferredAttachmentType
+// in render.h.
+
+// Normals are folded onto an octahedron and stored as two [-1, 1] values.
+vec2 signNotZero(vec2 v) {
+    return vec2((v.x >= 0) ? 1 : -1, (v.y >= 0) ? 1 : -1);
+}
+
+vec2 encodeNormal(vec3 n) {
+    vec2 p = n.xy / (abs(n.x) + abs(n.y) + abs(n.z));
+    return (n.z >= 0) ? p : (1 - abs(p.yx)) * signNotZero(p);
+}
+
+vec3 decodeNormal(vec2 e) {
+    vec3 n = vec3(e, 1 - abs(e.x) - abs(e.y));
+    if (n.z < 0) {
+        n.xy = (1 - abs(n.yx)) * signNotZero(n.xy);
+    }
+    return normalize(n);
+}
+
+// Position isn't stored, it's rebuilt from the depth buffer. ndc is the
+// [-1, 1] position on the screen.
+vec3 getWorldPosFromDepth(vec2 ndc, float depth) {
+    vec4 posWorld = uInvViewProjMat * vec4(ndc, depth, 1);
+    return posWorld.xyz / posWorld.w;
+}
+
+// The depth buffer is cleared to the far plane, which is 0 with reversed Z.
+bool isBackground(float depth) {
+    return depth == 0;
+}
@@ -10,6 +10,10 @@ layout (location = 4) in mat4 aModel;
 layout (location = 8) in mat4 aInvModel;
 
 
+// The depth pre-pass runs this without the rest of the pipeline, and the
+// depth it writes has to be matched exactly.
+invariant gl_Position;
+
 layout (location = 0) out vec4 vPosWorld;
 layout (location = 1) out vec2 vUV;
 layout (location = 2) out vec3 vNormalWorld;
@@ -0,0 +1,15 @@
+// Needs standard_sets.glsl. The grid size matches light_clusters.h.
+#define NUM_LIGHT_CLUSTERS_X 16
+#define NUM_LIGHT_CLUSTERS_Y 9
+#define NUM_LIGHT_CLUSTERS_Z 24
+
+uint getLightClusterIndex(vec3 posWorld) {
+    vec4 posClip = uProjMat * uViewMat * vec4(posWorld, 1);
+    vec2 ndc = posClip.xy / posClip.w;
+    uvec2 tile = uvec2(clamp((ndc * 0.5 + 0.5) * vec2(NUM_LIGHT_CLUSTERS_X, NUM_LIGHT_CLUSTERS_Y),
+                             vec2(0), vec2(NUM_LIGHT_CLUSTERS_X - 1, NUM_LIGHT_CLUSTERS_Y - 1)));
+    // clip.w is the view depth.
+    uint slice = uint(clamp(log(posClip.w) * uClusterDepthScale + uClusterDepthBias,
+                            0, NUM_LIGHT_CLUSTERS_Z - 1));
+    return tile.x + NUM_LIGHT_CLUSTERS_X * (tile.y + NUM_LIGHT_CLUSTERS_Y * slice);
+}
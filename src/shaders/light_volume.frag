@@ -0,0 +1,34 @@
+#version 450
+
+#include "brdf.glsl"
+#include "standard_sets.glsl"
+#include "subpass_inputs.glsl"
+#include "lighting.glsl"
+#include "gbuffer.glsl"
+
+layout (location = 0) flat in int vLightIndex;
+layout (location = 1) in vec4 vPosClip;
+
+layout (location = 0) out vec4 outColor;
+
+// Adds a single point or spot light to the pixels its volume covers.
+void main() {
+    float depth = subpassLoad(uDepthBuffer).r;
+    if (isBackground(depth)) {
+        discard;
+    }
+
+    // The volume's own clip position lands on the same pixel.
+    vec3 posWorld = getWorldPosFromDepth(vPosClip.xy / vPosClip.w, depth);
+    vec3 normal = decodeNormal(subpassLoad(uGbuffer[TEX_G_NORMAL]).rg);
+    vec3 albedo = subpassLoad(uGbuffer[TEX_G_ALBEDO]).rgb;
+    vec4 MRAH = subpassLoad(uGbuffer[TEX_G_MRAH]);
+
+    float metallic = MRAH.r;
+    float roughness = MRAH.g;
+
+    vec3 V = normalize(uViewPos - posWorld);
+    vec3 Lo = shadeLight(uLights[vLightIndex], posWorld, normal, V, albedo, metallic, roughness);
+
+    outColor = vec4(Lo, 0);
+}
@@ -0,0 +1,41 @@
+#version 450
+
+#include "standard_sets.glsl"
+#include "permutation.glsl"
+
+// The sphere is the light source marker mesh, which is built with this radius.
+// Its faces lie inside the sphere through its corners, so it's grown a bit to
+// still cover the whole light.
+#define SPHERE_MESH_RADIUS 0.1
+#define SPHERE_MESH_SCALE 1.03
+// Matches lightVolumeMinConeCos in main.cpp. Wider spot lights are drawn as
+// spheres, since their cone would get much larger than that.
+#define MIN_CONE_COS 0.5
+
+layout (location = 0) in vec3 aPos;
+
+layout (location = 0) flat out int vLightIndex;
+layout (location = 1) out vec4 vPosClip;
+
+void main() {
+    // Every light is drawn as its own instance.
+    Light light = uLights[gl_InstanceIndex];
+
+    vec3 posWorld;
+    if ((light.type == LIGHT_TYPE_SPOT) && (light.outerCutOff >= MIN_CONE_COS)) {
+        // The cone mesh opens towards +Z with a radius and height of 1.
+        float tanOuter = sqrt(1 - light.outerCutOff * light.outerCutOff) / light.outerCutOff;
+        vec3 forward = normalize(light.dir);
+        vec3 up = (abs(forward.y) < 0.99) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        vec3 right = normalize(cross(up, forward));
+        up = cross(forward, right);
+        vec3 scaled = vec3(aPos.xy * tanOuter, aPos.z) * light.radius;
+        posWorld = light.pos + right * scaled.x + up * scaled.y + forward * scaled.z;
+    } else {
+        posWorld = light.pos + aPos * (light.radius * SPHERE_MESH_SCALE / SPHERE_MESH_RADIUS);
+    }
+
+    gl_Position = uProjMat * uViewMat * vec4(posWorld, 1);
+    vPosClip = gl_Position;
+    vLightIndex = gl_InstanceIndex;
+}
@@ -0,0 +1,78 @@
+// Needs brdf.glsl and standard_sets.glsl.
+#include "permutation.glsl"
+#include "light_clusters.glsl"
+
+// Inverse square falloff, windowed to reach zero at the light's radius.
+float getDistanceAttenuation(float d, float radius) {
+    float ratio = d / radius;
+    float ratio2 = ratio * ratio;
+    float window = clamp(1 - ratio2 * ratio2, 0, 1);
+    return (window * window) / max(d * d, 0.0001);
+}
+
+vec3 shadeLight(Light light, vec3 posWorld, vec3 N, vec3 V, vec3 albedo, float metallic, float roughness) {
+    vec3 L;
+    float att;
+    if (isLightOfType(light, LIGHT_TYPE_DIRECTIONAL)) {
+        L = -normalize(light.dir);
+        att = 1;
+    } else {
+        L = light.pos - posWorld;
+        att = getDistanceAttenuation(length(L), light.radius);
+        L = normalize(L);
+        if (isLightOfType(light, LIGHT_TYPE_SPOT)) {
+            float theta = dot(L, normalize(-light.dir));
+            float epsilon = light.innerCutOff - light.outerCutOff;
+            att *= clamp((theta - light.outerCutOff) / epsilon, 0, 1);
+        }
+    }
+
+    vec3 H = normalize(L + V);
+
+    float D = distributionGGX(N, H, roughness);
+
+    vec3 F0 = vec3(0.04);
+    F0 = mix(F0, albedo, metallic);
+    vec3 F = fresnelSchlick(H, V, F0);
+    float G = geometrySmith(N, V, L, roughness);
+
+    vec3 radiance = att * light.color * light.intensity;
+
+    vec3 specular = (D * F * G) / max(4 * max(dot(V, N), 0) * max(dot(L, N), 0), 0.001);
+    vec3 kS = F;
+    vec3 kD = vec3(1) - kS;
+    kD *= (1 - metallic);
+
+    return (kD * albedo / PI + specular) * radiance * max(dot(N, L), 0);
+}
+
+vec3 shadeDirectionalLights(vec3 posWorld, vec3 N, vec3 albedo, float metallic, float roughness) {
+    vec3 Lo = vec3(0);
+    vec3 V = normalize(uViewPos - posWorld);
+
+    if ((PERM_LIGHT_TYPE_MASK & (1 << LIGHT_TYPE_DIRECTIONAL)) != 0) {
+        int numDirectionalLights = min(uNumDirectionalLights, PERM_MAX_NUM_LIGHTS);
+        for (int i = 0; i < numDirectionalLights; ++i) {
+            Light light = uLights[uClusterLightIndices[i]];
+            Lo += shadeLight(light, posWorld, N, V, albedo, metallic, roughness);
+        }
+    }
+
+    return Lo;
+}
+
+// Directional lights are applied everywhere, the rest only where the light
+// clusters say they reach.
+vec3 shadeLights(vec3 posWorld, vec3 N, vec3 albedo, float metallic, float roughness) {
+    vec3 Lo = shadeDirectionalLights(posWorld, N, albedo, metallic, roughness);
+    vec3 V = normalize(uViewPos - posWorld);
+
+    uvec2 cluster = uLightClusters[getLightClusterIndex(posWorld)];
+    uint numClusterLights = min(cluster.y, uint(PERM_MAX_NUM_LIGHTS));
+    for (uint i = 0; i < numClusterLights; ++i) {
+        Light light = uLights[uClusterLightIndices[cluster.x + i]];
+        Lo += shadeLight(light, posWorld, N, V, albedo, metallic, roughness);
+    }
+
+    return Lo;
+}
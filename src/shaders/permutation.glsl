@@ -0,0 +1,20 @@
+// Specialization constants set per pipeline variant, see ShaderPermutation in
+// render.h. The defaults are the full permutation. Needs standard_sets.glsl.
+layout (constant_id = 0) const int PERM_LIGHT_TYPE_MASK = 7;
+layout (constant_id = 1) const int PERM_MAX_NUM_LIGHTS = MAX_NUM_LIGHTS;
+layout (constant_id = 2) const bool PERM_ENABLE_NORMAL_MAP = true;
+layout (constant_id = 3) const bool PERM_ENABLE_TONE_MAPPING = true;
+
+#define LIGHT_TYPE_POINT       0
+#define LIGHT_TYPE_SPOT        1
+#define LIGHT_TYPE_DIRECTIONAL 2
+
+// Folds to a constant when the permutation has no lights of this type, or only
+// lights of this type.
+bool isLightOfType(Light light, int type) {
+    int typeBit = 1 << type;
+    if ((PERM_LIGHT_TYPE_MASK & typeBit) == 0) {
+        return false;
+    }
+    return (PERM_LIGHT_TYPE_MASK == typeBit) || (light.type == type);
+}
@@ -11,14 +11,16 @@ struct Light {
     vec3 color;
     float innerCutOff;
     float outerCutOff;
+    float radius;
 };
 
-#define MAX_NUM_LIGHTS 100
+// Most lights a single loop goes through, see render.h.
+#define MAX_NUM_LIGHTS 16384
 layout (set = SET_FRAME, binding = 0) uniform FrameData {
     int uNumLights;
-    Light uLights[MAX_NUM_LIGHTS];
+    // uClusterLightIndices starts with this many directional lights.
+    int uNumDirectionalLights;
     int uVisualizedGBufferAttachmentIndex;
-    int uEnableToneMapping;
     float uExposure;
 };
 
@@ -26,20 +28,28 @@ layout (set = SET_FRAME, binding = 1) uniform sampler uSamplers[2];
 #define SMP_NEAREST 0
 #define SMP_LINEAR  1
 
-layout (set = SET_FRAME, binding = 2) uniform texture2D uGbuffer[5];
-#define TEX_G_POSITION    0
-#define TEX_G_NORMAL      1
-#define TEX_G_ALBEDO      2
-#define TEX_G_MRAH        3
-#define TEX_G_MATINDEX    4
+// Every light of the scene, see LightBuffer.
+layout (set = SET_FRAME, binding = 4) readonly buffer LightData {
+    Light uLights[];
+};
+
+// Offset and count of each cluster's range in uClusterLightIndices, see
+// light_clusters.glsl.
+layout (set = SET_FRAME, binding = 5) readonly buffer LightClusterData {
+    uvec2 uLightClusters[];
+};
 
-layout (set = SET_FRAME, binding = 3) uniform texture2D uHDRBuffer;
+layout (set = SET_FRAME, binding = 6) readonly buffer ClusterLightIndexData {
+    uint uClusterLightIndices[];
+};
 
 layout (set = SET_VIEW, binding = 0) uniform ViewData {
     mat4 uViewMat;
     mat4 uProjMat;
+    mat4 uInvViewProjMat;
     vec3 uViewPos;
-    int uEnableNormalMap;
+    float uClusterDepthScale;
+    float uClusterDepthBias;
 };
 
 layout (set = SET_MATERIAL, binding = 0) uniform texture2D uMaterialTextures[6];
@@ -0,0 +1,13 @@
+// Needs standard_sets.glsl. Subpass inputs are only allowed in fragment
+// shaders, so they are kept out of standard_sets.glsl.
+
+// Input attachments of the lighting subpass, packed as described in
+// gbuffer.glsl. World position is rebuilt from uDepthBuffer.
+layout (input_attachment_index = 0, set = SET_FRAME, binding = 2) uniform subpassInput uGbuffer[3];
+#define TEX_G_NORMAL      0
+#define TEX_G_ALBEDO      1
+#define TEX_G_MRAH        2
+layout (input_attachment_index = 3, set = SET_FRAME, binding = 7) uniform subpassInput uDepthBuffer;
+
+// Input attachment of the HDR subpass.
+layout (input_attachment_index = 0, set = SET_FRAME, binding = 3) uniform subpassInput uHDRBuffer;
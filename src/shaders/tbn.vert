@@ -1,6 +1,7 @@
 #version 450
 
 #include "standard_sets.glsl"
+#include "permutation.glsl"
 
 layout (location = 0) in vec3 aPosition;
 layout (location = 1) in vec2 aUV;
@@ -24,7 +25,7 @@ void main() {
     vT = normalize(normalMat * aTangent);
     vB = cross(vN, vT);
 
-    if (uEnableNormalMap != 0) 
+    if (PERM_ENABLE_NORMAL_MAP)
     {
         mat3 TBN = mat3(vT, vB, vN);
         vec3 normal = TBN * (texture(sampler2D(uMaterialTextures[TEX_NORMAL], uSamplers[SMP_LINEAR]), aUV).xyz * 2 - 1);
@@ -0,0 +1,406 @@
+#include "staging.h"
+#include "util.h"
+#include "type_conversion.h"
+#include <algorithm>
+
+namespace bb {
+
+static VkDeviceSize alignUp(VkDeviceSize _offset, VkDeviceSize _alignment) {
+  return (_offset + _alignment - 1) / _alignment * _alignment;
+}
+
+// The dedicated buffers are short-lived and too big for the ring, so they get
+// memory of their own rather than taking a large part of a shared block.
+static Buffer createHostVisibleBuffer(StagingRing &_ring, VkDeviceSize _size) {
+  Buffer result = {};
+
+  VkBufferCreateInfo bufferCreateInfo = {};
+  bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCreateInfo.size = _size;
+  bufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  BB_VK_ASSERT(
+      vkCreateBuffer(_ring.Device, &bufferCreateInfo, nullptr, &result.Handle));
+
+  DeviceAllocationParams params = {};
+  vkGetBufferMemoryRequirements(_ring.Device, result.Handle,
+                                &params.Requirements);
+  params.Properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  params.ResourceKind = DeviceResourceKind::Buffer;
+  params.Category = DeviceMemoryCategory::Staging;
+  params.IsDedicated = true;
+  params.DedicatedBuffer = result.Handle;
+  result.Allocation = allocateDeviceMemory(*_ring.MemoryAllocator, params);
+  BB_VK_ASSERT(vkBindBufferMemory(_ring.Device, result.Handle,
+                                  result.Allocation.Memory,
+                                  result.Allocation.Offset));
+
+  result.Size = (uint32_t)_size;
+
+  return result;
+}
+
+static void destroyHostVisibleBuffer(StagingRing &_ring, Buffer &_buffer) {
+  vkDestroyBuffer(_ring.Device, _buffer.Handle, nullptr);
+  freeDeviceMemory(*_ring.MemoryAllocator, _buffer.Allocation);
+  _buffer = {};
+}
+
+// Must be called with _ring.Mutex locked.
+static void retireCompletedBatches(StagingRing &_ring) {
+  while (!_ring.InFlightBatches.empty()) {
+    StagingBatch *batch = _ring.InFlightBatches.front();
+    if (vkGetFenceStatus(_ring.Device, batch->Fence) != VK_SUCCESS) {
+      break;
+    }
+
+    _ring.CompletedSerial = batch->Serial;
+    for (Buffer &buffer : batch->DedicatedBuffers) {
+      destroyHostVisibleBuffer(_ring, buffer);
+    }
+    batch->DedicatedBuffers.clear();
+    _ring.InFlightBatches.pop_front();
+    _ring.FreeBatches.push_back(batch);
+  }
+
+  while (!_ring.Regions.empty()) {
+    const StagingRing::Region &region = _ring.Regions.front();
+    bool isRetired =
+        region.IsFreed ||
+        ((region.Serial != 0) && (region.Serial <= _ring.CompletedSerial));
+    if (!isRetired) {
+      break;
+    }
+
+    _ring.Stats.Used -= region.NumBytes;
+    _ring.Regions.pop_front();
+  }
+
+  if (_ring.Regions.empty()) {
+    _ring.Head = 0;
+  }
+}
+
+// Must be called with _ring.Mutex locked.
+static void waitForOldestBatch(StagingRing &_ring) {
+  BB_ASSERT(!_ring.InFlightBatches.empty());
+  BB_VK_ASSERT(vkWaitForFences(_ring.Device, 1,
+                               &_ring.InFlightBatches.front()->Fence, VK_TRUE,
+                               UINT64_MAX));
+  retireCompletedBatches(_ring);
+}
+
+StagingRing *createStagingRing(const Renderer &_renderer,
+                               VkDeviceSize _capacity) {
+  StagingRing *ring = new StagingRing();
+  ring->Device = _renderer.Device;
+  ring->Queue = _renderer.Queue;
+  ring->QueueMutex = _renderer.QueueMutex;
+  ring->QueueFamilyIndex = _renderer.QueueFamilyIndex;
+  ring->MemoryAllocator = _renderer.MemoryAllocator;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(_renderer.PhysicalDevice, &properties);
+  // Texel blocks of every format we upload are at most 16 bytes, so this
+  // satisfies the bufferOffset rule of vkCmdCopyBufferToImage as well.
+  ring->Alignment =
+      std::max<VkDeviceSize>(properties.limits.optimalBufferCopyOffsetAlignment,
+                             16);
+
+  ring->RingBuffer = createBuffer(_renderer, _capacity,
+                                  VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  ring->MappedData = (uint8_t *)ring->RingBuffer.Allocation.MappedData;
+
+  ring->NextAllocationId = 1;
+  ring->NextSerial = 1;
+  ring->Stats.Capacity = _capacity;
+
+  return ring;
+}
+
+void destroyStagingRing(StagingRing *_ring) {
+  flushStagingRing(*_ring);
+  // Anything left was neither submitted nor freed.
+  BB_ASSERT(_ring->Regions.empty());
+
+  for (StagingBatch *batch : _ring->FreeBatches) {
+    vkDestroyFence(_ring->Device, batch->Fence, nullptr);
+    vkDestroyCommandPool(_ring->Device, batch->CmdPool, nullptr);
+    delete batch;
+  }
+
+  destroyHostVisibleBuffer(*_ring, _ring->RingBuffer);
+
+  delete _ring;
+}
+
+StagingAllocation allocateStagingMemory(StagingRing &_ring,
+                                        VkDeviceSize _size) {
+  StagingAllocation result = {};
+  result.Size = _size;
+
+  std::unique_lock lock(_ring.Mutex);
+
+  ++_ring.Stats.NumAllocations;
+  retireCompletedBatches(_ring);
+
+  const VkDeviceSize capacity = _ring.Stats.Capacity;
+  bool fitsInRing = (_size <= capacity / 4);
+
+  while (fitsInRing) {
+    VkDeviceSize offset = alignUp(_ring.Head, _ring.Alignment);
+    VkDeviceSize numBytes;
+    if (offset + _size <= capacity) {
+      numBytes = offset + _size - _ring.Head;
+    } else {
+      // Skip the remaining space at the end of the ring and wrap around.
+      offset = 0;
+      numBytes = capacity - _ring.Head + _size;
+    }
+
+    if (_ring.Stats.Used + numBytes <= capacity) {
+      result.Handle = _ring.RingBuffer.Handle;
+      result.Offset = offset;
+      result.Data = _ring.MappedData + offset;
+      result.Id = _ring.NextAllocationId++;
+
+      _ring.Head = offset + _size;
+      _ring.Stats.Used += numBytes;
+      _ring.Stats.PeakUsed = std::max(_ring.Stats.PeakUsed, _ring.Stats.Used);
+      _ring.Regions.push_back({result.Id, numBytes, 0, false});
+      return result;
+    }
+
+    // The oldest region is still being written by the CPU, so waiting on the
+    // GPU won't free anything.
+    const StagingRing::Region &oldestRegion = _ring.Regions.front();
+    if ((oldestRegion.Serial == 0) && !oldestRegion.IsFreed) {
+      break;
+    }
+
+    Time stallBegin = getCurrentTime();
+    waitForOldestBatch(_ring);
+    ++_ring.Stats.NumStalls;
+    _ring.Stats.StallTime +=
+        getElapsedTimeInSeconds(stallBegin, getCurrentTime());
+  }
+
+  ++_ring.Stats.NumDedicatedAllocations;
+  lock.unlock();
+
+  result.DedicatedBuffer = createHostVisibleBuffer(_ring, _size);
+  result.Handle = result.DedicatedBuffer.Handle;
+  result.Offset = 0;
+  result.Data = result.DedicatedBuffer.Allocation.MappedData;
+
+  return result;
+}
+
+void freeStagingMemory(StagingRing &_ring, StagingAllocation &_allocation) {
+  if (_allocation.DedicatedBuffer.Handle != VK_NULL_HANDLE) {
+    destroyHostVisibleBuffer(_ring, _allocation.DedicatedBuffer);
+  } else if (_allocation.Id != 0) {
+    std::scoped_lock lock(_ring.Mutex);
+    uint64_t firstId = _ring.Regions.front().Id;
+    BB_ASSERT(_allocation.Id >= firstId);
+    StagingRing::Region &region = _ring.Regions[_allocation.Id - firstId];
+    BB_ASSERT(region.Serial == 0);
+    region.IsFreed = true;
+    retireCompletedBatches(_ring);
+  }
+  _allocation = {};
+}
+
+StagingBatch *beginStagingBatch(StagingRing &_ring) {
+  StagingBatch *batch = nullptr;
+  {
+    std::scoped_lock lock(_ring.Mutex);
+    retireCompletedBatches(_ring);
+    if (!_ring.FreeBatches.empty()) {
+      batch = _ring.FreeBatches.back();
+      _ring.FreeBatches.pop_back();
+    }
+  }
+
+  if (batch) {
+    BB_VK_ASSERT(vkResetCommandPool(_ring.Device, batch->CmdPool, 0));
+    BB_VK_ASSERT(vkResetFences(_ring.Device, 1, &batch->Fence));
+  } else {
+    batch = new StagingBatch();
+
+    VkCommandPoolCreateInfo cmdPoolCreateInfo = {};
+    cmdPoolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmdPoolCreateInfo.queueFamilyIndex = _ring.QueueFamilyIndex;
+    cmdPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    BB_VK_ASSERT(vkCreateCommandPool(_ring.Device, &cmdPoolCreateInfo, nullptr,
+                                     &batch->CmdPool));
+
+    VkCommandBufferAllocateInfo cmdBufferAllocInfo = {};
+    cmdBufferAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmdBufferAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmdBufferAllocInfo.commandPool = batch->CmdPool;
+    cmdBufferAllocInfo.commandBufferCount = 1;
+    BB_VK_ASSERT(vkAllocateCommandBuffers(_ring.Device, &cmdBufferAllocInfo,
+                                          &batch->CmdBuffer));
+
+    VkFenceCreateInfo fenceCreateInfo = {};
+    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    BB_VK_ASSERT(
+        vkCreateFence(_ring.Device, &fenceCreateInfo, nullptr, &batch->Fence));
+  }
+
+  VkCommandBufferBeginInfo cmdBeginInfo = {};
+  cmdBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  cmdBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  BB_VK_ASSERT(vkBeginCommandBuffer(batch->CmdBuffer, &cmdBeginInfo));
+
+  return batch;
+}
+
+uint64_t submitStagingBatch(StagingRing &_ring, StagingBatch *_batch,
+                            StagingAllocation *_allocations,
+                            uint32_t _numAllocations) {
+  BB_VK_ASSERT(vkEndCommandBuffer(_batch->CmdBuffer));
+
+  for (uint32_t i = 0; i < _numAllocations; ++i) {
+    StagingAllocation &allocation = _allocations[i];
+    if (allocation.DedicatedBuffer.Handle != VK_NULL_HANDLE) {
+      _batch->DedicatedBuffers.push_back(allocation.DedicatedBuffer);
+    }
+  }
+
+  std::scoped_lock lock(_ring.Mutex);
+
+  _batch->Serial = _ring.NextSerial++;
+
+  VkSubmitInfo submitInfo = {};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &_batch->CmdBuffer;
+  {
+    std::scoped_lock queueLock(*_ring.QueueMutex);
+    BB_VK_ASSERT(vkQueueSubmit(_ring.Queue, 1, &submitInfo, _batch->Fence));
+  }
+  _ring.InFlightBatches.push_back(_batch);
+  ++_ring.Stats.NumSubmissions;
+
+  for (uint32_t i = 0; i < _numAllocations; ++i) {
+    StagingAllocation &allocation = _allocations[i];
+    if (allocation.Id != 0) {
+      // Unsubmitted regions can't be retired, so the region of this
+      // allocation is still in the queue.
+      uint64_t firstId = _ring.Regions.front().Id;
+      BB_ASSERT(allocation.Id >= firstId);
+      _ring.Regions[allocation.Id - firstId].Serial = _batch->Serial;
+    }
+    allocation = {};
+  }
+
+  return _batch->Serial;
+}
+
+void recordStagedBufferCopy(VkCommandBuffer _cmdBuffer,
+                            const StagingAllocation &_src, VkBuffer _dst) {
+  VkBufferCopy copyRegion = {};
+  copyRegion.srcOffset = _src.Offset;
+  copyRegion.dstOffset = 0;
+  copyRegion.size = _src.Size;
+  vkCmdCopyBuffer(_cmdBuffer, _src.Handle, _dst, 1, &copyRegion);
+
+  VkBufferMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask =
+      VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT |
+      VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = _dst;
+  barrier.offset = 0;
+  barrier.size = _src.Size;
+  vkCmdPipelineBarrier(_cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+                           VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                       0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+void recordStagedImageCopy(VkCommandBuffer _cmdBuffer,
+                           const StagingAllocation &_src, VkImage _dst,
+                           Int2 _dims) {
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.image = _dst;
+  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.baseMipLevel = 0;
+  barrier.subresourceRange.levelCount = 1;
+  barrier.subresourceRange.baseArrayLayer = 0;
+  barrier.subresourceRange.layerCount = 1;
+  vkCmdPipelineBarrier(_cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                       nullptr, 1, &barrier);
+
+  VkBufferImageCopy region = {};
+  region.bufferOffset = _src.Offset;
+  region.bufferRowLength = 0;
+  region.bufferImageHeight = 0;
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.mipLevel = 0;
+  region.imageSubresource.baseArrayLayer = 0;
+  region.imageSubresource.layerCount = 1;
+  region.imageOffset = {0, 0, 0};
+  region.imageExtent = int2ToExtent3D(_dims);
+  vkCmdCopyBufferToImage(_cmdBuffer, _src.Handle, _dst,
+                         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(_cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0,
+                       nullptr, 1, &barrier);
+}
+
+uint64_t getLastSubmittedStagingSerial(StagingRing &_ring) {
+  std::scoped_lock lock(_ring.Mutex);
+  return _ring.NextSerial - 1;
+}
+
+bool isStagingSerialComplete(StagingRing &_ring, uint64_t _serial) {
+  std::scoped_lock lock(_ring.Mutex);
+  retireCompletedBatches(_ring);
+  return _serial <= _ring.CompletedSerial;
+}
+
+void waitForStagingSerial(StagingRing &_ring, uint64_t _serial) {
+  std::scoped_lock lock(_ring.Mutex);
+  retireCompletedBatches(_ring);
+  while (_serial > _ring.CompletedSerial) {
+    waitForOldestBatch(_ring);
+  }
+}
+
+void flushStagingRing(StagingRing &_ring) {
+  std::scoped_lock lock(_ring.Mutex);
+  while (!_ring.InFlightBatches.empty()) {
+    waitForOldestBatch(_ring);
+  }
+}
+
+StagingRingStats getStagingRingStats(StagingRing &_ring) {
+  std::scoped_lock lock(_ring.Mutex);
+  retireCompletedBatches(_ring);
+  return _ring.Stats;
+}
+
+} // namespace bb
@@ -0,0 +1,113 @@
+#pragma once
+#include "render.h"
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace bb {
+
+// Every upload to device local memory goes through a single persistently
+// mapped host visible buffer that is used as a ring. Each allocation is
+// retired once the fence of the batch that consumed it is signaled. Requests
+// that are too big for the ring (or that can't be satisfied without waiting for
+// allocations that haven't been submitted yet) fall back to a dedicated
+// staging buffer, which is destroyed the same way.
+constexpr VkDeviceSize defaultStagingRingSize = 64 * 1024 * 1024;
+
+struct StagingAllocation {
+  VkBuffer Handle;
+  VkDeviceSize Offset;
+  VkDeviceSize Size;
+  void *Data;
+
+  uint64_t Id;
+  Buffer DedicatedBuffer;
+};
+
+struct StagingBatch {
+  VkCommandPool CmdPool;
+  VkCommandBuffer CmdBuffer;
+  VkFence Fence;
+  uint64_t Serial;
+  std::vector<Buffer> DedicatedBuffers;
+};
+
+struct StagingRingStats {
+  VkDeviceSize Capacity;
+  VkDeviceSize Used;
+  VkDeviceSize PeakUsed;
+  uint64_t NumAllocations;
+  uint64_t NumDedicatedAllocations;
+  uint64_t NumSubmissions;
+  uint64_t NumStalls;
+  float StallTime;
+};
+
+struct StagingRing {
+  VkDevice Device;
+  VkQueue Queue;
+  std::mutex *QueueMutex;
+  uint32_t QueueFamilyIndex;
+  DeviceMemoryAllocator *MemoryAllocator;
+  VkDeviceSize Alignment;
+
+  Buffer RingBuffer;
+  uint8_t *MappedData;
+  VkDeviceSize Head;
+
+  struct Region {
+    uint64_t Id;
+    VkDeviceSize NumBytes;
+    // 0 until the allocation is submitted.
+    uint64_t Serial;
+    // Given back with freeStagingMemory(), so nothing is going to read it.
+    bool IsFreed;
+  };
+  // Regions are retired strictly in allocation order.
+  std::deque<Region> Regions;
+  uint64_t NextAllocationId;
+
+  std::deque<StagingBatch *> InFlightBatches;
+  std::vector<StagingBatch *> FreeBatches;
+  uint64_t NextSerial;
+  uint64_t CompletedSerial;
+
+  StagingRingStats Stats;
+  std::mutex Mutex;
+};
+
+StagingRing *createStagingRing(const Renderer &_renderer,
+                               VkDeviceSize _capacity);
+void destroyStagingRing(StagingRing *_ring);
+
+// Thread-safe. The returned memory stays valid until the batch it is submitted
+// with has finished executing on the GPU. Every allocation has to be either
+// submitted or freed, since the ring can't reuse anything allocated after it
+// until then.
+StagingAllocation allocateStagingMemory(StagingRing &_ring, VkDeviceSize _size);
+// Gives back an allocation that won't be submitted.
+void freeStagingMemory(StagingRing &_ring, StagingAllocation &_allocation);
+
+// Each batch owns its own command pool, so different threads can record
+// batches at the same time.
+StagingBatch *beginStagingBatch(StagingRing &_ring);
+uint64_t submitStagingBatch(StagingRing &_ring, StagingBatch *_batch,
+                            StagingAllocation *_allocations,
+                            uint32_t _numAllocations);
+
+// Record a copy out of staging memory, followed by a barrier that makes the
+// result visible to the shader stages of every later submission.
+void recordStagedBufferCopy(VkCommandBuffer _cmdBuffer,
+                            const StagingAllocation &_src, VkBuffer _dst);
+void recordStagedImageCopy(VkCommandBuffer _cmdBuffer,
+                           const StagingAllocation &_src, VkImage _dst,
+                           Int2 _dims);
+
+uint64_t getLastSubmittedStagingSerial(StagingRing &_ring);
+bool isStagingSerialComplete(StagingRing &_ring, uint64_t _serial);
+void waitForStagingSerial(StagingRing &_ring, uint64_t _serial);
+void flushStagingRing(StagingRing &_ring);
+
+StagingRingStats getStagingRingStats(StagingRing &_ring);
+
+} // namespace bb
@@ -0,0 +1,126 @@
+#include "task_graph.h"
+#include <algorithm>
+
+namespace bb {
+
+static float getElapsedMilliseconds(Time _start, Time _end) {
+  return std::chrono::duration<float, std::milli>(_end - _start).count();
+}
+
+TaskGraph *createTaskGraph(ThreadPool &_threadPool) {
+  TaskGraph *graph = new TaskGraph();
+  graph->ThreadPool = &_threadPool;
+  graph->NumCompletedTasks = 0;
+  return graph;
+}
+
+void destroyTaskGraph(TaskGraph *_graph) {
+  for (Task *task : _graph->Tasks) {
+    delete task;
+  }
+  delete _graph;
+}
+
+Task *addTask(TaskGraph &_graph, std::string_view _name, Job _work,
+              std::initializer_list<Task *> _dependencies) {
+  Task *task = new Task();
+  task->Name = _name;
+  task->Work = std::move(_work);
+  task->NumDependencies = 0;
+  _graph.Tasks.push_back(task);
+
+  for (Task *dependency : _dependencies) {
+    if (dependency) {
+      addTaskDependency(*task, *dependency);
+    }
+  }
+
+  return task;
+}
+
+void addTaskDependency(Task &_task, Task &_dependency) {
+  _dependency.Dependents.push_back(&_task);
+  ++_task.NumDependencies;
+}
+
+static void enqueueTask(TaskGraph &_graph, Task *_task) {
+  enqueueJob(*_graph.ThreadPool, [&_graph, _task] {
+    _task->StartTime = getCurrentTime();
+    _task->Work();
+    _task->EndTime = getCurrentTime();
+
+    for (Task *dependent : _task->Dependents) {
+      if (--dependent->NumPendingDependencies == 0) {
+        enqueueTask(_graph, dependent);
+      }
+    }
+
+    // Notified under the lock: once the last task is counted, runTaskGraph()
+    // may return and the graph be destroyed, so nothing may touch it after
+    // the lock is released.
+    std::scoped_lock lock(_graph.Mutex);
+    ++_graph.NumCompletedTasks;
+    _graph.TaskCompleted.notify_all();
+  });
+}
+
+void runTaskGraph(TaskGraph &_graph) {
+  _graph.NumCompletedTasks = 0;
+  _graph.StartTime = getCurrentTime();
+
+  for (Task *task : _graph.Tasks) {
+    task->NumPendingDependencies = task->NumDependencies;
+  }
+  for (Task *task : _graph.Tasks) {
+    if (task->NumDependencies == 0) {
+      enqueueTask(_graph, task);
+    }
+  }
+
+  const uint32_t numTasks = (uint32_t)_graph.Tasks.size();
+
+  std::unique_lock lock(_graph.Mutex);
+  while (_graph.NumCompletedTasks < numTasks) {
+    // New jobs are only ever queued by a task that completes, so it's enough
+    // to check the queue again whenever the completion count changes.
+    uint32_t numCompletedTasks = _graph.NumCompletedTasks;
+    lock.unlock();
+    bool ranJob = tryRunJob(*_graph.ThreadPool);
+    lock.lock();
+
+    if (!ranJob) {
+      _graph.TaskCompleted.wait(lock, [&] {
+        return _graph.NumCompletedTasks != numCompletedTasks;
+      });
+    }
+  }
+
+  _graph.EndTime = getCurrentTime();
+}
+
+void printTaskGraphReport(const TaskGraph &_graph, std::string_view _title) {
+  std::vector<const Task *> tasks(_graph.Tasks.begin(), _graph.Tasks.end());
+  std::sort(tasks.begin(), tasks.end(), [](const Task *_a, const Task *_b) {
+    return _a->StartTime < _b->StartTime;
+  });
+
+  float totalWorkTime = 0.f;
+  for (const Task *task : tasks) {
+    totalWorkTime += getElapsedMilliseconds(task->StartTime, task->EndTime);
+  }
+  float wallTime = getElapsedMilliseconds(_graph.StartTime, _graph.EndTime);
+
+  printLine("{}: {} tasks, {:.2f}ms wall, {:.2f}ms of work ({:.2f}x "
+            "parallelism)",
+            _title, tasks.size(), wallTime, totalWorkTime,
+            wallTime > 0.f ? totalWorkTime / wallTime : 0.f);
+  printLine("  {:>10} {:>10}  {}", "start", "duration", "task");
+  for (const Task *task : tasks) {
+    printLine("  {:>8.2f}ms {:>8.2f}ms  {}",
+              getElapsedMilliseconds(_graph.StartTime, task->StartTime),
+              getElapsedMilliseconds(task->StartTime, task->EndTime),
+              task->Name);
+  }
+}
+
+} // namespace bb
@@ -0,0 +1,59 @@
+#pragma once
+#include "util.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <condition_variable>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bb {
+
+struct Task {
+  std::string Name;
+  Job Work;
+
+  std::vector<Task *> Dependents;
+  uint32_t NumDependencies;
+  std::atomic<uint32_t> NumPendingDependencies;
+
+  Time StartTime;
+  Time EndTime;
+};
+
+// A set of jobs that only start once every task they depend on has finished.
+// Tasks are pushed to the thread pool as soon as they become ready, so
+// independent work (file I/O, decoding, pipeline compilation...) overlaps as
+// much as the dependencies allow.
+struct TaskGraph {
+  ThreadPool *ThreadPool;
+  std::vector<Task *> Tasks;
+
+  std::mutex Mutex;
+  std::condition_variable TaskCompleted;
+  uint32_t NumCompletedTasks;
+
+  Time StartTime;
+  Time EndTime;
+};
+
+TaskGraph *createTaskGraph(ThreadPool &_threadPool);
+void destroyTaskGraph(TaskGraph *_graph);
+
+// Every dependency has to be added to the same graph beforehand, which also
+// rules out cycles. nullptr dependencies are ignored.
+Task *addTask(TaskGraph &_graph, std::string_view _name, Job _work,
+              std::initializer_list<Task *> _dependencies = {});
+void addTaskDependency(Task &_task, Task &_dependency);
+
+// Blocks until every task has finished. The calling thread runs queued jobs
+// while it waits instead of sleeping.
+void runTaskGraph(TaskGraph &_graph);
+
+// Prints when each task started and how long it took, relative to the start of
+// runTaskGraph().
+void printTaskGraphReport(const TaskGraph &_graph, std::string_view _title);
+
+} // namespace bb
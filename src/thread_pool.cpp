@@ -0,0 +1,76 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+namespace bb {
+
+static void runWorker(ThreadPool &_pool) {
+  for (;;) {
+    Job job;
+    {
+      std::unique_lock lock(_pool.Mutex);
+      _pool.JobAvailable.wait(
+          lock, [&] { return _pool.IsQuitting || !_pool.Jobs.empty(); });
+      if (_pool.Jobs.empty()) {
+        return;
+      }
+      job = std::move(_pool.Jobs.front());
+      _pool.Jobs.pop_front();
+    }
+
+    job();
+  }
+}
+
+ThreadPool *createThreadPool(uint32_t _numThreads) {
+  if (_numThreads == 0) {
+    _numThreads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+  }
+
+  ThreadPool *pool = new ThreadPool();
+  pool->IsQuitting = false;
+  pool->Workers.reserve(_numThreads);
+  for (uint32_t i = 0; i < _numThreads; ++i) {
+    pool->Workers.emplace_back(runWorker, std::ref(*pool));
+  }
+
+  return pool;
+}
+
+void destroyThreadPool(ThreadPool *_pool) {
+  {
+    std::scoped_lock lock(_pool->Mutex);
+    _pool->IsQuitting = true;
+  }
+  _pool->JobAvailable.notify_all();
+
+  for (std::thread &worker : _pool->Workers) {
+    worker.join();
+  }
+
+  delete _pool;
+}
+
+void enqueueJob(ThreadPool &_pool, Job _job) {
+  {
+    std::scoped_lock lock(_pool.Mutex);
+    _pool.Jobs.push_back(std::move(_job));
+  }
+  _pool.JobAvailable.notify_one();
+}
+
+bool tryRunJob(ThreadPool &_pool) {
+  Job job;
+  {
+    std::scoped_lock lock(_pool.Mutex);
+    if (_pool.Jobs.empty()) {
+      return false;
+    }
+    job = std::move(_pool.Jobs.front());
+    _pool.Jobs.pop_front();
+  }
+
+  job();
+  return true;
+}
+
+} // namespace bb
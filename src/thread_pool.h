@@ -0,0 +1,32 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bb {
+
+using Job = std::function<void()>;
+
+struct ThreadPool {
+  std::vector<std::thread> Workers;
+  std::deque<Job> Jobs;
+  std::mutex Mutex;
+  std::condition_variable JobAvailable;
+  bool IsQuitting;
+};
+
+// _numThreads == 0 spawns one worker per hardware thread except the calling
+// one.
+ThreadPool *createThreadPool(uint32_t _numThreads = 0);
+// Runs every job that is still queued before joining the workers.
+void destroyThreadPool(ThreadPool *_pool);
+
+void enqueueJob(ThreadPool &_pool, Job _job);
+// Lets a thread that is waiting on queued work run one job itself. Returns
+// false if there was nothing to run.
+bool tryRunJob(ThreadPool &_pool);
+
+} // namespace bb
@@ -281,6 +281,44 @@ Mat4 operator/(const Mat4 &_a, float _b) {
   return result;
 }
 
+void extractFrustumPlanes(const Mat4 &_viewProjMat, Float4 (&_outPlanes)[6]) {
+  Float4 rows[4] = {_viewProjMat.row(0), _viewProjMat.row(1),
+                    _viewProjMat.row(2), _viewProjMat.row(3)};
+  auto add = [](const Float4 &_a, const Float4 &_b) -> Float4 {
+    return {_a.X + _b.X, _a.Y + _b.Y, _a.Z + _b.Z, _a.W + _b.W};
+  };
+  auto sub = [](const Float4 &_a, const Float4 &_b) -> Float4 {
+    return {_a.X - _b.X, _a.Y - _b.Y, _a.Z - _b.Z, _a.W - _b.W};
+  };
+
+  // -w <= x, y <= w and 0 <= z <= w in clip space.
+  _outPlanes[0] = add(rows[3], rows[0]);
+  _outPlanes[1] = sub(rows[3], rows[0]);
+  _outPlanes[2] = add(rows[3], rows[1]);
+  _outPlanes[3] = sub(rows[3], rows[1]);
+  _outPlanes[4] = rows[2];
+  _outPlanes[5] = sub(rows[3], rows[2]);
+
+  for (Float4 &plane : _outPlanes) {
+    float length = sqrtf(plane.X * plane.X + plane.Y * plane.Y +
+                         plane.Z * plane.Z);
+    plane = {plane.X / length, plane.Y / length, plane.Z / length,
+             plane.W / length};
+  }
+}
+
+bool isSphereInFrustum(const Float4 (&_planes)[6], const Float3 &_center,
+                       float _radius) {
+  for (const Float4 &plane : _planes) {
+    if (plane.X * _center.X + plane.Y * _center.Y + plane.Z * _center.Z +
+            plane.W <
+        -_radius) {
+      return false;
+    }
+  }
+  return true;
+}
+
 Float3 sphericalToCartesian(const SphericalFloat3 &_spherical) {
   float cosTheta = cosf(_spherical.theta);
 
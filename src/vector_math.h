@@ -86,6 +86,14 @@ struct Mat4 {
 Mat4 operator*(const Mat4 &_a, const Mat4 &_b);
 Mat4 operator/(const Mat4 &_a, float _b);
 
+// The six planes of the view frustum of a projection * view matrix, in world
+// space. A point p is inside when dot(plane, (p, 1)) >= 0 for every plane, and
+// the XYZ of each plane is normalized so that the dot product is a distance.
+void extractFrustumPlanes(const Mat4 &_viewProjMat, Float4 (&_outPlanes)[6]);
+// Whether any part of a sphere is inside the planes of extractFrustumPlanes().
+bool isSphereInFrustum(const Float4 (&_planes)[6], const Float3 &_center,
+                       float _radius);
+
 struct SphericalFloat3 {
   float r;
   float theta;